@@ -90,6 +90,14 @@ const struct dirent *AbstractDirRead(AbstractDir *dir)
     }
 }
 
+/* Only remote directories, which are listed in full when opened, can be
+ * rewound. */
+void AbstractDirRewind(AbstractDir *dir)
+{
+    assert(dir->local_dir == NULL);
+    dir->listpos = dir->list;
+}
+
 static void RemoteDirClose(AbstractDir *dir)
 {
     if (dir->list)
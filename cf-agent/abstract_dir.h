@@ -33,6 +33,7 @@ typedef struct AbstractDir_ AbstractDir;
 
 AbstractDir *AbstractDirOpen(const char *dirname, FileCopy fc, AgentConnection *pp);
 const struct dirent *AbstractDirRead(AbstractDir *dir);
+void AbstractDirRewind(AbstractDir *dir);
 void AbstractDirClose(AbstractDir *dir);
 
 #endif
@@ -103,7 +103,7 @@ static bool CFPARANOID = false; /* GLOBAL_P */
 
 static const Rlist *ACCESSLIST = NULL; /* GLOBAL_P */
 
-static int CFA_BACKGROUND = 0; /* GLOBAL_X */
+static int CFA_BACKGROUND = 0; /* GLOBAL_X, background workers started */
 static int CFA_BACKGROUND_LIMIT = 1; /* GLOBAL_P */
 
 static Item *PROCESSREFRESH = NULL; /* GLOBAL_P */
@@ -143,6 +143,7 @@ static PromiseResult KeepAgentPromise(EvalContext *ctx, const Promise *pp, void
 static int NewTypeContext(TypeSequence type);
 static void DeleteTypeContext(EvalContext *ctx, TypeSequence type);
 static PromiseResult ParallelFindAndVerifyFilesPromises(EvalContext *ctx, const Promise *pp);
+static PromiseResult MergeBackgroundFilesPromises(EvalContext *ctx);
 static bool VerifyBootstrap(void);
 static void KeepPromiseBundles(EvalContext *ctx, const Policy *policy, GenericAgentConfig *config);
 static void KeepPromises(EvalContext *ctx, const Policy *policy, GenericAgentConfig *config);
@@ -295,6 +296,7 @@ int main(int argc, char *argv[])
 
     EndAudit(ctx, CFA_BACKGROUND);
 
+    LogCacheStatistics();
     Nova_NoteAgentExecutionPerformance(config->input_file, start);
 
     GenericAgentFinalize(ctx, config);
@@ -1274,7 +1276,9 @@ static void KeepPromiseBundles(EvalContext *ctx, const Policy *policy, GenericAg
         {
             BundleBanner(bp,args);
             EvalContextStackPushBundleFrame(ctx, bp, args, false);
+            BeginLockSession();
             ScheduleAgentOperations(ctx, bp);
+            CommitLockSession();
             EvalContextStackPopFrame(ctx);
             EndBundleBanner(bp);
         }
@@ -1320,6 +1324,47 @@ static void AllClassesReport(const EvalContext *ctx)
     }
 }
 
+/**
+ * Inputs recorded for the promises of one bundle evaluation, per promise type
+ * and promise, so that later passes can skip the promises whose inputs have
+ * not changed since they were last evaluated.
+ */
+typedef struct
+{
+    EvalInputs **inputs[TYPE_SEQUENCE_NONE];
+    size_t num_promises[TYPE_SEQUENCE_NONE];
+} PassInputs;
+
+static void PassInputsDestroy(PassInputs *pass_inputs)
+{
+    for (TypeSequence type = 0; type < TYPE_SEQUENCE_NONE; type++)
+    {
+        for (size_t i = 0; i < pass_inputs->num_promises[type]; i++)
+        {
+            EvalInputsDestroy(pass_inputs->inputs[type][i]);
+        }
+        free(pass_inputs->inputs[type]);
+    }
+}
+
+static EvalInputs **PassInputsGet(PassInputs *pass_inputs, TypeSequence type,
+                                  const PromiseType *sp)
+{
+    if (pass_inputs->inputs[type] == NULL)
+    {
+        pass_inputs->num_promises[type] = SeqLength(sp->promises);
+        pass_inputs->inputs[type] = xcalloc(pass_inputs->num_promises[type],
+                                            sizeof(EvalInputs *));
+    }
+    return pass_inputs->inputs[type];
+}
+
+/* depends_on reads the outcome of other promises, which is not tracked. */
+static bool PromiseInputsAreTracked(const Promise *pp)
+{
+    return PromiseGetImmediateConstraint(pp, "depends_on") == NULL;
+}
+
 PromiseResult ScheduleAgentOperations(EvalContext *ctx, const Bundle *bp)
 // NB - this function can be called recursively through "methods"
 {
@@ -1334,6 +1379,7 @@ PromiseResult ScheduleAgentOperations(EvalContext *ctx, const Bundle *bp)
     }
 
     PromiseResult result = PROMISE_RESULT_SKIPPED;
+    PassInputs pass_inputs = { { NULL } };
 
     for (int pass = 1; pass < CF_DONEPASSES; pass++)
     {
@@ -1354,24 +1400,56 @@ PromiseResult ScheduleAgentOperations(EvalContext *ctx, const Bundle *bp)
             SpecialTypeBanner(type, pass);
             EvalContextStackPushPromiseTypeFrame(ctx, sp);
 
+            EvalInputs **type_inputs = PassInputsGet(&pass_inputs, type, sp);
+
             for (size_t ppi = 0; ppi < SeqLength(sp->promises); ppi++)
             {
                 Promise *pp = SeqAt(sp->promises, ppi);
 
+                if (type_inputs[ppi] != NULL &&
+                    !EvalContextInputsChanged(ctx, type_inputs[ppi]))
+                {
+                    /* Would read the same classes and variables again. */
+                    continue;
+                }
+
+                if (type == TYPE_SEQUENCE_FILES &&
+                    PromiseGetConstraint(pp, "depends_on") != NULL)
+                {
+                    /* It may depend on a promise still running in the background. */
+                    result = PromiseResultUpdate(result, MergeBackgroundFilesPromises(ctx));
+                }
+
                 EvalContextSetPass(ctx, pass);
 
+                EvalContextInputsRecordBegin(ctx);
                 PromiseResult promise_result = ExpandPromise(ctx, pp, KeepAgentPromise, NULL);
+                EvalInputsDestroy(type_inputs[ppi]);
+                type_inputs[ppi] = EvalContextInputsRecordEnd(ctx);
+                if (!PromiseInputsAreTracked(pp))
+                {
+                    EvalInputsDestroy(type_inputs[ppi]);
+                    type_inputs[ppi] = NULL;
+                }
+
                 result = PromiseResultUpdate(result, promise_result);
 
                 if (Abort(ctx))
                 {
+                    MergeBackgroundFilesPromises(ctx);
                     DeleteTypeContext(ctx, type);
                     EvalContextStackPopFrame(ctx);
+                    PassInputsDestroy(&pass_inputs);
                     NoteBundleCompliance(bp, save_pr_kept, save_pr_repaired, save_pr_notkept, start);
                     return result;
                 }
             }
 
+            if (type == TYPE_SEQUENCE_FILES)
+            {
+                result = PromiseResultUpdate(result, MergeBackgroundFilesPromises(ctx));
+            }
+
             DeleteTypeContext(ctx, type);
             EvalContextStackPopFrame(ctx);
 
@@ -1383,6 +1461,7 @@ PromiseResult ScheduleAgentOperations(EvalContext *ctx, const Bundle *bp)
         }
     }
 
+    PassInputsDestroy(&pass_inputs);
     NoteBundleCompliance(bp, save_pr_kept, save_pr_repaired, save_pr_notkept, start);
     return result;
 }
@@ -1839,48 +1918,442 @@ static PromiseResult ParallelFindAndVerifyFilesPromises(EvalContext *ctx, const
     return FindAndVerifyFilesPromises(ctx, pp);
 }
 
+static PromiseResult MergeBackgroundFilesPromises(ARG_UNUSED EvalContext *ctx)
+{
+    return PROMISE_RESULT_SKIPPED;
+}
+
 #else /* !__MINGW32__ */
 
-static PromiseResult ParallelFindAndVerifyFilesPromises(EvalContext *ctx, const Promise *pp)
+/*
+ * Files promises with background => "true" are run by a pool of at most
+ * max_children forked workers, each on its own copy of the evaluation
+ * context. A worker reports the outcome of its promise, and the soft classes
+ * it defined or cancelled, back through a pipe. The reports are merged into
+ * the context in the order the promises were started - never in the order
+ * they finished - when the files promises of the bundle are done, or before
+ * a promise that may depend on them runs.
+ */
+
+typedef struct
 {
-    int background = PromiseGetConstraintAsBoolean(ctx, "background", pp);
-    pid_t child = 1;
-    PromiseResult result = PROMISE_RESULT_SKIPPED;
+    pid_t pid;
+    int fd;                     /* read end of the report pipe, -1 at EOF */
+    char *promiser_root;        /* see FilesPromiserRoot() */
+    char *handle;
+    Buffer *report;
+} FilesWorker;
 
-    if (background)
+static Seq *FILES_WORKERS = NULL; /* GLOBAL_X, in start order */
+static int FILES_WORKERS_RUNNING = 0; /* GLOBAL_X */
+
+static void FilesWorkerDestroy(void *ptr)
+{
+    FilesWorker *worker = ptr;
+
+    if (worker->fd != -1)
     {
-        if (CFA_BACKGROUND < CFA_BACKGROUND_LIMIT)
+        close(worker->fd);
+    }
+    free(worker->promiser_root);
+    free(worker->handle);
+    BufferDestroy(worker->report);
+    free(worker);
+}
+
+/**
+ * @return the leading part of #promiser that names a literal path: up to the
+ *         directory holding the first regex metacharacter, if any.
+ */
+static char *FilesPromiserRoot(const char *promiser)
+{
+    size_t len = strcspn(promiser, "*?[]()|+{}^$\\");
+    if (promiser[len] != '\0')
+    {
+        while (len > 0 && !IsFileSep(promiser[len - 1]))
         {
-            CFA_BACKGROUND++;
-            Log(LOG_LEVEL_VERBOSE, "Spawning new process...");
-            child = fork();
+            len--;
+        }
+    }
+    return xstrndup(promiser, len);
+}
+
+/* Whether one of the roots is the other or one of its parent directories. */
+static bool FilesPromiserRootsOverlap(const char *a, const char *b)
+{
+    size_t len_a = strlen(a);
+    size_t len_b = strlen(b);
+    const char *shorter = (len_a <= len_b) ? a : b;
+    const char *longer = (len_a <= len_b) ? b : a;
+    size_t len = MIN(len_a, len_b);
+
+    if (strncmp(shorter, longer, len) != 0)
+    {
+        return false;
+    }
+
+    return len == 0 || longer[len] == '\0' ||
+        IsFileSep(longer[len]) || IsFileSep(shorter[len - 1]);
+}
+
+static void FilesWorkerReap(FilesWorker *worker)
+{
+    close(worker->fd);
+    worker->fd = -1;
+    FILES_WORKERS_RUNNING--;
+
+    int status;
+    while (waitpid(worker->pid, &status, 0) == -1 && errno == EINTR)
+    {
+    }
+}
+
+/* Read what the worker has written so far, reap it at end of file. */
+static void FilesWorkerRead(FilesWorker *worker)
+{
+    char buf[4096];
+    ssize_t ret = read(worker->fd, buf, sizeof(buf));
+    if (ret > 0)
+    {
+        BufferAppend(worker->report, buf, ret);
+    }
+    else if (ret == 0 || errno != EINTR)
+    {
+        FilesWorkerReap(worker);
+    }
+}
+
+/**
+ * Wait until a worker slot is free or, if #all, until every worker is done.
+ * Reports are read while waiting, so workers never block on a full pipe.
+ */
+static void FilesWorkersWait(bool all)
+{
+    while (FILES_WORKERS_RUNNING > 0 &&
+           (all || FILES_WORKERS_RUNNING >= CFA_BACKGROUND_LIMIT))
+    {
+        fd_set rset;
+        FD_ZERO(&rset);
+        int max_fd = -1;
 
-            if (child == 0)
+        for (size_t i = 0; i < SeqLength(FILES_WORKERS); i++)
+        {
+            FilesWorker *worker = SeqAt(FILES_WORKERS, i);
+            if (worker->fd != -1)
             {
-                ALARM_PID = -1;
+                FD_SET(worker->fd, &rset);
+                max_fd = MAX(max_fd, worker->fd);
+            }
+        }
 
-                result = PromiseResultUpdate(result, FindAndVerifyFilesPromises(ctx, pp));
+        if (select(max_fd + 1, &rset, NULL, NULL, NULL) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
 
-                Log(LOG_LEVEL_VERBOSE, "Exiting backgrounded promise");
-                PromiseRef(LOG_LEVEL_VERBOSE, pp);
-                _exit(EXIT_SUCCESS);
-                // TODO: need to solve this
+            Log(LOG_LEVEL_ERR, "Failed to wait for background promises (select: %s)",
+                GetErrorStr());
+            FD_ZERO(&rset);
+            for (size_t i = 0; i < SeqLength(FILES_WORKERS); i++)
+            {
+                FilesWorker *worker = SeqAt(FILES_WORKERS, i);
+                if (worker->fd != -1)
+                {
+                    /* Fall back to a blocking read of the oldest worker. */
+                    FD_SET(worker->fd, &rset);
+                    break;
+                }
             }
         }
-        else
+
+        for (size_t i = 0; i < SeqLength(FILES_WORKERS); i++)
         {
-            Log(LOG_LEVEL_VERBOSE, "Promised parallel execution promised but exceeded the max number of promised background tasks, so serializing");
-            background = 0;
+            FilesWorker *worker = SeqAt(FILES_WORKERS, i);
+            if (worker->fd != -1 && FD_ISSET(worker->fd, &rset))
+            {
+                FilesWorkerRead(worker);
+            }
         }
     }
-    else
+}
+
+static bool FilesWorkersOverlap(const char *promiser_root)
+{
+    for (size_t i = 0; FILES_WORKERS != NULL && i < SeqLength(FILES_WORKERS); i++)
+    {
+        const FilesWorker *worker = SeqAt(FILES_WORKERS, i);
+        if (FilesPromiserRootsOverlap(worker->promiser_root, promiser_root))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * The soft classes visible to the current bundle, as "g ns:name" for global
+ * and "l ns:name" for bundle-local ones.
+ */
+static StringSet *SoftClassesSnapshot(const EvalContext *ctx)
+{
+    StringSet *classes = StringSetNew();
+
+    ClassTableIterator *iter = EvalContextClassTableIteratorNewGlobal(ctx, NULL, false, true);
+    Class *cls;
+    while ((cls = ClassTableIteratorNext(iter)))
+    {
+        StringSetAdd(classes, StringFormat("g %s:%s", cls->ns ? cls->ns : "default", cls->name));
+    }
+    ClassTableIteratorDestroy(iter);
+
+    iter = EvalContextClassTableIteratorNewLocal(ctx);
+    while (iter && (cls = ClassTableIteratorNext(iter)))
+    {
+        StringSetAdd(classes, StringFormat("l %s:%s", cls->ns ? cls->ns : "default", cls->name));
+    }
+    ClassTableIteratorDestroy(iter);
+
+    return classes;
+}
+
+/**
+ * Write the report of a worker: a line "R result kept repaired notkept",
+ * then "+g ns:name tags" / "+l ns:name tags" for every soft class defined
+ * and "-g ns:name" / "-l ns:name" for every one cancelled since #before.
+ */
+static void FilesWorkerWriteReport(const EvalContext *ctx, int fd, StringSet *before,
+                                   PromiseResult result, int kept, int repaired, int notkept)
+{
+    Buffer *report = BufferNew();
+    BufferAppendF(report, "R %d %d %d %d\n", result, kept, repaired, notkept);
+
+    StringSet *after = SoftClassesSnapshot(ctx);
+
+    const Class *cls;
+    ClassTableIterator *iter = EvalContextClassTableIteratorNewGlobal(ctx, NULL, false, true);
+    for (int local = 0; local < 2; local++)
+    {
+        while (iter && (cls = ClassTableIteratorNext(iter)))
+        {
+            char *key = StringFormat("%c %s:%s", local ? 'l' : 'g',
+                                     cls->ns ? cls->ns : "default", cls->name);
+            if (!StringSetContains(before, key))
+            {
+                Buffer *tags = StringSetToBuffer(cls->tags, ',');
+                BufferAppendF(report, "+%s %s\n", key, BufferData(tags));
+                BufferDestroy(tags);
+            }
+            free(key);
+        }
+        ClassTableIteratorDestroy(iter);
+        iter = local ? NULL : EvalContextClassTableIteratorNewLocal(ctx);
+    }
+
+    StringSetIterator i = StringSetIteratorInit(before);
+    const char *key;
+    while ((key = StringSetIteratorNext(&i)))
+    {
+        if (!StringSetContains(after, key))
+        {
+            BufferAppendF(report, "-%s\n", key);
+        }
+    }
+    StringSetDestroy(after);
+
+    if (FullWrite(fd, BufferData(report), BufferSize(report)) < 0)
     {
-        result = PromiseResultUpdate(result, FindAndVerifyFilesPromises(ctx, pp));
+        Log(LOG_LEVEL_ERR, "Failed to report outcome of background promise (write: %s)",
+            GetErrorStr());
+    }
+    BufferDestroy(report);
+}
+
+static PromiseResult FilesWorkerMergeReport(EvalContext *ctx, const FilesWorker *worker)
+{
+    PromiseResult result = PROMISE_RESULT_FAIL;
+    bool reported = false;
+
+    char *report = xstrdup(BufferData(worker->report));
+    char *line = report;
+    while (*line != '\0')
+    {
+        char *eol = strchr(line, '\n');
+        if (eol == NULL)
+        {
+            break;                                   /* truncated report */
+        }
+        *eol = '\0';
+
+        int status, kept, repaired, notkept;
+        if (sscanf(line, "R %d %d %d %d", &status, &kept, &repaired, &notkept) == 4)
+        {
+            result = status;
+            PR_KEPT += kept;
+            PR_REPAIRED += repaired;
+            PR_NOTKEPT += notkept;
+            reported = true;
+        }
+        else if ((line[0] == '+' || line[0] == '-') && strlen(line) > 3)
+        {
+            char *name = line + 3;
+            char *tags = strchr(name, ' ');
+            if (tags != NULL)
+            {
+                *tags++ = '\0';
+            }
+
+            if (line[0] == '+')
+            {
+                EvalContextClassPutSoft(ctx, name,
+                                        line[1] == 'l' ? CONTEXT_SCOPE_BUNDLE : CONTEXT_SCOPE_NAMESPACE,
+                                        NULL_OR_EMPTY(tags) ? NULL : tags);
+            }
+            else
+            {
+                ClassRef ref = ClassRefParse(name);
+                EvalContextClassRemove(ctx, ref.ns, ref.name);
+                ClassRefDestroy(ref);
+            }
+        }
+
+        line = eol + 1;
     }
+    free(report);
+
+    if (!reported)
+    {
+        Log(LOG_LEVEL_ERR, "Background promise on '%s' (pid %jd) did not report its outcome",
+            worker->promiser_root, (intmax_t) worker->pid);
+    }
+
+    NotifyDependantHandle(ctx, worker->handle, result);
+    return result;
+}
+
+/**
+ * Wait for all background files promises and merge their outcomes and
+ * classes, in the order they were started.
+ */
+static PromiseResult MergeBackgroundFilesPromises(EvalContext *ctx)
+{
+    if (FILES_WORKERS == NULL || SeqLength(FILES_WORKERS) == 0)
+    {
+        return PROMISE_RESULT_SKIPPED;
+    }
+
+    FilesWorkersWait(true);
+
+    PromiseResult result = PROMISE_RESULT_SKIPPED;
+    for (size_t i = 0; i < SeqLength(FILES_WORKERS); i++)
+    {
+        result = PromiseResultUpdate(result,
+                                     FilesWorkerMergeReport(ctx, SeqAt(FILES_WORKERS, i)));
+    }
+    Log(LOG_LEVEL_VERBOSE, "Merged the outcome of %zu background files promises",
+        SeqLength(FILES_WORKERS));
+    SeqClear(FILES_WORKERS);
 
     return result;
 }
 
+static PromiseResult ParallelFindAndVerifyFilesPromises(EvalContext *ctx, const Promise *pp)
+{
+    int background = PromiseGetConstraintAsBoolean(ctx, "background", pp);
+    char *promiser_root = FilesPromiserRoot(pp->promiser);
+
+    /* Promises running at the same time must not touch the same files. */
+    if (FilesWorkersOverlap(promiser_root))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Files promise on '%s' overlaps a background promise, waiting for it",
+            pp->promiser);
+        MergeBackgroundFilesPromises(ctx);
+    }
+
+    if (!background || CFA_BACKGROUND_LIMIT < 1)
+    {
+        free(promiser_root);
+        return FindAndVerifyFilesPromises(ctx, pp);
+    }
+
+    FilesWorkersWait(false);
+
+    int fds[2];
+    if (pipe(fds) == -1)
+    {
+        Log(LOG_LEVEL_ERR, "Failed to create pipe for background promise, serializing (pipe: %s)",
+            GetErrorStr());
+        free(promiser_root);
+        return FindAndVerifyFilesPromises(ctx, pp);
+    }
+
+    /* Keep the pipe from processes that files promises execute. */
+    SetCloseOnExec(fds[0], true);
+    SetCloseOnExec(fds[1], true);
+
+    Log(LOG_LEVEL_VERBOSE, "Spawning new process...");
+    pid_t child = fork();
+
+    if (child == -1)
+    {
+        Log(LOG_LEVEL_ERR, "Failed to fork for background promise, serializing (fork: %s)",
+            GetErrorStr());
+        close(fds[0]);
+        close(fds[1]);
+        free(promiser_root);
+        return FindAndVerifyFilesPromises(ctx, pp);
+    }
+
+    if (child == 0)
+    {
+        ALARM_PID = -1;
+        close(fds[0]);
+
+        /* The parent's workers, connections and pending lock times are not
+         * ours to use. */
+        if (FILES_WORKERS != NULL)
+        {
+            SeqClear(FILES_WORKERS);
+        }
+        ConnCache_Forget();
+        ForkLockSession();
+
+        StringSet *before = SoftClassesSnapshot(ctx);
+        int kept = PR_KEPT, repaired = PR_REPAIRED, notkept = PR_NOTKEPT;
+
+        PromiseResult result = FindAndVerifyFilesPromises(ctx, pp);
+
+        FilesWorkerWriteReport(ctx, fds[1], before, result, PR_KEPT - kept,
+                               PR_REPAIRED - repaired, PR_NOTKEPT - notkept);
+        SyncLockSession();
+
+        Log(LOG_LEVEL_VERBOSE, "Exiting backgrounded promise");
+        PromiseRef(LOG_LEVEL_VERBOSE, pp);
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(fds[1]);
+    CFA_BACKGROUND++;
+    FILES_WORKERS_RUNNING++;
+
+    if (FILES_WORKERS == NULL)
+    {
+        FILES_WORKERS = SeqNew(CFA_BACKGROUND_LIMIT, FilesWorkerDestroy);
+    }
+
+    FilesWorker *worker = xcalloc(1, sizeof(FilesWorker));
+    worker->pid = child;
+    worker->fd = fds[0];
+    worker->promiser_root = promiser_root;
+    worker->handle = SafeStringDuplicate(PromiseGetHandle(pp));
+    worker->report = BufferNew();
+    SeqAppend(FILES_WORKERS, worker);
+
+    /* The outcome is merged by MergeBackgroundFilesPromises(). */
+    return PROMISE_RESULT_SKIPPED;
+}
+
 #endif /* !__MINGW32__ */
 
 /**************************************************************/
@@ -41,11 +41,14 @@
                                    copy equal to the copied template file - not the
                                    copied + edited file. */
 
+typedef struct EditLineIndex_ EditLineIndex;
+
 typedef struct
 {
     char *filename;
     Item *file_start;
     int num_edits;
+    EditLineIndex *line_index;                /* see files_editline.c */
 #ifdef HAVE_LIBXML2
     xmlDocPtr xmldoc;
 #endif
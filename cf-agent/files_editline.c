@@ -46,6 +46,7 @@
 #include <policy.h>
 #include <ornaments.h>
 #include <verify_classes.h>
+#include <set.h>
 
 #define CF_MAX_REPLACE 20
 
@@ -97,6 +98,81 @@ static int SelectRegion(EvalContext *ctx, Item *start, Item **begin_ptr, Item **
 static int MultiLineString(char *s);
 static int InsertFileAtLocation(EvalContext *ctx, Item **start, Item *begin_ptr, Item *end_ptr, Item *location, Item *prev, Attributes a, const Promise *pp, EditContext *edcontext, PromiseResult *result);
 
+/*****************************************************************************/
+
+/* All lines of the file being edited, so that insert_lines can tell whether
+ * a line exists without scanning the file for every promise. The index is
+ * valid as long as nothing but EditLineIndexUpdate() counted edits since it
+ * was built; otherwise it gets rebuilt on the next use. */
+
+struct EditLineIndex_
+{
+    StringSet *lines;
+    int num_edits;
+    const Item *file_start;
+};
+
+static EditLineIndex *EditLineIndexGet(EditContext *edcontext)
+{
+    EditLineIndex *index = edcontext->line_index;
+    if (index != NULL &&
+        index->num_edits == edcontext->num_edits &&
+        index->file_start == edcontext->file_start)
+    {
+        return index;
+    }
+
+    if (index == NULL)
+    {
+        index = xcalloc(1, sizeof(EditLineIndex));
+        edcontext->line_index = index;
+    }
+    else
+    {
+        StringSetDestroy(index->lines);
+    }
+
+    index->lines = StringSetNew();
+    for (const Item *ip = edcontext->file_start; ip != NULL; ip = ip->next)
+    {
+        StringSetAdd(index->lines, xstrdup(ip->name));
+    }
+    index->num_edits = edcontext->num_edits;
+    index->file_start = edcontext->file_start;
+
+    return index;
+}
+
+/**
+ * Account for the edit that was just counted in edcontext->num_edits, which
+ * inserted #line, or changed no lines at all if #line is NULL.
+ */
+static void EditLineIndexUpdate(EditContext *edcontext, const char *line)
+{
+    EditLineIndex *index = edcontext->line_index;
+    if (index == NULL || index->num_edits + 1 != edcontext->num_edits)
+    {
+        return;
+    }
+
+    if (line != NULL)
+    {
+        StringSetAdd(index->lines, xstrdup(line));
+    }
+    index->num_edits = edcontext->num_edits;
+    index->file_start = edcontext->file_start;
+}
+
+static void EditLineIndexDestroy(EditContext *edcontext)
+{
+    if (edcontext->line_index != NULL)
+    {
+        StringSetDestroy(edcontext->line_index->lines);
+        free(edcontext->line_index);
+        edcontext->line_index = NULL;
+    }
+}
+
 /*****************************************************************************/
 /* Level                                                                     */
 /*****************************************************************************/
@@ -139,6 +215,7 @@ int ScheduleEditLineOperations(EvalContext *ctx, const Bundle *bp, Attributes a,
 
                 if (Abort(ctx))
                 {
+                    EditLineIndexDestroy(edcontext);
                     YieldCurrentLock(thislock);
                     EvalContextStackPopFrame(ctx);
                     return false;
@@ -148,6 +225,7 @@ int ScheduleEditLineOperations(EvalContext *ctx, const Bundle *bp, Attributes a,
         }
     }
 
+    EditLineIndexDestroy(edcontext);
     YieldCurrentLock(thislock);
     return true;
 }
@@ -717,6 +795,7 @@ static PromiseResult VerifyLineInsertions(EvalContext *ctx, const Promise *pp, E
         if (InsertMultipleLinesToRegion(ctx, start, begin_ptr, end_ptr, a, pp, edcontext, &result))
         {
             (edcontext->num_edits)++;
+            EditLineIndexUpdate(edcontext, NULL);
         }
     }
     else
@@ -732,6 +811,7 @@ static PromiseResult VerifyLineInsertions(EvalContext *ctx, const Promise *pp, E
         if (InsertMultipleLinesAtLocation(ctx, start, begin_ptr, end_ptr, match, prev, a, pp, edcontext, &result))
         {
             (edcontext->num_edits)++;
+            EditLineIndexUpdate(edcontext, NULL);
         }
     }
 
@@ -922,9 +1002,26 @@ static int InsertMultipleLinesToRegion(EvalContext *ctx, Item **start, Item *beg
          * begin_ptr. 
          * As a bonus Redmine #7640 is fixed as we are not interested in
          * matching values outside of the region we are iterating over. */
+        bool match_region = !allow_multi_lines;
+        if (match_region && strchr(pp->promiser, '\n') == NULL)
+        {
+            /* A single line is either nowhere in the file, and then only the
+             * end of the region is needed, or found without a scan if the
+             * region is the whole file. */
+            if (!StringSetContains(EditLineIndexGet(edcontext)->lines, pp->promiser))
+            {
+                match_region = false;
+            }
+            else if (begin_ptr == *start && end_ptr == NULL)
+            {
+                cfPS(ctx, LOG_LEVEL_VERBOSE, PROMISE_RESULT_NOOP, pp, a, "Promised chunk '%s' exists within selected region of %s (promise kept)", pp->promiser, edcontext->filename);
+                return false;
+            }
+        }
+
         for (ip = begin_ptr; ip != NULL; ip = ip->next)
         {
-            if (!allow_multi_lines && MatchRegion(ctx, pp->promiser, ip, end_ptr, false))
+            if (match_region && MatchRegion(ctx, pp->promiser, ip, end_ptr, false))
             {
                 cfPS(ctx, LOG_LEVEL_VERBOSE, PROMISE_RESULT_NOOP, pp, a, "Promised chunk '%s' exists within selected region of %s (promise kept)", pp->promiser, edcontext->filename);
                 return false;
@@ -1417,18 +1514,44 @@ static int SanityCheckDeletions(Attributes a, const Promise *pp)
 /***************************************************************************/
 
 /* XXX */
-static int MatchPolicy(EvalContext *ctx, const char *camel, const char *haystack, Rlist *insert_match, const Promise *pp)
+/* An insert_match policy turned into the regexes to try for each line of the
+ * promised text, so that checking a region does not rebuild them per line. */
+
+typedef struct
+{
+    Seq *regexes;
+    bool exact;                 /* the line also matches its exact text */
+} MatchPolicyLine;
+
+typedef struct
 {
+    const char *camel;
+    Seq *lines;                 /* MatchPolicyLine */
+    bool exact;                 /* nothing but exact matches */
+} MatchPolicy;
+
+static void MatchPolicyLineDestroy(void *line)
+{
+    SeqDestroy(((MatchPolicyLine *) line)->regexes);
+    free(line);
+}
+
+static MatchPolicy *MatchPolicyCompile(const char *camel, Rlist *insert_match, const Promise *pp)
+{
+    MatchPolicy *policy = xcalloc(1, sizeof(MatchPolicy));
+    policy->camel = camel;
+    policy->lines = SeqNew(1, MatchPolicyLineDestroy);
+
     char *final = NULL;
-    bool ok      = false;
     bool escaped = false;
     Item *list = SplitString(camel, '\n');
 
     //Split into separate lines first
     for (Item *ip = list; ip != NULL; ip = ip->next)
     {
-        ok = false;
-        bool direct_cmp = (strcmp(camel, haystack) == 0);
+        MatchPolicyLine *line = xcalloc(1, sizeof(MatchPolicyLine));
+        line->regexes = SeqNew(1, free);
+        SeqAppend(policy->lines, line);
 
         final             = xstrdup(ip->name);
         size_t final_size = strlen(final) + 1;
@@ -1436,7 +1559,7 @@ static int MatchPolicy(EvalContext *ctx, const char *camel, const char *haystack
         if (insert_match == NULL)
         {
             // No whitespace policy means exact_match
-            ok = ok || direct_cmp;
+            line->exact = true;
             break;
         }
 
@@ -1455,7 +1578,7 @@ static int MatchPolicy(EvalContext *ctx, const char *camel, const char *haystack
                     PromiseRef(LOG_LEVEL_ERR, pp);
                 }
 
-                ok = ok || direct_cmp;
+                line->exact = true;
                 break;
             }
 
@@ -1587,36 +1710,98 @@ static int MatchPolicy(EvalContext *ctx, const char *camel, const char *haystack
                 }
             }
 
-            ok = ok || (FullTextMatch(ctx, final, haystack));
+            SeqAppend(line->regexes, xstrdup(final));
         }
 
         assert(final_size > strlen(final));
         free(final);
         final = NULL;
+    }
+
+    free(final);
+    DeleteItemList(list);
+
+    /* Nothing but exact matches: the whole text has to equal the line. */
+    policy->exact = (SeqLength(policy->lines) > 0);
+    for (size_t i = 0; i < SeqLength(policy->lines); i++)
+    {
+        const MatchPolicyLine *line = SeqAt(policy->lines, i);
+        policy->exact = policy->exact && line->exact && (SeqLength(line->regexes) == 0);
+    }
+
+    return policy;
+}
+
+static void MatchPolicyDestroy(MatchPolicy *policy)
+{
+    if (policy != NULL)
+    {
+        SeqDestroy(policy->lines);
+        free(policy);
+    }
+}
+
+static bool MatchPolicyMatches(EvalContext *ctx, const MatchPolicy *policy, const char *haystack)
+{
+    bool direct_cmp = (strcmp(policy->camel, haystack) == 0);
+    if (policy->exact)
+    {
+        return direct_cmp;
+    }
+
+    bool ok = false;
+    for (size_t i = 0; i < SeqLength(policy->lines); i++)
+    {
+        const MatchPolicyLine *line = SeqAt(policy->lines, i);
+
+        ok = false;
+        for (size_t j = 0; !ok && j < SeqLength(line->regexes); j++)
+        {
+            ok = FullTextMatch(ctx, SeqAt(line->regexes, j), haystack);
+        }
+        ok = ok || (line->exact && direct_cmp);
+
         if (!ok)                // All lines in region need to match to avoid insertions
         {
             break;
         }
     }
 
-    free(final);
-    DeleteItemList(list);
     return ok;
 }
 
-static int IsItemInRegion(EvalContext *ctx, const char *item, const Item *begin_ptr, const Item *end_ptr, Rlist *insert_match, const Promise *pp)
+static int IsItemInRegion(EvalContext *ctx, const char *item, const Item *begin_ptr, const Item *end_ptr,
+                          Rlist *insert_match, const Promise *pp, EditContext *edcontext)
 {
-    for (const Item *ip = begin_ptr; ((ip != end_ptr) && (ip != NULL)); ip = ip->next)
+    MatchPolicy *policy = MatchPolicyCompile(item, insert_match, pp);
+    bool found = false;
+
+    if (policy->exact &&
+        !StringSetContains(EditLineIndexGet(edcontext)->lines, item))
     {
-        if (MatchPolicy(ctx, item, ip->name, insert_match, pp))
+        found = false;       // Not in the file at all, so not in the region
+    }
+    else if (policy->exact && begin_ptr == edcontext->file_start && end_ptr == NULL)
+    {
+        found = true;
+    }
+    else
+    {
+        for (const Item *ip = begin_ptr; ((ip != end_ptr) && (ip != NULL)); ip = ip->next)
         {
-            return true;
+            if (MatchPolicyMatches(ctx, policy, ip->name))
+            {
+                found = true;
+                break;
+            }
         }
     }
 
-    return false;
+    MatchPolicyDestroy(policy);
+    return found;
 }
 
+
 /***************************************************************************/
 
 static int InsertFileAtLocation(EvalContext *ctx, Item **start, Item *begin_ptr, Item *end_ptr, Item *location,
@@ -1656,7 +1841,7 @@ static int InsertFileAtLocation(EvalContext *ctx, Item **start, Item *begin_ptr,
             continue;
         }
 
-        if (!preserve_block && IsItemInRegion(ctx, BufferData(exp), begin_ptr, end_ptr, a.insert_match, pp))
+        if (!preserve_block && IsItemInRegion(ctx, BufferData(exp), begin_ptr, end_ptr, a.insert_match, pp, edcontext))
         {
             cfPS(ctx, LOG_LEVEL_VERBOSE, PROMISE_RESULT_NOOP, pp, a,
                  "Promised file line '%s' exists within file %s (promise kept)", BufferData(exp), edcontext->filename);
@@ -1751,7 +1936,7 @@ static int InsertCompoundLineAtLocation(EvalContext *ctx, char *chunk, Item **st
             continue;
         }
 
-        if (!preserve_block && IsItemInRegion(ctx, buf, begin_ptr, end_ptr, a.insert_match, pp))
+        if (!preserve_block && IsItemInRegion(ctx, buf, begin_ptr, end_ptr, a.insert_match, pp, edcontext))
         {
             cfPS(ctx, LOG_LEVEL_VERBOSE, PROMISE_RESULT_NOOP, pp, a, "Promised chunk '%s' exists within selected region of %s (promise kept)", pp->promiser, edcontext->filename);
             continue;
@@ -1790,45 +1975,51 @@ static int InsertCompoundLineAtLocation(EvalContext *ctx, char *chunk, Item **st
     return retval;
 }
 
-static int NeighbourItemMatches(EvalContext *ctx, const Item *file_start, const Item *location, const char *string, EditOrder pos, Rlist *insert_match,
+static int NeighbourItemMatches(EvalContext *ctx, const Item *file_start, const Item *location, const Item *prev, const char *string, EditOrder pos, Rlist *insert_match,
                          const Promise *pp)
 {
 /* Look for a line matching proposed insert before or after location */
 
-    for (const Item *ip = file_start; ip != NULL; ip = ip->next)
+    const Item *neighbour = NULL;
+
+    if (location == NULL)
+    {
+        return false;
+    }
+
+    if (pos == EDIT_ORDER_BEFORE)
     {
-        if (pos == EDIT_ORDER_BEFORE)
+        if (prev != NULL && prev->next == location)
         {
-            if ((ip->next) && (ip->next == location))
-            {
-                if (MatchPolicy(ctx, string, ip->name, insert_match, pp))
-                {
-                    return true;
-                }
-                else
-                {
-                    return false;
-                }
-            }
+            neighbour = prev;
         }
-
-        if (pos == EDIT_ORDER_AFTER)
+        else
         {
-            if (ip == location)
+            for (const Item *ip = file_start; ip != NULL; ip = ip->next)
             {
-                if ((ip->next) && (MatchPolicy(ctx, string, ip->next->name, insert_match, pp)))
-                {
-                    return true;
-                }
-                else
+                if (ip->next == location)
                 {
-                    return false;
+                    neighbour = ip;
+                    break;
                 }
             }
         }
     }
 
-    return false;
+    if (pos == EDIT_ORDER_AFTER)
+    {
+        neighbour = location->next;
+    }
+
+    if (neighbour == NULL)
+    {
+        return false;
+    }
+
+    MatchPolicy *policy = MatchPolicyCompile(string, insert_match, pp);
+    bool matches = MatchPolicyMatches(ctx, policy, neighbour->name);
+    MatchPolicyDestroy(policy);
+    return matches;
 }
 
 static int InsertLineAtLocation(EvalContext *ctx, char *newline, Item **start, Item *location, Item *prev, Attributes a,
@@ -1856,6 +2047,7 @@ static int InsertLineAtLocation(EvalContext *ctx, char *newline, Item **start, I
                 {
                     PrependItemList(start, newline);
                     (edcontext->num_edits)++;
+                    EditLineIndexUpdate(edcontext, newline);
                     cfPS(ctx, LOG_LEVEL_VERBOSE, PROMISE_RESULT_CHANGE, pp, a, "Inserting the promised line '%s' into %s", newline,
                          edcontext->filename);
                     *result = PromiseResultUpdate(*result, PROMISE_RESULT_CHANGE);
@@ -1877,6 +2069,7 @@ static int InsertLineAtLocation(EvalContext *ctx, char *newline, Item **start, I
                 {
                     PrependItemList(start, newline);
                     (edcontext->num_edits)++;
+                    EditLineIndexUpdate(edcontext, newline);
                     cfPS(ctx, LOG_LEVEL_VERBOSE, PROMISE_RESULT_CHANGE, pp, a, "Prepending the promised line '%s' to %s", newline,
                          edcontext->filename);
                     *result = PromiseResultUpdate(*result, PROMISE_RESULT_CHANGE);
@@ -1894,7 +2087,7 @@ static int InsertLineAtLocation(EvalContext *ctx, char *newline, Item **start, I
 
     if (a.location.before_after == EDIT_ORDER_BEFORE)
     {
-        if (!preserve_block && NeighbourItemMatches(ctx, *start, location, newline, EDIT_ORDER_BEFORE, a.insert_match, pp))
+        if (!preserve_block && NeighbourItemMatches(ctx, *start, location, prev, newline, EDIT_ORDER_BEFORE, a.insert_match, pp))
         {
             cfPS(ctx, LOG_LEVEL_VERBOSE, PROMISE_RESULT_NOOP, pp, a, "Promised line '%s' exists before locator in (promise kept)",
                  newline);
@@ -1914,6 +2107,7 @@ static int InsertLineAtLocation(EvalContext *ctx, char *newline, Item **start, I
             {
                 InsertAfter(start, prev, newline);
                 (edcontext->num_edits)++;
+                EditLineIndexUpdate(edcontext, newline);
                 cfPS(ctx, LOG_LEVEL_VERBOSE, PROMISE_RESULT_CHANGE, pp, a, "Inserting the promised line '%s' into '%s' before locator",
                      newline, edcontext->filename);
                 *result = PromiseResultUpdate(*result, PROMISE_RESULT_CHANGE);
@@ -1923,7 +2117,7 @@ static int InsertLineAtLocation(EvalContext *ctx, char *newline, Item **start, I
     }
     else
     {
-        if (!preserve_block && NeighbourItemMatches(ctx, *start, location, newline, EDIT_ORDER_AFTER, a.insert_match, pp))
+        if (!preserve_block && NeighbourItemMatches(ctx, *start, location, prev, newline, EDIT_ORDER_AFTER, a.insert_match, pp))
         {
             cfPS(ctx, LOG_LEVEL_VERBOSE, PROMISE_RESULT_NOOP, pp, a, "Promised line '%s' exists after locator (promise kept)",
                  newline);
@@ -1945,6 +2139,7 @@ static int InsertLineAtLocation(EvalContext *ctx, char *newline, Item **start, I
                      newline, edcontext->filename);
                 *result = PromiseResultUpdate(*result, PROMISE_RESULT_CHANGE);
                 (edcontext->num_edits)++;
+                EditLineIndexUpdate(edcontext, newline);
                 return true;
             }
         }
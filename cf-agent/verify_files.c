@@ -56,6 +56,7 @@
 #include <mustache.h>
 #include <known_dirs.h>
 #include <evalfunction.h>
+#include <dbm_api.h>                                 /* BeginDBReadSession */
 
 static PromiseResult FindFilePromiserObjects(EvalContext *ctx, const Promise *pp);
 static PromiseResult VerifyFilePromise(EvalContext *ctx, char *path, const Promise *pp);
@@ -426,6 +427,10 @@ static PromiseResult VerifyFilePromise(EvalContext *ctx, char *path, const Promi
     {
         lstat(path, &oslb);     /* if doesn't exist have to stat again anyway */
 
+        /* The hash and stat lookups of unchanged files share one read
+         * transaction; changes are still committed as they are made. */
+        bool changes_session = a.havechange && BeginDBReadSession(dbid_changes);
+
         DepthSearch(ctx, path, &oslb, 0, a, pp, oslb.st_dev, &result);
 
         /* normally searches do not include the base directory */
@@ -448,6 +453,11 @@ static PromiseResult VerifyFilePromise(EvalContext *ctx, char *path, const Promi
                 cfPS(ctx, LOG_LEVEL_VERBOSE, PROMISE_RESULT_NOOP, pp, a, "Basedir '%s' not promising anything", path);
             }
         }
+
+        if (changes_session)
+        {
+            EndDBReadSession(dbid_changes);
+        }
     }
 
 /* Phase 2a - copying is potentially threadable if no followup actions */
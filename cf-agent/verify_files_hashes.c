@@ -65,7 +65,7 @@ int CompareFileHashes(const char *file1, const char *file2, struct stat *sstat,
     else
     {
         assert(fc.servers && strcmp(RlistScalarValue(fc.servers), "localhost"));
-        return CompareHashNet(file1, file2, fc.encrypt, conn);  /* client.c */
+        return CompareHashNet(file1, file2, dstat, fc.encrypt, conn);  /* client.c */
     }
 }
 
@@ -108,6 +108,6 @@ int CompareBinaryFiles(const char *file1, const char *file2, struct stat *sstat,
     {
         assert(fc.servers && strcmp(RlistScalarValue(fc.servers), "localhost"));
         Log(LOG_LEVEL_DEBUG, "Using network checksum instead");
-        return CompareHashNet(file1, file2, fc.encrypt, conn);  /* client.c */
+        return CompareHashNet(file1, file2, dstat, fc.encrypt, conn);  /* client.c */
     }
 }
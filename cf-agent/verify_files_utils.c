@@ -725,6 +725,104 @@ static PromiseResult PurgeLocalFiles(EvalContext *ctx, Item *filelist, const cha
     return result;
 }
 
+/**
+ * Fetch the stats of all entries of the remote directory #from in pipelined
+ * batches and, if the copy compares digests, the server's verdict on every
+ * regular file whose copy in #to has the same size. The STAT and MD5 requests
+ * SourceSearchAndCopy() makes per file are then answered from the stat cache
+ * of #conn instead of costing a round trip each.
+ */
+static void PrefetchRemoteDir(const char *from, const char *to, Attributes attr,
+                              AbstractDir *dirh, AgentConnection *conn)
+{
+    if (conn->conn_info->max_synch_batch <= 0)
+    {
+        return;
+    }
+
+    Seq *names = SeqNew(100, free);
+    Seq *sources = SeqNew(100, free);
+    Seq *stats = SeqNew(100, free);
+
+    for (const struct dirent *dirp = AbstractDirRead(dirh); dirp != NULL;
+         dirp = AbstractDirRead(dirh))
+    {
+        if (strcmp(dirp->d_name, ".") == 0 || strcmp(dirp->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        /* The paths stat'ed by ConsiderAbstractFile() and by
+         * SourceSearchAndCopy() differ if #from ends with a slash. */
+        char path[CF_BUFSIZE];
+        int ret = snprintf(path, sizeof(path), "%s/%s", from, dirp->d_name);
+        if (ret > 0 && ret < sizeof(path))
+        {
+            SeqAppend(stats, xstrdup(path));
+        }
+
+        char source[CF_BUFSIZE];
+        strlcpy(source, from, sizeof(source));
+        if (PathAppend(source, sizeof(source), dirp->d_name, '/'))
+        {
+            if (strcmp(source, path) != 0)
+            {
+                SeqAppend(stats, xstrdup(source));
+            }
+            SeqAppend(names, xstrdup(dirp->d_name));
+            SeqAppend(sources, xstrdup(source));
+        }
+    }
+    AbstractDirRewind(dirh);
+
+    if (StatCachePrefetch(conn, stats) != -1 &&
+        (attr.copy.compare == FILE_COMPARATOR_HASH ||
+         attr.copy.compare == FILE_COMPARATOR_CHECKSUM ||
+         attr.copy.compare == FILE_COMPARATOR_BINARY))
+    {
+        Seq *md5_sources = SeqNew(100, NULL);
+        Seq *digests = SeqNew(100, free);
+        Seq *local_stats = SeqNew(100, free);
+
+        for (size_t i = 0; i < SeqLength(sources); i++)
+        {
+            const char *source = SeqAt(sources, i);
+            const Stat *sp = StatCacheLookup(conn, source, conn->this_server);
+            if (sp == NULL || !S_ISREG(sp->cf_mode))
+            {
+                continue;
+            }
+
+            char dest[CF_BUFSIZE];
+            struct stat dsb;
+            strlcpy(dest, to, sizeof(dest));
+            if (!PathAppend(dest, sizeof(dest), SeqAt(names, i), FILE_SEPARATOR) ||
+                stat(dest, &dsb) == -1 ||
+                !S_ISREG(dsb.st_mode) || dsb.st_size != sp->cf_size)
+            {
+                continue;         /* CompareFileHashes() won't ask for it */
+            }
+
+            unsigned char *digest = xcalloc(1, EVP_MAX_MD_SIZE + 1);
+            HashFile(dest, digest, CF_DEFAULT_DIGEST);
+            SeqAppend(md5_sources, (void *) source);
+            SeqAppend(digests, digest);
+            SeqAppend(local_stats, xmemdup(&dsb, sizeof(dsb)));
+        }
+
+        /* CompareHashNet() reuses these digests if the files are unchanged. */
+        StatCachePrefetchDigests(conn, md5_sources, digests, local_stats);
+
+        SeqDestroy(md5_sources);
+        SeqDestroy(digests);
+        SeqDestroy(local_stats);
+    }
+
+    SeqDestroy(names);
+    SeqDestroy(sources);
+    SeqDestroy(stats);
+}
+
 static PromiseResult SourceSearchAndCopy(EvalContext *ctx, const char *from, char *to, int maxrecurse, Attributes attr,
                                          const Promise *pp, dev_t rootdevice, CompressedArray **inode_cache, AgentConnection *conn)
 {
@@ -814,6 +912,12 @@ static PromiseResult SourceSearchAndCopy(EvalContext *ctx, const char *from, cha
         return PROMISE_RESULT_INTERRUPTED;
     }
 
+    if (conn != NULL)
+    {
+        /* Replaces a round trip per entry with one per batch of entries. */
+        PrefetchRemoteDir(from, to, attr, dirh, conn);
+    }
+
     /* No backslashes over the network. */
     const char sep = (conn != NULL) ? '/' : FILE_SEPARATOR;
 
@@ -2784,6 +2888,13 @@ static AgentConnection *FileCopyConnectionOpen(const EvalContext *ctx,
         {
             return conn;
         }
+        else if (ConnCache_IsOffline(servername, port, flags))
+        {
+            Log(LOG_LEVEL_VERBOSE,
+                "Server '%s' failed to answer recently, not trying again yet",
+                servername);
+            return NULL;
+        }
         else                    /* not found, open and cache new connection */
         {
             int err = 0;
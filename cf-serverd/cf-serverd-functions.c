@@ -47,9 +47,15 @@
 #include <file_lib.h>
 #include <loading.h>
 #include <printsize.h>
+#include <server_pool.h>                                  /* ServerPool* */
+#include <server_reactor.h>                            /* ServerReactor* */
+#include <lastseen.h>                              /* LastSeenWriteBehind* */
+#include <server_digest_cache.h>                    /* ServerDigestCache* */
 
 
 static const size_t QUEUESIZE = 50;
+/* How often lastseen sightings buffered in memory are written to disk. */
+static const time_t LASTSEEN_FLUSH_INTERVAL = 10;
 int NO_FORK = false; /* GLOBAL_A */
 
 /*******************************************************************/
@@ -689,12 +695,18 @@ static void PrepareServer(int sd)
  */
 static int WaitOnThreads()
 {
+    /* Connections still waiting in the queue are dropped. */
+    ServerPoolClose();
+    ServerPoolLogStats(LOG_LEVEL_VERBOSE);
+    ServerTLSLogSessionStats(LOG_LEVEL_VERBOSE);
+    ServerDigestCacheLogStats(LOG_LEVEL_VERBOSE);
+
     int result = 1;
     for (int i = 2; i > 0; i--)
     {
         if (ThreadLock(cft_server_children))
         {
-            result = ACTIVE_THREADS;
+            result = MAX(ACTIVE_THREADS, (int) ServerPoolBusy());
             ThreadUnlock(cft_server_children);
         }
 
@@ -721,6 +733,7 @@ static int WaitOnThreads()
         assert(result == 0);
         Log(LOG_LEVEL_VERBOSE,
             "All threads are done, cleaning up allocations");
+        ServerPoolStop();
         ClearAuthAndACLs();
         ServerTLSDeInitialize();
     }
@@ -767,6 +780,13 @@ static void CollectCallIfDue(EvalContext *ctx)
  */
 static int WaitForIncoming(int sd)
 {
+    if (ServerReactorIsRunning())
+    {
+        /* Also serves requests on idle connections meanwhile. */
+        Log(LOG_LEVEL_DEBUG, "Waiting at incoming epoll...");
+        return ServerReactorWait(60);
+    }
+
     Log(LOG_LEVEL_DEBUG, "Waiting at incoming select...");
     struct timeval timeout = { .tv_sec = 60 };
     int signal_pipe = GetSignalPipe();
@@ -808,18 +828,21 @@ static int WaitForIncoming(int sd)
 
 /* Check for new policy just before spawning a thread.
  *
- * Server reconfiguration can only happen when no threads are active,
- * so this is a good time to do it; but we do still have to check for
- * running threads. */
+ * Server reconfiguration can only happen when no threads are active and no
+ * connections are queued, so this is a good time to do it; but we do still
+ * have to check for running threads. */
 static void PolicyUpdateIfSafe(EvalContext *ctx, Policy **policy,
                                GenericAgentConfig *config)
 {
     if (ThreadLock(cft_server_children))
     {
         int prior = COLLECT_INTERVAL;
-        if (ACTIVE_THREADS == 0)
+        /* Only the main thread queues connections, so ServerPoolBusy()
+         * can't grow while we hold the lock. */
+        if (ACTIVE_THREADS == 0 && ServerPoolBusy() == 0)
         {
             CheckFileChanges(ctx, policy, config);
+            ServerWorkersUpdate();
         }
         ThreadUnlock(cft_server_children);
 
@@ -832,6 +855,81 @@ static void PolicyUpdateIfSafe(EvalContext *ctx, Policy **policy,
     }
 }
 
+/* Log the connection queue statistics every few minutes. */
+static void LogWorkerStatsIfDue(time_t *last_logged)
+{
+    time_t now = time(NULL);
+    if (now >= *last_logged + 5 * SECONDS_PER_MINUTE)
+    {
+        ServerPoolLogStats(LOG_LEVEL_VERBOSE);
+        ServerTLSLogSessionStats(LOG_LEVEL_VERBOSE);
+        ServerDigestCacheLogStats(LOG_LEVEL_VERBOSE);
+        if (ServerReactorIsRunning())
+        {
+            Log(LOG_LEVEL_VERBOSE, "Idle connections waiting for requests: %zu",
+                ServerReactorParkedCount());
+        }
+        *last_logged = now;
+    }
+}
+
+static bool PathIsAdmitted(const struct admitdeny_acl *admit)
+{
+    return StrList_Len(admit->ips)       > 0 ||
+           StrList_Len(admit->hostnames) > 0 ||
+           StrList_Len(admit->keys)      > 0;
+}
+
+/* Hash the files under admitted paths in the background, if
+ * precomputedigests is set. The paths are copied, since a policy reload
+ * replaces paths_acl. */
+static void DigestPrecomputeStart(void)
+{
+    if (!CFD_PRECOMPUTE_DIGESTS || paths_acl == NULL)
+    {
+        return;
+    }
+
+    Seq *paths = SeqNew(paths_acl->len, free);
+    for (size_t i = 0; i < paths_acl->len; i++)
+    {
+        const char *path = StrList_At(paths_acl->resource_names, i);
+
+        /* Paths with special variables only exist per connection. */
+        if (!PathIsAdmitted(&paths_acl->acls[i].admit) ||
+            strstr(path, "$(") != NULL || strstr(path, "${") != NULL)
+        {
+            continue;
+        }
+
+        /* Directories are stored with a trailing slash, so skip anything
+         * below a directory that is already in the list. */
+        bool nested = false;
+        for (size_t j = 0; j < SeqLength(paths) && !nested; j++)
+        {
+            const char *dir = SeqAt(paths, j);
+            size_t dir_len = strlen(dir);
+            nested = (dir_len > 0 && IsFileSep(dir[dir_len - 1]) &&
+                      strncmp(path, dir, dir_len) == 0);
+        }
+        if (!nested)
+        {
+            SeqAppend(paths, xstrdup(path));
+        }
+    }
+
+    if (SeqLength(paths) == 0)
+    {
+        SeqDestroy(paths);
+        return;
+    }
+
+    Log(LOG_LEVEL_VERBOSE,
+        "Precomputing the digests of files under %zu admitted paths",
+        SeqLength(paths));
+    ServerDigestCachePrecomputeStart(paths);
+}
+
 /* Try to accept a connection; handle if we get one. */
 static void AcceptAndHandle(EvalContext *ctx, int sd)
 {
@@ -896,10 +994,17 @@ int StartServer(EvalContext *ctx, Policy **policy, GenericAgentConfig *config)
 
     PrepareServer(sd);
     CollectCallStart(COLLECT_INTERVAL);
+    ServerWorkersUpdate();
+    ServerReactorEnable(sd);
+    LastSeenWriteBehindStart(LASTSEEN_FLUSH_INTERVAL);
+    DigestPrecomputeStart();
 
+    time_t last_stats = time(NULL);
     while (!IsPendingTermination())
     {
         CollectCallIfDue(ctx);
+        LogWorkerStatsIfDue(&last_stats);
+        LastSeenFlushIfDue();
 
         int selected = WaitForIncoming(sd);
 
@@ -925,6 +1030,8 @@ int StartServer(EvalContext *ctx, Policy **policy, GenericAgentConfig *config)
     Log(LOG_LEVEL_NOTICE, "Cleaning up and exiting...");
 
     CollectCallStop();
+    ServerDigestCachePrecomputeStop();
+    ServerReactorStop();                      /* Drops idle connections */
     if (sd != -1)
     {
         Log(LOG_LEVEL_VERBOSE, "Closing listening socket");
@@ -933,6 +1040,7 @@ int StartServer(EvalContext *ctx, Policy **policy, GenericAgentConfig *config)
 
     /* This is a graceful exit, give 2 seconds chance to threads. */
     int threads_left = WaitOnThreads();
+    LastSeenWriteBehindStop();
     YieldCurrentLock(thislock);
     PolicyDestroy(server_cfengine_policy);
 
@@ -0,0 +1,345 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <platform.h>
+
+#include "iptree.h"
+
+#include <alloc.h>
+
+
+#define IPTREE_ADDR_BYTES 16                    /* enough for IPv6 */
+
+
+typedef struct iptree_node
+{
+    unsigned char prefix[IPTREE_ADDR_BYTES]; /* bits after bitlen are zero */
+    unsigned int bitlen;
+    char *rule;                     /* Non-NULL if a rule ends at this node */
+    struct iptree_node *child[2];
+} IPTreeNode;
+
+struct iptree
+{
+    IPTreeNode *root4;
+    IPTreeNode *root6;
+    size_t len;                                /* number of distinct rules */
+};
+
+
+static int GetBit(const unsigned char *addr, unsigned int bit)
+{
+    return (addr[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+/* Zero all bits of #addr from position #bitlen onwards. */
+static void MaskBits(unsigned char *addr, unsigned int bitlen)
+{
+    for (unsigned int i = bitlen / 8; i < IPTREE_ADDR_BYTES; i++)
+    {
+        if (i == bitlen / 8 && bitlen % 8 != 0)
+        {
+            addr[i] &= 0xFF << (8 - bitlen % 8);
+        }
+        else
+        {
+            addr[i] = 0;
+        }
+    }
+}
+
+/* Return the length of the common prefix of #a and #b, knowing that the
+ * first #from bits are already equal and looking no further than #max. */
+static unsigned int CommonBits(const unsigned char *a, const unsigned char *b,
+                               unsigned int from, unsigned int max)
+{
+    unsigned int bits = from;
+    while (bits < max)
+    {
+        if (bits % 8 == 0 && max - bits >= 8 && a[bits / 8] == b[bits / 8])
+        {
+            bits += 8;
+        }
+        else if (GetBit(a, bits) == GetBit(b, bits))
+        {
+            bits++;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return bits;
+}
+
+/**
+ * Parse #rule into binary address and prefix length, see iptree.h for the
+ * accepted formats.
+ *
+ * @return false if #rule is not one of them.
+ */
+static bool ParseRule(const char *rule, int *family,
+                      unsigned char *addr, unsigned int *bitlen)
+{
+    const char *slash = strchr(rule, '/');
+    if (slash != NULL)
+    {
+        char address[INET6_ADDRSTRLEN];
+        size_t len = slash - rule;
+        if (len == 0 || len >= sizeof(address) || !isdigit((unsigned char) slash[1]))
+        {
+            return false;
+        }
+        memcpy(address, rule, len);
+        address[len] = '\0';
+
+        char *end;
+        unsigned long mask = strtoul(slash + 1, &end, 10);
+        if (*end != '\0')
+        {
+            return false;
+        }
+
+        if (inet_pton(AF_INET, address, addr) == 1 && mask <= 32)
+        {
+            *family = AF_INET;
+        }
+        else if (inet_pton(AF_INET6, address, addr) == 1 && mask <= 128)
+        {
+            *family = AF_INET6;
+        }
+        else
+        {
+            return false;
+        }
+
+        *bitlen = mask;
+        return true;
+    }
+
+    if (strchr(rule, ':') != NULL)
+    {
+        if (inet_pton(AF_INET6, rule, addr) != 1)
+        {
+            return false;
+        }
+        *family = AF_INET6;
+        *bitlen = 128;
+        return true;
+    }
+
+    /* IPv4 address or octet prefix. Only canonical decimal octets are taken,
+     * since FuzzySetMatch() compares them textually. */
+    const char *p = rule;
+    unsigned int octets = 0;
+    for (;;)
+    {
+        if (!isdigit((unsigned char) *p) || octets == 4 ||
+            (p[0] == '0' && isdigit((unsigned char) p[1])))
+        {
+            return false;
+        }
+
+        unsigned int value = 0, digits = 0;
+        while (isdigit((unsigned char) *p))
+        {
+            value = value * 10 + (*p - '0');
+            p++;
+            digits++;
+        }
+        if (digits > 3 || value > 255)
+        {
+            return false;
+        }
+        addr[octets++] = value;
+
+        if (*p == '\0')
+        {
+            break;
+        }
+        if (*p != '.')
+        {
+            return false;
+        }
+        p++;
+    }
+
+    *family = AF_INET;
+    *bitlen = octets * 8;
+    return true;
+}
+
+static IPTreeNode *NodeNew(const unsigned char *addr, unsigned int bitlen,
+                           const char *rule)
+{
+    IPTreeNode *n = xcalloc(1, sizeof(*n));
+    memcpy(n->prefix, addr, sizeof(n->prefix));
+    MaskBits(n->prefix, bitlen);
+    n->bitlen = bitlen;
+    n->rule = (rule != NULL) ? xstrdup(rule) : NULL;
+    return n;
+}
+
+static void NodeFree(IPTreeNode *n)
+{
+    if (n != NULL)
+    {
+        NodeFree(n->child[0]);
+        NodeFree(n->child[1]);
+        free(n->rule);
+        free(n);
+    }
+}
+
+IPTree *IPTree_New(void)
+{
+    return xcalloc(1, sizeof(IPTree));
+}
+
+void IPTree_Free(IPTree *t)
+{
+    if (t != NULL)
+    {
+        NodeFree(t->root4);
+        NodeFree(t->root6);
+        free(t);
+    }
+}
+
+size_t IPTree_Len(const IPTree *t)
+{
+    return (t != NULL) ? t->len : 0;
+}
+
+/**
+ * @return false if #rule is not an address or subnet that can be stored in
+ *         the tree, in which case nothing was inserted.
+ */
+bool IPTree_Insert(IPTree *t, const char *rule)
+{
+    int family;
+    unsigned char addr[IPTREE_ADDR_BYTES] = { 0 };
+    unsigned int bitlen;
+
+    if (!ParseRule(rule, &family, addr, &bitlen))
+    {
+        return false;
+    }
+    MaskBits(addr, bitlen);
+
+    IPTreeNode **pp = (family == AF_INET) ? &t->root4 : &t->root6;
+    unsigned int matched = 0;
+    while (*pp != NULL)
+    {
+        IPTreeNode *n = *pp;
+        unsigned int common = CommonBits(addr, n->prefix, matched,
+                                         MIN(bitlen, n->bitlen));
+
+        if (common < n->bitlen)
+        {
+            /* Diverges inside this node's prefix: split it. */
+            IPTreeNode *split = NodeNew(addr, common, NULL);
+            split->child[GetBit(n->prefix, common)] = n;
+            if (common == bitlen)
+            {
+                split->rule = xstrdup(rule);
+            }
+            else
+            {
+                split->child[GetBit(addr, common)] = NodeNew(addr, bitlen, rule);
+            }
+            *pp = split;
+            t->len++;
+            return true;
+        }
+
+        if (bitlen == n->bitlen)
+        {
+            if (n->rule == NULL)                  /* else it's a duplicate */
+            {
+                n->rule = xstrdup(rule);
+                t->len++;
+            }
+            return true;
+        }
+
+        matched = n->bitlen;
+        pp = &n->child[GetBit(addr, n->bitlen)];
+    }
+
+    *pp = NodeNew(addr, bitlen, rule);
+    t->len++;
+    return true;
+}
+
+/**
+ * @return The first (shortest) rule in the tree covering #ipaddr, or NULL if
+ *         none does or #ipaddr is not a valid IPv4 or IPv6 address.
+ */
+const char *IPTree_Match(const IPTree *t, const char *ipaddr)
+{
+    unsigned char addr[IPTREE_ADDR_BYTES] = { 0 };
+    const IPTreeNode *n;
+    unsigned int addr_bits;
+
+    if (strchr(ipaddr, ':') != NULL)
+    {
+        if (inet_pton(AF_INET6, ipaddr, addr) != 1)
+        {
+            return NULL;
+        }
+        n = t->root6;
+        addr_bits = 128;
+    }
+    else
+    {
+        if (inet_pton(AF_INET, ipaddr, addr) != 1)
+        {
+            return NULL;
+        }
+        n = t->root4;
+        addr_bits = 32;
+    }
+
+    unsigned int matched = 0;
+    while (n != NULL)
+    {
+        if (CommonBits(addr, n->prefix, matched, n->bitlen) < n->bitlen)
+        {
+            return NULL;
+        }
+        if (n->rule != NULL)
+        {
+            return n->rule;
+        }
+        if (n->bitlen >= addr_bits)
+        {
+            return NULL;
+        }
+        matched = n->bitlen;
+        n = n->child[GetBit(addr, n->bitlen)];
+    }
+
+    return NULL;
+}
@@ -0,0 +1,57 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_IPTREE_H
+#define CFENGINE_IPTREE_H
+
+
+#include <platform.h>
+
+
+/**
+ * Path-compressed binary radix (patricia) tree of IPv4 and IPv6 subnets,
+ * used to hold the admit/deny IP rules of an ACL in compiled form.
+ *
+ * Accepted rules are:
+ *  - full addresses, e.g. "10.1.2.3" or "2001:db8::1" (/32 or /128)
+ *  - CIDR subnets, e.g. "10.1.0.0/16" or "2001:db8::/32"
+ *  - IPv4 octet prefixes, e.g. "10.1" (same as "10.1.0.0/16"), which is
+ *    how FuzzySetMatch() interprets them.
+ *
+ * Everything else (ranges like "10.1.1-5.1", regexes) is rejected by
+ * IPTree_Insert() and must be matched the slow way by the caller.
+ *
+ * Lookups cost O(prefix length), independently of the number of rules.
+ */
+typedef struct iptree IPTree;
+
+
+IPTree *IPTree_New(void);
+void IPTree_Free(IPTree *t);
+bool IPTree_Insert(IPTree *t, const char *rule);
+const char *IPTree_Match(const IPTree *t, const char *ipaddr);
+size_t IPTree_Len(const IPTree *t);
+
+
+#endif
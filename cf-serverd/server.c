@@ -48,13 +48,17 @@
 #include <printsize.h>
 
 #include "server_classic.h"                    /* BusyWithClassicConnection */
+#include "server_pool.h"                                    /* ServerPool* */
+#include "server_reactor.h"                             /* ServerReactor* */
 
 
 /*
-  The only exported function in this file is the following, used only in
+  The only exported functions in this file are the following, used only in
   cf-serverd-functions.c.
 
   void ServerEntryPoint(EvalContext *ctx, const char *ipaddr, ConnectionInfo *info);
+  void ServerWorkersUpdate(void);
+  bool ServerReactorEnable(int sd);
 
   TODO move this file to cf-serverd-functions.c or most probably server_common.c.
 */
@@ -67,6 +71,9 @@
 int ACTIVE_THREADS = 0; /* GLOBAL_X */
 
 int CFD_MAXPROCESSES = 0; /* GLOBAL_P */
+int CFD_WORKER_THREADS = 0; /* GLOBAL_P */
+int CFD_CONNECTION_QUEUE = 0; /* GLOBAL_P */
+bool CFD_PRECOMPUTE_DIGESTS = false; /* GLOBAL_P */
 bool DENYBADCLOCKS = true; /* GLOBAL_P */
 int MAXTRIES = 5; /* GLOBAL_P */
 bool LOGENCRYPT = false; /* GLOBAL_P */
@@ -83,6 +90,8 @@ char CFRUNCOMMAND[CF_MAXVARSIZE] = { 0 };                       /* GLOBAL_P */
 static void SpawnConnection(EvalContext *ctx, const char *ipaddr, ConnectionInfo *info);
 static void PurgeOldConnections(Item **list, time_t now);
 static void *HandleConnection(void *conn);
+static void DropConnection(void *conn);
+static bool ResumeConnection(void *conn);
 static ServerConnectionState *NewConn(EvalContext *ctx, ConnectionInfo *info);
 static void DeleteConn(ServerConnectionState *conn);
 
@@ -194,6 +203,62 @@ static void PurgeOldConnections(Item **list, time_t now)
 
 /*********************************************************************/
 
+/**
+ * (Re)start the pool of connection handling threads if its configured size,
+ * as set in body server control, has changed.
+ *
+ * @note Must only be called when no connections are queued or handled,
+ *       i.e. when it's safe to reload the policy.
+ */
+void ServerWorkersUpdate(void)
+{
+    /* Never more workers than maxconnections, since the extra ones would
+     * drop their connections anyway in HandleConnection(). */
+    size_t max_workers = MAX(CFD_MAXPROCESSES, 1);
+    size_t workers = (CFD_WORKER_THREADS > 0) ?
+        MIN((size_t) CFD_WORKER_THREADS, max_workers) : max_workers;
+    size_t queue_size = (CFD_CONNECTION_QUEUE > 0) ?
+        (size_t) CFD_CONNECTION_QUEUE : max_workers;
+
+    size_t cur_workers, cur_queue_size;
+    if (ServerPoolIsRunning(&cur_workers, &cur_queue_size))
+    {
+        if (cur_workers == workers && cur_queue_size == queue_size)
+        {
+            return;
+        }
+
+        assert(ServerPoolBusy() == 0);
+        ServerPoolStop();
+    }
+
+    if (!ServerPoolStart(workers, queue_size, HandleConnection, DropConnection))
+    {
+        Log(LOG_LEVEL_WARNING,
+            "Unable to start connection worker threads, "
+            "falling back to one thread per connection");
+
+        /* Parking connections needs workers to resume them. */
+        ServerReactorStop();
+    }
+}
+
+/**
+ * Start waiting for connections on #sd, and for requests on idle
+ * connections, with the reactor instead of select().
+ *
+ * @return false if the reactor is not available, see server_reactor.h.
+ */
+bool ServerReactorEnable(int sd)
+{
+    if (!ServerPoolIsRunning(NULL, NULL))
+    {
+        return false;
+    }
+    return ServerReactorStart(sd, GetSignalPipe(),
+                              ResumeConnection, DropConnection);
+}
+
 static void SpawnConnection(EvalContext *ctx, const char *ipaddr, ConnectionInfo *info)
 {
     ServerConnectionState *conn = NULL;
@@ -205,6 +270,24 @@ static void SpawnConnection(EvalContext *ctx, const char *ipaddr, ConnectionInfo
     int sd_accepted = ConnectionInfoSocket(info);
     strlcpy(conn->ipaddr, ipaddr, CF_MAX_IP_LEN );
 
+    if (ServerPoolIsRunning(NULL, NULL))
+    {
+        Log(LOG_LEVEL_VERBOSE,
+            "New connection (from %s, sd %d), queueing for worker thread...",
+            conn->ipaddr, sd_accepted);
+
+        if (!ServerPoolSubmit(conn))
+        {
+            Log(LOG_LEVEL_ERR,
+                "Connection queue full (%zu connections busy), "
+                "dropping connection from %s! "
+                "Increase server maxconnections or connectionqueuesize?",
+                ServerPoolBusy(), conn->ipaddr);
+            DropConnection(conn);
+        }
+        return;
+    }
+
     Log(LOG_LEVEL_VERBOSE,
         "New connection (from %s, sd %d), spawning new thread...",
         conn->ipaddr, sd_accepted);
@@ -277,6 +360,57 @@ static char *LogHook(LoggingPrivContext *log_ctx,
     return StringConcatenate(2, aligned_ipaddr, message);
 }
 
+/**
+ * Hand an idle connection over to the reactor until its next request
+ * arrives, freeing the current worker thread.
+ *
+ * @return true if parked, in which case #conn must not be touched any more:
+ *         another worker might already be serving it.
+ */
+static bool ParkConnection(ServerConnectionState *conn)
+{
+    /* epoll can't see requests already read and buffered by OpenSSL. */
+    if (conn->conn_info->ssl != NULL &&
+        SSL_pending(conn->conn_info->ssl) > 0)
+    {
+        return false;
+    }
+
+    conn->parked = true;
+    if (!ServerReactorPark(ConnectionInfoSocket(conn->conn_info), conn,
+                           CONNTIMEOUT * 20))
+    {
+        conn->parked = false;              /* not running, keep blocking */
+        return false;
+    }
+    return true;
+}
+
+/* Called by the reactor in the main thread, when a parked connection has a
+ * request waiting. */
+static bool ResumeConnection(void *c)
+{
+    return ServerPoolSubmit(c);
+}
+
+/**
+ * Serve requests of the new protocol until the connection is closed or goes
+ * idle and gets parked.
+ *
+ * @return true if parked.
+ */
+static bool ServeNewProtocol(ServerConnectionState *conn)
+{
+    while (BusyWithNewProtocol(conn->ctx, conn))
+    {
+        if (ParkConnection(conn))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
 /* TRIES: counts the number of consecutive connections dropped. */
 static int TRIES = 0;
 
@@ -307,6 +441,21 @@ static void *HandleConnection(void *c)
 
     LoggingPrivSetContext(&log_ctx);
 
+    if (conn->parked)
+    {
+        /* Woken up by the reactor for the next request of an established
+         * connection, which is still counted in ACTIVE_THREADS. */
+        conn->parked = false;
+        if (ServeNewProtocol(conn))
+        {
+            LoggingPrivSetContext(NULL);
+            return NULL;
+        }
+
+        Log(LOG_LEVEL_INFO, "Closing connection");
+        goto dethread;
+    }
+
     Log(LOG_LEVEL_INFO, "Accepting connection");
 
     /* We test if number of active threads is greater than max, if so we deny
@@ -417,8 +566,11 @@ static void *HandleConnection(void *c)
             }
         }
 
-        while (BusyWithNewProtocol(conn->ctx, conn))
+        if (ServeNewProtocol(conn))
         {
+            /* Parked, another worker will serve the next request. */
+            LoggingPrivSetContext(NULL);
+            return NULL;
         }
     }
     else if (protocol_version == CF_PROTOCOL_CLASSIC)
@@ -441,12 +593,31 @@ static void *HandleConnection(void *c)
     ThreadUnlock(cft_server_children);
 
   conndone:
+    DropConnection(conn);
+
+    /* Worker threads outlive the connection, and so the log_ctx above. */
+    LoggingPrivSetContext(NULL);
+    return NULL;
+}
+
+/* Tidy up a connection that has been handled or will never be. */
+static void DropConnection(void *c)
+{
+    ServerConnectionState *conn = c;
+
+    if (conn->parked)
+    {
+        /* Established connection, dropped while idle. */
+        ThreadLock(cft_server_children);
+        ACTIVE_THREADS--;
+        ThreadUnlock(cft_server_children);
+    }
+
     if (conn->conn_info->is_call_collect)
     {
         CollectCallMarkProcessed();
     }
     DeleteConn(conn);
-    return NULL;
 }
 
 
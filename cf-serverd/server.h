@@ -122,6 +122,9 @@ struct ServerConnectionState_
     /* TODO pass it through function arguments, EvalContext has nothing to do
      * with connection-specific data. */
     EvalContext *ctx;
+
+    /* Idle in-between requests, waiting in the reactor (server_reactor.h). */
+    bool parked;
 };
 
 typedef struct
@@ -136,6 +139,8 @@ typedef struct
 
 /* Used in cf-serverd-functions.c. */
 void ServerEntryPoint(EvalContext *ctx, const char *ipaddr, ConnectionInfo *info);
+void ServerWorkersUpdate(void);
+bool ServerReactorEnable(int sd);
 
 
 AgentConnection *ExtractCallBackChannel(ServerConnectionState *conn);
@@ -149,6 +154,9 @@ AgentConnection *ExtractCallBackChannel(ServerConnectionState *conn);
 
 extern int ACTIVE_THREADS;
 extern int CFD_MAXPROCESSES;
+extern int CFD_WORKER_THREADS;
+extern int CFD_CONNECTION_QUEUE;
+extern bool CFD_PRECOMPUTE_DIGESTS;
 extern bool DENYBADCLOCKS;
 extern int MAXTRIES;
 extern bool LOGENCRYPT;
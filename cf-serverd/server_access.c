@@ -45,6 +45,48 @@ struct acl *bundles_acl;
 struct acl *roles_acl;
 
 
+/**
+ * Linear search over all IPs in textual representation, used for the rules
+ * that racl_CompileIPs() could not put into the tree.
+ */
+static const char *LinearMatchIP(const StrList *ips, const char *ipaddr)
+{
+    for (int i = 0; i < StrList_Len(ips); i++)
+    {
+        if (FuzzySetMatch(StrList_At(ips, i), ipaddr) == 0 ||
+            /* Legacy regex matching, TODO DEPRECATE */
+            StringMatchFull(StrList_At(ips, i), ipaddr))
+        {
+            return StrList_At(ips, i);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @return a rule in #ad->ips matching #ipaddr, or NULL.
+ */
+static const char *admitdeny_MatchIP(const struct admitdeny_acl *ad,
+                                     const char *ipaddr)
+{
+    if (ad->ip_tree == NULL && ad->ip_slow == NULL)
+    {
+        /* Not compiled, fall back to checking all rules. */
+        return LinearMatchIP(ad->ips, ipaddr);
+    }
+
+    const char *rule = NULL;
+    if (ad->ip_tree != NULL)
+    {
+        rule = IPTree_Match(ad->ip_tree, ipaddr);
+    }
+    if (rule == NULL && ad->ip_slow != NULL)
+    {
+        rule = LinearMatchIP(ad->ip_slow, ipaddr);
+    }
+    return rule;
+}
+
 /**
  * Run this function on every resource (file, class, var etc) access to
  * grant/deny rights. Currently it checks if:
@@ -81,23 +123,7 @@ static bool access_CheckResource(const struct resource_acl *acl,
 
     if (!NULL_OR_EMPTY(ipaddr) && acl->admit.ips != NULL)
     {
-        /* Still using legacy code here, doing linear search over all IPs in
-         * textual representation... too CPU intensive! TODO store the ACL as
-         * one list of struct sockaddr_storage, together with CIDR notation
-         * subnet length.
-         */
-
-        const char *rule = NULL;
-        for (int i = 0; i < StrList_Len(acl->admit.ips); i++)
-        {
-            if (FuzzySetMatch(StrList_At(acl->admit.ips, i), ipaddr) == 0 ||
-                /* Legacy regex matching, TODO DEPRECATE */
-                StringMatchFull(StrList_At(acl->admit.ips, i), ipaddr))
-            {
-                rule = StrList_At(acl->admit.ips, i);
-                break;
-            }
-        }
+        const char *rule = admitdeny_MatchIP(&acl->admit, ipaddr);
 
         if (rule != NULL)
         {
@@ -189,17 +215,7 @@ static bool access_CheckResource(const struct resource_acl *acl,
         !NULL_OR_EMPTY(ipaddr) &&
         acl->deny.ips != NULL)
     {
-        const char *rule = NULL;
-        for (int i = 0; i < StrList_Len(acl->deny.ips); i++)
-        {
-            if (FuzzySetMatch(StrList_At(acl->deny.ips, i), ipaddr) == 0 ||
-                /* Legacy regex matching, TODO DEPRECATE */
-                StringMatchFull(StrList_At(acl->deny.ips, i), ipaddr))
-            {
-                rule = StrList_At(acl->deny.ips, i);
-                break;
-            }
-        }
+        const char *rule = admitdeny_MatchIP(&acl->deny, ipaddr);
 
         if (rule != NULL)
         {
@@ -518,9 +534,13 @@ void acl_Free(struct acl *a)
     for (i = 0; i < a->len; i++)
     {
         StrList_Free(&a->acls[i].admit.ips);
+        StrList_Free(&a->acls[i].admit.ip_slow);
+        IPTree_Free(a->acls[i].admit.ip_tree);
         StrList_Free(&a->acls[i].admit.hostnames);
         StrList_Free(&a->acls[i].admit.keys);
         StrList_Free(&a->acls[i].deny.ips);
+        StrList_Free(&a->acls[i].deny.ip_slow);
+        IPTree_Free(a->acls[i].deny.ip_tree);
         StrList_Free(&a->acls[i].deny.hostnames);
         StrList_Free(&a->acls[i].deny.keys);
     }
@@ -528,6 +548,38 @@ void acl_Free(struct acl *a)
     free(a);
 }
 
+/**
+ * (Re)build #ad->ip_tree and #ad->ip_slow from #ad->ips. Must be called
+ * every time #ad->ips changes, since once compiled #ad->ips itself is no
+ * longer consulted by access_CheckResource().
+ */
+void racl_CompileIPs(struct admitdeny_acl *ad)
+{
+    IPTree_Free(ad->ip_tree);
+    ad->ip_tree = NULL;
+    StrList_Free(&ad->ip_slow);
+
+    size_t len = StrList_Len(ad->ips);
+    if (len == 0)
+    {
+        return;
+    }
+
+    ad->ip_tree = IPTree_New();
+    for (size_t i = 0; i < len; i++)
+    {
+        const char *rule = StrList_At(ad->ips, i);
+        if (!IPTree_Insert(ad->ip_tree, rule))
+        {
+            StrList_Append(&ad->ip_slow, rule);
+        }
+    }
+    StrList_Finalise(&ad->ip_slow);
+
+    Log(LOG_LEVEL_DEBUG, "Compiled %zu IP rules: %zu in tree, %zu slow",
+        len, IPTree_Len(ad->ip_tree), StrList_Len(ad->ip_slow));
+}
+
 void acl_Summarise(const struct acl *acl, const char *title)
 {
     assert(acl->len == StrList_Len(acl->resource_names));
@@ -29,6 +29,7 @@
 
 #include <map.h>                                         /* StringMap */
 #include "strlist.h"                                     /* StrList */
+#include "iptree.h"                                       /* IPTree */
 
 
 /**
@@ -40,10 +41,16 @@
  *
  * @note: Currently these lists are binary searched, so after filling them up
  *        make sure you call StrList_Sort() to sort them.
+ *
+ * @note: After filling up #ips call racl_CompileIPs(), which splits them into
+ *        #ip_tree (addresses and subnets) and #ip_slow (ranges and regexes).
+ *        If it's never called, #ips is matched linearly.
  */
 struct admitdeny_acl
 {
     StrList *ips;                        /* admit_ips, deny_ips */
+    IPTree *ip_tree;                     /* compiled subset of ips */
+    StrList *ip_slow;                    /* rest of ips, not in ip_tree */
     StrList *hostnames;                  /* admit_hostnames, deny_hostnames */
     StrList *keys;                       /* admit_keys, deny_keys */
     StrList *usernames;      /* currently used only in roles access promise */
@@ -100,6 +107,7 @@ size_t ReplaceSpecialVariables(char *buf, size_t buf_size,
 
 size_t acl_SortedInsert(struct acl **a, const char *handle);
 void   acl_Free(struct acl *a);
+void   racl_CompileIPs(struct admitdeny_acl *ad);
 void   acl_Summarise(const struct acl *acl, const char *title);
 
 /* TODO instead of getting all kind of different parameters like
@@ -52,8 +52,13 @@ static const int CF_NOSIZE = -1;
 #include <cf-windows-functions.h>                  /* NovaWin_UserNameToSid */
 #include <mutex.h>                                 /* ThreadLock */
 #include <stat_cache.h>                            /* struct Stat */
+#include <server_digest_cache.h>             /* ServerDigestCacheHashFile */
 #include "server_access.h"
 
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>                                   /* sendfile */
+#endif
+
 
 /* NOTE: Always Log(LOG_LEVEL_INFO) before calling RefuseAccess(), so that
  * some clue is printed in the cf-serverd logs. */
@@ -396,22 +401,198 @@ static void FailedTransfer(ConnectionInfo *connection)
     }
 }
 
+/* Most bytes streamed between two checks that the source file is not
+ * changing under us; sendfile() is handed this much (in whole blocks). */
+#define CF_GETFILE_CHECK_INTERVAL (1024 * 1024)
+
+static bool SendFileBlock(ConnectionInfo *conn_info, const char *buf, int len)
+{
+    int ret;
+    switch (ConnectionInfoProtocolVersion(conn_info))
+    {
+    case CF_PROTOCOL_CLASSIC:
+        ret = SendSocketStream(ConnectionInfoSocket(conn_info), buf, len);
+        break;
+    case CF_PROTOCOL_TLS:
+        ret = TLSSend(ConnectionInfoSSL(conn_info), buf, len);
+        break;
+    default:
+        UnexpectedError("SendFileBlock: ProtocolVersion %d!",
+                        ConnectionInfoProtocolVersion(conn_info));
+        return false;
+    }
+
+    if (ret != len)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Send failed in GetFile. (send: %s)",
+            GetErrorStr());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * In-band messages (CF_FAILEDSTR, CF_CHANGEDSTR1) take the place of the next
+ * block, and must be exactly as long as the client reads for it: the client
+ * leaves anything more in the stream, where the next request on the
+ * connection would find it. That is #len, the rest of the file up to one
+ * block; the message is truncated or padded with zeros to fit.
+ */
+static void SendFileMessage(ConnectionInfo *conn_info, char *block,
+                            int len, const char *message)
+{
+    if (len <= 0)
+    {
+        return;
+    }
+    memset(block, 0, len);
+    memcpy(block, message, MIN(strlen(message), (size_t) len));
+    SendFileBlock(conn_info, block, len);
+}
+
+static void SendFileChanged(ConnectionInfo *conn_info, char *block,
+                            int len, const char *filename)
+{
+    char message[CF_BUFSIZE];
+    snprintf(message, sizeof(message), "%s%s: %s",
+             CF_CHANGEDSTR1, CF_CHANGEDSTR2, filename);
+    SendFileMessage(conn_info, block, len, message);
+}
+
+/**
+ * Read and send #len bytes of #fd, one block at a time.
+ *
+ * @param *sent bytes sent; less than #len if the file was truncated
+ * @return false on read or send error
+ */
+static bool SendFileRead(ConnectionInfo *conn_info, int fd,
+                         char *block, int blocksize, off_t len, off_t *sent)
+{
+    *sent = 0;
+    while (*sent < len)
+    {
+        int want = MIN(len - *sent, blocksize);
+        int n_read = 0;
+        while (n_read < want)
+        {
+            ssize_t ret = read(fd, block + n_read, want - n_read);
+            if (ret == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (ret == -1)
+            {
+                Log(LOG_LEVEL_ERR, "Read failed in GetFile. (read: %s)",
+                    GetErrorStr());
+                return false;
+            }
+            if (ret == 0)
+            {
+                break;
+            }
+            n_read += ret;
+        }
+
+        if (n_read < want)                        /* truncated at source */
+        {
+            return true;
+        }
+
+        if (!SendFileBlock(conn_info, block, n_read))
+        {
+            return false;
+        }
+        *sent += n_read;
+    }
+    return true;
+}
+
+#ifdef HAVE_SYS_SENDFILE_H
+/**
+ * Send #len bytes of #fd starting at #offset without copying them through
+ * user space. Only for the classic protocol, TLS needs the plaintext.
+ *
+ * @param *sent bytes sent; less than #len if the file was truncated
+ * @param *unsupported set if sendfile() refused this file before sending
+ *                     anything, so that the caller can fall back to read()
+ * @return false on error
+ */
+static bool SendFileKernel(int sd, int fd, off_t offset, off_t len,
+                           off_t *sent, bool *unsupported)
+{
+    *sent = 0;
+    *unsupported = false;
+
+    EnforceBwLimit((int) len);
+
+    while (*sent < len)
+    {
+        ssize_t ret = sendfile(sd, fd, &offset, len - *sent);
+        if (ret == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret == -1)
+        {
+            if (*sent == 0 && (errno == EINVAL || errno == ENOSYS))
+            {
+                *unsupported = true;
+                return true;
+            }
+            Log(LOG_LEVEL_VERBOSE, "Send failed in GetFile. (sendfile: %s)",
+                GetErrorStr());
+            return false;
+        }
+        if (ret == 0)                             /* truncated at source */
+        {
+            break;
+        }
+        *sent += ret;
+    }
+    return true;
+}
+#endif
+
+/**
+ * Stream a file in blocks of #args->buf_size bytes. Every few megabytes
+ * the file is stat()ed again and the transfer is cut short with
+ * CF_CHANGEDSTR1 if its size changed; the message always starts on a block
+ * boundary, where the client looks for it.
+ */
 void CfGetFile(ServerFileGetState *args)
 {
-    int fd;
-    off_t n_read, total = 0, sendlen = 0, count = 0;
-    char sendbuffer[CF_BUFSIZE + 256], filename[CF_BUFSIZE];
+    char filename[CF_BUFSIZE];
     struct stat sb;
-    int blocksize = 2048;
 
     ConnectionInfo *conn_info = args->conn->conn_info;
 
+    int blocksize = args->buf_size;
+    if (blocksize <= 0 || blocksize > CF_FILE_BLOCKSIZE_MAX)
+    {
+        blocksize = CF_FILE_BLOCKSIZE_LEGACY;
+    }
+
     TranslatePath(filename, args->replyfile);
 
-    stat(filename, &sb);
+    /* Used for in-band messages and for read() when not using sendfile(). */
+    char *block = xcalloc(1, blocksize);
 
-    Log(LOG_LEVEL_DEBUG, "CfGetFile('%s'), size = %jd",
-        filename, (intmax_t) sb.st_size);
+    if (stat(filename, &sb) == -1)
+    {
+        Log(LOG_LEVEL_ERR, "Cannot stat file '%s'. (stat: %s)",
+            filename, GetErrorStr());
+        /* The size the client expects is unknown, send a whole block. */
+        SendFileMessage(conn_info, block, blocksize, CF_FAILEDSTR);
+        free(block);
+        return;
+    }
+
+    Log(LOG_LEVEL_DEBUG, "CfGetFile('%s'), size = %jd, blocksize = %d",
+        filename, (intmax_t) sb.st_size, blocksize);
+
+    /* What the client reads first, supposing it has the same size as we
+     * do: it got it from a STAT or SYNCH request just before. */
+    const int first_block = MIN(sb.st_size, blocksize);
 
 /* Now check to see if we have remote permission */
 
@@ -419,132 +600,126 @@ void CfGetFile(ServerFileGetState *args)
     {
         Log(LOG_LEVEL_INFO, "REFUSE access to file: %s", filename);
         RefuseAccess(args->conn, args->replyfile);
-        snprintf(sendbuffer, CF_BUFSIZE, "%s", CF_FAILEDSTR);
-        if (ConnectionInfoProtocolVersion(conn_info) == CF_PROTOCOL_CLASSIC)
-        {
-            SendSocketStream(ConnectionInfoSocket(conn_info), sendbuffer, args->buf_size);
-        }
-        else if (ConnectionInfoProtocolVersion(conn_info) == CF_PROTOCOL_TLS)
-        {
-            TLSSend(ConnectionInfoSSL(conn_info), sendbuffer, args->buf_size);
-        }
+        /* The refusal transaction is the start of that first block. */
+        int refusal_len = CF_INBAND_OFFSET + strlen(CF_FAILEDSTR);
+        SendFileMessage(conn_info, block, first_block - refusal_len,
+                        CF_FAILEDSTR);
+        free(block);
         return;
     }
 
 /* File transfer */
 
-    if ((fd = safe_open(filename, O_RDONLY)) == -1)
+    int fd = safe_open(filename, O_RDONLY);
+    if (fd == -1)
     {
         Log(LOG_LEVEL_ERR, "Open error of file '%s'. (open: %s)",
             filename, GetErrorStr());
-        snprintf(sendbuffer, CF_BUFSIZE, "%s", CF_FAILEDSTR);
-        if (ConnectionInfoProtocolVersion(conn_info) == CF_PROTOCOL_CLASSIC)
-        {
-            SendSocketStream(ConnectionInfoSocket(conn_info), sendbuffer, args->buf_size);
-        }
-        else if (ConnectionInfoProtocolVersion(conn_info) == CF_PROTOCOL_TLS)
-        {
-            TLSSend(ConnectionInfoSSL(conn_info), sendbuffer, args->buf_size);
-        }
+        SendFileMessage(conn_info, block, first_block, CF_FAILEDSTR);
+        free(block);
+        return;
     }
-    else
-    {
-        int div = 3;
 
-        if (sb.st_size > 10485760L) /* File larger than 10 MB, checks every 64kB */
+#ifdef HAVE_POSIX_FADVISE
+    /* Let the kernel read ahead aggressively, we go front to back once. */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+#ifdef HAVE_SYS_SENDFILE_H
+    bool use_sendfile =
+        (ConnectionInfoProtocolVersion(conn_info) == CF_PROTOCOL_CLASSIC);
+#endif
+
+    /* Whole blocks between checks, so that CF_CHANGEDSTR1 stays aligned. */
+    const off_t run_size =
+        MAX(blocksize, CF_GETFILE_CHECK_INTERVAL / blocksize * blocksize);
+    const off_t size = sb.st_size;
+    off_t total = 0;
+
+    while (total < size)
+    {
+        /* check the file is not changing at source */
+        if (stat(filename, &sb) == -1)
         {
-            div = 32;
+            Log(LOG_LEVEL_ERR, "Cannot stat file '%s'. (stat: %s)",
+                filename, GetErrorStr());
+            break;
         }
 
-        while (true)
+        if (sb.st_size != size)
         {
-            memset(sendbuffer, 0, CF_BUFSIZE);
+            SendFileChanged(conn_info, block, MIN(size - total, blocksize),
+                            filename);
 
-            Log(LOG_LEVEL_DEBUG, "Now reading from disk...");
+            Log(LOG_LEVEL_DEBUG,
+                "Aborting transfer after %jd: file is changing rapidly at source.",
+                (intmax_t) total);
+            break;
+        }
 
-            if ((n_read = read(fd, sendbuffer, blocksize)) == -1)
-            {
-                Log(LOG_LEVEL_ERR, "Read failed in GetFile. (read: %s)", GetErrorStr());
-                break;
-            }
+        const off_t len = MIN(size - total, run_size);
+        off_t sent = 0;
+        bool ok;
 
-            if (n_read == 0)
+#ifdef HAVE_SYS_SENDFILE_H
+        if (use_sendfile)
+        {
+            bool unsupported;
+            ok = SendFileKernel(ConnectionInfoSocket(conn_info), fd,
+                                total, len, &sent, &unsupported);
+            if (ok && unsupported)
             {
-                break;
+                Log(LOG_LEVEL_DEBUG,
+                    "sendfile() not supported for '%s', using read()",
+                    filename);
+                use_sendfile = false;
+                lseek(fd, total, SEEK_SET);
+                continue;
             }
-            else
-            {
-                off_t savedlen = sb.st_size;
-
-                /* check the file is not changing at source */
-
-                if (count++ % div == 0)   /* Don't do this too often */
-                {
-                    if (stat(filename, &sb))
-                    {
-                        Log(LOG_LEVEL_ERR, "Cannot stat file '%s'. (stat: %s)",
-                            filename, GetErrorStr());
-                        break;
-                    }
-                }
-
-                if (sb.st_size != savedlen)
-                {
-                    snprintf(sendbuffer, CF_BUFSIZE, "%s%s: %s", CF_CHANGEDSTR1, CF_CHANGEDSTR2, filename);
-
-                    if (ConnectionInfoProtocolVersion(conn_info) == CF_PROTOCOL_CLASSIC)
-                    {
-                        if (SendSocketStream(ConnectionInfoSocket(conn_info), sendbuffer, blocksize) == -1)
-                        {
-                            Log(LOG_LEVEL_VERBOSE, "Send failed in GetFile. (send: %s)", GetErrorStr());
-                        }
-                    }
-                    else if (ConnectionInfoProtocolVersion(conn_info) == CF_PROTOCOL_TLS)
-                    {
-                        if (TLSSend(ConnectionInfoSSL(conn_info), sendbuffer, blocksize) == -1)
-                        {
-                            Log(LOG_LEVEL_VERBOSE, "Send failed in GetFile. (send: %s)", GetErrorStr());
-                        }
-                    }
-
-                    Log(LOG_LEVEL_DEBUG,
-                        "Aborting transfer after %jd: file is changing rapidly at source.",
-                        (intmax_t) total);
-                    break;
-                }
+        }
+        else
+#endif
+        {
+            ok = SendFileRead(conn_info, fd, block, blocksize, len, &sent);
+        }
 
-                if ((savedlen - total) / blocksize > 0)
-                {
-                    sendlen = blocksize;
-                }
-                else if (savedlen != 0)
-                {
-                    sendlen = (savedlen - total);
-                }
-            }
+        total += sent;
 
-            total += n_read;
+        if (!ok)
+        {
+            break;
+        }
 
-            if (ConnectionInfoProtocolVersion(conn_info) == CF_PROTOCOL_CLASSIC)
+        if (sent < len)
+        {
+            /* Truncated while sending: complete the current block with
+             * zeros, then tell the client unless that was the last one. */
+            if (total % blocksize != 0)
             {
-                if (SendSocketStream(ConnectionInfoSocket(conn_info), sendbuffer, sendlen) == -1)
+                off_t pad = MIN(blocksize - total % blocksize, size - total);
+                memset(block, 0, blocksize);
+                if (!SendFileBlock(conn_info, block, pad))
                 {
-                    Log(LOG_LEVEL_VERBOSE, "Send failed in GetFile. (send: %s)", GetErrorStr());
                     break;
                 }
+                total += pad;
             }
-            else if (ConnectionInfoProtocolVersion(conn_info) == CF_PROTOCOL_TLS)
+
+            if (total < size)
             {
-                if (TLSSend(ConnectionInfoSSL(conn_info), sendbuffer, sendlen) == -1)
-                {
-                    Log(LOG_LEVEL_VERBOSE, "Send failed in GetFile. (send: %s)", GetErrorStr());
-                    break;
-                }
+                SendFileChanged(conn_info, block,
+                                MIN(size - total, blocksize), filename);
             }
-        }
 
-        close(fd);
+            Log(LOG_LEVEL_DEBUG,
+                "Aborting transfer after %jd: file shrank at source.",
+                (intmax_t) total);
+            break;
+        }
     }
+
+    close(fd);
+    free(block);
 }
 
 void CfEncryptGetFile(ServerFileGetState *args)
@@ -853,7 +1028,7 @@ bool CompareLocalHash(const char *filename, const char digest[EVP_MAX_MD_SIZE +
 
     unsigned char file_digest[EVP_MAX_MD_SIZE + 1] = { 0 };
     /* TODO connection might timeout if this takes long! */
-    HashFile(translated_filename, file_digest, CF_DEFAULT_DIGEST);
+    ServerDigestCacheHashFile(translated_filename, file_digest);
 
     if (HashesMatch(digest, file_digest, CF_DEFAULT_DIGEST))
     {
@@ -0,0 +1,576 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <server_digest_cache.h>
+
+#include <openssl/evp.h>                                        /* EVP_* */
+#include <libcrypto-compat.h>
+
+#include <alloc.h>
+#include <map.h>
+#include <dir.h>                                            /* DirOpen */
+#include <file_lib.h>                                      /* safe_open */
+#include <hash.h>                                      /* HashNameFromId */
+#include <cf3.defs.h>                                /* CF_DEFAULT_DIGEST */
+
+
+/* Each entry takes about 200 bytes. */
+#define DIGEST_CACHE_CAPACITY 50000
+#define DIGEST_CACHE_READ_SIZE (64 * 1024)
+/* Files changed less than this long ago are not cached, since a change in
+ * the same second could leave size, mtime and ctime as they are. */
+#define DIGEST_CACHE_SETTLE_TIME 2
+
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+} DigestCacheKey;
+
+typedef struct
+{
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+} DigestCacheVersion;
+
+typedef struct
+{
+    DigestCacheKey key;                              /* the key in CACHE */
+    DigestCacheVersion version;
+    unsigned char digest[EVP_MAX_MD_SIZE + 1];
+    unsigned long last_used;
+    unsigned long hashing;      /* while being hashed, id of the hash job */
+} DigestCacheEntry;
+
+/* Protects everything below, and CHANGED is signalled whenever an entry
+ * stops being hashed. */
+static pthread_mutex_t CACHE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t CHANGED = PTHREAD_COND_INITIALIZER;
+static Map *CACHE = NULL; /* GLOBAL_X */
+static size_t CAPACITY = DIGEST_CACHE_CAPACITY; /* GLOBAL_X */
+static unsigned long USE_CLOCK = 0; /* GLOBAL_X */
+static unsigned long LAST_HASH_ID = 0; /* GLOBAL_X */
+static ServerDigestCacheStats STATS = { 0 }; /* GLOBAL_X */
+static bool PRECOMPUTE_STOP = false; /* GLOBAL_X */
+
+/* Only used from the main thread. */
+static pthread_t PRECOMPUTE_THREAD; /* GLOBAL_X */
+static bool PRECOMPUTE_RUNNING = false; /* GLOBAL_X */
+
+
+static unsigned int DigestCacheKeyHash(const void *k, unsigned int seed,
+                                       unsigned int max)
+{
+    const DigestCacheKey *key = k;
+    const uint64_t values[2] = { (uint64_t) key->dev, (uint64_t) key->ino };
+    const unsigned char *p = (const unsigned char *) values;
+
+    unsigned int h = seed;
+    for (size_t i = 0; i < sizeof(values); i++)
+    {
+        h += p[i];
+        h += (h << 10);
+        h ^= (h >> 6);
+    }
+    h += (h << 3);
+    h ^= (h >> 11);
+    h += (h << 15);
+
+    return (h & (max - 1));
+}
+
+static bool DigestCacheKeyEqual(const void *k1, const void *k2)
+{
+    const DigestCacheKey *key1 = k1, *key2 = k2;
+    return key1->dev == key2->dev && key1->ino == key2->ino;
+}
+
+static void DigestCacheVersionFromStat(DigestCacheVersion *version,
+                                       const struct stat *sb)
+{
+    version->size = sb->st_size;
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+    version->mtime = sb->st_mtim;
+    version->ctime = sb->st_ctim;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+    version->mtime = sb->st_mtimespec;
+    version->ctime = sb->st_ctimespec;
+#else
+    version->mtime.tv_sec  = sb->st_mtime;
+    version->mtime.tv_nsec = 0;
+    version->ctime.tv_sec  = sb->st_ctime;
+    version->ctime.tv_nsec = 0;
+#endif
+}
+
+static bool DigestCacheVersionEqual(const DigestCacheVersion *v1,
+                                    const DigestCacheVersion *v2)
+{
+    return v1->size          == v2->size          &&
+           v1->mtime.tv_sec  == v2->mtime.tv_sec  &&
+           v1->mtime.tv_nsec == v2->mtime.tv_nsec &&
+           v1->ctime.tv_sec  == v2->ctime.tv_sec  &&
+           v1->ctime.tv_nsec == v2->ctime.tv_nsec;
+}
+
+static bool DigestCacheVersionIsSettled(const DigestCacheVersion *version,
+                                        time_t now)
+{
+    return version->mtime.tv_sec < now - DIGEST_CACHE_SETTLE_TIME + 1 &&
+           version->ctime.tv_sec < now - DIGEST_CACHE_SETTLE_TIME + 1;
+}
+
+static bool HashDescriptor(int fd, unsigned char digest[EVP_MAX_MD_SIZE + 1])
+{
+    const EVP_MD *md = EVP_get_digestbyname(HashNameFromId(CF_DEFAULT_DIGEST));
+
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    if (context == NULL)
+    {
+        Log(LOG_LEVEL_ERR, "Failed to allocate openssl hashing context");
+        return false;
+    }
+
+    bool ok = (EVP_DigestInit(context, md) == 1);
+    unsigned char *buffer = xmalloc(DIGEST_CACHE_READ_SIZE);
+    while (ok)
+    {
+        ssize_t len = read(fd, buffer, DIGEST_CACHE_READ_SIZE);
+        if (len == 0)
+        {
+            break;
+        }
+        else if (len < 0)
+        {
+            if (errno != EINTR)
+            {
+                ok = false;
+            }
+            continue;
+        }
+        EVP_DigestUpdate(context, buffer, len);
+    }
+
+    unsigned int md_len;
+    ok = ok && (EVP_DigestFinal(context, digest, &md_len) == 1);
+
+    free(buffer);
+    EVP_MD_CTX_free(context);
+    return ok;
+}
+
+static int CompareLastUsed(const void *a, const void *b)
+{
+    const DigestCacheEntry *e1 = *(const DigestCacheEntry * const *) a;
+    const DigestCacheEntry *e2 = *(const DigestCacheEntry * const *) b;
+    return (e1->last_used > e2->last_used) - (e1->last_used < e2->last_used);
+}
+
+/* Drop the least recently used half of the cache, except entries being
+ * hashed. Called with CACHE_LOCK held. */
+static void DigestCacheEvict(void)
+{
+    DigestCacheEntry **entries = xmalloc(MapSize(CACHE) * sizeof(*entries));
+    size_t n = 0;
+
+    MapIterator i = MapIteratorInit(CACHE);
+    MapKeyValue *item;
+    while ((item = MapIteratorNext(&i)) != NULL)
+    {
+        DigestCacheEntry *entry = item->value;
+        if (entry->hashing == 0)
+        {
+            entries[n++] = entry;
+        }
+    }
+
+    qsort(entries, n, sizeof(*entries), CompareLastUsed);
+    for (size_t j = 0; j < (n + 1) / 2; j++)
+    {
+        DigestCacheKey key = entries[j]->key;
+        MapRemove(CACHE, &key);                           /* frees the entry */
+    }
+    STATS.evicted += (n + 1) / 2;
+
+    free(entries);
+}
+
+static Map *DigestCacheGet(void)
+{
+    if (CACHE == NULL)
+    {
+        CACHE = MapNew(DigestCacheKeyHash, DigestCacheKeyEqual, NULL, free);
+    }
+    return CACHE;
+}
+
+/**
+ * Look up the digest of the file open as #fd, hashing it if needed.
+ *
+ * @param precompute if true, count it as precomputed rather than as a hit or
+ *                   miss, and don't make room for it if the cache is full.
+ * @param hit        if not NULL, set to whether the digest was in the cache.
+ */
+static bool DigestCacheHashDescriptor(int fd,
+                                      unsigned char digest[EVP_MAX_MD_SIZE + 1],
+                                      bool precompute, bool *hit)
+{
+    if (hit != NULL)
+    {
+        *hit = false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1)
+    {
+        return false;
+    }
+    /* Inode numbers are not reliable everywhere (e.g. always 0 on Windows). */
+    if (!S_ISREG(sb.st_mode) || sb.st_ino == 0)
+    {
+        return HashDescriptor(fd, digest);
+    }
+
+    const DigestCacheKey key = { .dev = sb.st_dev, .ino = sb.st_ino };
+    DigestCacheVersion version;
+    DigestCacheVersionFromStat(&version, &sb);
+    const time_t now = time(NULL);
+
+    pthread_mutex_lock(&CACHE_LOCK);
+    Map *cache = DigestCacheGet();
+    bool waited = false;
+    DigestCacheEntry *entry;
+    while ((entry = MapGet(cache, &key)) != NULL && entry->hashing != 0)
+    {
+        /* Another thread is hashing this file, most likely the same version
+         * of it, so wait for its result. */
+        if (!waited)
+        {
+            STATS.waits++;
+            waited = true;
+        }
+        pthread_cond_wait(&CHANGED, &CACHE_LOCK);
+    }
+
+    if (entry != NULL && DigestCacheVersionEqual(&entry->version, &version))
+    {
+        memcpy(digest, entry->digest, sizeof(entry->digest));
+        entry->last_used = ++USE_CLOCK;
+        if (!precompute)
+        {
+            STATS.hits++;
+        }
+        if (hit != NULL)
+        {
+            *hit = true;
+        }
+        pthread_mutex_unlock(&CACHE_LOCK);
+        return true;
+    }
+
+    if (precompute)
+    {
+        STATS.precomputed++;
+    }
+    else
+    {
+        STATS.misses++;
+    }
+
+    unsigned long hash_id = 0;
+    if (!DigestCacheVersionIsSettled(&version, now))
+    {
+        STATS.uncached++;
+        if (entry != NULL)                     /* an older version of it */
+        {
+            MapRemove(cache, &key);
+        }
+    }
+    else if (entry != NULL || !precompute || MapSize(cache) < CAPACITY)
+    {
+        if (entry == NULL)
+        {
+            if (MapSize(cache) >= CAPACITY)
+            {
+                DigestCacheEvict();
+            }
+            entry = xcalloc(1, sizeof(*entry));
+            entry->key = key;
+            MapInsert(cache, &entry->key, entry);
+        }
+        /* Claim the entry, so others wait for us instead of hashing too. */
+        entry->version = version;
+        entry->hashing = hash_id = ++LAST_HASH_ID;
+    }
+    pthread_mutex_unlock(&CACHE_LOCK);
+
+    unsigned char file_digest[EVP_MAX_MD_SIZE + 1] = { 0 };
+    bool ok = HashDescriptor(fd, file_digest);
+
+    /* Make sure the file was not changed while we were reading it. */
+    DigestCacheVersion after;
+    bool unchanged = (fstat(fd, &sb) == 0);
+    if (unchanged)
+    {
+        DigestCacheVersionFromStat(&after, &sb);
+        unchanged = DigestCacheVersionEqual(&after, &version);
+    }
+
+    if (hash_id != 0)
+    {
+        pthread_mutex_lock(&CACHE_LOCK);
+        /* The entry may be gone if the cache was cleared meanwhile. */
+        entry = MapGet(cache, &key);
+        if (entry != NULL && entry->hashing == hash_id)
+        {
+            if (ok && unchanged)
+            {
+                memcpy(entry->digest, file_digest, sizeof(entry->digest));
+                entry->last_used = ++USE_CLOCK;
+                entry->hashing = 0;
+            }
+            else
+            {
+                if (ok)
+                {
+                    STATS.uncached++;
+                }
+                MapRemove(cache, &key);
+            }
+        }
+        pthread_cond_broadcast(&CHANGED);
+        pthread_mutex_unlock(&CACHE_LOCK);
+    }
+
+    if (ok)
+    {
+        memcpy(digest, file_digest, sizeof(file_digest));
+    }
+    return ok;
+}
+
+bool ServerDigestCacheHashFile(const char *filename,
+                               unsigned char digest[EVP_MAX_MD_SIZE + 1])
+{
+    int fd = safe_open(filename, O_RDONLY | O_BINARY);
+    if (fd == -1)
+    {
+        Log(LOG_LEVEL_INFO, "Cannot open file for hashing '%s'. (open: %s)",
+            filename, GetErrorStr());
+        return false;
+    }
+
+    bool ok = DigestCacheHashDescriptor(fd, digest, false, NULL);
+    if (!ok)
+    {
+        Log(LOG_LEVEL_INFO, "Failed to hash file '%s'. (%s)",
+            filename, GetErrorStr());
+    }
+    close(fd);
+    return ok;
+}
+
+/* Called by the precompute thread between files. */
+static bool PrecomputeShouldStop(void)
+{
+    pthread_mutex_lock(&CACHE_LOCK);
+    bool stop = PRECOMPUTE_STOP ||
+        (CACHE != NULL && MapSize(CACHE) >= CAPACITY);
+    pthread_mutex_unlock(&CACHE_LOCK);
+    return stop;
+}
+
+static size_t PrecomputeTree(const char *path)
+{
+    if (PrecomputeShouldStop())
+    {
+        return 0;
+    }
+
+    struct stat sb;
+    if (lstat(path, &sb) == -1)
+    {
+        Log(LOG_LEVEL_DEBUG, "Not precomputing digests for '%s' (lstat: %s)",
+            path, GetErrorStr());
+        return 0;
+    }
+
+    if (S_ISREG(sb.st_mode))
+    {
+        int fd = safe_open(path, O_RDONLY | O_BINARY);
+        if (fd == -1)
+        {
+            return 0;
+        }
+        unsigned char digest[EVP_MAX_MD_SIZE + 1] = { 0 };
+        bool hit;
+        bool ok = DigestCacheHashDescriptor(fd, digest, true, &hit);
+        close(fd);
+        return (ok && !hit) ? 1 : 0;
+    }
+    else if (!S_ISDIR(sb.st_mode))
+    {
+        return 0;
+    }
+
+    Dir *dir = DirOpen(path);
+    if (dir == NULL)
+    {
+        return 0;
+    }
+
+    size_t hashed = 0;
+    const struct dirent *dirp;
+    while ((dirp = DirRead(dir)) != NULL)
+    {
+        if (strcmp(dirp->d_name, ".") == 0 || strcmp(dirp->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        char *child;
+        size_t len = strlen(path);
+        if (len > 0 && IsFileSep(path[len - 1]))
+        {
+            xasprintf(&child, "%s%s", path, dirp->d_name);
+        }
+        else
+        {
+            xasprintf(&child, "%s%c%s", path, FILE_SEPARATOR, dirp->d_name);
+        }
+        hashed += PrecomputeTree(child);
+        free(child);
+    }
+    DirClose(dir);
+
+    return hashed;
+}
+
+size_t ServerDigestCachePrecompute(const char *path)
+{
+    return PrecomputeTree(path);
+}
+
+static void *PrecomputeThread(void *arg)
+{
+    Seq *paths = arg;
+    size_t hashed = 0;
+    for (size_t i = 0; i < SeqLength(paths); i++)
+    {
+        hashed += PrecomputeTree(SeqAt(paths, i));
+    }
+    Log(LOG_LEVEL_VERBOSE,
+        "Precomputed the digests of %zu files under %zu admitted paths",
+        hashed, SeqLength(paths));
+    SeqDestroy(paths);
+    return NULL;
+}
+
+bool ServerDigestCachePrecomputeStart(Seq *paths)
+{
+    assert(!PRECOMPUTE_RUNNING);
+
+    pthread_mutex_lock(&CACHE_LOCK);
+    PRECOMPUTE_STOP = false;
+    pthread_mutex_unlock(&CACHE_LOCK);
+
+    int ret = pthread_create(&PRECOMPUTE_THREAD, NULL, PrecomputeThread, paths);
+    if (ret != 0)
+    {
+        errno = ret;
+        Log(LOG_LEVEL_ERR,
+            "Unable to spawn thread to precompute digests (pthread_create: %s)",
+            GetErrorStr());
+        SeqDestroy(paths);
+        return false;
+    }
+
+    PRECOMPUTE_RUNNING = true;
+    return true;
+}
+
+void ServerDigestCachePrecomputeStop(void)
+{
+    if (!PRECOMPUTE_RUNNING)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&CACHE_LOCK);
+    PRECOMPUTE_STOP = true;
+    pthread_mutex_unlock(&CACHE_LOCK);
+
+    /* The file being hashed right now is finished first. */
+    pthread_join(PRECOMPUTE_THREAD, NULL);
+    PRECOMPUTE_RUNNING = false;
+
+    pthread_mutex_lock(&CACHE_LOCK);
+    PRECOMPUTE_STOP = false;
+    pthread_mutex_unlock(&CACHE_LOCK);
+}
+
+void ServerDigestCacheSetCapacity(size_t max_entries)
+{
+    assert(max_entries > 0);
+
+    pthread_mutex_lock(&CACHE_LOCK);
+    CAPACITY = max_entries;
+    pthread_mutex_unlock(&CACHE_LOCK);
+}
+
+void ServerDigestCacheClear(void)
+{
+    pthread_mutex_lock(&CACHE_LOCK);
+    if (CACHE != NULL)
+    {
+        /* Threads hashing a file find their entry gone, and don't cache. */
+        MapClear(CACHE);
+    }
+    pthread_mutex_unlock(&CACHE_LOCK);
+}
+
+void ServerDigestCacheGetStats(ServerDigestCacheStats *stats)
+{
+    pthread_mutex_lock(&CACHE_LOCK);
+    *stats = STATS;
+    stats->entries  = (CACHE != NULL) ? MapSize(CACHE) : 0;
+    stats->capacity = CAPACITY;
+    pthread_mutex_unlock(&CACHE_LOCK);
+}
+
+void ServerDigestCacheLogStats(LogLevel level)
+{
+    ServerDigestCacheStats s;
+    ServerDigestCacheGetStats(&s);
+
+    unsigned long lookups = s.hits + s.misses;
+    Log(level,
+        "File digest cache: %zu of %zu entries, hits: %lu, misses: %lu "
+        "(hit rate %.1f%%), waited for other thread: %lu, not cached: %lu, "
+        "evicted: %lu, precomputed: %lu",
+        s.entries, s.capacity, s.hits, s.misses,
+        (lookups > 0) ? 100.0 * s.hits / lookups : 0.0,
+        s.waits, s.uncached, s.evicted, s.precomputed);
+}
@@ -0,0 +1,100 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_SERVER_DIGEST_CACHE_H
+#define CFENGINE_SERVER_DIGEST_CACHE_H
+
+
+#include <platform.h>
+#include <logging.h>                                            /* LogLevel */
+#include <sequence.h>                                                /* Seq */
+#include <openssl/evp.h>                                  /* EVP_MAX_MD_SIZE */
+
+
+/**
+ * Process-wide cache of file digests (CF_DEFAULT_DIGEST), used by cf-serverd
+ * to answer MD5 and SYNCH compare requests without reading the whole file
+ * every time.
+ *
+ * A file is identified by its device and inode, and its digest is only
+ * reused while its size, mtime and ctime are the same as when it was
+ * hashed. Files changed while being hashed, or changed within the last
+ * couple of seconds (when a further change might leave all of these
+ * untouched), are hashed every time instead.
+ *
+ * When several threads ask for the same file at once, only one of them
+ * hashes it and the rest wait for its result. When the cache is full, the
+ * least recently used half of it is dropped.
+ *
+ * All functions are thread-safe.
+ */
+
+typedef struct
+{
+    size_t entries;
+    size_t capacity;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long waits;     /* waited for another thread hashing the file */
+    unsigned long uncached;        /* changed recently or while being hashed */
+    unsigned long evicted;
+    unsigned long precomputed;
+} ServerDigestCacheStats;
+
+
+/**
+ * Compute the digest of #filename, or take it from the cache.
+ *
+ * @return false if the file could not be read, leaving #digest untouched.
+ */
+bool ServerDigestCacheHashFile(const char *filename,
+                               unsigned char digest[EVP_MAX_MD_SIZE + 1]);
+
+/**
+ * Hash the regular file #path, or all regular files below the directory
+ * #path, and put their digests in the cache. Symbolic links are not
+ * followed. Stops early when the cache is full.
+ *
+ * @return the number of files hashed.
+ */
+size_t ServerDigestCachePrecompute(const char *path);
+
+/**
+ * Run ServerDigestCachePrecompute() over #paths in a background thread,
+ * which takes ownership of #paths. Must only be called from the main thread,
+ * and not again before ServerDigestCachePrecomputeStop().
+ */
+bool ServerDigestCachePrecomputeStart(Seq *paths);
+/* Ask the background thread to stop early, and wait for it. */
+void ServerDigestCachePrecomputeStop(void);
+
+/* Default is DIGEST_CACHE_CAPACITY in server_digest_cache.c. */
+void ServerDigestCacheSetCapacity(size_t max_entries);
+void ServerDigestCacheClear(void);
+
+void ServerDigestCacheGetStats(ServerDigestCacheStats *stats);
+void ServerDigestCacheLogStats(LogLevel level);
+
+
+#endif
@@ -0,0 +1,314 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <server_pool.h>
+
+#include <threaded_queue.h>
+#include <alloc.h>
+#include <misc_lib.h>                                      /* xclock_gettime */
+
+
+typedef struct
+{
+    void *data;
+    struct timespec submitted;
+} ServerPoolJob;
+
+static ThreadedQueue *JOBS = NULL; /* GLOBAL_X */
+static pthread_t *WORKERS = NULL; /* GLOBAL_X */
+static size_t NUM_WORKERS = 0; /* GLOBAL_X */
+static ServerPoolJobHandler *JOB_HANDLER = NULL; /* GLOBAL_X */
+static ServerPoolJobDestroy *JOB_DESTROY = NULL; /* GLOBAL_X */
+
+/* Protects STATS, which is only updated by the workers and ServerPoolSubmit.*/
+static pthread_mutex_t STATS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static ServerPoolStats STATS = { 0 }; /* GLOBAL_X */
+
+
+static double TimespecDiff(const struct timespec *start,
+                           const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) +
+        (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void ServerPoolJobFree(void *j)
+{
+    ServerPoolJob *job = j;
+    if (JOB_DESTROY != NULL)
+    {
+        JOB_DESTROY(job->data);
+    }
+    free(job);
+
+    pthread_mutex_lock(&STATS_LOCK);
+    STATS.busy--;
+    pthread_mutex_unlock(&STATS_LOCK);
+}
+
+static void *ServerPoolWorker(ARG_UNUSED void *arg)
+{
+    void *item;
+    while (ThreadedQueuePop(JOBS, &item))
+    {
+        ServerPoolJob *job = item;
+        struct timespec start, end;
+
+        xclock_gettime(CLOCK_MONOTONIC, &start);
+        JOB_HANDLER(job->data);
+        xclock_gettime(CLOCK_MONOTONIC, &end);
+
+        double wait    = TimespecDiff(&job->submitted, &start);
+        double service = TimespecDiff(&start, &end);
+        free(job);
+
+        pthread_mutex_lock(&STATS_LOCK);
+        STATS.busy--;
+        STATS.completed++;
+        STATS.wait_total += wait;
+        STATS.wait_max = MAX(STATS.wait_max, wait);
+        STATS.service_total += service;
+        STATS.service_max = MAX(STATS.service_max, service);
+        pthread_mutex_unlock(&STATS_LOCK);
+    }
+
+    return NULL;
+}
+
+/**
+ * Spawn #workers threads waiting on a queue of #queue_capacity jobs. Every
+ * submitted job is passed to #handler from one of the workers, or to
+ * #destroy if it is discarded from the queue by ServerPoolClose().
+ *
+ * @return false if not even one worker thread could be created.
+ */
+bool ServerPoolStart(size_t workers, size_t queue_capacity,
+                     ServerPoolJobHandler *handler,
+                     ServerPoolJobDestroy *destroy)
+{
+    assert(JOBS == NULL);
+    assert(workers > 0 && queue_capacity > 0);
+
+    pthread_attr_t threadattrs;
+    int ret = pthread_attr_init(&threadattrs);
+    if (ret != 0)
+    {
+        Log(LOG_LEVEL_ERR,
+            "Unable to initialize worker thread attributes (%s)",
+            GetErrorStr());
+        return false;
+    }
+    ret = pthread_attr_setstacksize(&threadattrs, 1024 * 1024);
+    if (ret != 0)
+    {
+        Log(LOG_LEVEL_WARNING,
+            "Unable to set worker thread stack size (%s).",
+            GetErrorStr());
+        /* Continue with default thread stack size. */
+    }
+
+    JOB_HANDLER = handler;
+    JOB_DESTROY = destroy;
+    JOBS        = ThreadedQueueNew(queue_capacity, ServerPoolJobFree);
+    WORKERS     = xcalloc(workers, sizeof(pthread_t));
+
+    for (NUM_WORKERS = 0; NUM_WORKERS < workers; NUM_WORKERS++)
+    {
+        ret = pthread_create(&WORKERS[NUM_WORKERS], &threadattrs,
+                             ServerPoolWorker, NULL);
+        if (ret != 0)
+        {
+            errno = ret;
+            Log(LOG_LEVEL_ERR,
+                "Unable to spawn worker thread %zu of %zu (pthread_create: %s)",
+                NUM_WORKERS + 1, workers, GetErrorStr());
+            break;
+        }
+    }
+    pthread_attr_destroy(&threadattrs);
+
+    if (NUM_WORKERS == 0)
+    {
+        ThreadedQueueDestroy(JOBS);       JOBS = NULL;
+        free(WORKERS);                    WORKERS = NULL;
+        return false;
+    }
+
+    pthread_mutex_lock(&STATS_LOCK);
+    STATS.workers        = NUM_WORKERS;
+    STATS.queue_capacity = queue_capacity;
+    pthread_mutex_unlock(&STATS_LOCK);
+
+    Log(LOG_LEVEL_VERBOSE,
+        "Started %zu worker threads with a queue of %zu connections",
+        NUM_WORKERS, queue_capacity);
+    return true;
+}
+
+/**
+ * @return true if the pool is running, filling in its dimensions.
+ */
+bool ServerPoolIsRunning(size_t *workers, size_t *queue_capacity)
+{
+    if (JOBS == NULL)
+    {
+        return false;
+    }
+    if (workers != NULL)
+    {
+        *workers = NUM_WORKERS;
+    }
+    if (queue_capacity != NULL)
+    {
+        *queue_capacity = ThreadedQueueCapacity(JOBS);
+    }
+    return true;
+}
+
+/**
+ * @return false if the pool is not running or the queue is full, in which
+ *         case #data is still owned by the caller.
+ */
+bool ServerPoolSubmit(void *data)
+{
+    if (JOBS == NULL)
+    {
+        return false;
+    }
+
+    ServerPoolJob *job = xmalloc(sizeof(*job));
+    job->data = data;
+    xclock_gettime(CLOCK_MONOTONIC, &job->submitted);
+
+    /* Count it before pushing, a worker might finish it immediately. */
+    pthread_mutex_lock(&STATS_LOCK);
+    STATS.busy++;
+    pthread_mutex_unlock(&STATS_LOCK);
+
+    bool pushed = ThreadedQueueTryPush(JOBS, job);
+
+    pthread_mutex_lock(&STATS_LOCK);
+    if (pushed)
+    {
+        STATS.submitted++;
+    }
+    else
+    {
+        STATS.busy--;
+        STATS.rejected++;
+    }
+    pthread_mutex_unlock(&STATS_LOCK);
+
+    if (!pushed)
+    {
+        free(job);
+    }
+    return pushed;
+}
+
+/**
+ * @return Number of jobs either waiting in the queue or being handled.
+ */
+size_t ServerPoolBusy(void)
+{
+    pthread_mutex_lock(&STATS_LOCK);
+    size_t busy = STATS.busy;
+    pthread_mutex_unlock(&STATS_LOCK);
+
+    return busy;
+}
+
+/**
+ * Stop accepting jobs, discard the waiting ones and let the workers exit as
+ * soon as they are done with their current job. Doesn't block.
+ */
+void ServerPoolClose(void)
+{
+    if (JOBS == NULL)
+    {
+        return;
+    }
+
+    ThreadedQueueClose(JOBS);
+
+    /* Workers might grab some of these concurrently, no problem. Popping
+     * from a closed queue never blocks. */
+    void *job;
+    while (ThreadedQueuePop(JOBS, &job))
+    {
+        ServerPoolJobFree(job);
+    }
+}
+
+/**
+ * Close the pool and wait for all workers to exit. Blocks as long as jobs
+ * are being handled, so call it when ServerPoolBusy() is zero.
+ */
+void ServerPoolStop(void)
+{
+    if (JOBS == NULL)
+    {
+        return;
+    }
+
+    ServerPoolClose();
+    for (size_t i = 0; i < NUM_WORKERS; i++)
+    {
+        pthread_join(WORKERS[i], NULL);
+    }
+
+    ThreadedQueueDestroy(JOBS);           JOBS = NULL;
+    free(WORKERS);                        WORKERS = NULL;
+    NUM_WORKERS = 0;
+}
+
+void ServerPoolGetStats(ServerPoolStats *stats)
+{
+    pthread_mutex_lock(&STATS_LOCK);
+    *stats = STATS;
+    pthread_mutex_unlock(&STATS_LOCK);
+
+    if (JOBS != NULL)
+    {
+        stats->queue_depth     = ThreadedQueueCount(JOBS);
+        stats->queue_depth_max = ThreadedQueueMaxCount(JOBS);
+    }
+}
+
+void ServerPoolLogStats(LogLevel level)
+{
+    ServerPoolStats s;
+    ServerPoolGetStats(&s);
+
+    Log(level,
+        "Connection workers: %zu, busy: %zu, "
+        "queue depth: %zu (max %zu of %zu)",
+        s.workers, s.busy, s.queue_depth, s.queue_depth_max, s.queue_capacity);
+    Log(level,
+        "Connections handled: %lu, rejected: %lu, "
+        "wait time avg %.3fs max %.3fs, service time avg %.3fs max %.3fs",
+        s.completed, s.rejected,
+        (s.completed > 0) ? s.wait_total / s.completed : 0.0, s.wait_max,
+        (s.completed > 0) ? s.service_total / s.completed : 0.0, s.service_max);
+}
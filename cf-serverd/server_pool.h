@@ -0,0 +1,78 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_SERVER_POOL_H
+#define CFENGINE_SERVER_POOL_H
+
+
+#include <platform.h>
+#include <logging.h>                                            /* LogLevel */
+
+
+/**
+ * Fixed pool of worker threads fed by a bounded queue of jobs, used by
+ * cf-serverd to handle accepted connections without creating a thread per
+ * connection. When all workers are busy, jobs wait in the queue; when the
+ * queue is full as well, ServerPoolSubmit() fails and the caller drops the
+ * job.
+ *
+ * There is only one pool per process, and ServerPoolStart(),
+ * ServerPoolSubmit(), ServerPoolClose() and ServerPoolStop() must only be
+ * called from the main thread.
+ */
+
+typedef void *ServerPoolJobHandler(void *data);
+typedef void ServerPoolJobDestroy(void *data);
+
+typedef struct
+{
+    size_t workers;
+    size_t queue_capacity;
+    size_t queue_depth;                            /* jobs waiting right now */
+    size_t queue_depth_max;                        /* high watermark */
+    size_t busy;                               /* waiting plus being handled */
+    unsigned long submitted;
+    unsigned long rejected;                       /* because queue was full */
+    unsigned long completed;
+    double wait_total;                /* seconds from submit to worker start */
+    double wait_max;
+    double service_total;                  /* seconds spent in the handler */
+    double service_max;
+} ServerPoolStats;
+
+
+bool ServerPoolStart(size_t workers, size_t queue_capacity,
+                     ServerPoolJobHandler *handler,
+                     ServerPoolJobDestroy *destroy);
+bool ServerPoolIsRunning(size_t *workers, size_t *queue_capacity);
+bool ServerPoolSubmit(void *data);
+size_t ServerPoolBusy(void);
+void ServerPoolClose(void);
+void ServerPoolStop(void);
+
+void ServerPoolGetStats(ServerPoolStats *stats);
+void ServerPoolLogStats(LogLevel level);
+
+
+#endif
@@ -0,0 +1,437 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <server_reactor.h>
+
+#include <alloc.h>
+#include <logging.h>
+#include <sequence.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#define REACTOR_MAX_EVENTS      256
+/* How often to retry connections that could not be handed to a worker. */
+#define REACTOR_RETRY_MS        100
+
+typedef struct ParkedConn_
+{
+    int sd;
+    void *data;
+    time_t deadline;                   /* dropped if still idle by then */
+    struct ParkedConn_ *prev;
+    struct ParkedConn_ *next;
+} ParkedConn;
+
+/* Put in epoll_event.data.ptr to tell these apart from ParkedConn. */
+static char LISTEN_MARKER; /* GLOBAL_C */
+static char SIGNAL_MARKER; /* GLOBAL_C */
+
+static int SIGNAL_PIPE = -1; /* GLOBAL_X */
+static ServerReactorReadyFunction *ON_READY = NULL; /* GLOBAL_X */
+static ServerReactorDropFunction *ON_DROP = NULL; /* GLOBAL_X */
+
+/* Workers park connections concurrently, so EPOLL_FD and the PARKED list are
+ * protected by PARKED_LOCK. */
+static pthread_mutex_t PARKED_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static int EPOLL_FD = -1; /* GLOBAL_X */
+static ParkedConn *PARKED = NULL; /* GLOBAL_X */
+static size_t PARKED_COUNT = 0; /* GLOBAL_X */
+
+/* Readable connections that could not be handed over yet, main thread only.*/
+static Seq *BACKLOG = NULL; /* GLOBAL_X */
+static time_t LAST_SWEEP = 0; /* GLOBAL_X */
+
+
+/* PARKED_LOCK must be held. */
+static void ParkedLink(ParkedConn *p)
+{
+    p->prev = NULL;
+    p->next = PARKED;
+    if (PARKED != NULL)
+    {
+        PARKED->prev = p;
+    }
+    PARKED = p;
+    PARKED_COUNT++;
+}
+
+/* PARKED_LOCK must be held. */
+static void ParkedUnlink(ParkedConn *p)
+{
+    if (p->prev != NULL)
+    {
+        p->prev->next = p->next;
+    }
+    else
+    {
+        PARKED = p->next;
+    }
+    if (p->next != NULL)
+    {
+        p->next->prev = p->prev;
+    }
+    p->prev = p->next = NULL;
+    PARKED_COUNT--;
+}
+
+static void ParkedDrop(ParkedConn *p)
+{
+    ON_DROP(p->data);
+    free(p);
+}
+
+static bool EpollAdd(int fd, void *ptr)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = ptr };
+    return epoll_ctl(EPOLL_FD, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+/**
+ * Start watching #listen_sd (may be -1, when not listening) and
+ * #signal_pipe, replacing select() in the main loop.
+ *
+ * @return false if epoll is not available, in which case nothing changes.
+ */
+bool ServerReactorStart(int listen_sd, int signal_pipe,
+                        ServerReactorReadyFunction *on_ready,
+                        ServerReactorDropFunction *on_drop)
+{
+    assert(EPOLL_FD == -1);
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+    {
+        Log(LOG_LEVEL_ERR,
+            "Unable to create event loop, falling back to select() (epoll_create1: %s)",
+            GetErrorStr());
+        return false;
+    }
+
+    pthread_mutex_lock(&PARKED_LOCK);
+    EPOLL_FD = epfd;
+    bool ok = EpollAdd(signal_pipe, &SIGNAL_MARKER) &&
+        (listen_sd == -1 || EpollAdd(listen_sd, &LISTEN_MARKER));
+    if (!ok)
+    {
+        Log(LOG_LEVEL_ERR,
+            "Unable to add socket to event loop, falling back to select() (epoll_ctl: %s)",
+            GetErrorStr());
+        close(epfd);
+        EPOLL_FD = -1;
+    }
+    pthread_mutex_unlock(&PARKED_LOCK);
+
+    if (!ok)
+    {
+        return false;
+    }
+
+    SIGNAL_PIPE = signal_pipe;
+    ON_READY    = on_ready;
+    ON_DROP     = on_drop;
+    BACKLOG     = SeqNew(16, NULL);
+    LAST_SWEEP  = time(NULL);
+
+    Log(LOG_LEVEL_VERBOSE, "Waiting for connections and requests with epoll");
+    return true;
+}
+
+/**
+ * Stop the event loop, dropping all parked connections.
+ */
+void ServerReactorStop(void)
+{
+    pthread_mutex_lock(&PARKED_LOCK);
+    if (EPOLL_FD == -1)
+    {
+        pthread_mutex_unlock(&PARKED_LOCK);
+        return;
+    }
+    close(EPOLL_FD);
+    EPOLL_FD = -1;
+    ParkedConn *parked = PARKED;
+    PARKED = NULL;
+    PARKED_COUNT = 0;
+    pthread_mutex_unlock(&PARKED_LOCK);
+
+    while (parked != NULL)
+    {
+        ParkedConn *next = parked->next;
+        ParkedDrop(parked);
+        parked = next;
+    }
+
+    for (size_t i = 0; i < SeqLength(BACKLOG); i++)
+    {
+        ParkedDrop(SeqAt(BACKLOG, i));
+    }
+    SeqDestroy(BACKLOG);
+    BACKLOG = NULL;
+}
+
+bool ServerReactorIsRunning(void)
+{
+    pthread_mutex_lock(&PARKED_LOCK);
+    bool running = (EPOLL_FD != -1);
+    pthread_mutex_unlock(&PARKED_LOCK);
+
+    return running;
+}
+
+size_t ServerReactorParkedCount(void)
+{
+    pthread_mutex_lock(&PARKED_LOCK);
+    size_t count = PARKED_COUNT;
+    pthread_mutex_unlock(&PARKED_LOCK);
+
+    return count + ((BACKLOG != NULL) ? SeqLength(BACKLOG) : 0);
+}
+
+/**
+ * Watch #sd until it becomes readable, then pass #data to the on_ready
+ * function. Thread-safe, called by workers after serving a request.
+ *
+ * @param idle_timeout Seconds after which the connection is dropped if no
+ *                     request arrived.
+ * @return false if the connection could not be parked, in which case the
+ *         caller still owns it. If true, #data may already be in the hands
+ *         of another thread.
+ */
+bool ServerReactorPark(int sd, void *data, time_t idle_timeout)
+{
+    ParkedConn *p = xmalloc(sizeof(*p));
+    p->sd = sd;
+    p->data = data;
+    p->deadline = time(NULL) + idle_timeout;
+
+    pthread_mutex_lock(&PARKED_LOCK);
+    bool parked = false;
+    if (EPOLL_FD != -1)
+    {
+        ParkedLink(p);
+        parked = EpollAdd(sd, p);
+        if (!parked)
+        {
+            Log(LOG_LEVEL_VERBOSE,
+                "Unable to park idle connection (epoll_ctl: %s)",
+                GetErrorStr());
+            ParkedUnlink(p);
+        }
+    }
+    pthread_mutex_unlock(&PARKED_LOCK);
+
+    if (!parked)
+    {
+        free(p);
+    }
+    return parked;
+}
+
+/* Stop watching #p, it is readable or being dropped. */
+static void Unpark(ParkedConn *p)
+{
+    pthread_mutex_lock(&PARKED_LOCK);
+    ParkedUnlink(p);
+    epoll_ctl(EPOLL_FD, EPOLL_CTL_DEL, p->sd, NULL);
+    pthread_mutex_unlock(&PARKED_LOCK);
+}
+
+static void Dispatch(ParkedConn *p)
+{
+    if (ON_READY(p->data))
+    {
+        free(p);
+    }
+    else
+    {
+        SeqAppend(BACKLOG, p);
+    }
+}
+
+static void RetryBacklog(void)
+{
+    size_t i = 0;
+    while (i < SeqLength(BACKLOG))
+    {
+        ParkedConn *p = SeqAt(BACKLOG, i);
+        if (ON_READY(p->data))
+        {
+            SeqSoftRemove(BACKLOG, i);
+            free(p);
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+/* Drop the connections that stayed idle past their deadline. */
+static void SweepIdle(time_t now)
+{
+    ParkedConn *expired = NULL;
+
+    pthread_mutex_lock(&PARKED_LOCK);
+    ParkedConn *next;
+    for (ParkedConn *p = PARKED; p != NULL; p = next)
+    {
+        next = p->next;
+        if (p->deadline <= now)
+        {
+            ParkedUnlink(p);
+            epoll_ctl(EPOLL_FD, EPOLL_CTL_DEL, p->sd, NULL);
+            p->next = expired;
+            expired = p;
+        }
+    }
+    pthread_mutex_unlock(&PARKED_LOCK);
+
+    while (expired != NULL)
+    {
+        next = expired->next;
+        Log(LOG_LEVEL_VERBOSE,
+            "Closing connection on socket %d, idle for too long",
+            expired->sd);
+        ParkedDrop(expired);
+        expired = next;
+    }
+}
+
+/**
+ * Wait up to #timeout_secs for an incoming connection, dispatching the
+ * parked connections that become readable in the meantime. Same return
+ * values as WaitForIncoming() in cf-serverd-functions.c.
+ *
+ * @retval > 0 In-coming connection.
+ * @retval 0 No in-coming connection (timeout or signal).
+ * @retval -1 Error (other than interrupt).
+ * @retval < -1 Interrupted while waiting.
+ */
+int ServerReactorWait(int timeout_secs)
+{
+    assert(EPOLL_FD != -1);
+    time_t deadline = time(NULL) + timeout_secs;
+
+    for (;;)
+    {
+        RetryBacklog();
+
+        time_t now = time(NULL);
+        if (now != LAST_SWEEP)
+        {
+            SweepIdle(now);
+            LAST_SWEEP = now;
+        }
+
+        /* Wake up every second to sweep idle connections, more often if
+         * there are connections waiting for a worker. */
+        int timeout_ms = (SeqLength(BACKLOG) > 0) ? REACTOR_RETRY_MS : 1000;
+
+        struct epoll_event events[REACTOR_MAX_EVENTS];
+        int n = epoll_wait(EPOLL_FD, events, REACTOR_MAX_EVENTS, timeout_ms);
+        if (n == -1)
+        {
+            return (errno == EINTR) ? -2 : -1;
+        }
+
+        bool incoming = false, signalled = false;
+        for (int i = 0; i < n; i++)
+        {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &LISTEN_MARKER)
+            {
+                incoming = true;
+            }
+            else if (ptr == &SIGNAL_MARKER)
+            {
+                /* Empty the signal pipe, it is there to only detect missed
+                 * signals in-between checking IsPendingTermination() and
+                 * waiting. */
+                unsigned char buf;
+                while (recv(SIGNAL_PIPE, &buf, 1, 0) > 0)
+                {
+                    /* skip */
+                }
+                signalled = true;
+            }
+            else
+            {
+                /* Readable, or hung up: either way it's the worker's job. */
+                ParkedConn *p = ptr;
+                Unpark(p);
+                Dispatch(p);
+            }
+        }
+
+        if (incoming)
+        {
+            return 1;
+        }
+        if (signalled || time(NULL) >= deadline)
+        {
+            return 0;
+        }
+    }
+}
+
+#else  /* !HAVE_SYS_EPOLL_H */
+
+bool ServerReactorStart(ARG_UNUSED int listen_sd, ARG_UNUSED int signal_pipe,
+                        ARG_UNUSED ServerReactorReadyFunction *on_ready,
+                        ARG_UNUSED ServerReactorDropFunction *on_drop)
+{
+    return false;
+}
+
+void ServerReactorStop(void)
+{
+}
+
+bool ServerReactorIsRunning(void)
+{
+    return false;
+}
+
+int ServerReactorWait(ARG_UNUSED int timeout_secs)
+{
+    return -1;
+}
+
+bool ServerReactorPark(ARG_UNUSED int sd, ARG_UNUSED void *data,
+                       ARG_UNUSED time_t idle_timeout)
+{
+    return false;
+}
+
+size_t ServerReactorParkedCount(void)
+{
+    return 0;
+}
+
+#endif  /* HAVE_SYS_EPOLL_H */
@@ -0,0 +1,67 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_SERVER_REACTOR_H
+#define CFENGINE_SERVER_REACTOR_H
+
+
+#include <platform.h>
+
+
+/**
+ * epoll(7) event loop for the cf-serverd main thread. Besides waiting for
+ * new connections on the listening socket, it watches connections that are
+ * idle in-between requests ("parked" by the worker that served the last
+ * request), and hands them back to the worker pool only when the next
+ * request arrives. That way thousands of mostly idle agent connections
+ * don't each hold a thread.
+ *
+ * Only available where epoll is (HAVE_SYS_EPOLL_H); elsewhere
+ * ServerReactorStart() fails and the caller must fall back to select().
+ *
+ * All functions except ServerReactorPark() must only be called from the
+ * main thread.
+ */
+
+/* Called from the main thread with the data of a parked connection that has
+ * become readable. Must return false if the connection can't be served right
+ * now, in which case it is retried later. */
+typedef bool ServerReactorReadyFunction(void *data);
+/* Called from the main thread for parked connections that are closed
+ * without being served, e.g. when idle for too long. */
+typedef void ServerReactorDropFunction(void *data);
+
+
+bool ServerReactorStart(int listen_sd, int signal_pipe,
+                        ServerReactorReadyFunction *on_ready,
+                        ServerReactorDropFunction *on_drop);
+void ServerReactorStop(void);
+bool ServerReactorIsRunning(void);
+
+int ServerReactorWait(int timeout_secs);
+bool ServerReactorPark(int sd, void *data, time_t idle_timeout);
+size_t ServerReactorParkedCount(void);
+
+
+#endif
@@ -40,6 +40,7 @@
 #include <regex.h>                                       /* StringMatchFull */
 #include <known_dirs.h>
 #include <file_lib.h>                                           /* IsDirReal */
+#include <mutex.h>                                            /* ThreadLock */
 
 #include "server_access.h"          /* access_CheckResource, acl_CheckExact */
 
@@ -47,6 +48,13 @@
 static SSL_CTX *SSLSERVERCONTEXT = NULL;
 static X509 *SSLSERVERCERT = NULL;
 
+/* Lifetime of the session tickets handed to agents. Long enough to span a
+ * few runs of cf-agent; the ticket key itself lives as long as the daemon. */
+#define SERVER_TLS_SESSION_TIMEOUT (4 * SECONDS_PER_HOUR)
+
+static pthread_mutex_t session_stats_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+static TLSSessionStats SESSION_STATS = { 0 };                   /* GLOBAL_X */
+
 
 /**
  * @warning Make sure you've called CryptoInitialize() first!
@@ -71,6 +79,15 @@ bool ServerTLSInitialize()
 
     TLSSetDefaultOptions(SSLSERVERCONTEXT, SV.allowtlsversion);
 
+    /* Agents resume their sessions with stateless tickets, which skips the
+     * RSA operations of a full handshake. The peer's key is still checked
+     * in ServerTLSSessionEstablish(), from the certificate in the session.
+     * A session ID context is mandatory for resumption with SSL_VERIFY_PEER. */
+    static const unsigned char session_id_context[] = "cf-serverd";
+    SSL_CTX_set_session_id_context(SSLSERVERCONTEXT, session_id_context,
+                                   sizeof(session_id_context) - 1);
+    SSL_CTX_set_timeout(SSLSERVERCONTEXT, SERVER_TLS_SESSION_TIMEOUT);
+
     /*
      * CFEngine is not a web server so it does not need to support many
      * ciphers. It only allows a safe but very common subset by default,
@@ -391,6 +408,26 @@ static int ServerSendWelcome(const ServerConnectionState *conn)
         len += ret;
     }
 
+    /* Clients that understand it will request GET blocks up to this size;
+     * older ones ignore unknown words after "OK WELCOME". */
+    ret = snprintf(&s[len], sizeof(s) - len, " %s=%d",
+                   "BLOCKSIZE", CF_FILE_BLOCKSIZE_MAX);
+    if (ret >= sizeof(s) - len)
+    {
+        Log(LOG_LEVEL_NOTICE, "Sending OK WELCOME message truncated: %s", s);
+        return -1;
+    }
+    len += ret;
+
+    ret = snprintf(&s[len], sizeof(s) - len, " %s=%d",
+                   "SYNCHBATCH", CF_SYNCH_BATCH_MAX);
+    if (ret >= sizeof(s) - len)
+    {
+        Log(LOG_LEVEL_NOTICE, "Sending OK WELCOME message truncated: %s", s);
+        return -1;
+    }
+    len += ret;
+
     /* Overwrite the terminating '\0', we don't need it anyway. */
     s[len] = '\n';
     len++;
@@ -441,7 +478,16 @@ int ServerTLSSessionEstablish(ServerConnectionState *conn)
             SSL_get_version(ssl),
             SSL_get_cipher_name(ssl),
             SSL_get_cipher_version(ssl));
-        Log(LOG_LEVEL_VERBOSE, "TLS session established, checking trust...");
+        Log(LOG_LEVEL_VERBOSE, "TLS session %s, checking trust...",
+            SSL_session_reused(ssl) ? "resumed" : "established");
+
+        ThreadLock(&session_stats_lock);
+        SESSION_STATS.handshakes++;
+        if (SSL_session_reused(ssl))
+        {
+            SESSION_STATS.resumed++;
+        }
+        ThreadUnlock(&session_stats_lock);
 
         /* Send/Receive "CFE_v%d" version string, agree on version, receive
            identity (username) of peer. */
@@ -509,6 +555,20 @@ int ServerTLSSessionEstablish(ServerConnectionState *conn)
     return 1;
 }
 
+void ServerTLSLogSessionStats(LogLevel level)
+{
+    ThreadLock(&session_stats_lock);
+    TLSSessionStats stats = SESSION_STATS;
+    ThreadUnlock(&session_stats_lock);
+
+    if (stats.handshakes > 0)
+    {
+        Log(level, "TLS handshakes: %zu, resumed: %zu (%.1f%%)",
+            stats.handshakes, stats.resumed,
+            100.0 * stats.resumed / stats.handshakes);
+    }
+}
+
 //*******************************************************************
 // COMMANDS
 //*******************************************************************
@@ -525,6 +585,7 @@ typedef enum
     PROTOCOL_COMMAND_CONTEXT,
     PROTOCOL_COMMAND_QUERY,
     PROTOCOL_COMMAND_CALL_ME_BACK,
+    PROTOCOL_COMMAND_SYNCH_BATCH,
     PROTOCOL_COMMAND_BAD
 } ProtocolCommandNew;
 
@@ -540,6 +601,7 @@ static const char *const PROTOCOL_NEW[PROTOCOL_COMMAND_BAD + 1] =
     "CONTEXT",
     "QUERY",
     "SCALLBACK",
+    "SYNCHBATCH",
     NULL
 };
 
@@ -559,6 +621,184 @@ static ProtocolCommandNew GetCommandNew(char *str)
     return i;
 }
 
+/**
+ * Expand shortcuts in the path of a STAT or MD5 request, sanitise it and
+ * check it against the paths ACL. Directories keep their trailing slash if
+ * #keep_dir_slash is set, as STAT needs them to match directory ACLs.
+ *
+ * @param filename_size must leave room for appending a '/'.
+ * @return 1 if access is granted, 0 if refused, -1 if the path is malformed.
+ */
+static int TranslateRequestPath(ServerConnectionState *conn,
+                                char *filename, size_t filename_size,
+                                const char *command, bool keep_dir_slash)
+{
+    /* -1 because we need one extra byte for appending '/' afterwards. */
+    size_t zret = ShortcutsExpand(filename, filename_size - 1,
+                                  SV.path_shortcuts,
+                                  conn->ipaddr, conn->revdns,
+                                  KeyPrintableHash(ConnectionInfoKey(conn->conn_info)));
+    if (zret == (size_t) -1)
+    {
+        return -1;
+    }
+
+    zret = PreprocessRequestPath(filename, filename_size - 1);
+    if (zret == (size_t) -1)
+    {
+        return 0;
+    }
+
+    if (keep_dir_slash && IsDirReal(filename) == 1)
+    {
+        PathAppendTrailingSlash(filename, strlen(filename));
+    }
+    else
+    {
+        PathRemoveTrailingSlash(filename, strlen(filename));
+    }
+
+    Log(LOG_LEVEL_VERBOSE, "%14s %7s %s",
+        "Translated to:", command, filename);
+
+    if (acl_CheckPath(paths_acl, filename,
+                      conn->ipaddr, conn->revdns,
+                      KeyPrintableHash(ConnectionInfoKey(conn->conn_info)))
+        == false)
+    {
+        Log(LOG_LEVEL_INFO, "access denied to %s: %s", command, filename);
+        return 0;
+    }
+
+    return 1;
+}
+
+typedef struct
+{
+    char *path;
+    bool want_digest;                         /* MD5 entry, else STAT entry */
+    char digest[EVP_MAX_MD_SIZE + 1];
+} SynchBatchEntry;
+
+/**
+ * Serve the entries of a "SYNCHBATCH <time> <count>" request. Every entry is
+ * a transaction of its own, formatted like the STAT part of SYNCH or like the
+ * MD5 command, and gets exactly the reply(ies) those would get. All entries
+ * are read before replying: the client writes the whole batch before reading
+ * the replies, so neither side can block on a full socket buffer.
+ *
+ * If the clocks are too far apart, every entry gets the same BAD reply, so
+ * that the client always reads exactly one reply per entry.
+ *
+ * @return false if the batch is malformed and the connection must be closed.
+ */
+static bool ServeSynchBatch(ServerConnectionState *conn,
+                            time_t trem, int count)
+{
+    char recvbuffer[CF_BUFSIZE + CF_BUFEXT];
+    char sendbuffer[CF_BUFSIZE];
+    char filename[CF_BUFSIZE + 1];      /* +1 for appending slash sometimes */
+
+    SynchBatchEntry *entries = xcalloc(count, sizeof(*entries));
+    bool ok = true;
+
+    for (int i = 0; i < count; i++)
+    {
+        memset(recvbuffer, 0, sizeof(recvbuffer));
+        int received = ReceiveTransaction(conn->conn_info, recvbuffer, NULL);
+        if (received == -1 || received > CF_BUFSIZE - 1)
+        {
+            ok = false;
+            break;
+        }
+
+        if (sscanf(recvbuffer, "STAT %[^\n]", filename) == 1)
+        {
+            entries[i].path = xstrdup(filename);
+        }
+        else if (sscanf(recvbuffer, "MD5 %[^\n]", filename) == 1)
+        {
+            entries[i].path = xstrdup(filename);
+            entries[i].want_digest = true;
+            memcpy(entries[i].digest,
+                   recvbuffer + strlen(recvbuffer) + CF_SMALL_OFFSET,
+                   CF_DEFAULT_DIGEST_LEN);
+        }
+        else
+        {
+            Log(LOG_LEVEL_INFO, "Bad SYNCHBATCH entry %d/%d: %s",
+                i + 1, count, recvbuffer);
+            ok = false;
+            break;
+        }
+    }
+
+    if (ok)
+    {
+        time_t tloc = time(NULL);
+        /* Not squared, as an int that would overflow for a bogus #trem. */
+        time_t drift = tloc - trem;
+
+        const char *bad = NULL;
+        if (tloc == -1)
+        {
+            /* Should never happen. */
+            Log(LOG_LEVEL_ERR, "Couldn't read system clock. (time: %s)", GetErrorStr());
+            bad = "BAD: clocks out of synch";
+        }
+        else if (DENYBADCLOCKS && (drift > CLOCK_DRIFT || drift < -CLOCK_DRIFT))
+        {
+            snprintf(sendbuffer, sizeof(sendbuffer),
+                     "BAD: Clocks are too far unsynchronized %ld/%ld",
+                     (long) tloc, (long) trem);
+            Log(LOG_LEVEL_INFO, "denybadclocks %s", sendbuffer);
+            bad = sendbuffer;
+        }
+
+        if (bad != NULL)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                SendTransaction(conn->conn_info, bad, 0, CF_DONE);
+            }
+        }
+        else
+        {
+            for (int i = 0; i < count; i++)
+            {
+                const char *command = entries[i].want_digest ? "MD5" : "STAT";
+
+                Log(LOG_LEVEL_VERBOSE, "%14s %7s %s",
+                    "Received:", command, entries[i].path);
+
+                strlcpy(filename, entries[i].path, sizeof(filename));
+                if (TranslateRequestPath(conn, filename, sizeof(filename),
+                                         command, !entries[i].want_digest) != 1)
+                {
+                    RefuseAccess(conn, entries[i].path);
+                }
+                else if (entries[i].want_digest)
+                {
+                    CompareLocalHash(filename, entries[i].digest, sendbuffer);
+                    SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE);
+                }
+                else
+                {
+                    StatFile(conn, sendbuffer, filename);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        free(entries[i].path);
+    }
+    free(entries);
+
+    return ok;
+}
+
 
 /**
  * Currently this function returns false when we want the connection
@@ -653,7 +893,8 @@ bool BusyWithNewProtocol(EvalContext *ctx, ServerConnectionState *conn)
                          &(get_args.buf_size), filename);
 
         if (ret != 2 ||
-            get_args.buf_size <= 0 || get_args.buf_size > CF_BUFSIZE)
+            get_args.buf_size <= 0 ||
+            get_args.buf_size > CF_FILE_BLOCKSIZE_MAX)
         {
             goto protocol_error;
         }
@@ -697,11 +938,6 @@ bool BusyWithNewProtocol(EvalContext *ctx, ServerConnectionState *conn)
 
         memset(sendbuffer, 0, sizeof(sendbuffer));
 
-        if (get_args.buf_size >= CF_BUFSIZE)
-        {
-            get_args.buf_size = 2048;
-        }
-
         /* TODO eliminate! */
         get_args.conn = conn;
         get_args.encrypt = false;
@@ -788,46 +1024,18 @@ bool BusyWithNewProtocol(EvalContext *ctx, ServerConnectionState *conn)
         Log(LOG_LEVEL_VERBOSE, "%14s %7s %s",
             "Received:", "STAT", filename);
 
-        /* sizeof()-1 because we need one extra byte for
-           appending '/' afterwards. */
-        size_t zret = ShortcutsExpand(filename, sizeof(filename) - 1,
-                                      SV.path_shortcuts,
-                                      conn->ipaddr, conn->revdns,
-                                      KeyPrintableHash(ConnectionInfoKey(conn->conn_info)));
-        if (zret == (size_t) -1)
+        ret = TranslateRequestPath(conn, filename, sizeof(filename),
+                                   "STAT", true);
+        if (ret == -1)
         {
             goto protocol_error;
         }
-
-        zret = PreprocessRequestPath(filename, sizeof(filename) - 1);
-        if (zret == (size_t) -1)
+        if (ret == 0)
         {
             RefuseAccess(conn, recvbuffer);
             return true;
         }
 
-        if (IsDirReal(filename) == 1)
-        {
-            PathAppendTrailingSlash(filename, strlen(filename));
-        }
-        else
-        {
-            PathRemoveTrailingSlash(filename, strlen(filename));
-        }
-
-        Log(LOG_LEVEL_VERBOSE, "%14s %7s %s",
-            "Translated to:", "STAT", filename);
-
-        if (acl_CheckPath(paths_acl, filename,
-                          conn->ipaddr, conn->revdns,
-                          KeyPrintableHash(ConnectionInfoKey(conn->conn_info)))
-            == false)
-        {
-            Log(LOG_LEVEL_INFO, "access denied to STAT: %s", filename);
-            RefuseAccess(conn, recvbuffer);
-            return true;
-        }
-
         Log(LOG_LEVEL_DEBUG, "Clocks were off by %ld",
             (long) tloc - (long) trem);
 
@@ -856,40 +1064,18 @@ bool BusyWithNewProtocol(EvalContext *ctx, ServerConnectionState *conn)
         Log(LOG_LEVEL_VERBOSE, "%14s %7s %s",
             "Received:", "MD5", filename);
 
-        /* TODO batch all the following in one function since it's very
-         * similar in all of GET, OPENDIR and STAT. */
-
-        size_t zret = ShortcutsExpand(filename, sizeof(filename),
-                                     SV.path_shortcuts,
-                                     conn->ipaddr, conn->revdns,
-                                     KeyPrintableHash(ConnectionInfoKey(conn->conn_info)));
-        if (zret == (size_t) -1)
+        ret = TranslateRequestPath(conn, filename, sizeof(filename),
+                                   "MD5", false);
+        if (ret == -1)
         {
             goto protocol_error;
         }
-
-        zret = PreprocessRequestPath(filename, sizeof(filename));
-        if (zret == (size_t) -1)
+        if (ret == 0)
         {
             RefuseAccess(conn, recvbuffer);
             return true;
         }
 
-        PathRemoveTrailingSlash(filename, strlen(filename));
-
-        Log(LOG_LEVEL_VERBOSE, "%14s %7s %s",
-            "Translated to:", "MD5", filename);
-
-        if (acl_CheckPath(paths_acl, filename,
-                          conn->ipaddr, conn->revdns,
-                          KeyPrintableHash(ConnectionInfoKey(conn->conn_info)))
-            == false)
-        {
-            Log(LOG_LEVEL_INFO, "access denied to file: %s", filename);
-            RefuseAccess(conn, recvbuffer);
-            return true;
-        }
-
         assert(CF_DEFAULT_DIGEST_LEN <= EVP_MAX_MD_SIZE);
         unsigned char digest[EVP_MAX_MD_SIZE + 1];
 
@@ -1029,6 +1215,26 @@ bool BusyWithNewProtocol(EvalContext *ctx, ServerConnectionState *conn)
          * it and our caller can close the connection: */
         return false;
 
+    case PROTOCOL_COMMAND_SYNCH_BATCH:
+    {
+        long time_no_see = 0;
+        int count = 0;
+        int ret = sscanf(recvbuffer, "SYNCHBATCH %ld %d",
+                         &time_no_see, &count);
+        if (ret != 2 || count <= 0 || count > CF_SYNCH_BATCH_MAX)
+        {
+            goto protocol_error;
+        }
+
+        Log(LOG_LEVEL_VERBOSE, "%14s %7s %d entries",
+            "Received:", "SYNCHBATCH", count);
+
+        if (!ServeSynchBatch(conn, (time_t) time_no_see, count))
+        {
+            goto protocol_error;
+        }
+        return true;
+    }
     case PROTOCOL_COMMAND_BAD:
 
         Log(LOG_LEVEL_WARNING, "Unexpected protocol command: %s", recvbuffer);
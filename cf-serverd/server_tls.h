@@ -38,6 +38,7 @@ bool ServerTLSInitialize();
 void ServerTLSDeInitialize();
 int ServerTLSPeek(ConnectionInfo *conn_info);
 int ServerTLSSessionEstablish(ServerConnectionState *conn);
+void ServerTLSLogSessionStats(LogLevel level);
 bool BusyWithNewProtocol(EvalContext *ctx, ServerConnectionState *conn);
 
 
@@ -276,6 +276,9 @@ static bool SetMaxOpenFiles(int n)
 static void KeepControlPromises(EvalContext *ctx, const Policy *policy, GenericAgentConfig *config)
 {
     CFD_MAXPROCESSES = 30;
+    CFD_WORKER_THREADS = 0;
+    CFD_CONNECTION_QUEUE = 0;
+    CFD_PRECOMPUTE_DIGESTS = false;
     MAXTRIES = 5;
     DENYBADCLOCKS = true;
     CFRUNCOMMAND[0] = '\0';
@@ -354,6 +357,25 @@ static void KeepControlPromises(EvalContext *ctx, const Policy *policy, GenericA
                 /* Set RLIMIT_NOFILE to be enough for all threads. */
                 SetMaxOpenFiles(CFD_MAXPROCESSES * 2 + 10);
             }
+            else if (IsControlBody(SERVER_CONTROL_WORKER_THREADS))
+            {
+                CFD_WORKER_THREADS = (int) IntFromString(value);
+                Log(LOG_LEVEL_VERBOSE,
+                    "Setting workerthreads to %d", CFD_WORKER_THREADS);
+            }
+            else if (IsControlBody(SERVER_CONTROL_CONNECTION_QUEUE_SIZE))
+            {
+                CFD_CONNECTION_QUEUE = (int) IntFromString(value);
+                Log(LOG_LEVEL_VERBOSE,
+                    "Setting connectionqueuesize to %d", CFD_CONNECTION_QUEUE);
+            }
+            else if (IsControlBody(SERVER_CONTROL_PRECOMPUTE_DIGESTS))
+            {
+                CFD_PRECOMPUTE_DIGESTS = BooleanFromString(value);
+                Log(LOG_LEVEL_VERBOSE,
+                    "Setting precomputedigests to '%s'",
+                    CFD_PRECOMPUTE_DIGESTS ? "true" : "false");
+            }
             else if (IsControlBody(SERVER_CONTROL_CALL_COLLECT_INTERVAL))
             {
                 COLLECT_INTERVAL = (int) 60 * IntFromString(value);
@@ -1162,6 +1184,9 @@ static void AccessPromise_AddAccessConstraints(const EvalContext *ctx,
 
     StrList_Finalise(&racl->deny.keys);
     StrList_Sort(racl->deny.keys, string_Compare);
+
+    racl_CompileIPs(&racl->admit);
+    racl_CompileIPs(&racl->deny);
 }
 
 /* It is allowed to have duplicate handles (paths or class names or variables
@@ -55,6 +55,17 @@ extern int CFENGINE_PORT;                              /* GLOBAL_P GLOBAL_E */
 #define CF_PROTO_OFFSET 16
 #define CF_INBAND_OFFSET 8
 
+/* Block sizes for streaming files with GET. Every peer understands
+ * CF_FILE_BLOCKSIZE_LEGACY; larger blocks are only requested from servers
+ * advertising "BLOCKSIZE=" in their TLS welcome line. */
+#define CF_FILE_BLOCKSIZE_LEGACY 2048
+#define CF_FILE_BLOCKSIZE        (64 * 1024)
+#define CF_FILE_BLOCKSIZE_MAX    (1024 * 1024)
+
+/* Most STAT/MD5 entries a server accepts in one SYNCHBATCH request; servers
+ * supporting the command advertise "SYNCHBATCH=" in their welcome line. */
+#define CF_SYNCH_BATCH_MAX       1024
+
 
 /**
   Available protocol versions. When connection is initialised ProtocolVersion
@@ -117,7 +128,7 @@ static inline bool ConnectionFlagsEqual(const ConnectionFlags *f1,
     x.tv_usec = DEFAULT_TLS_TIMEOUT_USECONDS
 #define DEFAULT_TLS_TRIES 5
 
-struct Stat_;              /* defined in stat_cache.h, typedef'ed to "Stat" */
+struct Map_;                      /* defined in map.h, typedef'ed to "Map" */
 
 typedef struct
 {
@@ -130,7 +141,7 @@ typedef struct
     unsigned char *session_key;
     char encryption_type;
     short error;
-    struct Stat_ *cache;                          /* cache for remote STATs */
+    struct Map_ *cache;           /* cache for remote STATs, see stat_cache.c */
 
     /* The following consistutes the ID of a server host, mostly taken from
      * the copy_from connection attributes. */
@@ -32,6 +32,7 @@
 #include <libcrypto-compat.h>
 #include <tls_client.h>               /* TLSTry */
 #include <tls_generic.h>              /* TLSVerifyPeer */
+#include <tls_session_cache.h>         /* TLSSessionCacheStore */
 #include <dir.h>
 #include <unix.h>
 #include <dir_priv.h>                          /* AllocateDirentForFilename */
@@ -45,6 +46,7 @@
 #include <misc_lib.h>                                   /* ProgrammingError */
 #include <printsize.h>                                         /* PRINTSIZE */
 #include <lastseen.h>                                            /* LastSaw */
+#include <stat_cache.h>                                  /* StatCacheLookup */
 
 
 #define CFENGINE_SERVICE "cfengine"
@@ -119,6 +121,7 @@ int TLSConnect(ConnectionInfo *conn_info, bool trust_server,
 
     if (ret == -1)                                      /* error */
     {
+        TLSSessionCacheForget(conn_info);
         return -1;
     }
 
@@ -142,6 +145,7 @@ int TLSConnect(ConnectionInfo *conn_info, bool trust_server,
         {
             Log(LOG_LEVEL_ERR,
                 "TRUST FAILED, server presented untrusted key: %s", key_hash);
+            TLSSessionCacheForget(conn_info);
             return -1;
         }
     }
@@ -150,6 +154,11 @@ int TLSConnect(ConnectionInfo *conn_info, bool trust_server,
      * identification data. */
     ret = TLSClientIdentificationDialog(conn_info, username);
 
+    if (ret > 0)
+    {
+        TLSSessionCacheStore(conn_info);
+    }
+
     return ret;
 }
 
@@ -353,7 +362,7 @@ Item *RemoteDirList(const char *dirname, bool encrypt, AgentConnection *conn)
         /* If recv error or socket closed before receiving CFD_TERMINATOR. */
         if (nbytes == -1)
         {
-            /* TODO mark connection in the cache as closed. */
+            conn->error = true;    /* not to be reused from the cache */
             goto err;
         }
 
@@ -424,14 +433,43 @@ Item *RemoteDirList(const char *dirname, bool encrypt, AgentConnection *conn)
 
 /*********************************************************************/
 
-int CompareHashNet(const char *file1, const char *file2, bool encrypt, AgentConnection *conn)
+/* Is #sb the very same, unmodified file as #prev? */
+static bool SameLocalFile(const struct stat *prev, const struct stat *sb)
+{
+    return (prev->st_dev == sb->st_dev && prev->st_ino == sb->st_ino &&
+            prev->st_size == sb->st_size && prev->st_mtime == sb->st_mtime &&
+            prev->st_ctime == sb->st_ctime);
+}
+
+/**
+ * @param dstat stat of #file2, or NULL. If given and #file2 hasn't changed
+ *              since a SYNCHBATCH got the server's verdict on its digest,
+ *              the verdict is returned without hashing #file2 again.
+ */
+int CompareHashNet(const char *file1, const char *file2, const struct stat *dstat,
+                   bool encrypt, AgentConnection *conn)
 {
     unsigned char d[EVP_MAX_MD_SIZE + 1];
     char *sp, sendbuffer[CF_BUFSIZE], recvbuffer[CF_BUFSIZE], in[CF_BUFSIZE], out[CF_BUFSIZE];
     int i, tosend, cipherlen;
 
+    /* Answered already by a SYNCHBATCH, for this very local file? */
+    const Stat *cached = StatCacheLookup(conn, file1, conn->this_server);
+    if (dstat != NULL && cached != NULL && cached->cf_digest != NULL &&
+        SameLocalFile(&cached->cf_digest_local, dstat))
+    {
+        return cached->cf_digest_differs;
+    }
+
     HashFile(file2, d, CF_DEFAULT_DIGEST);
 
+    /* Or for this very local digest? */
+    if (cached != NULL && cached->cf_digest != NULL &&
+        memcmp(cached->cf_digest, d, CF_DEFAULT_DIGEST_LEN) == 0)
+    {
+        return cached->cf_digest_differs;
+    }
+
     memset(recvbuffer, 0, CF_BUFSIZE);
 
     /* We encrypt only for CLASSIC protocol. The TLS protocol is always over
@@ -487,7 +525,7 @@ int CompareHashNet(const char *file1, const char *file2, bool encrypt, AgentConn
 
     if (ReceiveTransaction(conn->conn_info, recvbuffer, NULL) == -1)
     {
-        /* TODO mark connection in the cache as closed. */
+        conn->error = true;        /* not to be reused from the cache */
         Log(LOG_LEVEL_ERR, "Failed receive. (ReceiveTransaction: %s)", GetErrorStr());
         Log(LOG_LEVEL_VERBOSE, "No answer from host, assuming different checksum");
         return true;
@@ -684,11 +722,55 @@ static void FlushFileStream(int sd, int toget)
 
 /* TODO finalise socket or TLS session in all cases that this function fails
  * and the transaction protocol is out of sync. */
+/**
+ * Receive exactly #toget bytes of one GET block, in pieces small enough for
+ * RecvSocketStream() and TLSRecv().
+ *
+ * @return #toget, or the failing receive function's value (<= 0)
+ */
+static int RecvFileBlock(ConnectionInfo *conn_info, char *buf, int toget)
+{
+    int got = 0;
+    while (got < toget)
+    {
+        int piece = MIN(toget - got, CF_BUFSIZE - 1);
+        int ret;
+        switch(conn_info->protocol)
+        {
+        case CF_PROTOCOL_CLASSIC:
+            ret = RecvSocketStream(conn_info->sd, buf + got, piece);
+            break;
+        case CF_PROTOCOL_TLS:
+            ret = TLSRecv(conn_info->ssl, buf + got, piece);
+            break;
+        default:
+            UnexpectedError("RecvFileBlock: ProtocolVersion %d!",
+                            conn_info->protocol);
+            ret = -1;
+        }
+
+        if (ret <= 0)
+        {
+            return ret;
+        }
+        got += ret;
+    }
+
+    return got;
+}
+
 int CopyRegularFileNet(const char *source, const char *dest, off_t size,
                        bool encrypt, AgentConnection *conn)
 {
     char *buf, workbuf[CF_BUFSIZE], cfchangedstr[265];
-    const int buf_size = 2048;
+
+    /* Stream in large blocks only if the server said it can. */
+    int buf_size = CF_FILE_BLOCKSIZE_LEGACY;
+    if (conn->conn_info->protocol == CF_PROTOCOL_TLS &&
+        conn->conn_info->max_blocksize > CF_FILE_BLOCKSIZE_LEGACY)
+    {
+        buf_size = MIN(CF_FILE_BLOCKSIZE, conn->conn_info->max_blocksize);
+    }
 
     /* We encrypt only for CLASSIC protocol. The TLS protocol is always over
      * encrypted layer, so it does not support encrypted (S*) commands. */
@@ -738,7 +820,8 @@ int CopyRegularFileNet(const char *source, const char *dest, off_t size,
         return false;
     }
 
-    buf = xmalloc(CF_BUFSIZE + sizeof(int));    /* Note CF_BUFSIZE not buf_size !! */
+    /* Room for the '\0' the receive functions append. */
+    buf = xmalloc(MAX(buf_size, CF_BUFSIZE) + sizeof(int));
 
     Log(LOG_LEVEL_VERBOSE, "Copying remote file '%s:%s', expecting %jd bytes",
           conn->this_server, source, (intmax_t)size);
@@ -752,23 +835,7 @@ int CopyRegularFileNet(const char *source, const char *dest, off_t size,
         assert(toget > 0);
 
         /* Stage C1 - receive */
-        int n_read;
-        switch(conn->conn_info->protocol)
-        {
-        case CF_PROTOCOL_CLASSIC:
-            n_read = RecvSocketStream(conn->conn_info->sd, buf, toget);
-            break;
-        case CF_PROTOCOL_TLS:
-            n_read = TLSRecv(conn->conn_info->ssl, buf, toget);
-            break;
-        default:
-            UnexpectedError("CopyRegularFileNet: ProtocolVersion %d!",
-                            conn->conn_info->protocol);
-            n_read = -1;
-        }
-
-        /* TODO what if 0 < n_read < toget? Might happen with TLS. */
-
+        int n_read = RecvFileBlock(conn->conn_info, buf, toget);
         if (n_read <= 0)
         {
             /* This may happen on race conditions, where the file has shrunk
@@ -780,13 +847,14 @@ int CopyRegularFileNet(const char *source, const char *dest, off_t size,
 
             close(dd);
             free(buf);
+            conn->error = true;
             return false;
         }
 
         /* If the first thing we get is an error message, break. */
 
         if (n_wrote_total == 0
-            && strncmp(buf, CF_FAILEDSTR, strlen(CF_FAILEDSTR) == 0))
+            && strncmp(buf, CF_FAILEDSTR, strlen(CF_FAILEDSTR)) == 0)
         {
             Log(LOG_LEVEL_INFO, "Network access to '%s:%s' denied",
                 conn->this_server, source);
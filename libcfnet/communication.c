@@ -27,7 +27,7 @@
 #include <communication.h>
 
 #include <connection_info.h>
-#include <stat_cache.h>                                 /* Stat */
+#include <stat_cache.h>                     /* StatCacheDestroy */
 #include <alloc.h>                                      /* xmalloc,... */
 #include <logging.h>                                    /* Log */
 #include <misc_lib.h>                                   /* ProgrammingError */
@@ -50,14 +50,7 @@ AgentConnection *NewAgentConn(const char *server, const char *port,
 
 void DeleteAgentConn(AgentConnection *conn)
 {
-    Stat *sp = conn->cache;
-
-    while (sp != NULL)
-    {
-        Stat *sps = sp;
-        sp = sp->next;
-        free(sps);
-    }
+    StatCacheDestroy(conn);
 
     ConnectionInfoDestroy(&conn->conn_info);
     free(conn->this_server);
@@ -22,130 +22,295 @@
   included file COSL.txt.
 */
 
-
 #include <platform.h>
 #include <conn_cache.h>
 
 #include <cfnet.h>                                     /* AgentConnection */
 #include <client_code.h>                               /* DisconnectServer */
 #include <sequence.h>                                  /* Seq */
+#include <map.h>                                       /* Map */
 #include <mutex.h>                                     /* ThreadLock */
-#include <communication.h>                             /* Hostname2IPString */
+#include <string_lib.h>                                /* StringHash */
 #include <misc_lib.h>                                  /* CF_ASSERT */
 
 
 /**
    Global cache for connections to servers, currently only used in cf-agent.
 
-   @note THREAD-SAFETY: yes this connection cache *is* thread-safe, but is
-         extremely slow if used intensely from multiple threads. It needs to
-         be redesigned from scratch for that, not a priority for
-         single-threaded cf-agent!
+   Connections are grouped in buckets by (server, port, flags), each with a
+   list of idle and one of busy connections, so finding one is a hash lookup
+   instead of a scan of every connection. The buckets are spread over
+   CONN_CACHE_STRIPES independently locked stripes, so threads talking to
+   different servers don't contend for a lock.
+
+   Idle connections that are too old or have been idle for too long are
+   closed instead of reused, as the server may have dropped them already.
+
+   A bucket also remembers failed connection attempts: after a failure the
+   server is considered offline for a while, doubling with every further
+   failure, and ConnCache_IsOffline() tells callers not to bother.
+
+   @note THREAD-SAFETY: yes.
 */
 
 
+#define CONN_CACHE_STRIPES 16                         /* power of 2 */
+
+#define CONN_CACHE_MAX_AGE_DEFAULT  (60 * 60)
+#define CONN_CACHE_MAX_IDLE_DEFAULT (5 * 60)
+
+#define CONN_CACHE_BACKOFF_MIN 30
+#define CONN_CACHE_BACKOFF_MAX (10 * 60)
+
+
 typedef struct
 {
     AgentConnection *conn;
     enum ConnCacheStatus status; /* TODO unify with conn->conn_info->status */
+    time_t opened;
+    time_t last_used;
 } ConnCache_entry;
 
+/* All connections to one (server, port, flags). */
+typedef struct
+{
+    Seq *idle;                      /* ConnCache_entry, most recently used last */
+    Seq *busy;                      /* ConnCache_entry */
+    unsigned int failures;          /* consecutive failed connection attempts */
+    time_t offline_until;
+} ConnCache_bucket;
 
-static pthread_mutex_t cft_conncache = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+typedef struct
+{
+    pthread_mutex_t lock;
+    Map *buckets;                   /* key -> ConnCache_bucket */
+    ConnCacheStats stats;
+} ConnCache_stripe;
 
-static Seq *conn_cache = NULL;
 
+static ConnCache_stripe conn_cache[CONN_CACHE_STRIPES]; /* GLOBAL_X */
+static pthread_once_t conn_cache_once = PTHREAD_ONCE_INIT; /* GLOBAL_T */
 
-void ConnCache_Init()
-{
-    ThreadLock(&cft_conncache);
+static time_t CONN_CACHE_MAX_AGE = CONN_CACHE_MAX_AGE_DEFAULT; /* GLOBAL_P */
+static time_t CONN_CACHE_MAX_IDLE = CONN_CACHE_MAX_IDLE_DEFAULT; /* GLOBAL_P */
 
-    assert(conn_cache == NULL);
-    conn_cache = SeqNew(100, free);
 
-    ThreadUnlock(&cft_conncache);
+static void ConnCacheInitLocks(void)
+{
+    for (size_t i = 0; i < CONN_CACHE_STRIPES; i++)
+    {
+        pthread_mutex_init(&conn_cache[i].lock, NULL);
+    }
 }
 
-void ConnCache_Destroy()
+/* Entries are freed when removed from a bucket, connections are not. */
+static void ConnCacheBucketDestroy(void *ptr)
 {
-    ThreadLock(&cft_conncache);
+    ConnCache_bucket *bucket = ptr;
+
+    SeqDestroy(bucket->idle);
+    SeqDestroy(bucket->busy);
+    free(bucket);
+}
 
-    for (size_t i = 0; i < SeqLength(conn_cache); i++)
+static void ConnCacheDisconnectAll(Seq *entries)
+{
+    for (size_t i = 0; i < SeqLength(entries); i++)
     {
-        ConnCache_entry *svp = SeqAt(conn_cache, i);
+        ConnCache_entry *svp = SeqAt(entries, i);
 
-        CF_ASSERT(svp != NULL,
-                  "Destroy: NULL ConnCache_entry!");
         CF_ASSERT(svp->conn != NULL,
                   "Destroy: NULL connection in ConnCache_entry!");
 
         DisconnectServer(svp->conn);
     }
+}
 
-    SeqDestroy(conn_cache);
-    conn_cache = NULL;
+static char *ConnCacheKey(const char *server, const char *port,
+                          ConnectionFlags flags)
+{
+    return StringFormat("%s %s %d %d %d %d", server,
+                        (port != NULL) ? port : "",
+                        flags.protocol_version, flags.cache_connection,
+                        flags.force_ipv4, flags.trust_server);
+}
 
-    ThreadUnlock(&cft_conncache);
+static ConnCache_stripe *ConnCacheStripe(const char *key)
+{
+    pthread_once(&conn_cache_once, ConnCacheInitLocks);
+    return &conn_cache[StringHash(key, 0, CONN_CACHE_STRIPES)];
 }
 
-AgentConnection *ConnCache_FindIdleMarkBusy(const char *server,
-                                            const char *port,
-                                            ConnectionFlags flags)
+/* Call with the stripe locked. */
+static ConnCache_bucket *ConnCacheBucketGet(ConnCache_stripe *stripe,
+                                            const char *key, bool create)
 {
-    ThreadLock(&cft_conncache);
+    CF_ASSERT(stripe->buckets != NULL, "Connection cache not initialised!");
 
-    AgentConnection *ret_conn = NULL;
-    for (size_t i = 0; i < SeqLength(conn_cache); i++)
+    ConnCache_bucket *bucket = MapGet(stripe->buckets, key);
+    if (bucket == NULL && create)
     {
-        ConnCache_entry *svp = SeqAt(conn_cache, i);
+        bucket = xcalloc(1, sizeof(ConnCache_bucket));
+        bucket->idle = SeqNew(4, free);
+        bucket->busy = SeqNew(4, free);
+        MapInsert(stripe->buckets, xstrdup(key), bucket);
+    }
+    return bucket;
+}
 
-        CF_ASSERT(svp != NULL,
-                  "FindIdle: NULL ConnCache_entry!");
-        CF_ASSERT(svp->conn != NULL,
-                  "FindIdle: NULL connection in ConnCache_entry!");
+void ConnCache_Init()
+{
+    pthread_once(&conn_cache_once, ConnCacheInitLocks);
 
+    for (size_t i = 0; i < CONN_CACHE_STRIPES; i++)
+    {
+        ThreadLock(&conn_cache[i].lock);
+
+        assert(conn_cache[i].buckets == NULL);
+        conn_cache[i].buckets = MapNew(StringHash_untyped,
+                                       StringSafeEqual_untyped,
+                                       free, ConnCacheBucketDestroy);
+
+        ThreadUnlock(&conn_cache[i].lock);
+    }
+}
+
+void ConnCache_Destroy()
+{
+    for (size_t i = 0; i < CONN_CACHE_STRIPES; i++)
+    {
+        ThreadLock(&conn_cache[i].lock);
 
-        if (strcmp(server,  svp->conn->this_server) == 0 &&
-            ConnectionFlagsEqual(&flags, &svp->conn->flags) &&
-            (port == svp->conn->this_port
-             ||
-             (port != NULL && svp->conn->this_port != NULL &&
-              strcmp(port,    svp->conn->this_port) == 0)))
+        if (conn_cache[i].buckets != NULL)
         {
-            if (svp->status == CONNCACHE_STATUS_BUSY)
+            MapIterator it = MapIteratorInit(conn_cache[i].buckets);
+            MapKeyValue *item;
+            while ((item = MapIteratorNext(&it)))
             {
-                Log(LOG_LEVEL_DEBUG, "FindIdle:"
-                    " connection to '%s' seems to be busy.",
-                    server);
+                ConnCache_bucket *bucket = item->value;
+                ConnCacheDisconnectAll(bucket->idle);
+                ConnCacheDisconnectAll(bucket->busy);
             }
-            else if (svp->status == CONNCACHE_STATUS_OFFLINE)
-            {
-                Log(LOG_LEVEL_DEBUG, "FindIdle:"
-                    " connection to '%s' is marked as offline.",
-                    server);
-            }
-            else if (svp->conn->conn_info->sd >= 0)
-            {
-                assert(svp->status == CONNCACHE_STATUS_IDLE);
 
-                Log(LOG_LEVEL_VERBOSE, "FindIdle:"
-                    " found connection to '%s' already open and ready.",
-                    server);
+            MapDestroy(conn_cache[i].buckets);
+            conn_cache[i].buckets = NULL;
+        }
 
-                svp->status = CONNCACHE_STATUS_BUSY;
-                ret_conn = svp->conn;
-                break;
-            }
-            else
+        ThreadUnlock(&conn_cache[i].lock);
+    }
+}
+
+/**
+   Drop all cached connections without disconnecting them. For forked
+   children, whose copies of the connections share their sockets (and TLS
+   state) with the parent: using or shutting them down would break the
+   parent's sessions.
+*/
+void ConnCache_Forget()
+{
+    pthread_once(&conn_cache_once, ConnCacheInitLocks);
+
+    for (size_t i = 0; i < CONN_CACHE_STRIPES; i++)
+    {
+        ThreadLock(&conn_cache[i].lock);
+
+        if (conn_cache[i].buckets != NULL)
+        {
+            MapIterator it = MapIteratorInit(conn_cache[i].buckets);
+            MapKeyValue *item;
+            while ((item = MapIteratorNext(&it)))
             {
-                Log(LOG_LEVEL_VERBOSE, "FindIdle:"
-                    " connection to '%s' has invalid socket descriptor %d!",
-                    server, svp->conn->conn_info->sd);
+                ConnCache_bucket *bucket = item->value;
+                SeqClear(bucket->idle);
+                SeqClear(bucket->busy);
             }
         }
+
+        ThreadUnlock(&conn_cache[i].lock);
+    }
+}
+
+void ConnCache_SetLimits(time_t max_age, time_t max_idle)
+{
+    CONN_CACHE_MAX_AGE = max_age;
+    CONN_CACHE_MAX_IDLE = max_idle;
+}
+
+AgentConnection *ConnCache_FindIdleMarkBusy(const char *server,
+                                            const char *port,
+                                            ConnectionFlags flags)
+{
+    char *key = ConnCacheKey(server, port, flags);
+    ConnCache_stripe *stripe = ConnCacheStripe(key);
+    const time_t now = time(NULL);
+
+    /* Stale connections are closed after unlocking, it may take a while. */
+    Seq *stale = NULL;
+    AgentConnection *ret_conn = NULL;
+
+    ThreadLock(&stripe->lock);
+
+    ConnCache_bucket *bucket = ConnCacheBucketGet(stripe, key, false);
+    while (bucket != NULL && SeqLength(bucket->idle) > 0)
+    {
+        size_t last = SeqLength(bucket->idle) - 1;
+        ConnCache_entry *svp = SeqAt(bucket->idle, last);
+        SeqSoftRemove(bucket->idle, last);
+
+        assert(svp->status == CONNCACHE_STATUS_IDLE);
+
+        if (svp->conn->conn_info->sd < 0)
+        {
+            Log(LOG_LEVEL_VERBOSE, "FindIdle:"
+                " connection to '%s' has invalid socket descriptor %d!",
+                server, svp->conn->conn_info->sd);
+        }
+        else if (now - svp->opened >= CONN_CACHE_MAX_AGE ||
+                 now - svp->last_used >= CONN_CACHE_MAX_IDLE)
+        {
+            Log(LOG_LEVEL_VERBOSE, "FindIdle:"
+                " closing connection to '%s', open for %jd seconds"
+                " and idle for %jd", server,
+                (intmax_t) (now - svp->opened),
+                (intmax_t) (now - svp->last_used));
+        }
+        else
+        {
+            Log(LOG_LEVEL_VERBOSE, "FindIdle:"
+                " found connection to '%s' already open and ready.",
+                server);
+
+            svp->status = CONNCACHE_STATUS_BUSY;
+            SeqAppend(bucket->busy, svp);
+            ret_conn = svp->conn;
+            break;
+        }
+
+        stripe->stats.expired++;
+        if (stale == NULL)
+        {
+            stale = SeqNew(1, free);
+        }
+        SeqAppend(stale, svp);
     }
 
-    ThreadUnlock(&cft_conncache);
+    if (ret_conn != NULL)
+    {
+        stripe->stats.hits++;
+    }
+    else
+    {
+        stripe->stats.misses++;
+    }
+
+    ThreadUnlock(&stripe->lock);
+    free(key);
+
+    if (stale != NULL)
+    {
+        ConnCacheDisconnectAll(stale);
+        SeqDestroy(stale);
+    }
 
     if (ret_conn == NULL)
     {
@@ -161,17 +326,17 @@ void ConnCache_MarkNotBusy(AgentConnection *conn)
     Log(LOG_LEVEL_DEBUG, "Searching for specific busy connection to: %s",
         conn->this_server);
 
-    ThreadLock(&cft_conncache);
+    char *key = ConnCacheKey(conn->this_server, conn->this_port, conn->flags);
+    ConnCache_stripe *stripe = ConnCacheStripe(key);
+
+    ThreadLock(&stripe->lock);
 
     bool found = false;
-    for (size_t i = 0; i < SeqLength(conn_cache); i++)
+    ConnCache_entry *broken = NULL;
+    ConnCache_bucket *bucket = ConnCacheBucketGet(stripe, key, false);
+    for (size_t i = 0; bucket != NULL && i < SeqLength(bucket->busy); i++)
     {
-        ConnCache_entry *svp = SeqAt(conn_cache, i);
-
-        CF_ASSERT(svp != NULL,
-                  "MarkNotBusy: NULL ConnCache_entry!");
-        CF_ASSERT(svp->conn != NULL,
-                  "MarkNotBusy: NULL connection in ConnCache_entry!");
+        ConnCache_entry *svp = SeqAt(bucket->busy, i);
 
         if (svp->conn == conn)
         {
@@ -182,30 +347,129 @@ void ConnCache_MarkNotBusy(AgentConnection *conn)
                       "MarkNotBusy: status is not busy, it is %d!",
                       svp->status);
 
-            svp->status = CONNCACHE_STATUS_IDLE;
+            SeqSoftRemove(bucket->busy, i);
+            if (conn->error)
+            {
+                /* Whatever went wrong may have left the stream out of step
+                 * with the requests, so the connection is not reused. */
+                broken = svp;
+            }
+            else
+            {
+                svp->status = CONNCACHE_STATUS_IDLE;
+                svp->last_used = time(NULL);
+                SeqAppend(bucket->idle, svp);
+            }
             found = true;
             break;
         }
     }
 
-    ThreadUnlock(&cft_conncache);
+    ThreadUnlock(&stripe->lock);
+    free(key);
 
     if (!found)
     {
         ProgrammingError("MarkNotBusy: No busy connection found!");
     }
 
+    if (broken != NULL)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Closing connection to '%s' after an error",
+            conn->this_server);
+        DisconnectServer(broken->conn);
+        free(broken);
+        return;
+    }
+
     Log(LOG_LEVEL_DEBUG, "Busy connection just became free");
 }
 
-/* First time we open a connection, so store it. */
+/**
+   First time we open a connection, so store it. Adding a connection as
+   OFFLINE records a failed attempt to connect to its server instead: the
+   connection itself is not kept.
+*/
 void ConnCache_Add(AgentConnection *conn, enum ConnCacheStatus status)
 {
-    ConnCache_entry *svp = xmalloc(sizeof(*svp));
-    svp->status = status;
-    svp->conn = conn;
+    char *key = ConnCacheKey(conn->this_server, conn->this_port, conn->flags);
+    ConnCache_stripe *stripe = ConnCacheStripe(key);
+    const time_t now = time(NULL);
+
+    ThreadLock(&stripe->lock);
+
+    ConnCache_bucket *bucket = ConnCacheBucketGet(stripe, key, true);
+    if (status == CONNCACHE_STATUS_OFFLINE)
+    {
+        time_t backoff = CONN_CACHE_BACKOFF_MAX;
+        if (bucket->failures < 16)
+        {
+            backoff = MIN(CONN_CACHE_BACKOFF_MIN << bucket->failures,
+                          CONN_CACHE_BACKOFF_MAX);
+        }
+        bucket->failures++;
+        bucket->offline_until = now + backoff;
+
+        Log(LOG_LEVEL_VERBOSE, "Server '%s' marked as offline for %jd seconds"
+            " after %u failed connection attempts", conn->this_server,
+            (intmax_t) backoff, bucket->failures);
+    }
+    else
+    {
+        bucket->failures = 0;
+        bucket->offline_until = 0;
+
+        ConnCache_entry *svp = xmalloc(sizeof(*svp));
+        svp->status = status;
+        svp->conn = conn;
+        svp->opened = now;
+        svp->last_used = now;
+        SeqAppend((status == CONNCACHE_STATUS_BUSY) ? bucket->busy : bucket->idle,
+                  svp);
+    }
+
+    ThreadUnlock(&stripe->lock);
+    free(key);
+
+    if (status == CONNCACHE_STATUS_OFFLINE)
+    {
+        DisconnectServer(conn);
+    }
+}
+
+bool ConnCache_IsOffline(const char *server, const char *port,
+                         ConnectionFlags flags)
+{
+    char *key = ConnCacheKey(server, port, flags);
+    ConnCache_stripe *stripe = ConnCacheStripe(key);
+
+    ThreadLock(&stripe->lock);
 
-    ThreadLock(&cft_conncache);
-    SeqAppend(conn_cache, svp);
-    ThreadUnlock(&cft_conncache);
+    const ConnCache_bucket *bucket = ConnCacheBucketGet(stripe, key, false);
+    bool offline = (bucket != NULL && time(NULL) < bucket->offline_until);
+    if (offline)
+    {
+        stripe->stats.offline++;
+    }
+
+    ThreadUnlock(&stripe->lock);
+    free(key);
+
+    return offline;
+}
+
+void ConnCache_GetStats(ConnCacheStats *stats)
+{
+    pthread_once(&conn_cache_once, ConnCacheInitLocks);
+
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < CONN_CACHE_STRIPES; i++)
+    {
+        ThreadLock(&conn_cache[i].lock);
+        stats->hits += conn_cache[i].stats.hits;
+        stats->misses += conn_cache[i].stats.misses;
+        stats->expired += conn_cache[i].stats.expired;
+        stats->offline += conn_cache[i].stats.offline;
+        ThreadUnlock(&conn_cache[i].lock);
+    }
 }
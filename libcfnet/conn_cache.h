@@ -36,8 +36,18 @@ enum ConnCacheStatus
 };
 
 
+typedef struct
+{
+    size_t hits;                   /* idle connection found and reused */
+    size_t misses;
+    size_t expired;                /* idle connections closed as too old */
+    size_t offline;                /* lookups of servers backing off */
+} ConnCacheStats;
+
+
 void ConnCache_Init(void);
 void ConnCache_Destroy(void);
+void ConnCache_Forget(void);
 
 AgentConnection *ConnCache_FindIdleMarkBusy(const char *server,
                                             const char *port,
@@ -45,6 +55,10 @@ AgentConnection *ConnCache_FindIdleMarkBusy(const char *server,
 void ConnCache_MarkNotBusy(AgentConnection *conn);
 void ConnCache_Add(AgentConnection *conn, enum ConnCacheStatus status);
 void ConnCache_IsBusy(AgentConnection *conn);
+bool ConnCache_IsOffline(const char *server, const char *port,
+                         ConnectionFlags flags);
+void ConnCache_SetLimits(time_t max_age, time_t max_idle);
+void ConnCache_GetStats(ConnCacheStats *stats);
 
 
 #endif
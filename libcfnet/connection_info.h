@@ -63,6 +63,8 @@ struct ConnectionInfo {
     socklen_t ss_len;
     struct sockaddr_storage ss;
     bool is_call_collect;       /* Maybe replace with a bitfield later ... */
+    int max_blocksize;          /* GET block size advertised by peer, or 0 */
+    int max_synch_batch;        /* SYNCHBATCH entries accepted by peer, or 0 */
 };
 
 typedef struct ConnectionInfo ConnectionInfo;
@@ -33,12 +33,65 @@
 #include <logging.h>                          /* Log */
 #include <crypto.h>                           /* EncryptString */
 #include <misc_lib.h>                         /* ProgrammingError */
+#include <files_hashes.h>                     /* CF_DEFAULT_DIGEST_LEN */
+#include <map.h>                              /* Map */
+#include <string_lib.h>                       /* StringHash_untyped */
 
+/* Entries are keyed by "<server> <port> <path>"; neither host names nor
+ * ports contain spaces, so every (server, port, path) gets its own key. */
+#define STAT_CACHE_KEY_SIZE (CF_BUFSIZE + CF_MAXVARSIZE)
+
+static bool StatCacheKey(char *key, size_t key_size,
+                         const AgentConnection *conn,
+                         const char *server_name, const char *file_name)
+{
+    int ret = snprintf(key, key_size, "%s %s %s", server_name,
+                       (conn->this_port != NULL) ? conn->this_port : "",
+                       file_name);
+    return (ret >= 0 && ret < key_size);
+}
+
+static void StatDestroy(void *data)
+{
+    Stat *sp = data;
+    free(sp->cf_filename);
+    free(sp->cf_server);
+    free(sp->cf_readlink);
+    free(sp->cf_digest);
+    free(sp);
+}
+
+static Stat *StatCacheGet(const AgentConnection *conn, const char *file_name,
+                          const char *server_name)
+{
+    char key[STAT_CACHE_KEY_SIZE];
+    if (conn->cache == NULL ||
+        !StatCacheKey(key, sizeof(key), conn, server_name, file_name))
+    {
+        return NULL;
+    }
+
+    return MapGet(conn->cache, key);
+}
+
+/* Takes ownership of the strings in #data, replacing any older entry. */
 static void NewStatCache(Stat *data, AgentConnection *conn)
 {
-    Stat *sp = xmemdup(data, sizeof(Stat));
-    sp->next = conn->cache;
-    conn->cache = sp;
+    char key[STAT_CACHE_KEY_SIZE];
+    if (!StatCacheKey(key, sizeof(key), conn,
+                      data->cf_server, data->cf_filename))
+    {
+        StatDestroy(xmemdup(data, sizeof(Stat)));
+        return;
+    }
+
+    if (conn->cache == NULL)
+    {
+        conn->cache = MapNew(StringHash_untyped, StringSafeEqual_untyped,
+                             free, StatDestroy);
+    }
+
+    MapInsert(conn->cache, xstrdup(key), xmemdup(data, sizeof(Stat)));
 }
 
 /**
@@ -49,45 +102,161 @@ static void NewStatCache(Stat *data, AgentConnection *conn)
 static int StatFromCache(AgentConnection *conn, const char *file,
                          struct stat *statbuf, const char *stattype)
 {
-    for (Stat *sp = conn->cache; sp != NULL; sp = sp->next)
+    const Stat *sp = StatCacheGet(conn, file, conn->this_server);
+    if (sp != NULL)
     {
-        /* TODO differentiate ports etc in this stat cache! */
+        if (sp->cf_failed)  /* cached failure from cfopendir */
+        {
+            errno = EPERM;
+            return -1;
+        }
 
-        if (strcmp(conn->this_server, sp->cf_server) == 0 &&
-            strcmp(file, sp->cf_filename) == 0)
+        if ((strcmp(stattype, "link") == 0) && (sp->cf_lmode != 0))
         {
-            if (sp->cf_failed)  /* cached failure from cfopendir */
-            {
-                errno = EPERM;
-                return -1;
-            }
+            statbuf->st_mode = sp->cf_lmode;
+        }
+        else
+        {
+            statbuf->st_mode = sp->cf_mode;
+        }
 
-            if ((strcmp(stattype, "link") == 0) && (sp->cf_lmode != 0))
-            {
-                statbuf->st_mode = sp->cf_lmode;
-            }
-            else
-            {
-                statbuf->st_mode = sp->cf_mode;
-            }
+        statbuf->st_uid = sp->cf_uid;
+        statbuf->st_gid = sp->cf_gid;
+        statbuf->st_size = sp->cf_size;
+        statbuf->st_atime = sp->cf_atime;
+        statbuf->st_mtime = sp->cf_mtime;
+        statbuf->st_ctime = sp->cf_ctime;
+        statbuf->st_ino = sp->cf_ino;
+        statbuf->st_dev = sp->cf_dev;
+        statbuf->st_nlink = sp->cf_nlink;
 
-            statbuf->st_uid = sp->cf_uid;
-            statbuf->st_gid = sp->cf_gid;
-            statbuf->st_size = sp->cf_size;
-            statbuf->st_atime = sp->cf_atime;
-            statbuf->st_mtime = sp->cf_mtime;
-            statbuf->st_ctime = sp->cf_ctime;
-            statbuf->st_ino = sp->cf_ino;
-            statbuf->st_dev = sp->cf_dev;
-            statbuf->st_nlink = sp->cf_nlink;
-
-            return 0;
-        }
+        return 0;
     }
 
     return 1;                                                  /* not found */
 }
 
+/**
+ * @brief Parse the reply to a STAT request for #file, receive the readlink
+ *        transaction that follows a successful one, and cache the result.
+ * @return 0 if cached, -1 if the server refused or the connection failed.
+ */
+static int StatParseReply(AgentConnection *conn, const char *file,
+                          char *reply)
+{
+    if (BadProtoReply(reply))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Server returned error: %s",
+            reply + strlen("BAD: "));
+        errno = EPERM;
+        return -1;
+    }
+
+    if (!OKProtoReply(reply))
+    {
+        Log(LOG_LEVEL_ERR, "Transmission refused or failed statting '%s', got '%s'", file, reply);
+        errno = EPERM;
+        return -1;
+    }
+
+    Stat cfst = { 0 };
+
+    // use intmax_t here to provide enough space for large values coming over the protocol
+    intmax_t d1, d2, d3, d4, d5, d6, d7, d8, d9, d10, d11, d12 = 0, d13 = 0;
+    int ret = sscanf(reply, "OK: "
+           "%1" PRIdMAX     // 01 cfst.cf_type
+           " %5" PRIdMAX    // 02 cfst.cf_mode
+           " %14" PRIdMAX   // 03 cfst.cf_lmode
+           " %14" PRIdMAX   // 04 cfst.cf_uid
+           " %14" PRIdMAX   // 05 cfst.cf_gid
+           " %18" PRIdMAX   // 06 cfst.cf_size
+           " %14" PRIdMAX   // 07 cfst.cf_atime
+           " %14" PRIdMAX   // 08 cfst.cf_mtime
+           " %14" PRIdMAX   // 09 cfst.cf_ctime
+           " %1" PRIdMAX    // 10 cfst.cf_makeholes
+           " %14" PRIdMAX   // 11 cfst.cf_ino
+           " %14" PRIdMAX   // 12 cfst.cf_nlink
+           " %18" PRIdMAX,  // 13 cfst.cf_dev
+           &d1, &d2, &d3, &d4, &d5, &d6, &d7, &d8, &d9, &d10, &d11, &d12, &d13);
+
+    if (ret < 13)
+    {
+        Log(LOG_LEVEL_ERR, "Cannot read SYNCH reply from '%s', only %d/13 items parsed", conn->remoteip, ret );
+        return -1;
+    }
+
+    cfst.cf_type = (FileType) d1;
+    cfst.cf_mode = (mode_t) d2;
+    cfst.cf_lmode = (mode_t) d3;
+    cfst.cf_uid = (uid_t) d4;
+    cfst.cf_gid = (gid_t) d5;
+    cfst.cf_size = (off_t) d6;
+    cfst.cf_atime = (time_t) d7;
+    cfst.cf_mtime = (time_t) d8;
+    cfst.cf_ctime = (time_t) d9;
+    cfst.cf_makeholes = (char) d10;
+    cfst.cf_ino = d11;
+    cfst.cf_nlink = d12;
+    cfst.cf_dev = (dev_t)d13;
+
+    /* Use %?d here to avoid memory overflow attacks */
+
+    char recvbuffer[CF_BUFSIZE];
+    memset(recvbuffer, 0, CF_BUFSIZE);
+
+    if (ReceiveTransaction(conn->conn_info, recvbuffer, NULL) == -1)
+    {
+        conn->error = true;        /* not to be reused from the cache */
+        return -1;
+    }
+
+    if (strlen(recvbuffer) > 3)
+    {
+        cfst.cf_readlink = xstrdup(recvbuffer + 3);
+    }
+    else
+    {
+        cfst.cf_readlink = NULL;
+    }
+
+    switch (cfst.cf_type)
+    {
+    case FILE_TYPE_REGULAR:
+        cfst.cf_mode |= (mode_t) S_IFREG;
+        break;
+    case FILE_TYPE_DIR:
+        cfst.cf_mode |= (mode_t) S_IFDIR;
+        break;
+    case FILE_TYPE_CHAR_:
+        cfst.cf_mode |= (mode_t) S_IFCHR;
+        break;
+    case FILE_TYPE_FIFO:
+        cfst.cf_mode |= (mode_t) S_IFIFO;
+        break;
+    case FILE_TYPE_SOCK:
+        cfst.cf_mode |= (mode_t) S_IFSOCK;
+        break;
+    case FILE_TYPE_BLOCK:
+        cfst.cf_mode |= (mode_t) S_IFBLK;
+        break;
+    case FILE_TYPE_LINK:
+        cfst.cf_mode |= (mode_t) S_IFLNK;
+        break;
+    }
+
+    cfst.cf_filename = xstrdup(file);
+    cfst.cf_server = xstrdup(conn->this_server);
+    cfst.cf_failed = false;
+
+    if (cfst.cf_lmode != 0)
+    {
+        cfst.cf_lmode |= (mode_t) S_IFLNK;
+    }
+
+    NewStatCache(&cfst, conn);
+    return 0;
+}
+
 /**
  * @param #stattype should be either "link" or "file". If a link, this reads
  *                  readlink and sends it back in the same packet. It then
@@ -177,7 +346,7 @@ int cf_remote_stat(AgentConnection *conn, bool encrypt, const char *file,
 
     if (ReceiveTransaction(conn->conn_info, recvbuffer, NULL) == -1)
     {
-        /* TODO mark connection in the cache as closed. */
+        conn->error = true;        /* not to be reused from the cache */
         return -1;
     }
 
@@ -189,152 +358,299 @@ int cf_remote_stat(AgentConnection *conn, bool encrypt, const char *file,
         return -1;
     }
 
-    if (BadProtoReply(recvbuffer))
+    if (StatParseReply(conn, file, recvbuffer) == -1)
     {
-        Log(LOG_LEVEL_VERBOSE, "Server returned error: %s",
-            recvbuffer + strlen("BAD: "));
-        errno = EPERM;
         return -1;
     }
 
-    if (OKProtoReply(recvbuffer))
-    {
-        Stat cfst;
-
-        // use intmax_t here to provide enough space for large values coming over the protocol
-        intmax_t d1, d2, d3, d4, d5, d6, d7, d8, d9, d10, d11, d12 = 0, d13 = 0;
-        ret = sscanf(recvbuffer, "OK: "
-               "%1" PRIdMAX     // 01 cfst.cf_type
-               " %5" PRIdMAX    // 02 cfst.cf_mode
-               " %14" PRIdMAX   // 03 cfst.cf_lmode
-               " %14" PRIdMAX   // 04 cfst.cf_uid
-               " %14" PRIdMAX   // 05 cfst.cf_gid
-               " %18" PRIdMAX   // 06 cfst.cf_size
-               " %14" PRIdMAX   // 07 cfst.cf_atime
-               " %14" PRIdMAX   // 08 cfst.cf_mtime
-               " %14" PRIdMAX   // 09 cfst.cf_ctime
-               " %1" PRIdMAX    // 10 cfst.cf_makeholes
-               " %14" PRIdMAX   // 11 cfst.cf_ino
-               " %14" PRIdMAX   // 12 cfst.cf_nlink
-               " %18" PRIdMAX,  // 13 cfst.cf_dev
-               &d1, &d2, &d3, &d4, &d5, &d6, &d7, &d8, &d9, &d10, &d11, &d12, &d13);
-
-        if (ret < 13)
-        {
-            Log(LOG_LEVEL_ERR, "Cannot read SYNCH reply from '%s', only %d/13 items parsed", conn->remoteip, ret );
-            return -1;
-        }
+    return StatFromCache(conn, file, statbuf, stattype);
+}
 
-        cfst.cf_type = (FileType) d1;
-        cfst.cf_mode = (mode_t) d2;
-        cfst.cf_lmode = (mode_t) d3;
-        cfst.cf_uid = (uid_t) d4;
-        cfst.cf_gid = (gid_t) d5;
-        cfst.cf_size = (off_t) d6;
-        cfst.cf_atime = (time_t) d7;
-        cfst.cf_mtime = (time_t) d8;
-        cfst.cf_ctime = (time_t) d9;
-        cfst.cf_makeholes = (char) d10;
-        cfst.cf_ino = d11;
-        cfst.cf_nlink = d12;
-        cfst.cf_dev = (dev_t)d13;
+/*********************************************************************/
 
-        /* Use %?d here to avoid memory overflow attacks */
+const Stat *StatCacheLookup(const AgentConnection *conn, const char *file_name,
+                            const char *server_name)
+{
+    return StatCacheGet(conn, file_name, server_name);
+}
 
-        memset(recvbuffer, 0, CF_BUFSIZE);
+void StatCacheDestroy(AgentConnection *conn)
+{
+    if (conn->cache != NULL)
+    {
+        MapDestroy(conn->cache);
+        conn->cache = NULL;
+    }
+}
 
-        if (ReceiveTransaction(conn->conn_info, recvbuffer, NULL) == -1)
-        {
-            /* TODO mark connection in the cache as closed. */
-            return -1;
-        }
+/*********************************************************************/
+
+/**
+ * @brief Send #files[start .. start+count) as one SYNCHBATCH request, the
+ *        ones with a non-NULL entry in #digests as MD5 entries, and read all
+ *        the replies back.
+ *
+ * The whole batch is written before reading any reply; the server reads the
+ * whole batch before replying, so the request costs one round trip.
+ *
+ * The server answers every entry, even when it refuses the whole batch, so
+ * all #count replies are always read and the connection stays in step.
+ *
+ * @return number of entries answered, or -1 if any entry got a BAD reply or
+ *         the connection failed.
+ */
+static int SynchBatch(AgentConnection *conn, const Seq *files,
+                      const Seq *digests, size_t start, size_t count)
+{
+    char sendbuffer[CF_BUFSIZE];
+    char recvbuffer[CF_BUFSIZE];
+
+    time_t tloc = time(NULL);
+    if (tloc == (time_t) -1)
+    {
+        Log(LOG_LEVEL_ERR, "Couldn't read system clock (time: %s)",
+            GetErrorStr());
+        tloc = 0;
+    }
+
+    snprintf(sendbuffer, sizeof(sendbuffer), "SYNCHBATCH %jd %zu",
+             (intmax_t) tloc, count);
+    if (SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE) == -1)
+    {
+        Log(LOG_LEVEL_INFO,
+            "Transmission failed/refused talking to %.255s (SYNCHBATCH: %s)",
+            conn->this_server, GetErrorStr());
+        conn->error = true;
+        return -1;
+    }
+
+    for (size_t i = start; i < start + count; i++)
+    {
+        const char *file = SeqAt(files, i);
+        const unsigned char *digest =
+            (digests != NULL) ? SeqAt(digests, i) : NULL;
 
-        if (strlen(recvbuffer) > 3)
+        int tosend;
+        if (digest != NULL)
         {
-            cfst.cf_readlink = xstrdup(recvbuffer + 3);
+            /* Same layout as the MD5 command. */
+            snprintf(sendbuffer, sizeof(sendbuffer), "MD5 %s", file);
+            tosend = strlen(sendbuffer) + CF_SMALL_OFFSET;
+            memset(sendbuffer + strlen(sendbuffer), 0, CF_SMALL_OFFSET);
+            memcpy(sendbuffer + tosend, digest, CF_DEFAULT_DIGEST_LEN);
+            tosend += CF_DEFAULT_DIGEST_LEN;
         }
         else
         {
-            cfst.cf_readlink = NULL;
+            snprintf(sendbuffer, sizeof(sendbuffer), "STAT %s", file);
+            tosend = strlen(sendbuffer);
         }
 
-        switch (cfst.cf_type)
+        if (SendTransaction(conn->conn_info, sendbuffer, tosend, CF_DONE) == -1)
         {
-        case FILE_TYPE_REGULAR:
-            cfst.cf_mode |= (mode_t) S_IFREG;
-            break;
-        case FILE_TYPE_DIR:
-            cfst.cf_mode |= (mode_t) S_IFDIR;
-            break;
-        case FILE_TYPE_CHAR_:
-            cfst.cf_mode |= (mode_t) S_IFCHR;
-            break;
-        case FILE_TYPE_FIFO:
-            cfst.cf_mode |= (mode_t) S_IFIFO;
-            break;
-        case FILE_TYPE_SOCK:
-            cfst.cf_mode |= (mode_t) S_IFSOCK;
-            break;
-        case FILE_TYPE_BLOCK:
-            cfst.cf_mode |= (mode_t) S_IFBLK;
-            break;
-        case FILE_TYPE_LINK:
-            cfst.cf_mode |= (mode_t) S_IFLNK;
-            break;
+            Log(LOG_LEVEL_INFO,
+                "Transmission failed/refused talking to %.255s (SYNCHBATCH: %s)",
+                conn->this_server, GetErrorStr());
+            conn->error = true;
+            return -1;
         }
+    }
 
-        cfst.cf_filename = xstrdup(file);
-        cfst.cf_server = xstrdup(conn->this_server);
-        cfst.cf_failed = false;
+    int answered = 0;
+    bool refused = false;
+    for (size_t i = start; i < start + count; i++)
+    {
+        const char *file = SeqAt(files, i);
+        const unsigned char *digest =
+            (digests != NULL) ? SeqAt(digests, i) : NULL;
 
-        if (cfst.cf_lmode != 0)
+        memset(recvbuffer, 0, sizeof(recvbuffer));
+        if (ReceiveTransaction(conn->conn_info, recvbuffer, NULL) == -1)
         {
-            cfst.cf_lmode |= (mode_t) S_IFLNK;
+            conn->error = true;    /* not to be reused from the cache */
+            return -1;
         }
 
-        NewStatCache(&cfst, conn);
+        if (BadProtoReply(recvbuffer))
+        {
+            if (!refused && strstr(recvbuffer, "unsynchronized"))
+            {
+                Log(LOG_LEVEL_ERR,
+                    "Clocks differ too much to do copy by date (security), server reported: %s",
+                    recvbuffer + strlen("BAD: "));
+            }
+            else
+            {
+                Log(LOG_LEVEL_VERBOSE,
+                    "Server refused SYNCHBATCH entry '%s': %s",
+                    file, recvbuffer + strlen("BAD: "));
+            }
+            refused = true;
+            continue;
+        }
 
-        if ((cfst.cf_lmode != 0) && (strcmp(stattype, "link") == 0))
+        if (digest != NULL)
         {
-            statbuf->st_mode = cfst.cf_lmode;
+            bool differs;
+            if (strcmp(recvbuffer, CFD_TRUE) == 0)
+            {
+                differs = true;
+            }
+            else if (strcmp(recvbuffer, CFD_FALSE) == 0)
+            {
+                differs = false;
+            }
+            else
+            {
+                Log(LOG_LEVEL_ERR,
+                    "Unexpected reply to SYNCHBATCH entry '%s' from '%s': %s",
+                    file, conn->remoteip, recvbuffer);
+                refused = true;
+                continue;
+            }
+
+            Stat *sp = StatCacheGet(conn, file, conn->this_server);
+            if (sp != NULL)
+            {
+                free(sp->cf_digest);
+                sp->cf_digest = xmemdup(digest, CF_DEFAULT_DIGEST_LEN);
+                sp->cf_digest_differs = differs;
+                answered++;
+            }
+        }
+        else if (StatParseReply(conn, file, recvbuffer) == 0)
+        {
+            answered++;
         }
         else
         {
-            statbuf->st_mode = cfst.cf_mode;
+            /* Not a BAD reply, yet not one we could parse: whether a
+             * readlink transaction follows is unknown. */
+            conn->error = true;
+            return -1;
         }
+    }
 
-        statbuf->st_uid = cfst.cf_uid;
-        statbuf->st_gid = cfst.cf_gid;
-        statbuf->st_size = cfst.cf_size;
-        statbuf->st_mtime = cfst.cf_mtime;
-        statbuf->st_ctime = cfst.cf_ctime;
-        statbuf->st_atime = cfst.cf_atime;
-        statbuf->st_ino = cfst.cf_ino;
-        statbuf->st_dev = cfst.cf_dev;
-        statbuf->st_nlink = cfst.cf_nlink;
+    return refused ? -1 : answered;
+}
 
+static int SynchBatchAll(AgentConnection *conn, const Seq *files,
+                         const Seq *digests)
+{
+    const size_t batch_max = MIN(conn->conn_info->max_synch_batch,
+                                 CF_SYNCH_BATCH_MAX);
+    if (batch_max == 0 || SeqLength(files) == 0)
+    {
         return 0;
     }
 
-    Log(LOG_LEVEL_ERR, "Transmission refused or failed statting '%s', got '%s'", file, recvbuffer);
-    errno = EPERM;
-    return -1;
+    int answered = 0;
+    for (size_t start = 0; start < SeqLength(files); start += batch_max)
+    {
+        size_t count = MIN(batch_max, SeqLength(files) - start);
+        int ret = SynchBatch(conn, files, digests, start, count);
+        if (ret == -1)
+        {
+            return -1;
+        }
+        answered += ret;
+    }
+
+    return answered;
 }
 
-/*********************************************************************/
+/**
+ * @brief Fill the stat cache for all #files with pipelined SYNCHBATCH
+ *        requests, so that cf_remote_stat() on any of them needs no round
+ *        trip. Files already cached or with too long names are skipped.
+ *
+ * Does nothing unless the server advertised SYNCHBATCH. Refused entries are
+ * not cached; cf_remote_stat() asks for those one by one as before.
+ *
+ * @return number of stats cached, or -1 if the server refused any entry or
+ *         the connection failed; conn->error tells the two apart.
+ */
+int StatCachePrefetch(AgentConnection *conn, const Seq *files)
+{
+    if (conn->conn_info->protocol < CF_PROTOCOL_TLS ||
+        conn->conn_info->max_synch_batch <= 0)
+    {
+        return 0;
+    }
 
-/* TODO only a server_name is not enough for stat'ing of files... */
-const Stat *StatCacheLookup(const AgentConnection *conn, const char *file_name,
-                            const char *server_name)
+    Seq *wanted = SeqNew(SeqLength(files), NULL);
+    for (size_t i = 0; i < SeqLength(files); i++)
+    {
+        const char *file = SeqAt(files, i);
+        if (strlen(file) <= CF_BUFSIZE - 30 &&
+            StatCacheLookup(conn, file, conn->this_server) == NULL)
+        {
+            SeqAppend(wanted, (void *) file);
+        }
+    }
+
+    int ret = SynchBatchAll(conn, wanted, NULL);
+    SeqDestroy(wanted);
+    return ret;
+}
+
+/**
+ * @brief Have the server compare the digest of each of #files against the
+ *        corresponding entry of #digests (CF_DEFAULT_DIGEST_LEN bytes), with
+ *        pipelined SYNCHBATCH requests, and remember the verdicts in the stat
+ *        cache for CompareHashNet(). Only files already in the stat cache,
+ *        and without a verdict for that same digest, are sent.
+ *
+ * Each entry of #local_stats is the stat of the local file the digest was
+ * computed from, so that CompareHashNet() can tell whether the digest still
+ * holds without hashing the file again.
+ *
+ * @return number of verdicts cached, or -1 if the server refused any entry or
+ *         the connection failed.
+ */
+int StatCachePrefetchDigests(AgentConnection *conn, const Seq *files,
+                             const Seq *digests, const Seq *local_stats)
 {
-    for (const Stat *sp = conn->cache; sp != NULL; sp = sp->next)
+    assert(SeqLength(files) == SeqLength(digests));
+    assert(SeqLength(files) == SeqLength(local_stats));
+
+    if (conn->conn_info->protocol < CF_PROTOCOL_TLS ||
+        conn->conn_info->max_synch_batch <= 0)
+    {
+        return 0;
+    }
+
+    Seq *wanted = SeqNew(SeqLength(files), NULL);
+    Seq *wanted_digests = SeqNew(SeqLength(files), NULL);
+    for (size_t i = 0; i < SeqLength(files); i++)
+    {
+        const char *file = SeqAt(files, i);
+        const unsigned char *digest = SeqAt(digests, i);
+        const Stat *sp = StatCacheLookup(conn, file, conn->this_server);
+        if (strlen(file) <= CF_BUFSIZE - 30 && sp != NULL &&
+            (sp->cf_digest == NULL ||
+             memcmp(sp->cf_digest, digest, CF_DEFAULT_DIGEST_LEN) != 0))
+        {
+            SeqAppend(wanted, (void *) file);
+            SeqAppend(wanted_digests, (void *) digest);
+        }
+    }
+
+    int ret = SynchBatchAll(conn, wanted, wanted_digests);
+    SeqDestroy(wanted);
+    SeqDestroy(wanted_digests);
+
+    /* Whatever got a verdict for this digest, now or before, remembers
+     * which local file it was computed from. */
+    for (size_t i = 0; i < SeqLength(files); i++)
     {
-        if (strcmp(server_name, sp->cf_server) == 0 &&
-            strcmp(file_name, sp->cf_filename) == 0)
+        Stat *sp = StatCacheGet(conn, SeqAt(files, i), conn->this_server);
+        if (sp != NULL && sp->cf_digest != NULL &&
+            memcmp(sp->cf_digest, SeqAt(digests, i), CF_DEFAULT_DIGEST_LEN) == 0)
         {
-            return sp;
+            sp->cf_digest_local = *(const struct stat *) SeqAt(local_stats, i);
         }
     }
 
-    return NULL;
+    return ret;
 }
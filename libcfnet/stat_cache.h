@@ -26,6 +26,7 @@
 
 #include <platform.h>
 #include <cfnet.h>
+#include <sequence.h>
 
 
 typedef enum
@@ -59,7 +60,9 @@ struct Stat_
     int cf_nlink;               /* Number of hard links */
     int cf_ino;                 /* inode number on server */
     dev_t cf_dev;               /* device number */
-    Stat *next;
+    unsigned char *cf_digest;   /* local digest the server compared, or NULL */
+    bool cf_digest_differs;     /* server's verdict on cf_digest */
+    struct stat cf_digest_local; /* local file cf_digest was computed from */
 };
 
 
@@ -67,6 +70,10 @@ int cf_remote_stat(AgentConnection *conn, bool encrypt, const char *file,
                    struct stat *statbuf, const char *stattype);
 const Stat *StatCacheLookup(const AgentConnection *conn, const char *file_name,
                             const char *server_name);
+void StatCacheDestroy(AgentConnection *conn);
+int StatCachePrefetch(AgentConnection *conn, const Seq *files);
+int StatCachePrefetchDigests(AgentConnection *conn, const Seq *files,
+                             const Seq *digests, const Seq *local_stats);
 
 
 #endif
@@ -34,6 +34,7 @@
 
 #include <tls_client.h>
 #include <tls_generic.h>
+#include <tls_session_cache.h>
 #include <net.h>                     /* SendTransaction, ReceiveTransaction */
 /* TODO move crypto.h to libutils */
 #include <crypto.h>                                       /* LoadSecretKeys */
@@ -278,6 +279,26 @@ int TLSClientIdentificationDialog(ConnectionInfo *conn_info,
         return 0;
     }
 
+    /* Servers that stream files in larger blocks advertise the maximum. */
+    const char *blocksize = strstr(line, " BLOCKSIZE=");
+    int max_blocksize = 0;
+    if (blocksize != NULL &&
+        sscanf(blocksize, " BLOCKSIZE=%d", &max_blocksize) == 1 &&
+        max_blocksize > 0)
+    {
+        conn_info->max_blocksize = max_blocksize;
+    }
+
+    /* ...and servers that take batched STAT/MD5 requests, the batch size. */
+    const char *synch_batch = strstr(line, " SYNCHBATCH=");
+    int max_synch_batch = 0;
+    if (synch_batch != NULL &&
+        sscanf(synch_batch, " SYNCHBATCH=%d", &max_synch_batch) == 1 &&
+        max_synch_batch > 0)
+    {
+        conn_info->max_synch_batch = max_synch_batch;
+    }
+
     /* Before it contained the protocol version we requested from the server,
      * now we put in the value that was negotiated. */
     conn_info->protocol = wanted_version;
@@ -316,6 +337,9 @@ int TLSTry(ConnectionInfo *conn_info)
     /* Initiate the TLS handshake over the already open TCP socket. */
     SSL_set_fd(conn_info->ssl, conn_info->sd);
 
+    /* Try to skip most of it by resuming the last session with this server. */
+    TLSSessionCacheRestore(conn_info);
+
     int ret = SSL_connect(conn_info->ssl);
     if (ret <= 0)
     {
@@ -324,6 +348,8 @@ int TLSTry(ConnectionInfo *conn_info)
         return -1;
     }
 
+    TLSSessionCacheNoteHandshake(conn_info);
+
     Log(LOG_LEVEL_VERBOSE, "TLS version negotiated: %8s; Cipher: %s,%s",
         SSL_get_version(conn_info->ssl),
         SSL_get_cipher_name(conn_info->ssl),
@@ -874,20 +874,16 @@ void TLSSetDefaultOptions(SSL_CTX *ssl_ctx, const char *min_version)
     }
 
 
-    /* No session resumption or renegotiation for now. */
+    /* No session resumption on renegotiation. */
     options |= SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION;
 
-#ifdef SSL_OP_NO_TICKET
-    /* Disable another way of resumption, session tickets (RFC 5077). */
-    options |= SSL_OP_NO_TICKET;
-#endif
-
     SSL_CTX_set_options(ssl_ctx, options);
 
 
-    /* Disable both server-side and client-side session caching, to
-       complement the previous options. Safe for now, might enable for
-       performance in the future. */
+    /* No internal session caching by default. Session resumption, including
+       session tickets (RFC 5077), is set up where it is wanted: see
+       ServerTLSInitialize() and tls_session_cache.c. Key verification
+       happens after every handshake, resumed or not. */
     SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_OFF);
 
 
@@ -36,6 +36,13 @@
 
 extern int CONNECTIONINFO_SSL_IDX;
 
+/* How many handshakes were abbreviated by resuming an earlier session. */
+typedef struct
+{
+    size_t handshakes;
+    size_t resumed;
+} TLSSessionStats;
+
 
 bool TLSGenericInitialize(void);
 int TLSVerifyCallback(X509_STORE_CTX *ctx, void *arg);
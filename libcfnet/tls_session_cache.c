@@ -0,0 +1,245 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+
+#include <platform.h>
+#include <tls_session_cache.h>
+
+#include <openssl/ssl.h>
+
+#include <alloc.h>                                             /* xmalloc */
+#include <logging.h>                                               /* Log */
+#include <mutex.h>                                          /* ThreadLock */
+#include <dbm_api.h>                                     /* OpenDB,ReadDB */
+#include <files_hashes.h>                          /* HashPubKey,HashPrintSafe */
+
+
+extern RSA *PUBKEY;                                       /* cf3globals.c */
+extern HashMethod CF_DEFAULT_DIGEST;                      /* cf3globals.c */
+
+/* Sessions are a couple of KB with the peer certificate; anything much
+ * larger in the database is not ours. */
+#define TLS_SESSION_MAX_SIZE (64 * 1024)
+
+
+/**
+ * Stored in front of the DER encoded session. The server remembers the
+ * certificate we presented, so a session is useless after our key changed.
+ */
+typedef struct
+{
+    char owner[CF_HOSTKEY_STRING_SIZE];
+} TLSSessionRecord;
+
+
+static pthread_mutex_t tls_session_stats_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+static TLSSessionStats TLS_SESSION_STATS = { 0 };               /* GLOBAL_X */
+
+
+/* Sessions are kept per server address and port, as seen on the socket. */
+static bool SessionCacheKey(const ConnectionInfo *conn_info,
+                            char *key, size_t key_size)
+{
+    struct sockaddr_storage ss;
+    socklen_t ss_len = sizeof(ss);
+    if (getpeername(conn_info->sd, (struct sockaddr *) &ss, &ss_len) == -1)
+    {
+        return false;
+    }
+
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    if (getnameinfo((struct sockaddr *) &ss, ss_len,
+                    host, sizeof(host), port, sizeof(port),
+                    NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+    {
+        return false;
+    }
+
+    int ret = snprintf(key, key_size, "%s %s", host, port);
+    return (ret > 0 && ret < key_size);
+}
+
+static void OwnKeyHash(char hash[CF_HOSTKEY_STRING_SIZE])
+{
+    unsigned char digest[EVP_MAX_MD_SIZE + 1];
+    HashPubKey(PUBKEY, digest, CF_DEFAULT_DIGEST);
+    HashPrintSafe(hash, CF_HOSTKEY_STRING_SIZE, digest,
+                  CF_DEFAULT_DIGEST, true);
+}
+
+/**
+ * Offer the session last negotiated with this server, if there is one that
+ * has not expired. Call between SSL_new() and SSL_connect().
+ */
+void TLSSessionCacheRestore(ConnectionInfo *conn_info)
+{
+    char key[NI_MAXHOST + NI_MAXSERV + 1];
+    if (PUBKEY == NULL || !SessionCacheKey(conn_info, key, sizeof(key)))
+    {
+        return;
+    }
+
+    CF_DB *db;
+    if (!OpenDB(&db, dbid_tls_sessions))
+    {
+        return;
+    }
+
+    int size = ValueSizeDB(db, key, strlen(key) + 1);
+    if (size <= (int) sizeof(TLSSessionRecord) || size > TLS_SESSION_MAX_SIZE)
+    {
+        CloseDB(db);
+        return;
+    }
+
+    unsigned char *value = xmalloc(size);
+    bool ok = ReadDB(db, key, value, size);
+    CloseDB(db);
+
+    if (!ok)
+    {
+        free(value);
+        return;
+    }
+
+    TLSSessionRecord *record = (TLSSessionRecord *) value;
+    record->owner[sizeof(record->owner) - 1] = '\0';
+
+    char own_hash[CF_HOSTKEY_STRING_SIZE];
+    OwnKeyHash(own_hash);
+    if (strcmp(record->owner, own_hash) != 0)
+    {
+        Log(LOG_LEVEL_DEBUG,
+            "Cached TLS session for '%s' belongs to another key, ignoring",
+            key);
+        free(value);
+        return;
+    }
+
+    const unsigned char *der = value + sizeof(TLSSessionRecord);
+    SSL_SESSION *session =
+        d2i_SSL_SESSION(NULL, &der, size - sizeof(TLSSessionRecord));
+    free(value);
+
+    if (session == NULL)
+    {
+        Log(LOG_LEVEL_DEBUG, "Cached TLS session for '%s' is corrupt", key);
+        return;
+    }
+
+    time_t expires = SSL_SESSION_get_time(session) +
+        SSL_SESSION_get_timeout(session);
+    if (expires > time(NULL))
+    {
+        Log(LOG_LEVEL_DEBUG, "Offering cached TLS session for '%s'", key);
+        SSL_set_session(conn_info->ssl, session);
+    }
+
+    SSL_SESSION_free(session);
+}
+
+/* Count the handshake just completed, and whether it resumed a session. */
+void TLSSessionCacheNoteHandshake(const ConnectionInfo *conn_info)
+{
+    bool resumed = (SSL_session_reused(conn_info->ssl) == 1);
+
+    ThreadLock(&tls_session_stats_lock);
+    TLS_SESSION_STATS.handshakes++;
+    if (resumed)
+    {
+        TLS_SESSION_STATS.resumed++;
+    }
+    ThreadUnlock(&tls_session_stats_lock);
+
+    Log(LOG_LEVEL_VERBOSE, "TLS handshake %s",
+        resumed ? "resumed a cached session" : "was a full one");
+}
+
+/**
+ * Remember the session of an established connection, after the server's
+ * key has been verified and it has accepted our identity.
+ */
+void TLSSessionCacheStore(const ConnectionInfo *conn_info)
+{
+    char key[NI_MAXHOST + NI_MAXSERV + 1];
+    if (PUBKEY == NULL || !SessionCacheKey(conn_info, key, sizeof(key)))
+    {
+        return;
+    }
+
+    /* With TLS 1.3 this is the latest ticket the server sent us. */
+    SSL_SESSION *session = SSL_get1_session(conn_info->ssl);
+    if (session == NULL)
+    {
+        return;
+    }
+
+    int der_size = i2d_SSL_SESSION(session, NULL);
+    if (der_size <= 0 ||
+        der_size > TLS_SESSION_MAX_SIZE - (int) sizeof(TLSSessionRecord))
+    {
+        SSL_SESSION_free(session);
+        return;
+    }
+
+    int size = sizeof(TLSSessionRecord) + der_size;
+    unsigned char *value = xcalloc(1, size);
+    OwnKeyHash(((TLSSessionRecord *) value)->owner);
+    unsigned char *der = value + sizeof(TLSSessionRecord);
+    i2d_SSL_SESSION(session, &der);
+    SSL_SESSION_free(session);
+
+    CF_DB *db;
+    if (OpenDB(&db, dbid_tls_sessions))
+    {
+        WriteDB(db, key, value, size);
+        CloseDB(db);
+    }
+
+    free(value);
+}
+
+/* Drop the session of a server we could not establish trust with. */
+void TLSSessionCacheForget(const ConnectionInfo *conn_info)
+{
+    char key[NI_MAXHOST + NI_MAXSERV + 1];
+    if (!SessionCacheKey(conn_info, key, sizeof(key)))
+    {
+        return;
+    }
+
+    CF_DB *db;
+    if (OpenDB(&db, dbid_tls_sessions))
+    {
+        DeleteDB(db, key);
+        CloseDB(db);
+    }
+}
+
+void TLSSessionCacheGetStats(TLSSessionStats *stats)
+{
+    ThreadLock(&tls_session_stats_lock);
+    *stats = TLS_SESSION_STATS;
+    ThreadUnlock(&tls_session_stats_lock);
+}
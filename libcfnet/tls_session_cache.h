@@ -0,0 +1,47 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+#ifndef CFENGINE_TLS_SESSION_CACHE_H
+#define CFENGINE_TLS_SESSION_CACHE_H
+
+
+#include <cfnet.h>                                       /* ConnectionInfo */
+#include <tls_generic.h>                                /* TLSSessionStats */
+
+
+/**
+ * Client side TLS session cache. The session negotiated with each server is
+ * kept in the tls_sessions database, so that the next connection (usually
+ * the next cf-agent run) resumes it instead of doing a full handshake with
+ * its RSA operations on both ends. The server key is still verified on
+ * every connection, against the certificate remembered in the session.
+ */
+
+void TLSSessionCacheRestore(ConnectionInfo *conn_info);
+void TLSSessionCacheNoteHandshake(const ConnectionInfo *conn_info);
+void TLSSessionCacheStore(const ConnectionInfo *conn_info);
+void TLSSessionCacheForget(const ConnectionInfo *conn_info);
+void TLSSessionCacheGetStats(TLSSessionStats *stats);
+
+
+#endif
@@ -421,6 +421,7 @@ typedef enum
     COMMON_CONTROL_TLS_MIN_VERSION,
     COMMON_CONTROL_PACKAGE_INVENTORY,
     COMMON_CONTROL_PACKAGE_MODULE,
+    COMMON_CONTROL_FUNCTION_CACHE_EXPIREAFTER,
     COMMON_CONTROL_MAX
 } CommonControl;
 
@@ -47,7 +47,6 @@
 int yylex(void);
 extern char *yytext;
 
-static int RelevantBundle(const char *agent, const char *blocktype);
 static bool LvalWantsBody(char *stype, char *lval);
 static SyntaxTypeMatch CheckSelection(const char *type, const char *name, const char *lval, Rval rval);
 static SyntaxTypeMatch CheckConstraint(const char *type, const char *lval, Rval rval, const PromiseTypeSyntax *ss);
@@ -252,7 +251,7 @@ aitem:                 IDSYNTAX  /* recipient of argument is never a literal */
 
 bundlebody:            body_begin
                        {
-                           if (RelevantBundle(CF_AGENTTYPES[P.agent_type], P.blocktype))
+                           if (ParserBundleIsRelevant(P.agent_type, P.blocktype))
                            {
                                INSTALL_SKIP = false;
                            }
@@ -1343,30 +1342,6 @@ static void fatal_yyerror(const char *s)
     exit(EXIT_FAILURE);
 }
 
-static int RelevantBundle(const char *agent, const char *blocktype)
-{
-    if ((strcmp(agent, CF_AGENTTYPES[AGENT_TYPE_COMMON]) == 0) || (strcmp(CF_COMMONC, blocktype) == 0))
-    {
-        return true;
-    }
-
-/* Here are some additional bundle types handled by cfAgent */
-
-    Item *ip = SplitString("edit_line,edit_xml", ',');
-
-    if (strcmp(agent, CF_AGENTTYPES[AGENT_TYPE_AGENT]) == 0)
-    {
-        if (IsItemIn(ip, blocktype))
-        {
-            DeleteItemList(ip);
-            return true;
-        }
-    }
-
-    DeleteItemList(ip);
-    return false;
-}
-
 static bool LvalWantsBody(char *stype, char *lval)
 {
     for (int i = 0; i < CF3_MODULES; i++)
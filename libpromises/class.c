@@ -23,43 +23,186 @@
 */
 #include <class.h>
 
-#include <map.h>
 #include <alloc.h>
 #include <string_lib.h> /* String*() */
-#include <regex.h>      /* CompileRegex,StringMatchFullWithPrecompiledRegex */
+#include <regex.h>      /* RegexCacheGet,StringMatchFullWithPrecompiledRegex */
 #include <files_names.h>
+#include <mutex.h>
 
 
-static void ClassDestroy(Class *cls);                /* forward declaration */
+/**
+ * Process-wide interning of fully qualified class names. Every (namespace,
+ * name) pair that is ever put in a ClassTable gets a dense integer ID, which
+ * is never reused. The tables are then plain arrays indexed by ID, so that
+ * looking a class up in the global table and in every bundle frame costs a
+ * single hash of its name, and no string formatting.
+ */
+
+static pthread_mutex_t class_ids_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char **CLASS_ID_NAMES = NULL;       /* "ns:name", indexed by ClassId */
+static unsigned int *CLASS_ID_HASHES = NULL;             /* indexed by ClassId */
+static size_t CLASS_ID_COUNT = 0;
+static size_t CLASS_ID_CAPACITY = 0;
 
-static void ClassDestroy_untyped(void *p)
+/* Open addressing with linear probing, CLASS_ID_NONE marks an empty slot. */
+static ClassId *CLASS_ID_SLOTS = NULL;
+static size_t CLASS_ID_SLOTS_SIZE = 0;                       /* power of 2 */
+
+/* Jenkins' one-at-a-time over "ns:name", like StringHash(). */
+static unsigned int ClassNameHash(const char *ns, const char *name)
 {
-    ClassDestroy(p);
+    unsigned int h = 0;
+    for (const unsigned char *p = (const unsigned char *) ns; *p != '\0'; p++)
+    {
+        h += *p;
+        h += (h << 10);
+        h ^= (h >> 6);
+    }
+
+    h += ':';
+    h += (h << 10);
+    h ^= (h >> 6);
+
+    for (const unsigned char *p = (const unsigned char *) name; *p != '\0'; p++)
+    {
+        h += *p;
+        h += (h << 10);
+        h ^= (h >> 6);
+    }
+
+    h += (h << 3);
+    h ^= (h >> 11);
+    h += (h << 15);
+    return h;
 }
 
+static bool ClassNameEqual(const char *fullname, const char *ns, const char *name)
+{
+    size_t ns_len = strlen(ns);
+    return (strncmp(fullname, ns, ns_len) == 0 &&
+            fullname[ns_len] == ':' &&
+            strcmp(fullname + ns_len + 1, name) == 0);
+}
 
-/**
-   Define ClassMap.
-   Key: a string which is always the fully qualified class name,
-        for example "default:127_0_0_1"
-*/
+/* Must be called with class_ids_mutex held. */
+static size_t ClassIdSlot(const char *ns, const char *name, unsigned int hash)
+{
+    size_t mask = CLASS_ID_SLOTS_SIZE - 1;
+    size_t slot = hash & mask;
+
+    while (CLASS_ID_SLOTS[slot] != CLASS_ID_NONE)
+    {
+        ClassId id = CLASS_ID_SLOTS[slot];
+        if (CLASS_ID_HASHES[id] == hash &&
+            ClassNameEqual(CLASS_ID_NAMES[id], ns, name))
+        {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+/* Must be called with class_ids_mutex held. */
+static void ClassIdSlotsGrow(void)
+{
+    size_t new_size = (CLASS_ID_SLOTS_SIZE == 0) ? 1024 : CLASS_ID_SLOTS_SIZE * 2;
+
+    free(CLASS_ID_SLOTS);
+    CLASS_ID_SLOTS = xmalloc(new_size * sizeof(ClassId));
+    CLASS_ID_SLOTS_SIZE = new_size;
+    for (size_t i = 0; i < new_size; i++)
+    {
+        CLASS_ID_SLOTS[i] = CLASS_ID_NONE;
+    }
+
+    for (ClassId id = 0; id < CLASS_ID_COUNT; id++)
+    {
+        size_t slot = CLASS_ID_HASHES[id] & (new_size - 1);
+        while (CLASS_ID_SLOTS[slot] != CLASS_ID_NONE)
+        {
+            slot = (slot + 1) & (new_size - 1);
+        }
+        CLASS_ID_SLOTS[slot] = id;
+    }
+}
+
+ClassId ClassIdFind(const char *ns, const char *name)
+{
+    assert(name != NULL);
+    if (ns == NULL)
+    {
+        ns = "default";
+    }
+
+    unsigned int hash = ClassNameHash(ns, name);
+    ClassId id = CLASS_ID_NONE;
+
+    ThreadLock(&class_ids_mutex);
+    if (CLASS_ID_SLOTS_SIZE > 0)
+    {
+        id = CLASS_ID_SLOTS[ClassIdSlot(ns, name, hash)];
+    }
+    ThreadUnlock(&class_ids_mutex);
+
+    return id;
+}
+
+ClassId ClassIdIntern(const char *ns, const char *name)
+{
+    assert(name != NULL);
+    if (ns == NULL)
+    {
+        ns = "default";
+    }
+
+    unsigned int hash = ClassNameHash(ns, name);
+
+    ThreadLock(&class_ids_mutex);
+
+    /* Keep the load factor under 1/2. */
+    if (2 * (CLASS_ID_COUNT + 1) > CLASS_ID_SLOTS_SIZE)
+    {
+        ClassIdSlotsGrow();
+    }
 
-TYPED_MAP_DECLARE(Class, char *, Class *)
+    size_t slot = ClassIdSlot(ns, name, hash);
+    ClassId id = CLASS_ID_SLOTS[slot];
+    if (id == CLASS_ID_NONE)
+    {
+        if (CLASS_ID_COUNT == CLASS_ID_CAPACITY)
+        {
+            CLASS_ID_CAPACITY = (CLASS_ID_CAPACITY == 0) ? 512 : CLASS_ID_CAPACITY * 2;
+            CLASS_ID_NAMES = xrealloc(CLASS_ID_NAMES,
+                                      CLASS_ID_CAPACITY * sizeof(char *));
+            CLASS_ID_HASHES = xrealloc(CLASS_ID_HASHES,
+                                       CLASS_ID_CAPACITY * sizeof(unsigned int));
+        }
+
+        id = CLASS_ID_COUNT++;
+        CLASS_ID_NAMES[id] = StringConcatenate(3, ns, ":", name);
+        CLASS_ID_HASHES[id] = hash;
+        CLASS_ID_SLOTS[slot] = id;
+    }
+
+    ThreadUnlock(&class_ids_mutex);
+    return id;
+}
 
-TYPED_MAP_DEFINE(Class, char *, Class *,
-                 StringHash_untyped,
-                 StringSafeEqual_untyped,
-                 free,
-                 ClassDestroy_untyped)
 
 struct ClassTable_
 {
-    ClassMap *classes;
+    Class **classes;                       /* indexed by ClassId, or NULL */
+    size_t capacity;
+    size_t count;
 };
 
 struct ClassTableIterator_
 {
-    MapIterator iter;
+    const ClassTable *table;
+    ClassId next;
     char *ns;
     bool is_hard;
     bool is_soft;
@@ -117,10 +260,7 @@ static void ClassDestroy(Class *cls)
 
 ClassTable *ClassTableNew(void)
 {
-    ClassTable *table = xmalloc(sizeof(*table));
-
-    table->classes = ClassMapNew();
-
+    ClassTable *table = xcalloc(1, sizeof(*table));
     return table;
 }
 
@@ -128,7 +268,8 @@ void ClassTableDestroy(ClassTable *table)
 {
     if (table)
     {
-        ClassMapDestroy(table->classes);
+        ClassTableClear(table);
+        free(table->classes);
         free(table);
     }
 }
@@ -149,42 +290,70 @@ bool ClassTablePut(ClassTable *table,
     Class *cls = xmalloc(sizeof(*cls));
     ClassInit(cls, ns, name, is_soft, scope, tags);
 
+    Log(LOG_LEVEL_DEBUG, "Setting %sclass: %s:%s",
+        is_soft ? "" : "hard ",
+        ns, cls->name);
+
     /* (cls->name != name) because canonification has happened. */
-    char *fullname = StringConcatenate(3, ns, ":", cls->name);
+    ClassId id = ClassIdIntern(ns, cls->name);
+    if (id >= table->capacity)
+    {
+        size_t new_capacity = (table->capacity == 0) ? 64 : table->capacity;
+        while (new_capacity <= id)
+        {
+            new_capacity *= 2;
+        }
 
-    Log(LOG_LEVEL_DEBUG, "Setting %sclass: %s",
-        is_soft ? "" : "hard ",
-        fullname);
+        table->classes = xrealloc(table->classes,
+                                  new_capacity * sizeof(Class *));
+        memset(table->classes + table->capacity, 0,
+               (new_capacity - table->capacity) * sizeof(Class *));
+        table->capacity = new_capacity;
+    }
+
+    bool replaced = (table->classes[id] != NULL);
+    if (replaced)
+    {
+        ClassDestroy(table->classes[id]);
+    }
+    else
+    {
+        table->count++;
+    }
 
-    return ClassMapInsert(table->classes, fullname, cls);
+    table->classes[id] = cls;
+    return replaced;
+}
+
+Class *ClassTableGetById(const ClassTable *table, ClassId id)
+{
+    return (id < table->capacity) ? table->classes[id] : NULL;
 }
 
 Class *ClassTableGet(const ClassTable *table, const char *ns, const char *name)
 {
-    if (ns == NULL)
+    if (table->count == 0)
     {
-        ns = "default";
+        return NULL;
     }
 
-    char fullname[ strlen(ns) + 1 + strlen(name) + 1 ];
-    xsnprintf(fullname, sizeof(fullname), "%s:%s", ns, name);
-
-    return ClassMapGet(table->classes, fullname);
+    return ClassTableGetById(table, ClassIdFind(ns, name));
 }
 
 Class *ClassTableMatch(const ClassTable *table, const char *regex)
 {
-    ClassTableIterator *it = ClassTableIteratorNew(table, NULL, true, true);
-    Class *cls = NULL;
-
-    pcre *pattern = CompileRegex(regex);
-    if (pattern == NULL)
+    CachedRegex *rx = RegexCacheGet(regex);
+    if (rx == NULL)
     {
         // TODO: perhaps pcre has can give more info on this error?
         Log(LOG_LEVEL_ERR, "Unable to pcre compile regex '%s'", regex);
         return false;
     }
 
+    pcre *pattern = CachedRegexPattern(rx);
+    ClassTableIterator *it = ClassTableIteratorNew(table, NULL, true, true);
+    Class *cls = NULL;
+
     while ((cls = ClassTableIteratorNext(it)))
     {
         bool matched;
@@ -205,7 +374,7 @@ Class *ClassTableMatch(const ClassTable *table, const char *regex)
         }
     }
 
-    pcre_free(pattern);
+    RegexCacheRelease(rx);
 
     ClassTableIteratorDestroy(it);
     return cls;
@@ -213,21 +382,35 @@ Class *ClassTableMatch(const ClassTable *table, const char *regex)
 
 bool ClassTableRemove(ClassTable *table, const char *ns, const char *name)
 {
-    if (ns == NULL)
+    if (table->count == 0)
     {
-        ns = "default";
+        return false;
     }
 
-    char fullname[ strlen(ns) + 1 + strlen(name) + 1 ];
-    xsnprintf(fullname, sizeof(fullname), "%s:%s", ns, name);
+    ClassId id = ClassIdFind(ns, name);
+    if (id >= table->capacity || table->classes[id] == NULL)
+    {
+        return false;
+    }
 
-    return ClassMapRemove(table->classes, fullname);
+    ClassDestroy(table->classes[id]);
+    table->classes[id] = NULL;
+    table->count--;
+    return true;
 }
 
 bool ClassTableClear(ClassTable *table)
 {
-    bool has_classes = (ClassMapSize(table->classes) > 0);
-    ClassMapClear(table->classes);
+    bool has_classes = (table->count > 0);
+    for (size_t i = 0; i < table->capacity && table->count > 0; i++)
+    {
+        if (table->classes[i] != NULL)
+        {
+            ClassDestroy(table->classes[i]);
+            table->classes[i] = NULL;
+            table->count--;
+        }
+    }
     return has_classes;
 }
 
@@ -238,7 +421,8 @@ ClassTableIterator *ClassTableIteratorNew(const ClassTable *table,
     ClassTableIterator *iter = xmalloc(sizeof(*iter));
 
     iter->ns = ns ? xstrdup(ns) : NULL;
-    iter->iter = MapIteratorInit(table->classes->impl);
+    iter->table = table;
+    iter->next = 0;
     iter->is_soft = is_soft;
     iter->is_hard = is_hard;
 
@@ -247,11 +431,15 @@ ClassTableIterator *ClassTableIteratorNew(const ClassTable *table,
 
 Class *ClassTableIteratorNext(ClassTableIterator *iter)
 {
-    MapKeyValue *keyvalue;
+    const ClassTable *table = iter->table;
 
-    while ((keyvalue = MapIteratorNext(&iter->iter)) != NULL)
+    while (iter->next < table->capacity)
     {
-        Class *cls = keyvalue->value;
+        Class *cls = table->classes[iter->next++];
+        if (cls == NULL)
+        {
+            continue;
+        }
 
         /* Make sure we never store "default" as namespace in the ClassTable,
          * instead we have always ns==NULL in that case. */
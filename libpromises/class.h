@@ -38,6 +38,16 @@ typedef struct
 } Class;
 
 
+/**
+ * Dense, process-wide ID of a fully qualified class name. ClassIdFind()
+ * returns CLASS_ID_NONE for names that were never put in any ClassTable.
+ */
+typedef size_t ClassId;
+#define CLASS_ID_NONE ((ClassId) -1)
+
+ClassId ClassIdFind(const char *ns, const char *name);
+ClassId ClassIdIntern(const char *ns, const char *name);
+
 typedef struct ClassTable_ ClassTable;
 typedef struct ClassTableIterator_ ClassTableIterator;
 
@@ -46,6 +56,7 @@ void ClassTableDestroy(ClassTable *table);
 
 bool ClassTablePut(ClassTable *table, const char *ns, const char *name, bool is_soft, ContextScope scope, const char *tags);
 Class *ClassTableGet(const ClassTable *table, const char *ns, const char *name);
+Class *ClassTableGetById(const ClassTable *table, ClassId id);
 Class *ClassTableMatch(const ClassTable *table, const char *regex);
 bool ClassTableRemove(ClassTable *table, const char *ns, const char *name);
 
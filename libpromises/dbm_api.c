@@ -33,11 +33,28 @@
 #include <misc_lib.h>
 #include <known_dirs.h>
 #include <string_lib.h>
+#include <map.h>
+#include <sequence.h>
 
 
 static int DBPathLock(const char *filename);
 static void DBPathUnLock(int fd);
 static void DBPathMoveBroken(const char *filename);
+static bool IsInDBReadSession(const DBHandle *handle);
+static void EndAllDBReadSessions(void);
+
+/*
+ * Opening an LMDB environment costs a file lock, several system calls and a
+ * transaction, so once opened environments stay open until the process
+ * exits, and the next OpenDB() only checks that the file is still the same.
+ * The other backends lock the database file while it is open, so they are
+ * closed as soon as the last user is gone, as before.
+ */
+#ifdef LMDB
+# define DB_KEEP_OPEN true
+#else
+# define DB_KEEP_OPEN false
+#endif
 
 struct DBHandle_
 {
@@ -52,6 +69,11 @@ struct DBHandle_
 
     int refcount;
 
+    /* Process that opened .priv, and the file it opened. */
+    pid_t open_pid;
+    dev_t open_dev;
+    ino_t open_ino;
+
     /* This lock protects initialization of .priv element, and .refcount manipulation */
     pthread_mutex_t lock;
 };
@@ -61,12 +83,6 @@ struct DBCursor_
     DBCursorPriv *cursor;
 };
 
-typedef struct dynamic_db_handles_
-{
-    DBHandle *handle;
-    struct dynamic_db_handles_ *next;
-} DynamicDBHandles;
-
 /******************************************************************************/
 
 /*
@@ -76,10 +92,16 @@ typedef struct dynamic_db_handles_
 static pthread_mutex_t db_handles_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP; /* GLOBAL_T */
 
 static DBHandle db_handles[dbid_max] = { { 0 } }; /* GLOBAL_X */
-static DynamicDBHandles *db_dynamic_handles;
+/* "<dbid>/<subname>" -> DBHandle of the sub-databases opened so far. */
+static Map *db_dynamic_handles = NULL; /* GLOBAL_X */
 
 static pthread_once_t db_shutdown_once = PTHREAD_ONCE_INIT; /* GLOBAL_T */
 
+/* Seq of the handles with a read session open in the calling thread, one
+ * entry per BeginDBReadSession(). */
+static pthread_key_t db_read_sessions_key; /* GLOBAL_T */
+static pthread_once_t db_read_sessions_once = PTHREAD_ONCE_INIT; /* GLOBAL_T */
+
 /******************************************************************************/
 
 static const char *const DB_PATHS_STATEDIR[] = {
@@ -105,7 +127,9 @@ static const char *const DB_PATHS_STATEDIR[] = {
     [dbid_agent_execution] = "nova_agent_execution",
     [dbid_bundles] = "bundles",
     [dbid_packages_installed] = "packages_installed",
-    [dbid_packages_updates] = "packages_updates"
+    [dbid_packages_updates] = "packages_updates",
+    [dbid_tls_sessions] = "cf_tls_sessions",
+    [dbid_function_cache] = "cf_function_cache"
 };
 
 /*
@@ -186,13 +210,14 @@ char *DBIdToPath(dbid id)
     return native_filename;
 }
 
-static
-bool IsSubHandle(DBHandle *handle, dbid id, const char *name)
+static void DBHandleInit(DBHandle *handle)
 {
-    char *sub_path = DBIdToSubPath(id, name);
-    bool result = StringSafeEqual(handle->filename, sub_path);
-    free(sub_path);
-    return result;
+    /* Initialize mutexes as error-checking ones. */
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+    pthread_mutex_init(&handle->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
 }
 
 static DBHandle *DBHandleGetSubDB(dbid id, const char *name)
@@ -202,34 +227,25 @@ static DBHandle *DBHandleGetSubDB(dbid id, const char *name)
         return NULL;
     }
 
-    DynamicDBHandles *handles_list = db_dynamic_handles;
-
-    while (handles_list)
+    if (db_dynamic_handles == NULL)
     {
-        if (IsSubHandle(handles_list->handle, id, name))
-        {
-            ThreadUnlock(&db_handles_lock);
-            return handles_list->handle;
-        }
-        handles_list = handles_list->next;
+        db_dynamic_handles = MapNew(StringHash_untyped, StringSafeEqual_untyped,
+                                    free, NULL);
     }
 
-    DBHandle *handle = xcalloc(1, sizeof(DBHandle));
-    handle->filename = DBIdToSubPath(id, name);
-    handle->subname = SafeStringDuplicate(name);
+    char key[strlen(name) + 16];
+    xsnprintf(key, sizeof(key), "%d/%s", (int) id, name);
 
-    /* Initialize mutexes as error-checking ones. */
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
-    pthread_mutex_init(&handle->lock, &attr);
-    pthread_mutexattr_destroy(&attr);
+    DBHandle *handle = MapGet(db_dynamic_handles, key);
+    if (handle == NULL)
+    {
+        handle = xcalloc(1, sizeof(DBHandle));
+        handle->filename = DBIdToSubPath(id, name);
+        handle->subname = SafeStringDuplicate(name);
+        DBHandleInit(handle);
 
-    /* Prepend handle to global list. */
-    handles_list = xcalloc(1, sizeof(DynamicDBHandles));
-    handles_list->handle = handle;
-    handles_list->next = db_dynamic_handles;
-    db_dynamic_handles = handles_list;
+        MapInsert(db_dynamic_handles, xstrdup(key), handle);
+    }
 
     ThreadUnlock(&db_handles_lock);
 
@@ -245,13 +261,7 @@ static DBHandle *DBHandleGet(int id)
         if (db_handles[id].filename == NULL)
         {
             db_handles[id].filename = DBIdToPath(id);
-
-            /* Initialize mutexes as error-checking ones. */
-            pthread_mutexattr_t attr;
-            pthread_mutexattr_init(&attr);
-            pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
-            pthread_mutex_init(&db_handles[id].lock, &attr);
-            pthread_mutexattr_destroy(&attr);
+            DBHandleInit(&db_handles[id]);
         }
 
         ThreadUnlock(&db_handles_lock);
@@ -264,6 +274,39 @@ static DBHandle *DBHandleGet(int id)
     }
 }
 
+/**
+ * Close the database of #handle, which nobody is using any more. Call with
+ * handle->lock held.
+ */
+static void DBHandleClosePriv(DBHandle *handle)
+{
+    /* An environment inherited across fork() belongs to the parent, closing
+     * it here could release the parent's locks. It is left alone. */
+    if (handle->open_pid == getpid())
+    {
+        DBPrivCloseDB(handle->priv);
+    }
+    handle->priv = NULL;
+}
+
+/**
+ * @return whether the database kept open in #handle can be used again: it
+ *         was opened by this process and the file was not removed or
+ *         replaced since, e.g. by a restore from backup.
+ */
+static bool DBHandleIsCurrent(const DBHandle *handle)
+{
+    if (handle->open_pid != getpid())
+    {
+        return false;
+    }
+
+    struct stat sb;
+    return (stat(handle->filename, &sb) == 0 &&
+            sb.st_dev == handle->open_dev &&
+            sb.st_ino == handle->open_ino);
+}
+
 static inline
 void CloseDBInstance(DBHandle *handle)
 {
@@ -295,6 +338,10 @@ void CloseDBInstance(DBHandle *handle)
     }
     else /* TODO: can we clean this up unconditionally ? */
     {
+        if (handle->priv != NULL)
+        {
+            DBHandleClosePriv(handle);
+        }
         free(handle->filename);
         free(handle->subname);
         handle->filename = NULL;
@@ -313,6 +360,8 @@ void CloseDBInstance(DBHandle *handle)
  **/
 void CloseAllDBExit()
 {
+    EndAllDBReadSessions();
+
     ThreadLock(&db_handles_lock);
 
     for (int i = 0; i < dbid_max; i++)
@@ -323,16 +372,19 @@ void CloseAllDBExit()
         }
     }
 
-    DynamicDBHandles *db_dynamic_handles_list = db_dynamic_handles;
-    while (db_dynamic_handles_list)
+    if (db_dynamic_handles != NULL)
     {
-        DBHandle *handle = db_dynamic_handles_list->handle;
-        CloseDBInstance(handle);
-        db_dynamic_handles_list = db_dynamic_handles_list->next;
-        free(handle);
+        MapIterator i = MapIteratorInit(db_dynamic_handles);
+        MapKeyValue *item;
+        while ((item = MapIteratorNext(&i)))
+        {
+            DBHandle *handle = item->value;
+            CloseDBInstance(handle);
+            free(handle);
+        }
+        MapDestroy(db_dynamic_handles);
+        db_dynamic_handles = NULL;
     }
-    free(db_dynamic_handles);
-    db_dynamic_handles = NULL;
 }
 
 static void RegisterShutdownHandler(void)
@@ -358,7 +410,13 @@ bool OpenDBInstance(DBHandle **dbp, dbid id, DBHandle *handle)
 {
     if (ThreadLock(&handle->lock))
     {
-        if (handle->refcount == 0)
+        if (handle->refcount == 0 && handle->priv != NULL &&
+            !DBHandleIsCurrent(handle))
+        {
+            DBHandleClosePriv(handle);
+        }
+
+        if (handle->priv == NULL)
         {
             int lock_fd = DBPathLock(handle->filename);
 
@@ -387,6 +445,17 @@ bool OpenDBInstance(DBHandle **dbp, dbid id, DBHandle *handle)
                     handle->priv = NULL;
                 }
             }
+
+            if (handle->priv)
+            {
+                struct stat sb;
+                handle->open_pid = getpid();
+                if (stat(handle->filename, &sb) == 0)
+                {
+                    handle->open_dev = sb.st_dev;
+                    handle->open_ino = sb.st_ino;
+                }
+            }
         }
 
         if (handle->priv)
@@ -433,7 +502,13 @@ void CloseDB(DBHandle *handle)
      * DB behaviour becomes erratic otherwise (CFE-1996). */
     if (ThreadLock(&handle->lock))
     {
-        DBPrivCommit(handle->priv);
+        /* A read session keeps its read transaction, but never a write
+         * transaction: that would keep all other writers waiting. */
+        if (!IsInDBReadSession(handle) ||
+            DBPrivHasWriteTransaction(handle->priv))
+        {
+            DBPrivCommit(handle->priv);
+        }
 
         if (handle->refcount < 1)
         {
@@ -444,9 +519,9 @@ void CloseDB(DBHandle *handle)
         else
         {
             handle->refcount--;
-            if (handle->refcount == 0)
+            if (handle->refcount == 0 && !DB_KEEP_OPEN)
             {
-                DBPrivCloseDB(handle->priv);
+                DBHandleClosePriv(handle);
             }
         }
 
@@ -454,6 +529,93 @@ void CloseDB(DBHandle *handle)
     }
 }
 
+/*****************************************************************************/
+
+static void DestroyDBReadSessions(void *ptr)
+{
+    UnexpectedError("Database read session still open when terminating thread");
+    SeqDestroy(ptr);
+}
+
+static void CreateDBReadSessionsKey(void)
+{
+    pthread_key_create(&db_read_sessions_key, &DestroyDBReadSessions);
+}
+
+static Seq *GetDBReadSessions(bool create)
+{
+    pthread_once(&db_read_sessions_once, &CreateDBReadSessionsKey);
+
+    Seq *sessions = pthread_getspecific(db_read_sessions_key);
+    if (sessions == NULL && create)
+    {
+        sessions = SeqNew(4, NULL);
+        pthread_setspecific(db_read_sessions_key, sessions);
+    }
+    return sessions;
+}
+
+static bool IsInDBReadSession(const DBHandle *handle)
+{
+    Seq *sessions = GetDBReadSessions(false);
+    if (sessions != NULL)
+    {
+        for (size_t i = 0; i < SeqLength(sessions); i++)
+        {
+            if (SeqAt(sessions, i) == handle)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool BeginDBReadSession(dbid id)
+{
+    DBHandle *handle;
+    if (!OpenDB(&handle, id))
+    {
+        return false;
+    }
+
+    /* The session keeps this reference until it ends. */
+    SeqAppend(GetDBReadSessions(true), handle);
+    return true;
+}
+
+void EndDBReadSession(dbid id)
+{
+    DBHandle *handle = DBHandleGet(id);
+    Seq *sessions = GetDBReadSessions(false);
+
+    size_t i = (sessions != NULL) ? SeqLength(sessions) : 0;
+    while (i > 0 && SeqAt(sessions, i - 1) != handle)
+    {
+        i--;
+    }
+    if (i == 0)
+    {
+        ProgrammingError("Ending a database read session that is not open: %s",
+                         handle->filename);
+    }
+    SeqRemove(sessions, i - 1);
+
+    /* Ends the transaction, unless an outer session is still open. */
+    CloseDB(handle);
+}
+
+static void EndAllDBReadSessions(void)
+{
+    Seq *sessions = GetDBReadSessions(false);
+    while (sessions != NULL && SeqLength(sessions) > 0)
+    {
+        DBHandle *handle = SeqAt(sessions, SeqLength(sessions) - 1);
+        SeqRemove(sessions, SeqLength(sessions) - 1);
+        CloseDB(handle);
+    }
+}
+
 bool CleanDB(DBHandle *handle)
 {
     bool ret = false;
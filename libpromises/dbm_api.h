@@ -52,6 +52,8 @@ typedef enum
     dbid_bundles,   // Deprecated
     dbid_packages_installed, //new package promise installed packages list
     dbid_packages_updates,   //new package promise list of available updates
+    dbid_tls_sessions,       // resumable TLS sessions, per server
+    dbid_function_cache,     // persistent function results, see fncall_cache.c
 
     dbid_max
 } dbid;
@@ -69,6 +71,23 @@ bool OpenSubDB(DBHandle **dbp, dbid id, const char *sub_name);
 bool CleanDB(DBHandle *handle);
 void CloseDB(CF_DB *dbp);
 
+/*
+ * Read sessions let a loop that does OpenDB()/ReadDB()/CloseDB() per key
+ * share one transaction: until the session ends, CloseDB() in the calling
+ * thread does not end the transaction, so the following reads reuse it.
+ *
+ * The reads see the database as it was when the first one was made;
+ * changes made by others in the meantime are only seen after the session.
+ * Writes made inside a session are still committed by the CloseDB() that
+ * follows them, so a session never keeps other writers waiting; the reads
+ * after such a write start a new transaction.
+ *
+ * Sessions nest. Only call EndDBReadSession() if BeginDBReadSession()
+ * succeeded.
+ */
+bool BeginDBReadSession(dbid id);
+void EndDBReadSession(dbid id);
+
 bool HasKeyDB(CF_DB *dbp, const char *key, int key_size);
 int ValueSizeDB(CF_DB *dbp, const char *key, int key_size);
 bool ReadComplexKeyDB(CF_DB *dbp, const char *key, int key_size, void *dest, int destSz);
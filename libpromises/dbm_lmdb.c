@@ -379,6 +379,12 @@ void DBPrivCommit(DBPriv *db)
     free(db_txn);
 }
 
+bool DBPrivHasWriteTransaction(DBPriv *db)
+{
+    DBTxn *db_txn = pthread_getspecific(db->txn_key);
+    return (db_txn != NULL && db_txn->txn != NULL && db_txn->rw_txn);
+}
+
 bool DBPrivHasKey(DBPriv *db, const void *key, int key_size)
 {
     MDB_val mkey, data;
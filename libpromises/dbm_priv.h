@@ -51,6 +51,8 @@ void DBPrivSetMaximumConcurrentTransactions(int max_txn);
 DBPriv *DBPrivOpenDB(const char *dbpath, dbid id);
 void DBPrivCloseDB(DBPriv *hdbp);
 void DBPrivCommit(DBPriv *hdbp);
+/* Whether the calling thread has a transaction open that may have written. */
+bool DBPrivHasWriteTransaction(DBPriv *hdbp);
 bool DBPrivClean(DBPriv *hdbp);
 
 bool DBPrivHasKey(DBPriv *db, const void *key, int key_size);
@@ -182,6 +182,11 @@ void DBPrivCommit(ARG_UNUSED DBPriv *db)
 {
 }
 
+bool DBPrivHasWriteTransaction(ARG_UNUSED DBPriv *db)
+{
+    return false;
+}
+
 bool DBPrivClean(DBPriv *db)
 {
     if (!Lock(db))
@@ -221,6 +221,11 @@ void DBPrivCommit(ARG_UNUSED DBPriv *db)
 {
 }
 
+bool DBPrivHasWriteTransaction(ARG_UNUSED DBPriv *db)
+{
+    return false;
+}
+
 bool DBPrivClean(DBPriv *db)
 {
     DBCursorPriv *cursor = DBPrivOpenCursor(db);
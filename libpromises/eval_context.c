@@ -49,13 +49,14 @@
 #include <printsize.h>
 #include <regex.h>
 #include <map.h>
+#include <mutex.h>
 #include <conversion.h>                               /* DataTypeIsIterable */
 
 
 /**
    Define FuncCacheMap.
-   Key:   an Rlist (which is linked list of Rvals)
-          listing all the argument of the function
+   Key:   an Rlist (which is linked list of Rvals) holding the function
+          name followed by all the arguments of the function
    Value: an Rval, the result of the function
  */
 
@@ -88,6 +89,11 @@ static bool EvalContextHeapContainsHard(const EvalContext *ctx, const char *name
 static bool EvalContextClassPut(EvalContext *ctx, const char *ns, const char *name, bool is_soft, ContextScope scope, const char *tags);
 static const char *EvalContextCurrentNamespace(const EvalContext *ctx);
 static ClassRef IDRefQualify(const EvalContext *ctx, const char *id);
+static void EvalContextInputsNoteClassRead(const EvalContext *ctx, const char *name);
+static void EvalContextInputsNoteClassChange(EvalContext *ctx, const char *name);
+static void EvalContextInputsNoteVariableRead(const EvalContext *ctx, const VarRef *ref);
+static void EvalContextInputsNoteVariableChange(EvalContext *ctx, const char *scope, const char *lval);
+static void EvalContextInputsNoteReset(EvalContext *ctx);
 
 /**
  * Every agent has only one EvalContext from process start to finish.
@@ -119,6 +125,7 @@ struct EvalContext_
     StringSet *promise_lock_cache;
     StringSet *dependency_handles;
     FuncCacheMap *function_cache;
+    time_t function_cache_ttl;          /* persistent cache, 0 is disabled */
 
     uid_t uid;
     uid_t gid;
@@ -136,6 +143,14 @@ struct EvalContext_
 
     /* List if all classes set during policy evaluation */
     StringSet *all_classes;
+
+    /* Promise inputs tracking, see EvalContextInputsRecordBegin() */
+    EvalInputs *inputs;                 /* innermost recording, or NULL */
+    bool inputs_tracking;               /* changes are noted from then on */
+    uint64_t inputs_generation;         /* bumped by every change */
+    uint64_t inputs_reset;              /* last change to everything */
+    Map *class_changes;                 /* name -> uint64_t generation */
+    Map *variable_changes;              /* lval -> uint64_t generation */
 };
 
 bool EvalContextGetSelectEndMatchEof(const EvalContext *ctx)
@@ -402,6 +417,7 @@ static void EvalContextStackFrameAddSoft(EvalContext *ctx, const char *context,
     }
 
     ClassTablePut(frame.classes, frame.owner->ns, context, true, CONTEXT_SCOPE_BUNDLE, tags);
+    EvalContextInputsNoteClassChange(ctx, context);
 
     if (!BundleAborted(ctx))
     {
@@ -420,44 +436,53 @@ static void EvalContextStackFrameAddSoft(EvalContext *ctx, const char *context,
 static ExpressionValue EvalTokenAsClass(const char *classname, void *param)
 {
     const EvalContext *ctx = param;
-    ClassRef ref = ClassRefParse(classname);
-    if (ClassRefIsQualified(ref))
+
+    /* Split "ns:name" on the stack, ClassRefParse() would allocate. */
+    const char *name = classname;
+    const char *ns = NULL;
+    const char *colon = strchr(classname, ':');
+    char ns_buf[(colon != NULL) ? (colon - classname + 1) : 1];
+    if (colon != NULL)
     {
-        if (strcmp(ref.ns, NamespaceDefault()) == 0)
-        {
-            if (EvalContextHeapContainsHard(ctx, ref.name))
-            {
-                ClassRefDestroy(ref);
-                return true;
-            }
-        }
+        memcpy(ns_buf, classname, colon - classname);
+        ns_buf[colon - classname] = '\0';
+        ns = ns_buf;
+        name = colon + 1;
     }
-    else
+
+    if (strcmp("any", name) == 0)
     {
-        if (EvalContextHeapContainsHard(ctx, ref.name))
+        return true;
+    }
+
+    EvalContextInputsNoteClassRead(ctx, name);
+
+    /* Hard classes only live in the default namespace. */
+    ClassId default_id = CLASS_ID_NONE;
+    if (ns == NULL || strcmp(ns, NamespaceDefault()) == 0)
+    {
+        default_id = ClassIdFind(NULL, name);
+        const Class *cls = ClassTableGetById(ctx->global_classes, default_id);
+        if (cls != NULL && !cls->is_soft)
         {
-            ClassRefDestroy(ref);
             return true;
         }
+    }
 
-        const char *ns = EvalContextCurrentNamespace(ctx);
-        if (ns)
-        {
-            ClassRefQualify(&ref, ns);
-        }
-        else
-        {
-            ClassRefQualify(&ref, NamespaceDefault());
-        }
+    if (ns == NULL)
+    {
+        ns = EvalContextCurrentNamespace(ctx);
     }
 
-    assert(ClassRefIsQualified(ref));
-    bool classy = (strcmp("any", ref.name) == 0 ||
-                   EvalContextHeapContainsSoft(ctx, ref.ns, ref.name) ||
-                   EvalContextStackFrameContainsSoft(ctx, ref.name));
+    ClassId id = (ns == NULL || strcmp(ns, NamespaceDefault()) == 0) ?
+        default_id : ClassIdFind(ns, name);
+    const Class *cls = ClassTableGetById(ctx->global_classes, id);
+    if (cls != NULL && cls->is_soft)
+    {
+        return true;
+    }
 
-    ClassRefDestroy(ref);
-    return classy; /* ExpressionValue is just an enum extending bool... */
+    return EvalContextStackFrameContainsSoft(ctx, name); /* ExpressionValue is just an enum extending bool... */
 }
 
 /**********************************************************************/
@@ -479,15 +504,68 @@ bool ClassCharIsWhitespace(char ch)
     return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
 }
 
-bool IsDefinedClass(const EvalContext *ctx, const char *context)
+/**
+ * Process-wide cache of parsed class expressions, keyed by the expression
+ * text. The same guards are evaluated for every promise on every pass, so
+ * each distinct expression is checked and parsed only once; evaluating it
+ * against the current classes is then just a walk over the cached tree.
+ * Expressions that fail the checks are cached too (with a NULL tree), so
+ * that the error is still reported every time they are evaluated.
+ */
+
+typedef enum
 {
-    ParseResult res;
+    CLASS_EXPRESSION_OK,
+    CLASS_EXPRESSION_WHITESPACE,
+    CLASS_EXPRESSION_UNPARSABLE,
+} ClassExpressionStatus;
 
-    if (!context)
+typedef struct
+{
+    ClassExpressionStatus status;
+    Expression *expr;
+} ClassExpression;
+
+/* Expressions with variables expanded into them need not repeat, so stop
+ * caching new ones rather than grow without bound. */
+#define CLASS_EXPRESSION_CACHE_MAX 8192
+
+static pthread_mutex_t class_expression_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Map *class_expression_cache = NULL;
+static ClassExpressionCacheStats class_expression_cache_stats = { 0 };
+
+static void ClassExpressionDestroy(void *p)
+{
+    ClassExpression *cexpr = p;
+    if (cexpr->expr != NULL)
     {
-        return true;
+        FreeExpression(cexpr->expr);
+    }
+    free(cexpr);
+}
+
+/* A single class name, possibly namespace-qualified, needs no parsing. */
+static bool IsBareClassName(const char *context)
+{
+    if (*context == '\0')
+    {
+        return false;
     }
 
+    for (const char *c = context; *c != '\0'; c++)
+    {
+        if (!isalnum((unsigned char) *c) && *c != '_' && *c != ':')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static ClassExpression *ClassExpressionCompile(const char *context)
+{
+    ClassExpression *cexpr = xcalloc(1, sizeof(ClassExpression));
+
     if (context_expression_whitespace_rx == NULL)
     {
         context_expression_whitespace_rx = CompileRegex(CFENGINE_REGEX_WHITESPACE_IN_CONTEXTS);
@@ -496,36 +574,142 @@ bool IsDefinedClass(const EvalContext *ctx, const char *context)
     if (context_expression_whitespace_rx == NULL)
     {
         Log(LOG_LEVEL_ERR, "The context expression whitespace regular expression could not be compiled, aborting.");
-        return false;
+        cexpr->status = CLASS_EXPRESSION_UNPARSABLE;
+        return cexpr;
     }
 
     if (StringMatchFullWithPrecompiledRegex(context_expression_whitespace_rx, context))
     {
-        Log(LOG_LEVEL_INFO, "class names can't be separated by whitespace without an intervening operator in expression '%s'", context);
-        return false;
+        cexpr->status = CLASS_EXPRESSION_WHITESPACE;
+        return cexpr;
     }
 
     Buffer *condensed = BufferNewFrom(context, strlen(context));
     BufferRewrite(condensed, &ClassCharIsWhitespace, true);
-    res = ParseExpression(BufferData(condensed), 0, BufferSize(condensed));
+    ParseResult res = ParseExpression(BufferData(condensed), 0, BufferSize(condensed));
     BufferDestroy(condensed);
 
-    if (!res.result)
+    cexpr->expr = res.result;
+    cexpr->status = (res.result != NULL) ?
+        CLASS_EXPRESSION_OK : CLASS_EXPRESSION_UNPARSABLE;
+    return cexpr;
+}
+
+/**
+ * @return the cached expression for #context, or a new one that the caller
+ *         owns (*owned set to true) if the cache is full.
+ */
+static const ClassExpression *ClassExpressionCacheGet(const char *context,
+                                                      bool *owned)
+{
+    *owned = false;
+
+    ThreadLock(&class_expression_cache_mutex);
+
+    if (class_expression_cache == NULL)
     {
-        Log(LOG_LEVEL_ERR, "Unable to parse class expression '%s'", context);
-        return false;
+        class_expression_cache = MapNew(StringHash_untyped,
+                                        StringSafeEqual_untyped,
+                                        free, ClassExpressionDestroy);
+    }
+
+    ClassExpression *cexpr = MapGet(class_expression_cache, context);
+    if (cexpr != NULL)
+    {
+        class_expression_cache_stats.hits++;
+        ThreadUnlock(&class_expression_cache_mutex);
+        return cexpr;
+    }
+
+    class_expression_cache_stats.misses++;
+
+    /* Compiled under the lock, which also guards the whitespace regex. */
+    cexpr = ClassExpressionCompile(context);
+    if (MapSize(class_expression_cache) < CLASS_EXPRESSION_CACHE_MAX)
+    {
+        MapInsert(class_expression_cache, xstrdup(context), cexpr);
+        class_expression_cache_stats.entries++;
     }
     else
     {
-        ExpressionValue r = EvalExpression(res.result,
+        *owned = true;
+    }
+
+    ThreadUnlock(&class_expression_cache_mutex);
+    return cexpr;
+}
+
+void ClassExpressionCacheGetStats(ClassExpressionCacheStats *stats)
+{
+    ThreadLock(&class_expression_cache_mutex);
+    *stats = class_expression_cache_stats;
+    ThreadUnlock(&class_expression_cache_mutex);
+}
+
+void ClassExpressionCacheClear(void)
+{
+    ThreadLock(&class_expression_cache_mutex);
+    if (class_expression_cache != NULL)
+    {
+        MapDestroy(class_expression_cache);
+        class_expression_cache = NULL;
+    }
+    class_expression_cache_stats.entries = 0;
+    ThreadUnlock(&class_expression_cache_mutex);
+}
+
+bool IsDefinedClass(const EvalContext *ctx, const char *context)
+{
+    if (!context)
+    {
+        return true;
+    }
+
+    if (IsBareClassName(context))
+    {
+        /* Same special names as EvalExpression(). */
+        if (strcmp(context, "true") == 0)
+        {
+            return true;
+        }
+        if (strcmp(context, "false") == 0)
+        {
+            return false;
+        }
+        return EvalTokenAsClass(context, (void *) ctx) == true;
+    }
+
+    bool owned;
+    const ClassExpression *cexpr = ClassExpressionCacheGet(context, &owned);
+    bool ret = false;
+
+    switch (cexpr->status)
+    {
+    case CLASS_EXPRESSION_WHITESPACE:
+        Log(LOG_LEVEL_INFO, "class names can't be separated by whitespace without an intervening operator in expression '%s'", context);
+        break;
+
+    case CLASS_EXPRESSION_UNPARSABLE:
+        Log(LOG_LEVEL_ERR, "Unable to parse class expression '%s'", context);
+        break;
+
+    case CLASS_EXPRESSION_OK:
+    {
+        ExpressionValue r = EvalExpression(cexpr->expr,
                                            &EvalTokenAsClass, &EvalVarRef,
                                            (void *)ctx); // controlled cast. None of these should modify EvalContext
 
-        FreeExpression(res.result);
-
         /* r is EvalResult which could be ERROR */
-        return r == true;
+        ret = (r == true);
+        break;
+    }
     }
+
+    if (owned)
+    {
+        ClassExpressionDestroy((ClassExpression *) cexpr);
+    }
+    return ret;
 }
 
 /**********************************************************************/
@@ -984,11 +1168,19 @@ void EvalContextDestroy(EvalContext *ctx)
         StringSetDestroy(ctx->promise_lock_cache);
 
         FuncCacheMapDestroy(ctx->function_cache);
+        ClassExpressionCacheClear();
+        ScalarTemplateCacheClear();
 
         FreePackagePromiseContext(ctx->package_promise_context);
 
         StringSetDestroy(ctx->all_classes);
 
+        if (ctx->inputs_tracking)
+        {
+            MapDestroy(ctx->class_changes);
+            MapDestroy(ctx->variable_changes);
+        }
+
         free(ctx);
     }
 }
@@ -1035,16 +1227,19 @@ static bool EvalContextStackFrameContainsSoft(const EvalContext *ctx, const char
 
 bool EvalContextHeapRemoveSoft(EvalContext *ctx, const char *ns, const char *name)
 {
+    EvalContextInputsNoteClassChange(ctx, name);
     return ClassTableRemove(ctx->global_classes, ns, name);
 }
 
 bool EvalContextHeapRemoveHard(EvalContext *ctx, const char *name)
 {
+    EvalContextInputsNoteClassChange(ctx, name);
     return ClassTableRemove(ctx->global_classes, NULL, name);
 }
 
 void EvalContextClear(EvalContext *ctx)
 {
+    EvalContextInputsNoteReset(ctx);
     ClassTableClear(ctx->global_classes);
     EvalContextDeleteIpAddresses(ctx);
     VariableTableClear(ctx->global_variables, NULL, NULL, NULL);
@@ -1225,6 +1420,7 @@ void EvalContextStackFrameRemoveSoft(EvalContext *ctx, const char *context)
     StackFrame *frame = LastStackFrameByType(ctx, STACK_FRAME_TYPE_BUNDLE);
     assert(frame);
 
+    EvalContextInputsNoteClassChange(ctx, context);
     ClassTableRemove(frame->data.bundle.classes, frame->data.bundle.owner->ns, context);
 }
 
@@ -1273,6 +1469,7 @@ void EvalContextStackPushBundleFrame(EvalContext *ctx, const Bundle *owner, cons
             Rval retval = ExpandPrivateRval(ctx, owner->ns, owner->name, var->rval.item, var->rval.type);
             RvalDestroy(var->rval);
             var->rval = retval;
+            EvalContextInputsNoteVariableChange(ctx, var->ref->scope, var->ref->lval);
         }
         VariableTableIteratorDestroy(iter);
     }
@@ -1441,6 +1638,7 @@ void EvalContextStackPopFrame(EvalContext *ctx)
             if (strcmp(bp->type, "edit_line") == 0 || strcmp(bp->type, "edit_xml") == 0)
             {
                 VariableTableClear(last_frame->data.bundle.vars, "default", "edit", NULL);
+                EvalContextInputsNoteVariableChange(ctx, "edit", NULL);
             }
         }
         break;
@@ -1470,6 +1668,8 @@ void EvalContextStackPopFrame(EvalContext *ctx)
 
 bool EvalContextClassRemove(EvalContext *ctx, const char *ns, const char *name)
 {
+    EvalContextInputsNoteClassChange(ctx, name);
+
     for (size_t i = 0; i < SeqLength(ctx->stack); i++)
     {
         StackFrame *frame = SeqAt(ctx->stack, i);
@@ -1593,6 +1793,8 @@ static bool EvalContextClassPut(EvalContext *ctx, const char *ns, const char *na
         ProgrammingError("Attempted to add a class without a set scope");
     }
 
+    EvalContextInputsNoteClassChange(ctx, name);
+
     if (!BundleAborted(ctx))
     {
         for (const Item *ip = ctx->heap_abort_current_bundle; ip != NULL; ip = ip->next)
@@ -1951,6 +2153,7 @@ static VariableTable *GetVariableTableForScope(const EvalContext *ctx,
 
 bool EvalContextVariableRemove(const EvalContext *ctx, const VarRef *ref)
 {
+    EvalContextInputsNoteVariableChange((EvalContext *) ctx, ref->scope, ref->lval);
     VariableTable *table = GetVariableTableForScope(ctx, ref->ns, ref->scope);
     return VariableTableRemove(table, ref);
 }
@@ -2029,6 +2232,24 @@ static void VarRefStackQualify(const EvalContext *ctx, VarRef *ref)
     }
 }
 
+static bool RvalValueEqual(Rval a, Rval b)
+{
+    if (a.type != b.type)
+    {
+        return false;
+    }
+
+    switch (a.type)
+    {
+    case RVAL_TYPE_SCALAR:
+        return strcmp(RvalScalarValue(a), RvalScalarValue(b)) == 0;
+    case RVAL_TYPE_LIST:
+        return RlistEqual(RvalRlistValue(a), RvalRlistValue(b));
+    default:
+        return false;           /* e.g. containers, treated as changed */
+    }
+}
+
 /*
  * Copies value, so you need to free your own copy afterwards.
  */
@@ -2064,7 +2285,21 @@ bool EvalContextVariablePut(EvalContext *ctx,
 
     VariableTable *table = GetVariableTableForScope(ctx, ref->ns, ref->scope);
     const Promise *pp = EvalContextStackCurrentPromise(ctx);
+
+    /* Re-evaluated promises mostly put the same value again. */
+    bool unchanged = false;
+    if (ctx->inputs_tracking)
+    {
+        const Variable *existing = VariableTableGet(table, ref);
+        unchanged = (existing != NULL && existing->type == type &&
+                     RvalValueEqual(existing->rval, rval));
+    }
+
     VariableTablePut(table, ref, &rval, type, tags, pp ? pp->org_pp : pp);
+    if (!unchanged)
+    {
+        EvalContextInputsNoteVariableChange(ctx, ref->scope, ref->lval);
+    }
     return true;
 }
 
@@ -2122,6 +2357,8 @@ static Variable *VariableResolve(const EvalContext *ctx, const VarRef *ref)
  */
 const void *EvalContextVariableGet(const EvalContext *ctx, const VarRef *ref, DataType *type_out)
 {
+    EvalContextInputsNoteVariableRead(ctx, ref);
+
     Variable *var = VariableResolve(ctx, ref);
     if (var)
     {
@@ -2210,11 +2447,22 @@ StringSet *EvalContextVariableTags(const EvalContext *ctx, const VarRef *ref)
 
 bool EvalContextVariableClearMatch(EvalContext *ctx)
 {
+    EvalContextInputsNoteVariableChange(ctx, "match", NULL);
     return VariableTableClear(ctx->match_variables, NULL, NULL, NULL);
 }
 
 VariableTableIterator *EvalContextVariableTableIteratorNew(const EvalContext *ctx, const char *ns, const char *scope, const char *lval)
 {
+    if (lval != NULL)
+    {
+        const VarRef ref = VarRefConst(ns, scope, lval);
+        EvalContextInputsNoteVariableRead(ctx, &ref);
+    }
+    else
+    {
+        EvalContextInputsMarkVolatile(ctx);
+    }
+
     VariableTable *table = scope ? GetVariableTableForScope(ctx, ns, scope) : ctx->global_variables;
     return table ? VariableTableIteratorNew(table, ns, scope, lval) : NULL;
 }
@@ -2223,6 +2471,7 @@ VariableTableIterator *EvalContextVariableTableIteratorNew(const EvalContext *ct
 VariableTableIterator *EvalContextVariableTableFromRefIteratorNew(const EvalContext *ctx, const VarRef *ref)
 {
     assert(ref);
+    EvalContextInputsNoteVariableRead(ctx, ref);
     VariableTable *table = ref->scope ? GetVariableTableForScope(ctx, ref->ns, ref->scope) : ctx->global_variables;
     return table ? VariableTableIteratorNewFromVarRef(table, ref) : NULL;
 }
@@ -2380,8 +2629,16 @@ void EvalContextPromiseLockCacheRemove(EvalContext *ctx, const char *key)
     StringSetRemove(ctx->promise_lock_cache, key);
 }
 
+/* Results of different functions with the same arguments must not mix. */
+static Rlist *FunctionCacheKey(const FnCall *fp, const Rlist *args)
+{
+    Rlist *key = RlistCopy(args);
+    RlistPrepend(&key, fp->name, RVAL_TYPE_SCALAR);
+    return key;
+}
+
 bool EvalContextFunctionCacheGet(const EvalContext *ctx,
-                                 const FnCall *fp ARG_UNUSED,
+                                 const FnCall *fp,
                                  const Rlist *args, Rval *rval_out)
 {
     if (!(ctx->eval_options & EVAL_OPTION_CACHE_SYSTEM_FUNCTIONS))
@@ -2389,7 +2646,10 @@ bool EvalContextFunctionCacheGet(const EvalContext *ctx,
         return false;
     }
 
-    Rval *rval = FuncCacheMapGet(ctx->function_cache, args);
+    Rlist *key = FunctionCacheKey(fp, args);
+    Rval *rval = FuncCacheMapGet(ctx->function_cache, key);
+    RlistDestroy(key);
+
     if (rval)
     {
         if (rval_out)
@@ -2405,7 +2665,7 @@ bool EvalContextFunctionCacheGet(const EvalContext *ctx,
 }
 
 void EvalContextFunctionCachePut(EvalContext *ctx,
-                                 const FnCall *fp ARG_UNUSED,
+                                 const FnCall *fp,
                                  const Rlist *args, const Rval *rval)
 {
     if (!(ctx->eval_options & EVAL_OPTION_CACHE_SYSTEM_FUNCTIONS))
@@ -2415,7 +2675,239 @@ void EvalContextFunctionCachePut(EvalContext *ctx,
 
     Rval *rval_copy = xmalloc(sizeof(Rval));
     *rval_copy = RvalCopy(*rval);
-    FuncCacheMapInsert(ctx->function_cache, RlistCopy(args), rval_copy);
+    FuncCacheMapInsert(ctx->function_cache, FunctionCacheKey(fp, args), rval_copy);
+}
+
+void EvalContextSetFunctionCacheTTL(EvalContext *ctx, time_t ttl)
+{
+    ctx->function_cache_ttl = ttl;
+}
+
+time_t EvalContextGetFunctionCacheTTL(const EvalContext *ctx)
+{
+    return ctx->function_cache_ttl;
+}
+
+/**********************************************************************/
+
+struct EvalInputs_
+{
+    StringSet *classes;
+    StringSet *variables;
+    uint64_t generation;        /* of the EvalContext when recording ended */
+    bool is_volatile;
+    EvalInputs *parent;
+};
+
+static pthread_mutex_t eval_inputs_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static EvalInputsStats eval_inputs_stats = { 0 };
+
+void EvalInputsDestroy(EvalInputs *inputs)
+{
+    if (inputs != NULL)
+    {
+        StringSetDestroy(inputs->classes);
+        StringSetDestroy(inputs->variables);
+        free(inputs);
+    }
+}
+
+/**
+ * Start recording the inputs of a promise. Recordings nest, but the outer
+ * one is then volatile: what a nested bundle read is not propagated up.
+ */
+void EvalContextInputsRecordBegin(EvalContext *ctx)
+{
+    EvalInputs *inputs = xcalloc(1, sizeof(EvalInputs));
+    inputs->classes = StringSetNew();
+    inputs->variables = StringSetNew();
+    inputs->parent = ctx->inputs;
+
+    if (inputs->parent != NULL)
+    {
+        inputs->parent->is_volatile = true;
+    }
+
+    if (!ctx->inputs_tracking)
+    {
+        ctx->inputs_tracking = true;
+        ctx->class_changes = MapNew(StringHash_untyped, StringSafeEqual_untyped,
+                                    free, free);
+        ctx->variable_changes = MapNew(StringHash_untyped, StringSafeEqual_untyped,
+                                       free, free);
+    }
+
+    ctx->inputs = inputs;
+}
+
+/**
+ * @return the inputs recorded since the matching
+ *         EvalContextInputsRecordBegin(), or NULL if they are volatile.
+ */
+EvalInputs *EvalContextInputsRecordEnd(EvalContext *ctx)
+{
+    EvalInputs *inputs = ctx->inputs;
+    assert(inputs != NULL);
+    ctx->inputs = inputs->parent;
+
+    if (inputs->is_volatile)
+    {
+        EvalInputsDestroy(inputs);
+        return NULL;
+    }
+
+    inputs->parent = NULL;
+    inputs->generation = ctx->inputs_generation;
+
+    ThreadLock(&eval_inputs_stats_mutex);
+    eval_inputs_stats.recorded++;
+    ThreadUnlock(&eval_inputs_stats_mutex);
+
+    return inputs;
+}
+
+void EvalContextInputsMarkVolatile(const EvalContext *ctx)
+{
+    if (ctx->inputs != NULL)
+    {
+        ctx->inputs->is_volatile = true;
+    }
+}
+
+static bool InputsChangedIn(const Map *changes, const StringSet *names,
+                            uint64_t generation)
+{
+    StringSetIterator it = StringSetIteratorInit((StringSet *) names);
+    const char *name;
+    while ((name = StringSetIteratorNext(&it)))
+    {
+        const uint64_t *changed = MapGet((Map *) changes, name);
+        if (changed != NULL && *changed > generation)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool EvalContextInputsChanged(const EvalContext *ctx, const EvalInputs *inputs)
+{
+    assert(ctx->inputs_tracking);
+
+    bool changed = (inputs->generation < ctx->inputs_reset ||
+                    InputsChangedIn(ctx->class_changes, inputs->classes,
+                                    inputs->generation) ||
+                    InputsChangedIn(ctx->variable_changes, inputs->variables,
+                                    inputs->generation));
+
+    ThreadLock(&eval_inputs_stats_mutex);
+    if (changed)
+    {
+        eval_inputs_stats.changed++;
+    }
+    else
+    {
+        eval_inputs_stats.unchanged++;
+    }
+    ThreadUnlock(&eval_inputs_stats_mutex);
+
+    return changed;
+}
+
+void EvalInputsGetStats(EvalInputsStats *stats)
+{
+    ThreadLock(&eval_inputs_stats_mutex);
+    *stats = eval_inputs_stats;
+    ThreadUnlock(&eval_inputs_stats_mutex);
+}
+
+static void NoteChange(EvalContext *ctx, Map *changes, const char *name)
+{
+    uint64_t *changed = MapGet(changes, name);
+    if (changed == NULL)
+    {
+        changed = xmalloc(sizeof(uint64_t));
+        MapInsert(changes, xstrdup(name), changed);
+    }
+    *changed = ++ctx->inputs_generation;
+}
+
+/* The scopes that live in promise and body frames are set up from the
+ * promise itself, anything they are computed from is tracked already. */
+static bool IsFrameLocalScope(const char *scope)
+{
+    return scope != NULL &&
+        (strcmp(scope, "this") == 0 || strcmp(scope, "body") == 0);
+}
+
+/* Match and edit variables are replaced wholesale, track them as one. */
+static const char *VariableInputName(const char *scope, const char *lval)
+{
+    if (scope != NULL)
+    {
+        if (strcmp(scope, "match") == 0)
+        {
+            return "match.";
+        }
+        if (strcmp(scope, "edit") == 0)
+        {
+            return "edit.";
+        }
+    }
+    return lval;
+}
+
+static void EvalContextInputsNoteClassRead(const EvalContext *ctx, const char *name)
+{
+    if (ctx->inputs != NULL && !StringSetContains(ctx->inputs->classes, name))
+    {
+        StringSetAdd(ctx->inputs->classes, xstrdup(name));
+    }
+}
+
+static void EvalContextInputsNoteClassChange(EvalContext *ctx, const char *name)
+{
+    if (!ctx->inputs_tracking)
+    {
+        return;
+    }
+
+    /* A promise that changes a class it has read might see something
+     * different if it were evaluated again. */
+    if (ctx->inputs != NULL && StringSetContains(ctx->inputs->classes, name))
+    {
+        ctx->inputs->is_volatile = true;
+    }
+
+    NoteChange(ctx, ctx->class_changes, name);
+}
+
+static void EvalContextInputsNoteVariableRead(const EvalContext *ctx, const VarRef *ref)
+{
+    if (ctx->inputs != NULL && !IsFrameLocalScope(ref->scope))
+    {
+        const char *name = VariableInputName(ref->scope, ref->lval);
+        if (!StringSetContains(ctx->inputs->variables, name))
+        {
+            StringSetAdd(ctx->inputs->variables, xstrdup(name));
+        }
+    }
+}
+
+static void EvalContextInputsNoteVariableChange(EvalContext *ctx, const char *scope, const char *lval)
+{
+    if (ctx->inputs_tracking && !IsFrameLocalScope(scope))
+    {
+        NoteChange(ctx, ctx->variable_changes, VariableInputName(scope, lval));
+    }
+}
+
+static void EvalContextInputsNoteReset(EvalContext *ctx)
+{
+    if (ctx->inputs_tracking)
+    {
+        ctx->inputs_reset = ++ctx->inputs_generation;
+    }
 }
 
 /* cfPS and associated machinery */
@@ -2672,17 +3164,19 @@ static void DoSummarizeTransaction(EvalContext *ctx, PromiseResult status, const
 }
 
 void NotifyDependantPromises(EvalContext *ctx, const Promise *pp, PromiseResult result)
+{
+    NotifyDependantHandle(ctx, PromiseGetHandle(pp), result);
+}
+
+void NotifyDependantHandle(EvalContext *ctx, const char *handle, PromiseResult result)
 {
     switch (result)
     {
     case PROMISE_RESULT_CHANGE:
     case PROMISE_RESULT_NOOP:
+        if (handle)
         {
-            const char *handle = PromiseGetHandle(pp);
-            if (handle)
-            {
-                StringSetAdd(ctx->dependency_handles, xstrdup(handle));
-            }
+            StringSetAdd(ctx->dependency_handles, xstrdup(handle));
         }
         break;
 
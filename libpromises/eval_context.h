@@ -174,6 +174,37 @@ void EvalContextPromiseLockCachePut(EvalContext *ctx, const char *key);
 void EvalContextPromiseLockCacheRemove(EvalContext *ctx, const char *key);
 bool EvalContextFunctionCacheGet(const EvalContext *ctx, const FnCall *fp, const Rlist *args, Rval *rval_out);
 void EvalContextFunctionCachePut(EvalContext *ctx, const FnCall *fp, const Rlist *args, const Rval *rval);
+void EvalContextSetFunctionCacheTTL(EvalContext *ctx, time_t ttl);
+time_t EvalContextGetFunctionCacheTTL(const EvalContext *ctx);
+
+/**
+ * The classes and variables a promise read while it was evaluated, recorded
+ * between EvalContextInputsRecordBegin() and EvalContextInputsRecordEnd().
+ * As long as EvalContextInputsChanged() says none of them has changed since,
+ * evaluating the promise again would read the same values and do nothing
+ * new, so later passes can skip it.
+ *
+ * Names are tracked without namespace or scope, which can only make
+ * promises look changed more often than they are. Promises that read state
+ * not tracked here (non-cached functions, nested bundles) are volatile, and
+ * EvalContextInputsRecordEnd() returns NULL for them.
+ */
+typedef struct EvalInputs_ EvalInputs;
+
+void EvalContextInputsRecordBegin(EvalContext *ctx);
+EvalInputs *EvalContextInputsRecordEnd(EvalContext *ctx);
+void EvalContextInputsMarkVolatile(const EvalContext *ctx);
+bool EvalContextInputsChanged(const EvalContext *ctx, const EvalInputs *inputs);
+void EvalInputsDestroy(EvalInputs *inputs);
+
+typedef struct
+{
+    size_t recorded;
+    size_t unchanged;
+    size_t changed;
+} EvalInputsStats;
+
+void EvalInputsGetStats(EvalInputsStats *stats);
 
 const void  *EvalContextVariableControlCommonGet(const EvalContext *ctx, CommonControl lval);
 
@@ -200,6 +231,16 @@ Seq *EvalContextResolveBodyExpression(const EvalContext *ctx, const Policy *poli
 /* - Parsing/evaluating expressions - */
 void ValidateClassSyntax(const char *str);
 bool IsDefinedClass(const EvalContext *ctx, const char *context);
+
+typedef struct
+{
+    size_t hits;
+    size_t misses;
+    size_t entries;
+} ClassExpressionCacheStats;
+
+void ClassExpressionCacheGetStats(ClassExpressionCacheStats *stats);
+void ClassExpressionCacheClear(void);
 StringSet *ClassesMatching(const EvalContext *ctx, ClassTableIterator *iter, const char* regex, const Rlist *tags, bool first_only);
 
 bool EvalProcessResult(const char *process_result, StringSet *proc_attr);
@@ -225,6 +266,7 @@ void EvalContextSetLaunchDirectory(EvalContext *ctx, const char *path);
 
 bool Abort(EvalContext *ctx);
 void NotifyDependantPromises(EvalContext *ctx, const Promise *pp, PromiseResult result);
+void NotifyDependantHandle(EvalContext *ctx, const char *handle, PromiseResult result);
 bool MissingDependencies(EvalContext *ctx, const Promise *pp);
 void cfPS(EvalContext *ctx, LogLevel level, PromiseResult status, const Promise *pp, Attributes attr, const char *fmt, ...) FUNC_ATTR_PRINTF(6, 7);
 
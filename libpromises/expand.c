@@ -42,6 +42,8 @@
 #include <string_lib.h>
 #include <conversion.h>
 #include <verify_classes.h>
+#include <map.h>
+#include <mutex.h>
 
 
 /**
@@ -417,25 +419,75 @@ Rval ExpandBundleReference(EvalContext *ctx,
 }
 
 /**
- * Expand a #string into Buffer #out, returning the pointer to the string
- * itself, inside the Buffer #out. If #out is NULL then the buffer will be
- * created and destroyed internally.
- *
- * @retval NULL something went wrong
+ * Scalar templates: ExpandScalar() scans each distinct string once, into a
+ * list of literal segments and variable reference slots, and keeps that in a
+ * process-wide cache keyed by the string. Expanding is then a walk over the
+ * segments, looking up pre-parsed references.
  */
-char *ExpandScalar(const EvalContext *ctx, const char *ns, const char *scope,
-                   const char *string, Buffer *out)
+
+typedef struct ScalarTemplate_ ScalarTemplate;
+
+typedef struct
 {
-    bool out_belongs_to_us = false;
+    char *text;            /* literal text, or the reference between $( ) */
+    size_t len;
+    bool is_reference;
+    char bracket;                                          /* '(' or '{' */
+    ScalarTemplate *nested;      /* the reference contains references */
+    VarRef *ref;       /* the reference can be looked up, without defaults */
+} ScalarSegment;
+
+struct ScalarTemplate_
+{
+    ScalarSegment *segments;
+    size_t num_segments;
+};
 
-    if (out == NULL)
+/* Strings with variables expanded into them need not repeat, so stop
+ * caching new ones rather than grow without bound. */
+#define SCALAR_TEMPLATE_CACHE_MAX 16384
+
+static pthread_mutex_t scalar_template_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Map *scalar_template_cache = NULL;
+static ScalarTemplateCacheStats scalar_template_cache_stats = { 0 };
+
+static void ScalarTemplateDestroy(ScalarTemplate *template)
+{
+    if (template != NULL)
     {
-        out               = BufferNew();
-        out_belongs_to_us = true;
+        for (size_t i = 0; i < template->num_segments; i++)
+        {
+            free(template->segments[i].text);
+            ScalarTemplateDestroy(template->segments[i].nested);
+            VarRefDestroy(template->segments[i].ref);
+        }
+        free(template->segments);
+        free(template);
     }
+}
 
-    assert(string != NULL);
-    assert(out != NULL);
+static void ScalarTemplateDestroy_untyped(void *template)
+{
+    ScalarTemplateDestroy(template);
+}
+
+static ScalarSegment *ScalarTemplateAppend(ScalarTemplate *template,
+                                           const Buffer *text)
+{
+    template->segments = xrealloc(template->segments,
+                                  (template->num_segments + 1) * sizeof(ScalarSegment));
+    ScalarSegment *segment = &template->segments[template->num_segments++];
+
+    memset(segment, 0, sizeof(*segment));
+    segment->text = xstrndup(BufferData(text), BufferSize(text));
+    segment->len = BufferSize(text);
+    return segment;
+}
+
+/* Scans #string the same way ExpandScalar() always did. */
+static ScalarTemplate *ScalarTemplateCompile(const char *string)
+{
+    ScalarTemplate *template = xcalloc(1, sizeof(ScalarTemplate));
     Buffer *current_item = BufferNew();
 
     for (const char *sp = string; *sp != '\0'; sp++)
@@ -443,7 +495,10 @@ char *ExpandScalar(const EvalContext *ctx, const char *ns, const char *scope,
         BufferClear(current_item);
         ExtractScalarPrefix(current_item, sp, strlen(sp));
 
-        BufferAppend(out, BufferData(current_item), BufferSize(current_item));
+        if (BufferSize(current_item) > 0)
+        {
+            ScalarTemplateAppend(template, current_item);
+        }
         sp += BufferSize(current_item);
         if (*sp == '\0')
         {
@@ -455,59 +510,254 @@ char *ExpandScalar(const EvalContext *ctx, const char *ns, const char *scope,
         ExtractScalarReference(current_item,  sp, strlen(sp), true);
         sp += BufferSize(current_item) + 2;
 
-        if (IsCf3VarString(BufferData(current_item)))
+        /* An unterminated "$(" at the very end: don't run past it. */
+        if (*sp == '\0')
         {
-            Buffer *temp = BufferCopy(current_item);
-            BufferClear(current_item);
-            ExpandScalar(ctx, ns, scope, BufferData(temp), current_item);
-            BufferDestroy(temp);
+            sp--;
         }
 
-        if (!IsExpandable(BufferData(current_item)))
+        ScalarSegment *segment = ScalarTemplateAppend(template, current_item);
+        segment->is_reference = true;
+        segment->bracket = varstring;
+
+        if (IsCf3VarString(segment->text))
         {
-            VarRef *ref = VarRefParseFromNamespaceAndScope(
-                BufferData(current_item),
-                ns, scope, CF_NS, '.');
-            DataType value_type;
-            const void *value = EvalContextVariableGet(ctx, ref, &value_type);
-            VarRefDestroy(ref);
+            segment->nested = ScalarTemplateCompile(segment->text);
+        }
+        else if (!IsExpandable(segment->text))
+        {
+            segment->ref = VarRefParseFromNamespaceAndScope(segment->text,
+                                                            NULL, NULL,
+                                                            CF_NS, '.');
+        }
+    }
 
-            switch (DataTypeToRvalType(value_type))
-            {
-            case RVAL_TYPE_SCALAR:
-                assert(value != NULL);
-                BufferAppendString(out, value);
-                continue;
-                break;
+    BufferDestroy(current_item);
+    return template;
+}
 
-            case RVAL_TYPE_CONTAINER:
-            {
-                assert(value != NULL);
-                const JsonElement *jvalue = value;      /* instead of casts */
-                if (JsonGetElementType(jvalue) == JSON_ELEMENT_TYPE_PRIMITIVE)
-                {
-                    BufferAppendString(out, JsonPrimitiveGetAsString(jvalue));
-                    continue;
-                }
-                break;
-            }
-            default:
-                /* TODO Log() */
-                break;
-            }
+/**
+ * @return the cached template for #string, or a new one that the caller
+ *         owns (*owned set to true) if the cache is full.
+ */
+static const ScalarTemplate *ScalarTemplateGet(const char *string, bool *owned)
+{
+    *owned = false;
+
+    ThreadLock(&scalar_template_cache_mutex);
+
+    if (scalar_template_cache == NULL)
+    {
+        scalar_template_cache = MapNew(StringHash_untyped,
+                                       StringSafeEqual_untyped,
+                                       free, ScalarTemplateDestroy_untyped);
+    }
+
+    ScalarTemplate *template = MapGet(scalar_template_cache, string);
+    if (template != NULL)
+    {
+        scalar_template_cache_stats.hits++;
+        ThreadUnlock(&scalar_template_cache_mutex);
+        return template;
+    }
+
+    scalar_template_cache_stats.misses++;
+    ThreadUnlock(&scalar_template_cache_mutex);
+
+    template = ScalarTemplateCompile(string);
+
+    ThreadLock(&scalar_template_cache_mutex);
+    if (MapHasKey(scalar_template_cache, string))
+    {
+        /* Somebody else compiled it meanwhile. */
+        *owned = true;
+    }
+    else if (MapSize(scalar_template_cache) < SCALAR_TEMPLATE_CACHE_MAX)
+    {
+        MapInsert(scalar_template_cache, xstrdup(string), template);
+        scalar_template_cache_stats.entries++;
+    }
+    else
+    {
+        *owned = true;
+    }
+    ThreadUnlock(&scalar_template_cache_mutex);
+
+    return template;
+}
+
+void ScalarTemplateCacheGetStats(ScalarTemplateCacheStats *stats)
+{
+    ThreadLock(&scalar_template_cache_mutex);
+    *stats = scalar_template_cache_stats;
+    ThreadUnlock(&scalar_template_cache_mutex);
+}
+
+void ScalarTemplateCacheClear(void)
+{
+    ThreadLock(&scalar_template_cache_mutex);
+    if (scalar_template_cache != NULL)
+    {
+        MapDestroy(scalar_template_cache);
+        scalar_template_cache = NULL;
+    }
+    scalar_template_cache_stats.entries = 0;
+    ThreadUnlock(&scalar_template_cache_mutex);
+}
+
+/**
+ * Append the value of #ref to #out.
+ *
+ * @return false if it has no scalar value
+ */
+static bool ExpandScalarReference(const EvalContext *ctx, const VarRef *ref,
+                                  Buffer *out)
+{
+    DataType value_type;
+    const void *value = EvalContextVariableGet(ctx, ref, &value_type);
+
+    switch (DataTypeToRvalType(value_type))
+    {
+    case RVAL_TYPE_SCALAR:
+        assert(value != NULL);
+        BufferAppendString(out, value);
+        return true;
+
+    case RVAL_TYPE_CONTAINER:
+    {
+        assert(value != NULL);
+        const JsonElement *jvalue = value;      /* instead of casts */
+        if (JsonGetElementType(jvalue) == JSON_ELEMENT_TYPE_PRIMITIVE)
+        {
+            BufferAppendString(out, JsonPrimitiveGetAsString(jvalue));
+            return true;
         }
+        return false;
+    }
+    default:
+        /* TODO Log() */
+        return false;
+    }
+}
+
+/**
+ * Append the value of the reference #name, itself the expansion of a nested
+ * reference like the "a[$(i)]" in $(a[$(i)]), to #out.
+ *
+ * @return false if it has no scalar value
+ */
+static bool ExpandScalarNestedReference(const EvalContext *ctx,
+                                        const char *ns, const char *scope,
+                                        const Buffer *name, Buffer *out)
+{
+    if (IsExpandable(BufferData(name)))
+    {
+        return false;
+    }
+
+    /* Parse the reference on the stack when it fits. */
+    char name_copy[CF_MAXVARSIZE];
+    char *indices[8];
+    VarRef local_ref;
+    if (BufferSize(name) < sizeof(name_copy))
+    {
+        memcpy(name_copy, BufferData(name), BufferSize(name) + 1);
+        if (VarRefParseInPlace(name_copy, ns, scope, indices,
+                               sizeof(indices) / sizeof(indices[0]),
+                               &local_ref))
+        {
+            return ExpandScalarReference(ctx, &local_ref, out);
+        }
+    }
 
-        if (varstring == '{')
+    VarRef *ref = VarRefParseFromNamespaceAndScope(BufferData(name), ns, scope,
+                                                   CF_NS, '.');
+    bool expanded = ExpandScalarReference(ctx, ref, out);
+    VarRefDestroy(ref);
+    return expanded;
+}
+
+static void ScalarTemplateExpand(const EvalContext *ctx,
+                                 const char *ns, const char *scope,
+                                 const ScalarTemplate *template, Buffer *out)
+{
+    for (size_t i = 0; i < template->num_segments; i++)
+    {
+        const ScalarSegment *segment = &template->segments[i];
+        const char *format = (segment->bracket == '{') ? "${%s}" : "$(%s)";
+
+        if (!segment->is_reference)
+        {
+            BufferAppend(out, segment->text, segment->len);
+        }
+        else if (segment->nested != NULL)
         {
-            BufferAppendF(out, "${%s}", BufferData(current_item));
+            Buffer *name = BufferNew();
+            ScalarTemplateExpand(ctx, ns, scope, segment->nested, name);
+            if (!ExpandScalarNestedReference(ctx, ns, scope, name, out))
+            {
+                BufferAppendF(out, format, BufferData(name));
+            }
+            BufferDestroy(name);
         }
         else
         {
-            BufferAppendF(out, "$(%s)", BufferData(current_item));
+            bool expanded = false;
+            if (segment->ref != NULL)
+            {
+                VarRef ref = VarRefConstInScope(segment->ref, ns, scope);
+                expanded = ExpandScalarReference(ctx, &ref, out);
+            }
+            if (!expanded)
+            {
+                BufferAppendF(out, format, segment->text);
+            }
         }
     }
+}
 
-    BufferDestroy(current_item);
+/**
+ * Expand a #string into Buffer #out, returning the pointer to the string
+ * itself, inside the Buffer #out. If #out is NULL then the buffer will be
+ * created and destroyed internally.
+ *
+ * @retval NULL something went wrong
+ */
+char *ExpandScalar(const EvalContext *ctx, const char *ns, const char *scope,
+                   const char *string, Buffer *out)
+{
+    bool out_belongs_to_us = false;
+
+    if (out == NULL)
+    {
+        out               = BufferNew();
+        out_belongs_to_us = true;
+    }
+
+    assert(string != NULL);
+    assert(out != NULL);
+
+    /* Nothing to expand, nothing worth caching. */
+    const char *dollar = strchr(string, '$');
+    while (dollar != NULL && dollar[1] != '(' && dollar[1] != '{')
+    {
+        dollar = strchr(dollar + 1, '$');
+    }
+
+    if (dollar == NULL)
+    {
+        BufferAppendString(out, string);
+    }
+    else
+    {
+        bool owned;
+        const ScalarTemplate *template = ScalarTemplateGet(string, &owned);
+        ScalarTemplateExpand(ctx, ns, scope, template, out);
+        if (owned)
+        {
+            ScalarTemplateDestroy((ScalarTemplate *) template);
+        }
+    }
 
     LogDebug(LOG_MOD_EXPAND, "ExpandScalar( %s : %s . %s )  =>  %s",
              SAFENULL(ns), SAFENULL(scope), string, BufferData(out));
@@ -691,6 +941,18 @@ ProtocolVersion ProtocolVersionParse(const char *s)
     }
 }
 
+static void SetFunctionCacheTTL(EvalContext *ctx, const char *value)
+{
+    long minutes = IntFromString(value);
+    if (minutes == CF_NOINT || minutes < 0)
+    {
+        minutes = 0;
+    }
+
+    Log(LOG_LEVEL_VERBOSE, "SET function_cache_expireafter %ld", minutes);
+    EvalContextSetFunctionCacheTTL(ctx, minutes * SECONDS_PER_MINUTE);
+}
+
 /**
  * Evaluate the relevant control body, and set the
  * relevant fields in #ctx and #config.
@@ -836,6 +1098,11 @@ static void ResolveControlBody(EvalContext *ctx, GenericAgentConfig *config,
                                      cache_system_functions);
         }
 
+        if (strcmp(lval, CFG_CONTROLBODY[COMMON_CONTROL_FUNCTION_CACHE_EXPIREAFTER].lval) == 0)
+        {
+            SetFunctionCacheTTL(ctx, RvalScalarValue(evaluated_rval));
+        }
+
         if (strcmp(lval, CFG_CONTROLBODY[COMMON_CONTROL_PROTOCOL_VERSION].lval) == 0)
         {
             config->protocol_version = ProtocolVersionParse(
@@ -919,9 +1186,40 @@ static void ResolvePackageManagerBody(EvalContext *ctx, const Body *pm_body)
     AddPackageModuleToContext(ctx, new_manager);
 }
 
+/**
+ * The pre-eval passes below already call most of the expensive functions,
+ * so the persistent function cache has to be set up before them. A literal
+ * value is taken straight from body common control; one that needs
+ * expansion only takes effect once the control body is resolved.
+ */
+static void PreResolveFunctionCacheTTL(EvalContext *ctx, const Policy *policy)
+{
+    Body *control = PolicyGetBody(policy, NULL, "common", "control");
+    if (control == NULL)
+    {
+        return;
+    }
+
+    const char *lval =
+        CFG_CONTROLBODY[COMMON_CONTROL_FUNCTION_CACHE_EXPIREAFTER].lval;
+    for (size_t i = 0; i < SeqLength(control->conlist); i++)
+    {
+        const Constraint *cp = SeqAt(control->conlist, i);
+        if (strcmp(cp->lval, lval) == 0 &&
+            strcmp(cp->classes, "any") == 0 &&
+            cp->rval.type == RVAL_TYPE_SCALAR &&
+            !IsExpandable(RvalScalarValue(cp->rval)))
+        {
+            SetFunctionCacheTTL(ctx, RvalScalarValue(cp->rval));
+        }
+    }
+}
+
 void PolicyResolve(EvalContext *ctx, const Policy *policy,
                    GenericAgentConfig *config)
 {
+    PreResolveFunctionCacheTTL(ctx, policy);
+
     /* PRE-EVAL: common bundles: classes,vars. */
     for (size_t i = 0; i < SeqLength(policy->bundles); i++)
     {
@@ -41,6 +41,16 @@ bool IsExpandable(const char *str);
 
 char *ExpandScalar(const EvalContext *ctx, const char *ns, const char *scope,
                    const char *string, Buffer *out);
+
+typedef struct
+{
+    size_t hits;
+    size_t misses;
+    size_t entries;
+} ScalarTemplateCacheStats;
+
+void ScalarTemplateCacheGetStats(ScalarTemplateCacheStats *stats);
+void ScalarTemplateCacheClear(void);
 Rval ExpandBundleReference(EvalContext *ctx, const char *ns, const char *scope, Rval rval);
 Rval ExpandPrivateRval(EvalContext *ctx, const char *ns, const char *scope, const void *rval_item, RvalType rval_type);
 Rlist *ExpandList(EvalContext *ctx, const char *ns, const char *scope, const Rlist *list, int expandnaked);
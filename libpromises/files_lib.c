@@ -376,6 +376,10 @@ int LoadFileAsItemList(Item **liststart, const char *file, EditDefaults edits)
     char *line = xmalloc(line_size);
     bool result = true;
 
+    /* Append after the last line read, rather than walking the whole list
+     * for every line like AppendItem() does. */
+    Item *last = (*liststart == NULL) ? NULL : EndOfList(*liststart);
+
     for (;;)
     {
         ssize_t num_read = CfReadLine(&line, &line_size, fp);
@@ -402,7 +406,16 @@ int LoadFileAsItemList(Item **liststart, const char *file, EditDefaults edits)
             BufferAppend(concat, line, num_read);
             if (!feof(fp) || (BufferSize(concat) > 0))
             {
-                AppendItem(liststart, BufferData(concat), NULL);
+                if (last == NULL)
+                {
+                    AppendItem(liststart, BufferData(concat), NULL);
+                    last = *liststart;
+                }
+                else
+                {
+                    InsertAfter(liststart, last, BufferData(concat));
+                    last = last->next;
+                }
             }
         }
 
@@ -25,6 +25,7 @@
 #include <fncall.h>
 
 #include <eval_context.h>
+#include <fncall_cache.h>
 #include <files_names.h>
 #include <expand.h>
 #include <vars.h>
@@ -304,6 +305,40 @@ static FnCallResult CallFunction(EvalContext *ctx, const Policy *policy, const F
     return (*fncall_type->impl) (ctx, policy, fp, expargs);
 }
 
+/* Functions whose result depends on nothing but their arguments and the
+ * classes and variables they read through the EvalContext. */
+static const char *const PURE_FUNCTIONS[] =
+{
+    "and", "canonify", "canonifyuniquely", "concat", "dirname", "format",
+    "ifelse", "isvariable", "join", "lastnode", "length", "not", "or",
+    "splitstring", "strcmp", "string_downcase", "string_head",
+    "string_length", "string_reverse", "string_split", "string_tail",
+    "string_upcase", NULL
+};
+
+/**
+ * @return true if evaluating #fp again during this run gives the same
+ *         result as long as the classes and variables it reads are the same.
+ */
+static bool FnCallIsRepeatable(EvalContext *ctx, const FnCall *fp,
+                               const FnCallType *fp_type)
+{
+    if ((fp_type->options & FNCALL_OPTION_CACHED) &&
+        EvalContextGetEvalOption(ctx, EVAL_OPTION_CACHE_SYSTEM_FUNCTIONS))
+    {
+        return true;
+    }
+
+    for (size_t i = 0; PURE_FUNCTIONS[i] != NULL; i++)
+    {
+        if (strcmp(fp->name, PURE_FUNCTIONS[i]) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
 FnCallResult FnCallEvaluate(EvalContext *ctx, const Policy *policy, FnCall *fp, const Promise *caller)
 {
     assert(ctx);
@@ -335,6 +370,11 @@ FnCallResult FnCallEvaluate(EvalContext *ctx, const Policy *policy, FnCall *fp,
         return (FnCallResult) { FNCALL_FAILURE, { FnCallCopy(fp), RVAL_TYPE_FNCALL } };
     }
 
+    if (!FnCallIsRepeatable(ctx, fp, fp_type))
+    {
+        EvalContextInputsMarkVolatile(ctx);
+    }
+
     Rlist *expargs = NewExpArgs(ctx, policy, fp, fp_type);
 
     Writer *fncall_writer = NULL;
@@ -393,6 +433,26 @@ FnCallResult FnCallEvaluate(EvalContext *ctx, const Policy *policy, FnCall *fp,
         return (FnCallResult) { FNCALL_SUCCESS, RvalCopy(cached_rval) };
     }
 
+    time_t persistent_ttl = EvalContextGetFunctionCacheTTL(ctx);
+    bool persistent = (persistent_ttl > 0 && FnCallCacheIsPersistable(fp->name));
+    if (persistent && FnCallCacheLoad(fp->name, expargs, persistent_ttl, &cached_rval))
+    {
+        if (LogGetGlobalLevel() >= LOG_LEVEL_DEBUG)
+        {
+            WriterClose(fncall_writer);
+        }
+        Log(LOG_LEVEL_VERBOSE,
+            "Using persistently cached result for function '%s'", fp->name);
+
+        if (fp_type->options & FNCALL_OPTION_CACHED)
+        {
+            EvalContextFunctionCachePut(ctx, fp, expargs, &cached_rval);
+        }
+        RlistDestroy(expargs);
+
+        return (FnCallResult) { FNCALL_SUCCESS, cached_rval };
+    }
+
     if (LogGetGlobalLevel() >= LOG_LEVEL_DEBUG)
     {
         Log(LOG_LEVEL_DEBUG, "Evaluating function: %s",
@@ -418,6 +478,11 @@ FnCallResult FnCallEvaluate(EvalContext *ctx, const Policy *policy, FnCall *fp,
         EvalContextFunctionCachePut(ctx, fp, expargs, &result.rval);
     }
 
+    if (persistent)
+    {
+        FnCallCacheStore(fp->name, expargs, result.rval);
+    }
+
     RlistDestroy(expargs);
 
     return result;
@@ -0,0 +1,356 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <fncall_cache.h>
+
+#include <alloc.h>                                             /* xmalloc */
+#include <logging.h>                                               /* Log */
+#include <mutex.h>                                          /* ThreadLock */
+#include <dbm_api.h>                                     /* OpenDB,ReadDB */
+#include <files_hashes.h>                         /* HashString,HashPrintSafe */
+#include <rlist.h>                                           /* RvalToJson */
+#include <json.h>
+#include <string_lib.h>                                  /* StringStartsWith */
+
+
+/* Results bigger than this are cheaper to compute again than to store. */
+#define FNCALL_CACHE_MAX_SIZE (4 * 1024 * 1024)
+
+
+/**
+ * Functions whose results may be kept between runs. input_arg is the index
+ * of the argument naming the file or directory the result depends on, or -1
+ * for functions that can only be bounded by the expiry time.
+ */
+typedef struct
+{
+    const char *name;
+    int input_arg;
+} FnCallCacheable;
+
+static const FnCallCacheable FNCALL_CACHEABLE[] =
+{
+    { "countlinesmatching", 1 },
+    { "execresult", -1 },
+    { "findfiles", -1 },
+    { "host2ip", -1 },
+    { "ip2host", -1 },
+    { "lsdir", 0 },
+    { "readcsv", 0 },
+    { "readdata", 0 },
+    { "readenvfile", 0 },
+    { "readfile", 0 },
+    { "readjson", 0 },
+    { "readyaml", 0 },
+    { "returnszero", -1 },
+    { NULL, -1 }
+};
+
+/**
+ * Stored in front of the compact JSON of the result, which is always wrapped
+ * in a one element array so that scalars parse as well.
+ */
+typedef struct
+{
+    time_t stored;
+    time_t mtime;
+    time_t ctime;
+    uint64_t ino;
+    int64_t size;
+    int rval_type;
+} FnCallCacheRecord;
+
+
+static pthread_mutex_t fncall_cache_stats_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+static FnCallCacheStats FNCALL_CACHE_STATS = { 0 };             /* GLOBAL_X */
+
+
+static const FnCallCacheable *FnCallCacheableGet(const char *name)
+{
+    for (const FnCallCacheable *f = FNCALL_CACHEABLE; f->name != NULL; f++)
+    {
+        if (strcmp(f->name, name) == 0)
+        {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+bool FnCallCacheIsPersistable(const char *name)
+{
+    return FnCallCacheableGet(name) != NULL;
+}
+
+static void NoteStat(size_t *counter)
+{
+    ThreadLock(&fncall_cache_stats_lock);
+    (*counter)++;
+    ThreadUnlock(&fncall_cache_stats_lock);
+}
+
+void FnCallCacheGetStats(FnCallCacheStats *stats)
+{
+    ThreadLock(&fncall_cache_stats_lock);
+    *stats = FNCALL_CACHE_STATS;
+    ThreadUnlock(&fncall_cache_stats_lock);
+}
+
+/* The key is a hash of the function name and its expanded arguments. */
+static void FnCallCacheKey(const char *name, const Rlist *args,
+                           char key[CF_HOSTKEY_STRING_SIZE])
+{
+    JsonElement *call = JsonArrayCreate(4);
+    JsonArrayAppendString(call, name);
+    for (const Rlist *rp = args; rp != NULL; rp = rp->next)
+    {
+        JsonArrayAppendElement(call, RvalToJson(rp->val));
+    }
+
+    Writer *w = StringWriter();
+    JsonWriteCompact(w, call);
+    JsonDestroy(call);
+
+    unsigned char digest[EVP_MAX_MD_SIZE + 1];
+    HashString(StringWriterData(w), strlen(StringWriterData(w)),
+               digest, HASH_METHOD_SHA256);
+    WriterClose(w);
+
+    HashPrintSafe(key, CF_HOSTKEY_STRING_SIZE, digest,
+                  HASH_METHOD_SHA256, false);
+}
+
+/**
+ * Fill in the input stamp of the record. Returns false if the result must
+ * not be cached, because the input is missing or lives on a pseudo
+ * filesystem that does not maintain sizes and times.
+ */
+static bool FnCallCacheStamp(const FnCallCacheable *f, const Rlist *args,
+                             FnCallCacheRecord *record)
+{
+    if (f->input_arg < 0)
+    {
+        return true;
+    }
+
+    const Rlist *rp = args;
+    for (int i = 0; rp != NULL && i < f->input_arg; i++)
+    {
+        rp = rp->next;
+    }
+    if (rp == NULL || rp->val.type != RVAL_TYPE_SCALAR)
+    {
+        return false;
+    }
+
+    const char *path = RlistScalarValue(rp);
+    if (StringStartsWith(path, "/proc/") || StringStartsWith(path, "/sys/"))
+    {
+        return false;
+    }
+
+    struct stat sb;
+    if (stat(path, &sb) == -1 ||
+        (S_ISREG(sb.st_mode) && sb.st_size == 0))
+    {
+        return false;
+    }
+
+    record->mtime = sb.st_mtime;
+    record->ctime = sb.st_ctime;
+    record->ino = sb.st_ino;
+    record->size = sb.st_size;
+    return true;
+}
+
+bool FnCallCacheLoad(const char *name, const Rlist *args, time_t ttl,
+                     Rval *rval_out)
+{
+    const FnCallCacheable *f = FnCallCacheableGet(name);
+    if (f == NULL || ttl <= 0)
+    {
+        return false;
+    }
+
+    char key[CF_HOSTKEY_STRING_SIZE];
+    FnCallCacheKey(name, args, key);
+
+    CF_DB *db;
+    if (!OpenDB(&db, dbid_function_cache))
+    {
+        return false;
+    }
+
+    int size = ValueSizeDB(db, key, strlen(key) + 1);
+    if (size <= (int) sizeof(FnCallCacheRecord) ||
+        size > FNCALL_CACHE_MAX_SIZE + (int) sizeof(FnCallCacheRecord))
+    {
+        CloseDB(db);
+        NoteStat(&FNCALL_CACHE_STATS.misses);
+        return false;
+    }
+
+    char *value = xmalloc(size);
+    bool ok = ReadDB(db, key, value, size);
+    CloseDB(db);
+
+    if (!ok)
+    {
+        free(value);
+        NoteStat(&FNCALL_CACHE_STATS.misses);
+        return false;
+    }
+
+    FnCallCacheRecord stored;
+    memcpy(&stored, value, sizeof(stored));
+    value[size - 1] = '\0';
+
+    FnCallCacheRecord current = { 0 };
+    time_t now = time(NULL);
+    if (stored.stored > now || now - stored.stored >= ttl ||
+        !FnCallCacheStamp(f, args, &current) ||
+        current.mtime != stored.mtime || current.ctime != stored.ctime ||
+        current.ino != stored.ino || current.size != stored.size)
+    {
+        Log(LOG_LEVEL_DEBUG,
+            "Cached result of function '%s' is stale", name);
+        free(value);
+        NoteStat(&FNCALL_CACHE_STATS.stale);
+        return false;
+    }
+
+    const char *data = value + sizeof(FnCallCacheRecord);
+    JsonElement *json = NULL;
+    if (JsonParse(&data, &json) != JSON_PARSE_OK ||
+        JsonGetElementType(json) != JSON_ELEMENT_TYPE_CONTAINER ||
+        JsonLength(json) != 1)
+    {
+        Log(LOG_LEVEL_DEBUG,
+            "Cached result of function '%s' is corrupt", name);
+        JsonDestroy(json);
+        free(value);
+        NoteStat(&FNCALL_CACHE_STATS.misses);
+        return false;
+    }
+    free(value);
+
+    JsonElement *result = JsonArrayGet(json, 0);
+    ok = true;
+    switch (stored.rval_type)
+    {
+    case RVAL_TYPE_SCALAR:
+        if (JsonGetElementType(result) == JSON_ELEMENT_TYPE_PRIMITIVE)
+        {
+            *rval_out = RvalNew(JsonPrimitiveGetAsString(result),
+                                RVAL_TYPE_SCALAR);
+        }
+        else
+        {
+            ok = false;
+        }
+        break;
+    case RVAL_TYPE_LIST:
+        *rval_out = (Rval) { RlistFromContainer(result), RVAL_TYPE_LIST };
+        break;
+    case RVAL_TYPE_CONTAINER:
+        *rval_out = RvalNew(result, RVAL_TYPE_CONTAINER);
+        break;
+    default:
+        ok = false;
+        break;
+    }
+    JsonDestroy(json);
+
+    NoteStat(ok ? &FNCALL_CACHE_STATS.hits : &FNCALL_CACHE_STATS.misses);
+    return ok;
+}
+
+void FnCallCacheStore(const char *name, const Rlist *args, Rval rval)
+{
+    const FnCallCacheable *f = FnCallCacheableGet(name);
+    if (f == NULL)
+    {
+        return;
+    }
+
+    if (rval.type == RVAL_TYPE_LIST)
+    {
+        for (const Rlist *rp = RvalRlistValue(rval); rp != NULL; rp = rp->next)
+        {
+            if (rp->val.type != RVAL_TYPE_SCALAR)
+            {
+                return;
+            }
+        }
+    }
+    else if (rval.type != RVAL_TYPE_SCALAR &&
+             rval.type != RVAL_TYPE_CONTAINER)
+    {
+        return;
+    }
+
+    FnCallCacheRecord record = {
+        .stored = time(NULL),
+        .rval_type = rval.type,
+    };
+    if (!FnCallCacheStamp(f, args, &record))
+    {
+        Log(LOG_LEVEL_DEBUG,
+            "Input of function '%s' can not be stamped, not caching", name);
+        return;
+    }
+
+    JsonElement *wrapped = JsonArrayCreate(1);
+    JsonArrayAppendElement(wrapped, RvalToJson(rval));
+    Writer *w = StringWriter();
+    JsonWriteCompact(w, wrapped);
+    JsonDestroy(wrapped);
+
+    size_t json_size = strlen(StringWriterData(w)) + 1;
+    if (json_size > FNCALL_CACHE_MAX_SIZE)
+    {
+        WriterClose(w);
+        return;
+    }
+
+    size_t size = sizeof(record) + json_size;
+    char *value = xmalloc(size);
+    memcpy(value, &record, sizeof(record));
+    memcpy(value + sizeof(record), StringWriterData(w), json_size);
+    WriterClose(w);
+
+    char key[CF_HOSTKEY_STRING_SIZE];
+    FnCallCacheKey(name, args, key);
+
+    CF_DB *db;
+    if (OpenDB(&db, dbid_function_cache))
+    {
+        if (WriteDB(db, key, value, size))
+        {
+            NoteStat(&FNCALL_CACHE_STATS.stored);
+        }
+        CloseDB(db);
+    }
+    free(value);
+}
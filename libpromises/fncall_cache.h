@@ -0,0 +1,58 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_FNCALL_CACHE_H
+#define CFENGINE_FNCALL_CACHE_H
+
+
+#include <cf3.defs.h>
+
+
+/**
+ * Persistent cache of function results, kept in the function_cache database
+ * so that expensive functions are not evaluated again on every agent run.
+ * It is opt-in: nothing is cached unless "function_cache_expireafter" is set
+ * in body common control.
+ *
+ * Every entry expires after that many minutes. Functions that read a file
+ * or directory also remember its inode, size and modification times, and
+ * their entries are dropped as soon as the input changes.
+ */
+
+typedef struct
+{
+    size_t hits;
+    size_t misses;
+    size_t stale;                      /* found, but expired or input changed */
+    size_t stored;
+} FnCallCacheStats;
+
+bool FnCallCacheIsPersistable(const char *name);
+bool FnCallCacheLoad(const char *name, const Rlist *args, time_t ttl,
+                     Rval *rval_out);
+void FnCallCacheStore(const char *name, const Rlist *args, Rval rval);
+void FnCallCacheGetStats(FnCallCacheStats *stats);
+
+
+#endif
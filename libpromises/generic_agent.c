@@ -1863,6 +1863,7 @@ GenericAgentConfig *GenericAgentConfigNewDefault(AgentType agent_type, bool tty_
     {
     case AGENT_TYPE_COMMON:
         config->agent_specific.common.eval_functions = true;
+        config->agent_specific.common.write_policy_images = false;
         config->agent_specific.common.show_classes = false;
         config->agent_specific.common.show_variables = false;
         config->agent_specific.common.policy_output_format = GENERIC_AGENT_CONFIG_COMMON_POLICY_OUTPUT_FORMAT_NONE;
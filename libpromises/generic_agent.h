@@ -77,6 +77,7 @@ typedef struct
             unsigned int parser_warnings;
             unsigned int parser_warnings_error;
             bool eval_functions;
+            bool write_policy_images; /* for the other agents, see policy_image.h */
             char *show_classes;
             char *show_variables;
         } common;
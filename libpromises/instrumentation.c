@@ -29,6 +29,12 @@
 #include <item_lib.h>
 #include <string_lib.h>
 #include <policy.h>
+#include <regex.h>                                       /* RegexCacheGetStats */
+#include <tls_session_cache.h>                      /* TLSSessionCacheGetStats */
+#include <conn_cache.h>                                  /* ConnCache_GetStats */
+#include <fncall_cache.h>                              /* FnCallCacheGetStats */
+#include <eval_context.h>   /* ClassExpressionCacheGetStats, EvalInputsGetStats */
+#include <expand.h>                              /* ScalarTemplateCacheGetStats */
 
 #include <math.h>
 
@@ -139,6 +145,58 @@ int EndMeasureValueMs(struct timespec start)
 
 /***************************************************************/
 
+void LogCacheStatistics(void)
+{
+    if (!TIMING)
+    {
+        return;
+    }
+
+    RegexCacheStats regex_stats;
+    RegexCacheGetStats(&regex_stats);
+
+    Log(LOG_LEVEL_VERBOSE, "T: .........................................................");
+    Log(LOG_LEVEL_VERBOSE, "T: Cache statistics");
+    Log(LOG_LEVEL_VERBOSE, "T:   Regex cache: %zu hits, %zu misses, %zu evictions, %zu entries",
+        regex_stats.hits, regex_stats.misses,
+        regex_stats.evictions, regex_stats.entries);
+
+    TLSSessionStats tls_stats;
+    TLSSessionCacheGetStats(&tls_stats);
+    Log(LOG_LEVEL_VERBOSE, "T:   TLS sessions: %zu handshakes, %zu resumed",
+        tls_stats.handshakes, tls_stats.resumed);
+
+    ConnCacheStats conn_stats;
+    ConnCache_GetStats(&conn_stats);
+    Log(LOG_LEVEL_VERBOSE, "T:   Connection cache: %zu hits, %zu misses, %zu expired, %zu offline",
+        conn_stats.hits, conn_stats.misses,
+        conn_stats.expired, conn_stats.offline);
+
+    FnCallCacheStats fncall_stats;
+    FnCallCacheGetStats(&fncall_stats);
+    Log(LOG_LEVEL_VERBOSE, "T:   Function cache: %zu hits, %zu misses, %zu stale, %zu stored",
+        fncall_stats.hits, fncall_stats.misses,
+        fncall_stats.stale, fncall_stats.stored);
+
+    ClassExpressionCacheStats class_stats;
+    ClassExpressionCacheGetStats(&class_stats);
+    Log(LOG_LEVEL_VERBOSE, "T:   Class expression cache: %zu hits, %zu misses, %zu entries",
+        class_stats.hits, class_stats.misses, class_stats.entries);
+
+    ScalarTemplateCacheStats template_stats;
+    ScalarTemplateCacheGetStats(&template_stats);
+    Log(LOG_LEVEL_VERBOSE, "T:   Scalar template cache: %zu hits, %zu misses, %zu entries",
+        template_stats.hits, template_stats.misses, template_stats.entries);
+
+    EvalInputsStats inputs_stats;
+    EvalInputsGetStats(&inputs_stats);
+    Log(LOG_LEVEL_VERBOSE, "T:   Promise inputs: %zu recorded, %zu evaluations skipped, %zu re-evaluated",
+        inputs_stats.recorded, inputs_stats.unchanged, inputs_stats.changed);
+    Log(LOG_LEVEL_VERBOSE, "T: .........................................................");
+}
+
+/***************************************************************/
+
 static void NotePerformance(char *eventname, time_t t, double value)
 {
     CF_DB *dbp;
@@ -34,5 +34,8 @@ struct timespec BeginMeasure(void);
 void EndMeasure(char *eventname, struct timespec start);
 int EndMeasureValueMs(struct timespec start);
 void EndMeasurePromise(struct timespec start, const Promise *pp);
+
+/* Reports hit/miss counters of the process-wide caches (when --timing). */
+void LogCacheStatistics(void);
 extern bool TIMING;
 #endif
@@ -30,6 +30,10 @@
 #include <locks.h>
 #include <item_lib.h>
 #include <known_dirs.h>
+#include <mutex.h>
+#include <atexit.h>
+#include <map.h>
+#include <string_lib.h>
 #ifdef LMDB
 #include <lmdb.h>
 #endif
@@ -106,47 +110,293 @@ void LastSaw(const char *ipaddress, const char *digest, LastSeenRole role)
 
 /*****************************************************************************/
 
-void UpdateLastSawHost(const char *hostkey, const char *address,
-                       bool incoming, time_t timestamp)
+/* Write-behind buffer, see LastSeenWriteBehindStart(). */
+
+typedef struct
 {
-    DBHandle *db = NULL;
-    if (!OpenDB(&db, dbid_lastseen))
+    time_t timestamp;
+    unsigned int count;             /* how many sightings at that timestamp */
+} LastSeenSighting;
+
+typedef struct
+{
+    LastSeenSighting *sightings;    /* in the order they were reported */
+    size_t num_sightings;
+    size_t alloc_sightings;
+} LastSeenPending;
+
+static pthread_mutex_t lastseen_pending_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP; /* GLOBAL_T */
+static pthread_mutex_t lastseen_flush_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP; /* GLOBAL_T */
+static pthread_once_t lastseen_cleanup_once = PTHREAD_ONCE_INIT; /* GLOBAL_T */
+
+/* Quality key -> LastSeenPending */
+static Map *LASTSEEN_PENDING = NULL; /* GLOBAL_X */
+/* Hostkey and address keys -> the latest value, as in the database. */
+static StringMap *LASTSEEN_PENDING_MAPPINGS = NULL; /* GLOBAL_X */
+static time_t LASTSEEN_FLUSH_INTERVAL = 0; /* GLOBAL_X, 0 when writing through */
+static time_t LASTSEEN_LAST_FLUSH = 0; /* GLOBAL_X */
+static pid_t LASTSEEN_OWNER = 0; /* GLOBAL_X, the process buffering */
+
+static void LastSeenPendingDestroy(void *ptr)
+{
+    LastSeenPending *pending = ptr;
+    free(pending->sightings);
+    free(pending);
+}
+
+/**
+ * Update the quality-of-connection entry #quality_key in the open lastseen
+ * #db for #num_sightings sightings, as if UpdateLastSawHost() had been
+ * called for each of them in turn.
+ */
+static void WriteLastSawQuality(DBHandle *db, const char *quality_key,
+                                const LastSeenSighting *sightings,
+                                size_t num_sightings)
+{
+    KeyHostSeen q;
+    bool found = ReadDB(db, quality_key, &q, sizeof(q));
+
+    for (size_t i = 0; i < num_sightings; i++)
     {
-        Log(LOG_LEVEL_ERR, "Unable to open last seen db");
+        for (unsigned int j = 0; j < sightings[i].count; j++)
+        {
+            KeyHostSeen newq = { .lastseen = sightings[i].timestamp };
+            if (found)
+            {
+                newq.Q = QAverage(q.Q, newq.lastseen - q.lastseen, 0.4);
+            }
+            else
+            {
+                /* FIXME: more meaningful default value? */
+                newq.Q = QDefinite(0);
+            }
+            q = newq;
+            found = true;
+        }
+    }
+
+    WriteDB(db, quality_key, &q, sizeof(q));
+}
+
+/* Call with lastseen_pending_lock held. */
+static void LastSeenPendingAdd(const char *quality_key, const char *hostkey_key,
+                               const char *address_key, const char *hostkey,
+                               const char *address, time_t timestamp)
+{
+    if (LASTSEEN_PENDING == NULL)
+    {
+        LASTSEEN_PENDING = MapNew(StringHash_untyped, StringSafeEqual_untyped,
+                                  free, LastSeenPendingDestroy);
+        LASTSEEN_PENDING_MAPPINGS = StringMapNew();
+    }
+
+    StringMapInsert(LASTSEEN_PENDING_MAPPINGS, xstrdup(hostkey_key), xstrdup(address));
+    StringMapInsert(LASTSEEN_PENDING_MAPPINGS, xstrdup(address_key), xstrdup(hostkey));
+
+    LastSeenPending *pending = MapGet(LASTSEEN_PENDING, quality_key);
+    if (pending == NULL)
+    {
+        pending = xcalloc(1, sizeof(LastSeenPending));
+        MapInsert(LASTSEEN_PENDING, xstrdup(quality_key), pending);
+    }
+
+    /* Repeated sightings within the same second are merged into one. */
+    if (pending->num_sightings > 0 &&
+        pending->sightings[pending->num_sightings - 1].timestamp == timestamp)
+    {
+        pending->sightings[pending->num_sightings - 1].count++;
         return;
     }
 
-    /* Update quality-of-connection entry */
+    if (pending->num_sightings == pending->alloc_sightings)
+    {
+        pending->alloc_sightings = MAX(4, pending->alloc_sightings * 2);
+        pending->sightings = xrealloc(pending->sightings,
+                                      pending->alloc_sightings * sizeof(LastSeenSighting));
+    }
+    pending->sightings[pending->num_sightings++] = (LastSeenSighting) {
+        .timestamp = timestamp,
+        .count = 1,
+    };
+}
 
-    char quality_key[CF_BUFSIZE];
-    snprintf(quality_key, CF_BUFSIZE, "q%c%s", incoming ? 'i' : 'o', hostkey);
+void LastSeenFlush(void)
+{
+    ThreadLock(&lastseen_flush_lock);
 
-    KeyHostSeen newq = { .lastseen = timestamp };
+    ThreadLock(&lastseen_pending_lock);
+    Map *pending = LASTSEEN_PENDING;
+    StringMap *mappings = LASTSEEN_PENDING_MAPPINGS;
+    LASTSEEN_PENDING = NULL;
+    LASTSEEN_PENDING_MAPPINGS = NULL;
+    LASTSEEN_LAST_FLUSH = time(NULL);
+    ThreadUnlock(&lastseen_pending_lock);
 
-    KeyHostSeen q;
-    if (ReadDB(db, quality_key, &q, sizeof(q)))
+    if (pending == NULL)
+    {
+        ThreadUnlock(&lastseen_flush_lock);
+        return;
+    }
+
+    size_t sightings = 0;
+    MapIterator i = MapIteratorInit(pending);
+    MapKeyValue *item;
+    while ((item = MapIteratorNext(&i)))
     {
-        newq.Q = QAverage(q.Q, newq.lastseen - q.lastseen, 0.4);
+        const LastSeenPending *entry = item->value;
+        for (size_t j = 0; j < entry->num_sightings; j++)
+        {
+            sightings += entry->sightings[j].count;
+        }
+    }
+
+    DBHandle *db = NULL;
+    if (OpenDB(&db, dbid_lastseen))
+    {
+        i = MapIteratorInit(pending);
+        while ((item = MapIteratorNext(&i)))
+        {
+            const LastSeenPending *entry = item->value;
+            WriteLastSawQuality(db, item->key, entry->sightings,
+                                entry->num_sightings);
+        }
+
+        i = MapIteratorInit(mappings->impl);
+        while ((item = MapIteratorNext(&i)))
+        {
+            WriteDB(db, item->key, item->value, strlen(item->value) + 1);
+        }
+
+        /* All entries go to disk in the transaction committed here. */
+        CloseDB(db);
+
+        Log(LOG_LEVEL_DEBUG, "Wrote %zu sightings of %zu hosts to lastseen db",
+            sightings, MapSize(pending));
     }
     else
     {
-        /* FIXME: more meaningful default value? */
-        newq.Q = QDefinite(0);
+        Log(LOG_LEVEL_ERR,
+            "Unable to open last seen db, %zu sightings of %zu hosts lost",
+            sightings, MapSize(pending));
     }
-    WriteDB(db, quality_key, &newq, sizeof(newq));
 
-    /* Update forward mapping */
+    MapDestroy(pending);
+    StringMapDestroy(mappings);
+
+    ThreadUnlock(&lastseen_flush_lock);
+}
 
+static void LastSeenCleanup(void)
+{
+    /* Children forked by the buffering process must not write its copy of
+     * the buffer a second time. */
+    if (getpid() == LASTSEEN_OWNER)
+    {
+        LastSeenWriteBehindStop();
+    }
+}
+
+static void RegisterLastSeenCleanup(void)
+{
+    RegisterAtExitFunction(&LastSeenCleanup);
+}
+
+void LastSeenWriteBehindStart(time_t flush_interval)
+{
+    assert(flush_interval > 0);
+
+    /* Open the DB once first, so that the CloseAllDB() atexit() handler is
+     * registered before ours and runs after the buffer is written out. */
+    DBHandle *db = NULL;
+    if (OpenDB(&db, dbid_lastseen))
+    {
+        CloseDB(db);
+    }
+    pthread_once(&lastseen_cleanup_once, &RegisterLastSeenCleanup);
+
+    ThreadLock(&lastseen_pending_lock);
+    LASTSEEN_FLUSH_INTERVAL = flush_interval;
+    LASTSEEN_LAST_FLUSH = time(NULL);
+    LASTSEEN_OWNER = getpid();
+    ThreadUnlock(&lastseen_pending_lock);
+
+    Log(LOG_LEVEL_VERBOSE, "Writing lastseen updates to disk every %jd seconds",
+        (intmax_t) flush_interval);
+}
+
+void LastSeenWriteBehindStop(void)
+{
+    ThreadLock(&lastseen_pending_lock);
+    LASTSEEN_FLUSH_INTERVAL = 0;
+    ThreadUnlock(&lastseen_pending_lock);
+
+    LastSeenFlush();
+}
+
+void LastSeenFlushIfDue(void)
+{
+    ThreadLock(&lastseen_pending_lock);
+    bool due = (LASTSEEN_PENDING != NULL && LASTSEEN_FLUSH_INTERVAL > 0 &&
+                time(NULL) >= LASTSEEN_LAST_FLUSH + LASTSEEN_FLUSH_INTERVAL);
+    ThreadUnlock(&lastseen_pending_lock);
+
+    if (due)
+    {
+        LastSeenFlush();
+    }
+}
+
+void UpdateLastSawHost(const char *hostkey, const char *address,
+                       bool incoming, time_t timestamp)
+{
+    char quality_key[CF_BUFSIZE];
+    snprintf(quality_key, CF_BUFSIZE, "q%c%s", incoming ? 'i' : 'o', hostkey);
     char hostkey_key[CF_BUFSIZE];
     snprintf(hostkey_key, CF_BUFSIZE, "k%s", hostkey);
+    char address_key[CF_BUFSIZE];
+    snprintf(address_key, CF_BUFSIZE, "a%s", address);
+
+    ThreadLock(&lastseen_pending_lock);
+    if (LASTSEEN_FLUSH_INTERVAL > 0)
+    {
+        LastSeenPendingAdd(quality_key, hostkey_key, address_key,
+                           hostkey, address, timestamp);
+
+        /* Only the first thread to find the buffer due writes it out. */
+        time_t now = time(NULL);
+        bool due = (now >= LASTSEEN_LAST_FLUSH + LASTSEEN_FLUSH_INTERVAL);
+        if (due)
+        {
+            LASTSEEN_LAST_FLUSH = now;
+        }
+        ThreadUnlock(&lastseen_pending_lock);
+
+        if (due)
+        {
+            LastSeenFlush();
+        }
+        return;
+    }
+    ThreadUnlock(&lastseen_pending_lock);
+
+    DBHandle *db = NULL;
+    if (!OpenDB(&db, dbid_lastseen))
+    {
+        Log(LOG_LEVEL_ERR, "Unable to open last seen db");
+        return;
+    }
+
+    /* Update quality-of-connection entry */
+
+    LastSeenSighting sighting = { .timestamp = timestamp, .count = 1 };
+    WriteLastSawQuality(db, quality_key, &sighting, 1);
+
+    /* Update forward mapping */
 
     WriteDB(db, hostkey_key, address, strlen(address) + 1);
 
     /* Update reverse mapping */
 
-    char address_key[CF_BUFSIZE];
-    snprintf(address_key, CF_BUFSIZE, "a%s", address);
-
     WriteDB(db, address_key, hostkey, strlen(hostkey) + 1);
 
     CloseDB(db);
@@ -223,6 +473,8 @@ bool Address2Hostkey(char *dst, size_t dst_size, const char *address)
     }
     else                                                 /* lastseen lookup */
     {
+        LastSeenFlush();
+
         DBHandle *db;
         if (OpenDB(&db, dbid_lastseen))
         {
@@ -306,6 +558,8 @@ bool IsLastSeenCoherent(void)
     DBHandle *db;
     DBCursor *cursor;
 
+    LastSeenFlush();
+
     if (!OpenDB(&db, dbid_lastseen))
     {
         char *db_path = DBIdToPath(dbid_lastseen);
@@ -449,6 +703,8 @@ bool DeleteIpFromLastSeen(const char *ip, char *digest, size_t digest_size)
     DBHandle *db;
     bool res = false;
 
+    LastSeenFlush();
+
     if (!OpenDB(&db, dbid_lastseen))
     {
         char *db_path = DBIdToPath(dbid_lastseen);
@@ -517,6 +773,8 @@ bool DeleteDigestFromLastSeen(const char *key, char *ip, size_t ip_size)
     DBHandle *db;
     bool res = false;
 
+    LastSeenFlush();
+
     if (!OpenDB(&db, dbid_lastseen))
     {
         char *db_path = DBIdToPath(dbid_lastseen);
@@ -573,6 +831,8 @@ clean:
 /*****************************************************************************/
 bool ScanLastSeenQuality(LastSeenQualityCallback callback, void *ctx)
 {
+    LastSeenFlush();
+
     StringMap *lastseen_db = LoadDatabaseToStringMap(dbid_lastseen);
     if (!lastseen_db)
     {
@@ -651,6 +911,8 @@ int LastSeenHostKeyCount(void)
 
     int count = 0;
 
+    LastSeenFlush();
+
     if (OpenDB(&dbp, dbid_lastseen))
     {
         memset(&entry, 0, sizeof(entry));
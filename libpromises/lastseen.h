@@ -43,6 +43,24 @@ bool Address2Hostkey(char *dst, size_t dst_size, const char *address);
 void LastSaw1(const char *ipaddress, const char *hashstr, LastSeenRole role);
 void LastSaw(const char *ipaddress, const char *digest, LastSeenRole role);
 
+/**
+ * Write-behind mode, for cf-serverd: instead of a database transaction per
+ * connection, LastSaw() only records the sighting in memory, merging
+ * repeated sightings of the same host. Every #flush_interval seconds the
+ * buffer is written out in a single transaction, computing the same
+ * connection quality as if each sighting had been written at once.
+ *
+ * Lookups, scans and removals in this process write out the buffer first,
+ * so they always see its sightings. Other processes see them only after
+ * the next flush. Sightings buffered when the process crashes are lost;
+ * at a normal exit they are written out.
+ */
+void LastSeenWriteBehindStart(time_t flush_interval);
+/* Write out the buffer and go back to writing each sighting at once. */
+void LastSeenWriteBehindStop(void);
+void LastSeenFlushIfDue(void);
+void LastSeenFlush(void);
+
 bool DeleteIpFromLastSeen(const char *ip, char *digest, size_t digest_size);
 bool DeleteDigestFromLastSeen(const char *key, char *ip, size_t ip_size);
 
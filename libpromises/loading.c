@@ -35,6 +35,7 @@
 #include <fncall.h>
 #include <known_dirs.h>
 #include <ornaments.h>
+#include <policy_image.h>
 
 // TODO: remove
 #include <vars.h>                                         /* IsCf3VarString */
@@ -47,11 +48,38 @@ static Policy *LoadPolicyFile(EvalContext *ctx, GenericAgentConfig *config, cons
 
 
 
-/*
- * The difference between filename and input_input file is that the latter is the file specified by -f or
- * equivalently the file containing body common control. This will hopefully be squashed in later refactoring.
+static Policy *LoadPolicyImage(const GenericAgentConfig *config, const char *input_path,
+                               const char *checksum)
+{
+    char image_file[CF_BUFSIZE];
+    PolicyImageFilename(image_file, sizeof(image_file), checksum);
+
+    Policy *policy = PolicyImageRead(image_file, input_path, checksum, config->agent_type);
+    if (policy != NULL)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Using policy image '%s' of file: %s", image_file, input_path);
+    }
+    return policy;
+}
+
+static void SavePolicyImage(const Policy *policy, const char *input_path, const char *checksum)
+{
+    char image_file[CF_BUFSIZE];
+    PolicyImageFilename(image_file, sizeof(image_file), checksum);
+
+    if (!PolicyImageWrite(policy, image_file, input_path, checksum))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Could not save policy image of file: %s", input_path);
+    }
+}
+
+/**
+ * @param checksum checksum of the file contents, to use its policy image if
+ *                 there is one, or NULL to always parse it
+ * @param from_image set to true if the policy came from the image
  */
-Policy *Cf3ParseFile(const GenericAgentConfig *config, const char *input_path)
+static Policy *ParsePolicyFile(const GenericAgentConfig *config, const char *input_path,
+                               const char *checksum, bool *from_image)
 {
     struct stat statbuf;
 
@@ -124,6 +152,11 @@ Policy *Cf3ParseFile(const GenericAgentConfig *config, const char *input_path)
         JsonDestroy(json_policy);
         WriterClose(contents);
     }
+    else if (checksum != NULL && config->agent_type != AGENT_TYPE_COMMON &&
+             (policy = LoadPolicyImage(config, input_path, checksum)) != NULL)
+    {
+        *from_image = true;
+    }
     else
     {
         if (config->agent_type == AGENT_TYPE_COMMON)
@@ -140,6 +173,16 @@ Policy *Cf3ParseFile(const GenericAgentConfig *config, const char *input_path)
     return policy;
 }
 
+/*
+ * The difference between filename and input_input file is that the latter is the file specified by -f or
+ * equivalently the file containing body common control. This will hopefully be squashed in later refactoring.
+ */
+Policy *Cf3ParseFile(const GenericAgentConfig *config, const char *input_path)
+{
+    bool from_image = false;
+    return ParsePolicyFile(config, input_path, NULL, &from_image);
+}
+
 static Policy *LoadPolicyInputFiles(EvalContext *ctx, GenericAgentConfig *config, const Rlist *inputs, StringSet *parsed_files_and_checksums, StringSet *failed_files)
 {
     Policy *policy = PolicyNew();
@@ -281,12 +324,14 @@ static Policy *LoadPolicyFile(EvalContext *ctx, GenericAgentConfig *config, cons
         Log(LOG_LEVEL_DEBUG, "Loading policy file %s", policy_file);
     }
 
-    Policy *policy = Cf3ParseFile(config, policy_file);
+    bool from_image = false;
+    Policy *policy = ParsePolicyFile(config, policy_file, hashbuffer, &from_image);
     // we keep the checksum and the policy file name to help debugging
     StringSetAdd(parsed_files_and_checksums, xstrdup(policy_file));
     StringSetAdd(parsed_files_and_checksums, xstrdup(hashprintbuffer));
 
-    if (policy)
+    /* Images are only written after passing these checks. */
+    if (policy && !from_image)
     {
         Seq *errors = SeqNew(10, free);
         if (!PolicyCheckPartial(policy, errors))
@@ -305,8 +350,15 @@ static Policy *LoadPolicyFile(EvalContext *ctx, GenericAgentConfig *config, cons
         }
 
         SeqDestroy(errors);
+
+        if (config->agent_type == AGENT_TYPE_COMMON &&
+            config->agent_specific.common.write_policy_images &&
+            !StringEndsWith(policy_file, ".json"))
+        {
+            SavePolicyImage(policy, policy_file, hashbuffer);
+        }
     }
-    else
+    else if (!policy)
     {
         StringSetAdd(failed_files, xstrdup(policy_file));
         return NULL;
@@ -447,6 +499,14 @@ Policy *LoadPolicy(EvalContext *ctx, GenericAgentConfig *config)
     StringSetDestroy(parsed_files_and_checksums);
     StringSetDestroy(failed_files);
 
+    if (config->agent_type == AGENT_TYPE_COMMON &&
+        config->agent_specific.common.write_policy_images)
+    {
+        char image_dir[CF_BUFSIZE];
+        PolicyImageDirectory(image_dir, sizeof(image_dir));
+        PolicyImagePurge(image_dir, POLICY_IMAGE_MAX_AGE);
+    }
+
     {
         Seq *errors = SeqNew(100, PolicyErrorDestroy);
 
@@ -39,6 +39,7 @@
 #include <misc_lib.h>
 #include <known_dirs.h>
 #include <sysinfo.h>
+#include <map.h>
 #include <openssl/evp.h>
 #include <libcrypto-compat.h>
 
@@ -178,42 +179,226 @@ static bool WriteLockDataCurrent(CF_DB *dbp, const char *lock_id)
     return WriteLockData(dbp, lock_id, &lock_data);
 }
 
-time_t FindLockTime(const char *name)
+#ifdef LMDB
+# define LOCK_DB_KEY_SIZE (EVP_MAX_MD_SIZE*2 + 1)
+#else
+# define LOCK_DB_KEY_SIZE CF_BUFSIZE
+#endif
+
+static void LockDBKey(const char *name, char *key, size_t key_size)
+{
+#ifdef LMDB
+    assert(key_size >= LOCK_DB_KEY_SIZE);
+    GenerateMd5Hash(name, key);
+#else
+    strlcpy(key, name, key_size);
+#endif
+}
+
+/**
+ * @return 1 if the lock entry was found, 0 if not, -1 if the lock database
+ *         could not be opened.
+ */
+static int ReadLockData(const char *name, LockData *entry)
 {
-    bool ret;
     CF_DB *dbp;
-    LockData entry = {
-        .process_start_time = PROCESS_START_TIME_UNKNOWN,
-    };
 
     if ((dbp = OpenLock()) == NULL)
     {
         return -1;
     }
 
-#ifdef LMDB
-    unsigned char ohash[EVP_MAX_MD_SIZE*2 + 1];
-    GenerateMd5Hash(name, ohash);
+    char key[LOCK_DB_KEY_SIZE];
+    LockDBKey(name, key, sizeof(key));
 
-    LOG_LOCK_ENTRY(name, ohash, &entry);
-    ret = ReadDB(dbp, ohash, &entry, sizeof(entry));
-    LOG_LOCK_EXIT(name, ohash, &entry);
-#else
-    ret = ReadDB(dbp, name, &entry, sizeof(entry));
+#ifdef LMDB
+    LOG_LOCK_ENTRY(name, key, entry);
+#endif
+    bool ret = ReadDB(dbp, key, entry, sizeof(*entry));
+#ifdef LMDB
+    LOG_LOCK_EXIT(name, key, entry);
 #endif
 
-    if (ret)
+    CloseLock(dbp);
+    return ret ? 1 : 0;
+}
+
+time_t FindLockTime(const char *name)
+{
+    LockData entry = {
+        .process_start_time = PROCESS_START_TIME_UNKNOWN,
+    };
+
+    if (ReadLockData(name, &entry) == 1)
     {
-        CloseLock(dbp);
         return entry.time;
     }
     else
     {
-        CloseLock(dbp);
         return -1;
     }
 }
 
+/*****************************************************************************/
+
+/* Lock sessions, see BeginLockSession(). While a session is open, the
+ * "last." times written by AcquireLock() and YieldCurrentLock() are kept in
+ * memory, and reads of them see these pending times first. They are written
+ * back in a single transaction when the outermost session is committed, or
+ * at exit. The "lock." entries and the critical section do not take part in
+ * sessions, they go straight to the database so other agents see them. */
+
+static pthread_mutex_t lock_session_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP; /* GLOBAL_T */
+static int LOCK_SESSION_DEPTH = 0; /* GLOBAL_X */
+static Map *LOCK_SESSION = NULL; /* GLOBAL_X, pending "last." times by DB key */
+
+static void RegisterLockCleanup(void);
+
+/* Call with lock_session_lock held. */
+static void LockSessionFlush(void)
+{
+    if (LOCK_SESSION == NULL)
+    {
+        return;
+    }
+
+    size_t changes = MapSize(LOCK_SESSION);
+    if (changes > 0)
+    {
+        ThreadLock(cft_lock);
+        CF_DB *dbp = OpenLock();
+        if (dbp != NULL)
+        {
+            LogDebug(LOG_MOD_LOCKS, "Committing %zu lock changes", changes);
+
+            MapIterator i = MapIteratorInit(LOCK_SESSION);
+            MapKeyValue *item;
+            while ((item = MapIteratorNext(&i)))
+            {
+                WriteDB(dbp, item->key, item->value, sizeof(LockData));
+            }
+
+            /* All changes go to disk in the transaction committed here. */
+            CloseLock(dbp);
+        }
+        else
+        {
+            Log(LOG_LEVEL_ERR,
+                "Unable to open locks database, %zu lock changes lost",
+                changes);
+        }
+        ThreadUnlock(cft_lock);
+    }
+
+    MapDestroy(LOCK_SESSION);
+    LOCK_SESSION = NULL;
+}
+
+void BeginLockSession(void)
+{
+    ThreadLock(&lock_session_lock);
+    LOCK_SESSION_DEPTH++;
+    ThreadUnlock(&lock_session_lock);
+}
+
+void CommitLockSession(void)
+{
+    ThreadLock(&lock_session_lock);
+    assert(LOCK_SESSION_DEPTH > 0);
+    if (LOCK_SESSION_DEPTH > 0 && --LOCK_SESSION_DEPTH == 0)
+    {
+        LockSessionFlush();
+    }
+    ThreadUnlock(&lock_session_lock);
+}
+
+void ForkLockSession(void)
+{
+    ThreadLock(&lock_session_lock);
+    if (LOCK_SESSION != NULL)
+    {
+        /* Left to the parent to commit. */
+        MapClear(LOCK_SESSION);
+    }
+    ThreadUnlock(&lock_session_lock);
+}
+
+void SyncLockSession(void)
+{
+    ThreadLock(&lock_session_lock);
+    LockSessionFlush();
+    ThreadUnlock(&lock_session_lock);
+}
+
+/* Like ReadLockData(), but sees the times pending in the session first.
+ * Only for "last." entries. */
+static int ReadSessionLockData(const char *name, LockData *data)
+{
+    ThreadLock(&lock_session_lock);
+    if (LOCK_SESSION != NULL)
+    {
+        char key[LOCK_DB_KEY_SIZE];
+        LockDBKey(name, key, sizeof(key));
+
+        LockData *pending = MapGet(LOCK_SESSION, key);
+        if (pending != NULL)
+        {
+            *data = *pending;
+            ThreadUnlock(&lock_session_lock);
+            return 1;
+        }
+    }
+    ThreadUnlock(&lock_session_lock);
+
+    return ReadLockData(name, data);
+}
+
+/* Like WriteLock(), but deferred to the end of the session if open. Only
+ * for "last." entries. */
+static int WriteSessionLock(const char *name)
+{
+    ThreadLock(&lock_session_lock);
+    if (LOCK_SESSION_DEPTH > 0)
+    {
+        if (LOCK_SESSION == NULL)
+        {
+            CF_DB *dbp = OpenLock();
+            if (dbp == NULL)
+            {
+                ThreadUnlock(&lock_session_lock);
+                return -1;
+            }
+
+            /* The DB has been opened, so CloseAllDB() is registered before
+             * us and runs after the pending times have been written at
+             * exit. */
+            pthread_once(&lock_cleanup_once, &RegisterLockCleanup);
+            CloseLock(dbp);
+
+            LOCK_SESSION = MapNew(StringHash_untyped, StringSafeEqual_untyped,
+                                  free, free);
+        }
+
+        char key[LOCK_DB_KEY_SIZE];
+        LockDBKey(name, key, sizeof(key));
+
+        LockData data = {
+            .pid = getpid(),
+            .time = time(NULL),
+            .process_start_time = GetProcessStartTime(getpid()),
+        };
+        MapInsert(LOCK_SESSION, xstrdup(key), xmemdup(&data, sizeof(data)));
+
+        ThreadUnlock(&lock_session_lock);
+        return 0;
+    }
+    ThreadUnlock(&lock_session_lock);
+
+    return WriteLock(name);
+}
+
+/*****************************************************************************/
+
 static void RemoveDates(char *s)
 {
     int i, a = 0, b = 0, c = 0, d = 0;
@@ -358,38 +543,43 @@ static time_t FindLock(char *last)
     }
 }
 
-static pid_t FindLockPid(char *name)
+/* Like FindLock(), but for "last." entries, whose writes sessions defer. */
+static time_t FindSessionLock(char *last)
 {
-    bool ret;
-    CF_DB *dbp;
     LockData entry = {
         .process_start_time = PROCESS_START_TIME_UNKNOWN,
     };
 
-    if ((dbp = OpenLock()) == NULL)
+    if (ReadSessionLockData(last, &entry) != 1)
     {
-        return -1;
-    }
+        /* Do this to prevent deadlock loops from surviving if IfElapsed > T_sched */
 
-#ifdef LMDB
-    unsigned char ohash[EVP_MAX_MD_SIZE*2 + 1];
-    GenerateMd5Hash(name, ohash);
+        if (WriteSessionLock(last) == -1)
+        {
+            Log(LOG_LEVEL_ERR, "Unable to lock %s", last);
+            return 0;
+        }
 
-    LOG_LOCK_ENTRY(name, ohash, &entry);
-    ret = ReadDB(dbp, ohash, &entry, sizeof(entry));
-    LOG_LOCK_EXIT(name, ohash, &entry);
-#else
-    ret = ReadDB(dbp, name, &entry, sizeof(entry));
-#endif
+        return 0;
+    }
+    else
+    {
+        return entry.time;
+    }
+}
 
-    if (ret)
+static pid_t FindLockPid(char *name)
+{
+    LockData entry = {
+        .process_start_time = PROCESS_START_TIME_UNKNOWN,
+    };
+
+    if (ReadLockData(name, &entry) == 1)
     {
-        CloseLock(dbp);
         return entry.pid;
     }
     else
     {
-        CloseLock(dbp);
         return -1;
     }
 }
@@ -406,6 +596,11 @@ static void LocksCleanup(void)
         YieldCurrentLock(best_guess);
         free(lock);
     }
+
+    ThreadLock(&lock_session_lock);
+    LockSessionFlush();
+    LOCK_SESSION_DEPTH = 0;
+    ThreadUnlock(&lock_session_lock);
 }
 
 static void RegisterLockCleanup(void)
@@ -473,38 +668,23 @@ static void PromiseTypeString(char *dst, size_t dst_size, const Promise *pp)
 
 static bool KillLockHolder(const char *lock)
 {
-    bool ret;
-    CF_DB *dbp = OpenLock();
-    if (dbp == NULL)
-    {
-        Log(LOG_LEVEL_ERR, "Unable to open locks database");
-        return false;
-    }
-
     LockData lock_data = {
         .process_start_time = PROCESS_START_TIME_UNKNOWN,
     };
 
-#ifdef LMDB
-    unsigned char ohash[EVP_MAX_MD_SIZE*2 + 1];
-    GenerateMd5Hash(lock, ohash);
-
-    LOG_LOCK_ENTRY(lock, ohash, &lock_data);
-    ret = ReadDB(dbp, ohash, &lock_data, sizeof(lock_data));
-    LOG_LOCK_EXIT(lock, ohash, &lock_data);
-#else
-    ret = ReadDB(dbp, lock, &lock_data, sizeof(lock_data));
-#endif
+    int ret = ReadLockData(lock, &lock_data);
+    if (ret == -1)
+    {
+        Log(LOG_LEVEL_ERR, "Unable to open locks database");
+        return false;
+    }
 
-    if (!ret)
+    if (ret == 0)
     {
         /* No lock found */
-        CloseLock(dbp);
         return true;
     }
 
-    CloseLock(dbp);
-
     return GracefulTerminate(lock_data.pid, lock_data.process_start_time);
 }
 
@@ -726,7 +906,7 @@ CfLock AcquireLock(EvalContext *ctx, const char *operand, const char *host, time
     WaitForCriticalSection(CF_CRITIAL_SECTION);
 
     // Look for non-existent (old) processes
-    time_t lastcompleted = FindLock(cflast);
+    time_t lastcompleted = FindSessionLock(cflast);
     time_t elapsedtime = (time_t) (now - lastcompleted) / 60;
 
     // For promises/locks with ifelapsed == 0, skip all detection logic of
@@ -835,7 +1015,7 @@ void YieldCurrentLock(CfLock lock)
         return;
     }
 
-    if (WriteLock(lock.last) == -1)
+    if (WriteSessionLock(lock.last) == -1)
     {
         Log(LOG_LEVEL_ERR, "Unable to create '%s'. (creat: %s)", lock.last, GetErrorStr());
         free(lock.last);
@@ -39,6 +39,36 @@ void GetLockName(char *lockname, const char *locktype,
 void PurgeLocks(void);
 void BackupLockDatabase(void);
 
+/**
+ * Lock sessions batch the "last." times written by AcquireLock() and
+ * YieldCurrentLock(): while a session is open they are kept in memory, and
+ * all of them are written in a single transaction when the outermost
+ * session is committed (or at exit, if it never is). The "lock." entries of
+ * running promises and the critical section that guards them are still
+ * written to and checked against the database right away, so other agents
+ * always see which promises are running.
+ *
+ * Crash semantics: a process that dies inside a session leaves its "lock."
+ * entries behind, as it would outside of one, and loses the "last." times
+ * of the promises it ran in the session, so they run again next time. Other
+ * agents see these times only once the session is committed, so sessions
+ * should span a bundle, not a whole run.
+ *
+ * Sessions nest; only the outermost commit writes.
+ */
+void BeginLockSession(void);
+void CommitLockSession(void);
+
+/**
+ * Forked children share the session of their parent. Call ForkLockSession()
+ * in the child right after fork(): the pending times it inherited are left
+ * to the parent to commit. SyncLockSession() then writes out only the times
+ * the child recorded itself; call it once the child's promises are done,
+ * just before it exits.
+ */
+void ForkLockSession(void);
+void SyncLockSession(void);
+
 
 /* TODO remove from header file, these are currently only used internally! */
 int WriteLock(const char *lock);
@@ -27,16 +27,17 @@
 #include <matching.h>
 #include <eval_context.h>
 #include <string_lib.h>                                   /* StringFromLong */
-#include <regex.h>                                        /* CompileRegex */
+#include <regex.h>                          /* CompileRegex,RegexCacheGet */
 
 
 /* Sets variables */
-static int RegExMatchSubString(EvalContext *ctx, pcre *rx, const char *teststring, int *start, int *end)
+static int RegExMatchSubString(EvalContext *ctx, CachedRegex *rx, const char *teststring, int *start, int *end)
 {
     int ovector[OVECCOUNT];
     int rc = 0;
 
-    if ((rc = pcre_exec(rx, NULL, teststring, strlen(teststring), 0, 0, ovector, OVECCOUNT)) >= 0)
+    if ((rc = pcre_exec(CachedRegexPattern(rx), CachedRegexExtra(rx),
+                        teststring, strlen(teststring), 0, 0, ovector, OVECCOUNT)) >= 0)
     {
         *start = ovector[0];
         *end = ovector[1];
@@ -64,12 +65,11 @@ static int RegExMatchSubString(EvalContext *ctx, pcre *rx, const char *teststrin
         *end = 0;
     }
 
-    pcre_free(rx);
     return rc >= 0;
 }
 
 /* Sets variables */
-static int RegExMatchFullString(EvalContext *ctx, pcre *rx, const char *teststring)
+static int RegExMatchFullString(EvalContext *ctx, CachedRegex *rx, const char *teststring)
 {
     int match_start;
     int match_len;
@@ -86,27 +86,20 @@ static int RegExMatchFullString(EvalContext *ctx, pcre *rx, const char *teststri
 
 int FullTextMatch(EvalContext *ctx, const char *regexp, const char *teststring)
 {
-    pcre *rx;
-
     if (strcmp(regexp, teststring) == 0)
     {
         return true;
     }
 
-    rx = CompileRegex(regexp);
+    CachedRegex *rx = RegexCacheGet(regexp);
     if (rx == NULL)
     {
         return false;
     }
 
-    if (RegExMatchFullString(ctx, rx, teststring))
-    {
-        return true;
-    }
-    else
-    {
-        return false;
-    }
+    bool ret = RegExMatchFullString(ctx, rx, teststring);
+    RegexCacheRelease(rx);
+    return ret;
 }
 
 bool ValidateRegEx(const char *regex)
@@ -120,19 +113,14 @@ bool ValidateRegEx(const char *regex)
 
 int BlockTextMatch(EvalContext *ctx, const char *regexp, const char *teststring, int *start, int *end)
 {
-    pcre *rx = CompileRegex(regexp);
+    CachedRegex *rx = RegexCacheGet(regexp);
 
     if (rx == NULL)
     {
         return 0;
     }
 
-    if (RegExMatchSubString(ctx, rx, teststring, start, end))
-    {
-        return true;
-    }
-    else
-    {
-        return false;
-    }
+    bool ret = RegExMatchSubString(ctx, rx, teststring, start, end);
+    RegexCacheRelease(rx);
+    return ret;
 }
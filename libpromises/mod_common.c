@@ -266,6 +266,7 @@ const ConstraintSyntax CFG_CONTROLBODY[COMMON_CONTROL_MAX + 1] =
     ConstraintSyntaxNewString("tls_min_version", "", "Minimum acceptable TLS version for outgoing connections, defaults to OpenSSL's default", SYNTAX_STATUS_NORMAL),
     ConstraintSyntaxNewStringList("package_inventory", ".*", "Name of the package manager used for software inventory management", SYNTAX_STATUS_NORMAL),
     ConstraintSyntaxNewString("package_module", ".*", "Name of the default package manager", SYNTAX_STATUS_NORMAL),
+    ConstraintSyntaxNewInt("function_cache_expireafter", CF_VALRANGE, "Number of minutes the results of expensive functions are kept between runs. Default value: 0 (not kept)", SYNTAX_STATUS_NORMAL),
     ConstraintSyntaxNewNull()
 };
 
@@ -345,6 +346,9 @@ const ConstraintSyntax CFS_CONTROLBODY[SERVER_CONTROL_MAX + 1] =
     ConstraintSyntaxNewString("allowciphers", "", "List of ciphers the server accepts. For Syntax help see man page for \"openssl ciphers\". Default is \"AES256-GCM-SHA384:AES256-SHA\"", SYNTAX_STATUS_NORMAL),
     ConstraintSyntaxNewStringList("allowlegacyconnects", "", "List of IPs from whom we accept legacy protocol connections", SYNTAX_STATUS_NORMAL),
     ConstraintSyntaxNewString("allowtlsversion", "", "Minimum TLS version allowed for incoming connections", SYNTAX_STATUS_NORMAL),
+    ConstraintSyntaxNewInt("workerthreads", CF_VALRANGE, "Number of threads started in advance to handle connections, at most maxconnections. Default value: same as maxconnections", SYNTAX_STATUS_NORMAL),
+    ConstraintSyntaxNewInt("connectionqueuesize", CF_VALRANGE, "Maximum number of accepted connections or requests waiting for a free worker thread. Default value: same as maxconnections", SYNTAX_STATUS_NORMAL),
+    ConstraintSyntaxNewBool("precomputedigests", "true/false hash the files under admitted paths in the background at startup, so that digest comparisons of unchanged files are answered without reading them. Default value: false", SYNTAX_STATUS_NORMAL),
     ConstraintSyntaxNewNull()
 };
 
@@ -54,6 +54,9 @@ typedef enum
     SERVER_CONTROL_ALLOWCIPHERS,
     SERVER_CONTROL_ALLOWLEGACYCONNECTS,
     SERVER_CONTROL_ALLOWTLSVERSION,
+    SERVER_CONTROL_WORKER_THREADS,
+    SERVER_CONTROL_CONNECTION_QUEUE_SIZE,
+    SERVER_CONTROL_PRECOMPUTE_DIGESTS,
     SERVER_CONTROL_MAX
 } ServerControl;
 
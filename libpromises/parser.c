@@ -68,6 +68,8 @@ static void ParserStateReset(ParserState *p, bool discard)
     p->line_pos = 1;
     p->error_count = 0;
     p->warning_count = 0;
+    /* Offsets are within the file, whatever was parsed before it. */
+    memset(&p->offsets, 0, sizeof(p->offsets));
     p->list_nesting = 0;
     p->arg_nesting = 0;
 
@@ -151,6 +153,23 @@ Policy *ParserParseFile(AgentType agent_type, const char *path, unsigned int war
     return policy;
 }
 
+bool ParserBundleIsRelevant(AgentType agent_type, const char *bundle_type)
+{
+    if (agent_type == AGENT_TYPE_COMMON || strcmp(CF_COMMONC, bundle_type) == 0)
+    {
+        return true;
+    }
+
+    /* Here are some additional bundle types handled by cf-agent */
+    if (agent_type == AGENT_TYPE_AGENT)
+    {
+        return (strcmp(bundle_type, "edit_line") == 0 ||
+                strcmp(bundle_type, "edit_xml") == 0);
+    }
+
+    return false;
+}
+
 int ParserWarningFromString(const char *warning_str)
 {
     if (strcmp("deprecated", warning_str) == 0)
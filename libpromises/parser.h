@@ -38,6 +38,12 @@
 int ParserWarningFromString(const char *warning_str);
 const char *ParserWarningToString(unsigned int warning);
 
+/**
+ * @return true if bundles of #bundle_type are kept when parsing for
+ *         #agent_type, besides the bundles of the agent's own type
+ */
+bool ParserBundleIsRelevant(AgentType agent_type, const char *bundle_type);
+
 /**
  * @brief Parse a CFEngine file to create a Policy DOM
  * @param agent_type Which agent is parsing the file. The parser will ignore elements not pertitent to its type
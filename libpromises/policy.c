@@ -218,7 +218,8 @@ static unsigned BundleHash(const Bundle *bundle, unsigned seed, unsigned max)
 
 unsigned PolicyHash(const Policy *policy)
 {
-    static const unsigned max = UINT_MAX;
+    /* The hash functions need a power of 2. */
+    static const unsigned max = 1U << 31;
     unsigned hash = 0;
 
     for (size_t i = 0; i < SeqLength(policy->bodies); i++)
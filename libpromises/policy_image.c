@@ -0,0 +1,769 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <policy_image.h>
+
+#include <parser.h>
+#include <rlist.h>
+#include <fncall.h>
+#include <buffer.h>
+#include <file_lib.h>
+#include <dir.h>
+#include <files_lib.h>                          /* MakeParentDirectory */
+#include <known_dirs.h>
+#include <string_lib.h>
+#include <prototypes3.h>                        /* Version */
+
+#ifndef __MINGW32__
+# include <sys/mman.h>
+#endif
+
+#define POLICY_IMAGE_MAGIC 0x43465049           /* "CFPI" */
+#define POLICY_IMAGE_NULL_STRING UINT32_MAX
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t hash;                              /* PolicyHash() */
+    uint32_t length;                            /* of what follows */
+} PolicyImageHeader;
+
+/*
+ * Everything is written in host byte order, a mismatch shows as a bad magic.
+ *
+ * string:     uint32 length (or POLICY_IMAGE_NULL_STRING) and the bytes
+ * rval:       uint8 RvalType, then
+ *               scalar:    string
+ *               list:      rlist
+ *               fncall:    string name, rlist args
+ *               container: json
+ * json:       'o', uint32 count and the string keys and json values, or
+ *             'a', uint32 count and the json values, or
+ *             'p', uint8 JsonPrimitiveType and the string value
+ *             (keys keep their order, which writing JSON text would sort)
+ * rlist:      uint32 count and the rvals
+ * offset:     4 uint64, as in SourceOffset
+ * constraint: string lval, rval, string classes, uint8 references_body, offset
+ * body:       string type, name, ns, rlist args, string source_path, offset,
+ *             uint32 count and the constraints
+ * promise:    string classes, comment, promiser, rval promisee, offset,
+ *             uint32 count and the constraints
+ * bundle:     string type, name, ns, rlist args, string source_path, offset,
+ *             uint32 count and the promise types:
+ *               string name, offset, uint32 count and the promises
+ *
+ * After the header: string version, string source path, string checksum,
+ * uint32 count and the bodies, uint32 count and the bundles.
+ */
+
+/*********************************************************************/
+
+static void WriteUInt32(Buffer *out, uint32_t value)
+{
+    BufferAppend(out, (const char *) &value, sizeof(value));
+}
+
+static void WriteString(Buffer *out, const char *str)
+{
+    if (str == NULL)
+    {
+        WriteUInt32(out, POLICY_IMAGE_NULL_STRING);
+        return;
+    }
+
+    size_t length = strlen(str);
+    WriteUInt32(out, length);
+    BufferAppend(out, str, length);
+}
+
+static void WriteOffset(Buffer *out, const SourceOffset *offset)
+{
+    const uint64_t values[4] = {
+        offset->start, offset->end, offset->line, offset->context
+    };
+    BufferAppend(out, (const char *) values, sizeof(values));
+}
+
+static void WriteJson(Buffer *out, const JsonElement *element)
+{
+    if (JsonGetElementType(element) == JSON_ELEMENT_TYPE_PRIMITIVE)
+    {
+        BufferAppendChar(out, 'p');
+        BufferAppendChar(out, JsonGetPrimitiveType(element));
+        WriteString(out, JsonPrimitiveGetAsString(element));
+        return;
+    }
+
+    const bool object = (JsonGetContainerType(element) == JSON_CONTAINER_TYPE_OBJECT);
+    BufferAppendChar(out, object ? 'o' : 'a');
+    WriteUInt32(out, JsonLength(element));
+
+    JsonIterator iter = JsonIteratorInit(element);
+    const JsonElement *child;
+    while ((child = JsonIteratorNextValue(&iter)) != NULL)
+    {
+        if (object)
+        {
+            WriteString(out, JsonIteratorCurrentKey(&iter));
+        }
+        WriteJson(out, child);
+    }
+}
+
+static void WriteRlist(Buffer *out, const Rlist *list);
+
+static void WriteRval(Buffer *out, Rval rval)
+{
+    BufferAppendChar(out, rval.type);
+
+    switch (rval.type)
+    {
+    case RVAL_TYPE_SCALAR:
+        WriteString(out, RvalScalarValue(rval));
+        break;
+
+    case RVAL_TYPE_LIST:
+        WriteRlist(out, RvalRlistValue(rval));
+        break;
+
+    case RVAL_TYPE_FNCALL:
+        WriteString(out, RvalFnCallValue(rval)->name);
+        WriteRlist(out, RvalFnCallValue(rval)->args);
+        break;
+
+    case RVAL_TYPE_CONTAINER:
+        WriteJson(out, RvalContainerValue(rval));
+        break;
+
+    case RVAL_TYPE_NOPROMISEE:
+        break;
+    }
+}
+
+static void WriteRlist(Buffer *out, const Rlist *list)
+{
+    WriteUInt32(out, RlistLen(list));
+    for (const Rlist *rp = list; rp != NULL; rp = rp->next)
+    {
+        WriteRval(out, rp->val);
+    }
+}
+
+static void WriteConstraints(Buffer *out, const Seq *constraints)
+{
+    WriteUInt32(out, SeqLength(constraints));
+    for (size_t i = 0; i < SeqLength(constraints); i++)
+    {
+        const Constraint *cp = SeqAt(constraints, i);
+        WriteString(out, cp->lval);
+        WriteRval(out, cp->rval);
+        WriteString(out, cp->classes);
+        BufferAppendChar(out, cp->references_body);
+        WriteOffset(out, &cp->offset);
+    }
+}
+
+static void WritePolicy(Buffer *out, const Policy *policy)
+{
+    WriteUInt32(out, SeqLength(policy->bodies));
+    for (size_t i = 0; i < SeqLength(policy->bodies); i++)
+    {
+        const Body *body = SeqAt(policy->bodies, i);
+        WriteString(out, body->type);
+        WriteString(out, body->name);
+        WriteString(out, body->ns);
+        WriteRlist(out, body->args);
+        WriteString(out, body->source_path);
+        WriteOffset(out, &body->offset);
+        WriteConstraints(out, body->conlist);
+    }
+
+    WriteUInt32(out, SeqLength(policy->bundles));
+    for (size_t i = 0; i < SeqLength(policy->bundles); i++)
+    {
+        const Bundle *bundle = SeqAt(policy->bundles, i);
+        WriteString(out, bundle->type);
+        WriteString(out, bundle->name);
+        WriteString(out, bundle->ns);
+        WriteRlist(out, bundle->args);
+        WriteString(out, bundle->source_path);
+        WriteOffset(out, &bundle->offset);
+
+        WriteUInt32(out, SeqLength(bundle->promise_types));
+        for (size_t j = 0; j < SeqLength(bundle->promise_types); j++)
+        {
+            const PromiseType *type = SeqAt(bundle->promise_types, j);
+            WriteString(out, type->name);
+            WriteOffset(out, &type->offset);
+
+            WriteUInt32(out, SeqLength(type->promises));
+            for (size_t k = 0; k < SeqLength(type->promises); k++)
+            {
+                const Promise *pp = SeqAt(type->promises, k);
+                WriteString(out, pp->classes);
+                WriteString(out, pp->comment);
+                WriteString(out, pp->promiser);
+                WriteRval(out, pp->promisee);
+                WriteOffset(out, &pp->offset);
+                WriteConstraints(out, pp->conlist);
+            }
+        }
+    }
+}
+
+void PolicyImageDirectory(char *dst, size_t dst_size)
+{
+    snprintf(dst, dst_size, "%s%cpolicy_images", GetStateDir(), FILE_SEPARATOR);
+    MapName(dst);
+}
+
+void PolicyImageFilename(char *dst, size_t dst_size, const char *checksum)
+{
+    char dirname[CF_BUFSIZE];
+    PolicyImageDirectory(dirname, sizeof(dirname));
+    snprintf(dst, dst_size, "%s%c%s.img", dirname, FILE_SEPARATOR, checksum);
+}
+
+bool PolicyImageWrite(const Policy *policy, const char *image_file,
+                      const char *source_path, const char *checksum)
+{
+    Buffer *out = BufferNew();
+    BufferSetMode(out, BUFFER_BEHAVIOR_BYTEARRAY);
+    WriteString(out, Version());
+    WriteString(out, source_path);
+    WriteString(out, checksum);
+    WritePolicy(out, policy);
+
+    const PolicyImageHeader header = {
+        .magic = POLICY_IMAGE_MAGIC,
+        .version = POLICY_IMAGE_VERSION,
+        .hash = PolicyHash(policy),
+        .length = BufferSize(out),
+    };
+
+    char tmp_file[CF_BUFSIZE];
+    snprintf(tmp_file, sizeof(tmp_file), "%s.%ju", image_file, (uintmax_t) getpid());
+
+    if (!MakeParentDirectory(image_file, false))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Could not create directory for policy image '%s'", image_file);
+        BufferDestroy(out);
+        return false;
+    }
+
+    int fd = safe_open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+    if (fd == -1)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Could not create policy image '%s' (open: %s)", tmp_file, GetErrorStr());
+        BufferDestroy(out);
+        return false;
+    }
+
+    bool ok = (FullWrite(fd, (const char *) &header, sizeof(header)) == sizeof(header) &&
+               FullWrite(fd, BufferData(out), BufferSize(out)) == (ssize_t) BufferSize(out));
+    if (!ok)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Could not write policy image '%s' (write: %s)", tmp_file, GetErrorStr());
+    }
+    if (close(fd) == -1)
+    {
+        ok = false;
+    }
+
+#ifdef __MINGW32__
+    unlink(image_file);                         /* rename() does not replace */
+#endif
+
+    /* Readers see either the old image or the complete new one. */
+    if (ok && rename(tmp_file, image_file) == -1)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Could not save policy image '%s' (rename: %s)", image_file, GetErrorStr());
+        ok = false;
+    }
+
+    if (ok)
+    {
+        Log(LOG_LEVEL_DEBUG, "Saved policy image '%s' of '%s'", image_file, source_path);
+    }
+    else
+    {
+        unlink(tmp_file);
+    }
+
+    BufferDestroy(out);
+    return ok;
+}
+
+/*********************************************************************/
+
+typedef struct
+{
+    const char *data;
+    size_t length;
+    size_t pos;
+    bool error;                                 /* read past the end */
+} ImageReader;
+
+static const void *ReadBytes(ImageReader *in, size_t length)
+{
+    if (in->error || length > in->length - in->pos)
+    {
+        in->error = true;
+        return NULL;
+    }
+
+    const void *bytes = in->data + in->pos;
+    in->pos += length;
+    return bytes;
+}
+
+static uint32_t ReadUInt32(ImageReader *in)
+{
+    uint32_t value = 0;
+    const void *bytes = ReadBytes(in, sizeof(value));
+    if (bytes != NULL)
+    {
+        memcpy(&value, bytes, sizeof(value));
+    }
+    return value;
+}
+
+/* A count of items, each taking at least a byte of what is left. */
+static uint32_t ReadCount(ImageReader *in)
+{
+    uint32_t count = ReadUInt32(in);
+    if (count > in->length - in->pos)
+    {
+        in->error = true;
+        return 0;
+    }
+    return count;
+}
+
+static char ReadChar(ImageReader *in)
+{
+    const char *byte = ReadBytes(in, 1);
+    return (byte != NULL) ? *byte : '\0';
+}
+
+static char *ReadString(ImageReader *in)
+{
+    uint32_t length = ReadUInt32(in);
+    if (length == POLICY_IMAGE_NULL_STRING)
+    {
+        return NULL;
+    }
+
+    const char *bytes = ReadBytes(in, length);
+    return (bytes != NULL) ? xstrndup(bytes, length) : NULL;
+}
+
+/* Compares a string of the image with #expected without copying it. */
+static bool ReadStringEquals(ImageReader *in, const char *expected)
+{
+    uint32_t length = ReadUInt32(in);
+    if (length == POLICY_IMAGE_NULL_STRING)
+    {
+        return false;
+    }
+
+    const char *bytes = ReadBytes(in, length);
+    return (bytes != NULL && length == strlen(expected) &&
+            memcmp(bytes, expected, length) == 0);
+}
+
+static SourceOffset ReadOffset(ImageReader *in)
+{
+    uint64_t values[4] = { 0 };
+    const void *bytes = ReadBytes(in, sizeof(values));
+    if (bytes != NULL)
+    {
+        memcpy(values, bytes, sizeof(values));
+    }
+    return (SourceOffset) {
+        .start = values[0], .end = values[1],
+        .line = values[2], .context = values[3]
+    };
+}
+
+static JsonElement *ReadJson(ImageReader *in)
+{
+    const char kind = ReadChar(in);
+
+    if (kind == 'p')
+    {
+        const JsonPrimitiveType type = ReadChar(in);
+        char *value = ReadString(in);
+        JsonElement *primitive = NULL;
+        if (value == NULL)
+        {
+            in->error = true;
+        }
+        else if (type == JSON_PRIMITIVE_TYPE_STRING)
+        {
+            primitive = JsonStringCreate(value);
+        }
+        else
+        {
+            /* Numbers keep their text this way. */
+            const char *data = value;
+            if (JsonParse(&data, &primitive) != JSON_PARSE_OK ||
+                JsonGetElementType(primitive) != JSON_ELEMENT_TYPE_PRIMITIVE)
+            {
+                JsonDestroy(primitive);
+                primitive = NULL;
+                in->error = true;
+            }
+        }
+        free(value);
+        return primitive;
+    }
+    else if (kind != 'o' && kind != 'a')
+    {
+        in->error = true;
+        return NULL;
+    }
+
+    const uint32_t count = ReadCount(in);
+    JsonElement *container = (kind == 'o') ? JsonObjectCreate(count) : JsonArrayCreate(count);
+    for (uint32_t i = 0; i < count && !in->error; i++)
+    {
+        char *key = (kind == 'o') ? ReadString(in) : NULL;
+        JsonElement *child = ReadJson(in);
+        if (child == NULL || (kind == 'o' && key == NULL))
+        {
+            in->error = true;
+            JsonDestroy(child);
+        }
+        else if (kind == 'o')
+        {
+            JsonObjectAppendElement(container, key, child);
+        }
+        else
+        {
+            JsonArrayAppendElement(container, child);
+        }
+        free(key);
+    }
+
+    return container;
+}
+
+static Rlist *ReadRlist(ImageReader *in);
+
+static Rval ReadRval(ImageReader *in)
+{
+    RvalType type = ReadChar(in);
+
+    switch (type)
+    {
+    case RVAL_TYPE_SCALAR:
+        return (Rval) { ReadString(in), RVAL_TYPE_SCALAR };
+
+    case RVAL_TYPE_LIST:
+        return (Rval) { ReadRlist(in), RVAL_TYPE_LIST };
+
+    case RVAL_TYPE_FNCALL:
+    {
+        char *name = ReadString(in);
+        FnCall *fp = FnCallNew(name ? name : "", ReadRlist(in));
+        free(name);
+        return (Rval) { fp, RVAL_TYPE_FNCALL };
+    }
+
+    case RVAL_TYPE_CONTAINER:
+    {
+        JsonElement *json = ReadJson(in);
+        if (json == NULL)
+        {
+            return (Rval) { NULL, RVAL_TYPE_NOPROMISEE };
+        }
+        return (Rval) { json, RVAL_TYPE_CONTAINER };
+    }
+
+    case RVAL_TYPE_NOPROMISEE:
+        return (Rval) { NULL, RVAL_TYPE_NOPROMISEE };
+
+    default:
+        in->error = true;
+        return (Rval) { NULL, RVAL_TYPE_NOPROMISEE };
+    }
+}
+
+static Rlist *ReadRlist(ImageReader *in)
+{
+    Rlist *list = NULL;
+    Rlist **tail = &list;
+
+    uint32_t count = ReadCount(in);
+    for (uint32_t i = 0; i < count && !in->error; i++)
+    {
+        Rlist *rp = xmalloc(sizeof(Rlist));
+        rp->val = ReadRval(in);
+        rp->next = NULL;
+        *tail = rp;
+        tail = &rp->next;
+    }
+
+    return list;
+}
+
+static Constraint *ReadConstraint(ImageReader *in)
+{
+    Constraint *cp = xcalloc(1, sizeof(Constraint));
+    cp->lval = ReadString(in);
+    cp->rval = ReadRval(in);
+    cp->classes = ReadString(in);
+    cp->references_body = ReadChar(in);
+    cp->offset = ReadOffset(in);
+    return cp;
+}
+
+static void ReadPolicy(ImageReader *in, Policy *policy)
+{
+    uint32_t bodies = ReadCount(in);
+    for (uint32_t i = 0; i < bodies && !in->error; i++)
+    {
+        Body *body = xcalloc(1, sizeof(Body));
+        body->parent_policy = policy;
+        SeqAppend(policy->bodies, body);
+
+        body->type = ReadString(in);
+        body->name = ReadString(in);
+        body->ns = ReadString(in);
+        body->args = ReadRlist(in);
+        body->source_path = ReadString(in);
+        body->offset = ReadOffset(in);
+
+        uint32_t constraints = ReadCount(in);
+        body->conlist = SeqNew(constraints, ConstraintDestroy);
+        for (uint32_t j = 0; j < constraints && !in->error; j++)
+        {
+            Constraint *cp = ReadConstraint(in);
+            cp->type = POLICY_ELEMENT_TYPE_BODY;
+            cp->parent.body = body;
+            SeqAppend(body->conlist, cp);
+        }
+    }
+
+    uint32_t bundles = ReadCount(in);
+    for (uint32_t i = 0; i < bundles && !in->error; i++)
+    {
+        Bundle *bundle = xcalloc(1, sizeof(Bundle));
+        bundle->parent_policy = policy;
+        SeqAppend(policy->bundles, bundle);
+
+        bundle->type = ReadString(in);
+        bundle->name = ReadString(in);
+        bundle->ns = ReadString(in);
+        bundle->args = ReadRlist(in);
+        bundle->source_path = ReadString(in);
+        bundle->offset = ReadOffset(in);
+
+        uint32_t types = ReadCount(in);
+        bundle->promise_types = SeqNew(types, PromiseTypeDestroy);
+        for (uint32_t j = 0; j < types && !in->error; j++)
+        {
+            PromiseType *type = xcalloc(1, sizeof(PromiseType));
+            type->parent_bundle = bundle;
+            SeqAppend(bundle->promise_types, type);
+
+            type->name = ReadString(in);
+            type->offset = ReadOffset(in);
+
+            uint32_t promises = ReadCount(in);
+            type->promises = SeqNew(promises, PromiseDestroy);
+            for (uint32_t k = 0; k < promises && !in->error; k++)
+            {
+                Promise *pp = xcalloc(1, sizeof(Promise));
+                pp->parent_promise_type = type;
+                pp->org_pp = pp;
+                SeqAppend(type->promises, pp);
+
+                pp->classes = ReadString(in);
+                pp->comment = ReadString(in);
+                pp->promiser = ReadString(in);
+                pp->promisee = ReadRval(in);
+                pp->offset = ReadOffset(in);
+
+                uint32_t constraints = ReadCount(in);
+                pp->conlist = SeqNew(constraints, ConstraintDestroy);
+                for (uint32_t l = 0; l < constraints && !in->error; l++)
+                {
+                    Constraint *cp = ReadConstraint(in);
+                    cp->type = POLICY_ELEMENT_TYPE_PROMISE;
+                    cp->parent.promise = pp;
+                    SeqAppend(pp->conlist, cp);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Drop the bundles the parser would have skipped for #agent_type, the
+ * image was written by cf-promises which keeps them all.
+ */
+static void PolicyImageFilterBundles(Policy *policy, AgentType agent_type)
+{
+    for (size_t i = SeqLength(policy->bundles); i-- > 0; )
+    {
+        const Bundle *bundle = SeqAt(policy->bundles, i);
+        if (!ParserBundleIsRelevant(agent_type, bundle->type) &&
+            strcmp(CF_AGENTTYPES[agent_type], bundle->type) != 0)
+        {
+            SeqRemove(policy->bundles, i);
+        }
+    }
+}
+
+/**
+ * @return the policy of the image in #data, or NULL if it is not an image
+ *         of #source_path with checksum #checksum, written by this version.
+ */
+static Policy *PolicyImageDecode(const char *data, size_t length,
+                                 const char *source_path, const char *checksum)
+{
+    ImageReader in = { data, length, 0, false };
+
+    const PolicyImageHeader *header = ReadBytes(&in, sizeof(PolicyImageHeader));
+    if (header == NULL ||
+        header->magic != POLICY_IMAGE_MAGIC ||
+        header->version != POLICY_IMAGE_VERSION ||
+        header->length != length - sizeof(PolicyImageHeader))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Policy image of '%s' has an unknown format", source_path);
+        return NULL;
+    }
+
+    if (!ReadStringEquals(&in, Version()) ||
+        !ReadStringEquals(&in, source_path) ||
+        !ReadStringEquals(&in, checksum))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Policy image of '%s' is stale", source_path);
+        return NULL;
+    }
+
+    Policy *policy = PolicyNew();
+    ReadPolicy(&in, policy);
+
+    if (in.error || in.pos != length || PolicyHash(policy) != header->hash)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Policy image of '%s' is damaged", source_path);
+        PolicyDestroy(policy);
+        return NULL;
+    }
+
+    return policy;
+}
+
+Policy *PolicyImageRead(const char *image_file, const char *source_path,
+                        const char *checksum, AgentType agent_type)
+{
+    int fd = safe_open(image_file, O_RDONLY | O_BINARY);
+    if (fd == -1)
+    {
+        Log(LOG_LEVEL_DEBUG, "No policy image '%s' (open: %s)", image_file, GetErrorStr());
+        return NULL;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+#ifndef _WIN32
+    if (sb.st_mode & (S_IWGRP | S_IWOTH))
+    {
+        Log(LOG_LEVEL_ERR, "Policy image '%s' is writable by others (security exception)", image_file);
+        close(fd);
+        return NULL;
+    }
+#endif
+
+    size_t length = sb.st_size;
+    Policy *policy = NULL;
+
+#ifndef __MINGW32__
+    void *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Could not map policy image '%s' (mmap: %s)", image_file, GetErrorStr());
+        return NULL;
+    }
+
+    policy = PolicyImageDecode(data, length, source_path, checksum);
+    munmap(data, length);
+#else
+    char *data = xmalloc(length);
+    if (FullRead(fd, data, length) == (ssize_t) length)
+    {
+        policy = PolicyImageDecode(data, length, source_path, checksum);
+    }
+    close(fd);
+    free(data);
+#endif
+
+    if (policy != NULL)
+    {
+        PolicyImageFilterBundles(policy, agent_type);
+    }
+
+    return policy;
+}
+
+void PolicyImagePurge(const char *dirname, time_t max_age)
+{
+    Dir *dirh = DirOpen(dirname);
+    if (dirh == NULL)
+    {
+        return;
+    }
+
+    const time_t now = time(NULL);
+    const struct dirent *dirp;
+    while ((dirp = DirRead(dirh)) != NULL)
+    {
+        if (!StringEndsWith(dirp->d_name, ".img"))
+        {
+            continue;
+        }
+
+        char filename[CF_BUFSIZE];
+        snprintf(filename, sizeof(filename), "%s%c%s", dirname, FILE_SEPARATOR, dirp->d_name);
+
+        struct stat sb;
+        if (stat(filename, &sb) == 0 && now - sb.st_mtime > max_age)
+        {
+            Log(LOG_LEVEL_DEBUG, "Removing old policy image '%s'", filename);
+            unlink(filename);
+        }
+    }
+
+    DirClose(dirh);
+}
@@ -0,0 +1,79 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_POLICY_IMAGE_H
+#define CFENGINE_POLICY_IMAGE_H
+
+#include <policy.h>
+
+/**
+ * Policy images are a binary serialization of the Policy parsed from one
+ * policy file, written by cf-promises so that the other agents can skip
+ * lexing, parsing and the per-file checks of files that did not change.
+ *
+ * An image holds the whole parse of the file (bundles of all agent types);
+ * it is keyed by the checksum of the file contents, records the path it
+ * was parsed from and the version of CFEngine that wrote it, and carries
+ * the PolicyHash() of its contents to detect damaged images. The format
+ * only uses offsets, so images are read straight from an mmap()ed file.
+ */
+
+#define POLICY_IMAGE_VERSION 1
+
+/* Images not rewritten in this many seconds are purged by cf-promises. */
+#define POLICY_IMAGE_MAX_AGE SECONDS_PER_WEEK
+
+/**
+ * @brief Get the directory of the policy images, in the state directory.
+ */
+void PolicyImageDirectory(char *dst, size_t dst_size);
+
+/**
+ * @brief Get the file name of the image of a file with the given checksum,
+ *        in the policy_images directory of the state directory.
+ */
+void PolicyImageFilename(char *dst, size_t dst_size, const char *checksum);
+
+/**
+ * @brief Write the image of #policy, parsed from #source_path with contents
+ *        checksum #checksum, atomically to #image_file.
+ * @return true if successful
+ */
+bool PolicyImageWrite(const Policy *policy, const char *image_file,
+                      const char *source_path, const char *checksum);
+
+/**
+ * @brief Read the image of #source_path with contents checksum #checksum
+ *        as #agent_type would have parsed it.
+ * @return the Policy, or NULL if the image is missing, stale or damaged
+ */
+Policy *PolicyImageRead(const char *image_file, const char *source_path,
+                        const char *checksum, AgentType agent_type);
+
+/**
+ * @brief Remove images in #dirname that were not written for #max_age seconds.
+ */
+void PolicyImagePurge(const char *dirname, time_t max_age);
+
+#endif
@@ -0,0 +1,72 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_PROCESS_TABLE_H
+#define CFENGINE_PROCESS_TABLE_H
+
+#include <platform.h>
+#include <map.h>                                              /* StringMap */
+
+
+/**
+ * Process table read straight from the kernel instead of parsed from ps
+ * output. It is stored by column, one array per attribute, so that process
+ * selection compares typed values without splitting any text. Row i of every
+ * array describes the same process.
+ *
+ * line[i] is a ps-like rendering of the row below #legend, kept for logging,
+ * findprocesses() and the cf_procs files in the state directory.
+ */
+typedef struct
+{
+    size_t count;
+    size_t capacity;
+
+    pid_t *pid;
+    pid_t *ppid;
+    pid_t *pgid;
+    uid_t *uid;
+    const char **user;
+    char *state;                         /* R, S, D, Z, T, ... as in ps -o s */
+    int *nice;
+    int *threads;
+    long *vsize;                                                     /* KiB */
+    long *rsize;                                                     /* KiB */
+    time_t *start;                                 /* Unix time of creation */
+    time_t *cputime;                          /* user + system, in seconds */
+    const char **tty;
+    char **command;                  /* arguments, or [name] for kthreads */
+    char **line;
+
+    char *legend;
+    time_t loaded;                          /* when the table was read */
+
+    StringMap *names;             /* interned user and terminal names */
+} ProcessTable;
+
+ProcessTable *ProcessTableLoad(const char *proc_root);
+void ProcessTableDestroy(ProcessTable *table);
+
+
+#endif
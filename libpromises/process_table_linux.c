@@ -0,0 +1,491 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <cf3.defs.h>
+
+#include <process_table.h>
+#include <file_lib.h>                                            /* FullRead */
+#include <printsize.h>
+
+#include <pwd.h>
+
+
+#define PROCESS_TABLE_LEGEND                                            \
+    "USER          PID     PPID     PGID %CPU %MEM       VSZ  NI       RSS NLWP STIME     ELAPSED     TIME COMMAND"
+
+/* Longer command lines are truncated, they only matter for matching. */
+#define PROCESS_CMDLINE_MAX (128 * 1024)
+
+
+/* Values of a single process, as read from /proc/<pid>. */
+typedef struct
+{
+    pid_t pid;
+    pid_t ppid;
+    pid_t pgid;
+    uid_t uid;
+    char state;
+    int tty_nr;
+    int nice;
+    int threads;
+    unsigned long long utime;                                      /* ticks */
+    unsigned long long stime;                                      /* ticks */
+    unsigned long long starttime;                     /* ticks after boot */
+    unsigned long vsize;                                           /* bytes */
+    long rss;                                                      /* pages */
+    char comm[64];
+} ProcEntry;
+
+/* System wide values needed to convert what /proc/<pid> says. */
+typedef struct
+{
+    time_t boot_time;
+    long clock_ticks;
+    long page_kb;
+    long mem_total_kb;
+} ProcSystem;
+
+
+static ssize_t ReadProcFile(const char *path, char *buf, size_t size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    ssize_t len = FullRead(fd, buf, size - 1);
+    close(fd);
+
+    if (len < 0)
+    {
+        return -1;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+static bool ReadProcSystem(const char *proc_root, ProcSystem *sys)
+{
+    char path[PATH_MAX];
+    char buf[CF_BUFSIZE * 4];
+
+    sys->clock_ticks = sysconf(_SC_CLK_TCK);
+    sys->page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    sys->boot_time = 0;
+    sys->mem_total_kb = 0;
+
+    xsnprintf(path, sizeof(path), "%s/stat", proc_root);
+    if (ReadProcFile(path, buf, sizeof(buf)) > 0)
+    {
+        const char *btime = strstr(buf, "\nbtime ");
+        if (btime != NULL)
+        {
+            long value;
+            if (sscanf(btime, "\nbtime %ld", &value) == 1)
+            {
+                sys->boot_time = value;
+            }
+        }
+    }
+
+    xsnprintf(path, sizeof(path), "%s/meminfo", proc_root);
+    if (ReadProcFile(path, buf, sizeof(buf)) > 0)
+    {
+        sscanf(buf, "MemTotal: %ld kB", &sys->mem_total_kb);
+    }
+
+    return (sys->boot_time > 0 && sys->clock_ticks > 0);
+}
+
+/**
+ * /proc/<pid>/stat is "<pid> (<comm>) <state> <ppid> ...". The command name
+ * may contain spaces and parentheses, so search for the last ')' first.
+ */
+static bool ParseProcStat(const char *buf, size_t len, ProcEntry *entry)
+{
+    const char *open_paren = strchr(buf, '(');
+    const char *close_paren = memrchr(buf, ')', len);
+    if (open_paren == NULL || close_paren == NULL || close_paren < open_paren)
+    {
+        return false;
+    }
+
+    size_t comm_len = MIN((size_t) (close_paren - open_paren - 1),
+                          sizeof(entry->comm) - 1);
+    memcpy(entry->comm, open_paren + 1, comm_len);
+    entry->comm[comm_len] = '\0';
+
+    int ret = sscanf(close_paren + 1,
+                     " %c"    /* state */
+                     " %d"    /* ppid */
+                     " %d"    /* pgrp */
+                     " %*s"   /* session */
+                     " %d"    /* tty_nr */
+                     " %*s"   /* tpgid */
+                     " %*s"   /* flags */
+                     " %*s"   /* minflt */
+                     " %*s"   /* cminflt */
+                     " %*s"   /* majflt */
+                     " %*s"   /* cmajflt */
+                     " %llu"  /* utime */
+                     " %llu"  /* stime */
+                     " %*s"   /* cutime */
+                     " %*s"   /* cstime */
+                     " %*s"   /* priority */
+                     " %d"    /* nice */
+                     " %d"    /* num_threads */
+                     " %*s"   /* itrealvalue */
+                     " %llu"  /* starttime */
+                     " %lu"   /* vsize */
+                     " %ld",  /* rss */
+                     &entry->state, &entry->ppid, &entry->pgid,
+                     &entry->tty_nr, &entry->utime, &entry->stime,
+                     &entry->nice, &entry->threads, &entry->starttime,
+                     &entry->vsize, &entry->rss);
+    return (ret == 11);
+}
+
+/* ps reports the effective user, the second value of the Uid: line. */
+static bool ParseProcStatus(const char *buf, ProcEntry *entry)
+{
+    const char *uid_line = strstr(buf, "\nUid:");
+    unsigned int euid;
+    if (uid_line == NULL ||
+        sscanf(uid_line, "\nUid: %*u %u", &euid) != 1)
+    {
+        return false;
+    }
+
+    entry->uid = euid;
+    return true;
+}
+
+/**
+ * Arguments are separated by '\0', which become spaces. Kernel threads have
+ * none and are shown as "[name]", like ps does.
+ */
+static char *ReadProcCmdline(const char *path, const ProcEntry *entry,
+                             char *buf, size_t size)
+{
+    ssize_t len = ReadProcFile(path, buf, size);
+    while (len > 0 && buf[len - 1] == '\0')
+    {
+        len--;
+    }
+
+    if (len <= 0)
+    {
+        char *command;
+        xasprintf(&command, "[%s]%s", entry->comm,
+                  (entry->state == 'Z') ? " <defunct>" : "");
+        return command;
+    }
+
+    for (ssize_t i = 0; i < len; i++)
+    {
+        if (buf[i] == '\0' || buf[i] == '\n')
+        {
+            buf[i] = ' ';
+        }
+    }
+    return xstrndup(buf, len);
+}
+
+static const char *InternName(StringMap *names, const char *key,
+                              const char *value)
+{
+    char *interned = xstrdup(value);
+    StringMapInsert(names, xstrdup(key), interned);
+    return interned;
+}
+
+static const char *UserName(ProcessTable *table, uid_t uid)
+{
+    char key[PRINTSIZE(uid) + 2];
+    xsnprintf(key, sizeof(key), "u%ju", (uintmax_t) uid);
+
+    const char *name = StringMapGet(table->names, key);
+    if (name != NULL)
+    {
+        return name;
+    }
+
+    struct passwd *pw = getpwuid(uid);
+    if (pw != NULL)
+    {
+        return InternName(table->names, key, pw->pw_name);
+    }
+    return InternName(table->names, key, key + 1);
+}
+
+/* Device numbers as in the kernel's Documentation/admin-guide/devices.txt */
+static const char *TtyName(ProcessTable *table, int tty_nr)
+{
+    char key[PRINTSIZE(tty_nr) + 2];
+    xsnprintf(key, sizeof(key), "t%d", tty_nr);
+
+    const char *name = StringMapGet(table->names, key);
+    if (name != NULL)
+    {
+        return name;
+    }
+
+    unsigned int major = (tty_nr >> 8) & 0xfff;
+    unsigned int minor = (tty_nr & 0xff) | ((tty_nr >> 12) & 0xfff00);
+
+    char tty[32];
+    if (tty_nr == 0)
+    {
+        strcpy(tty, "?");
+    }
+    else if (major >= 136 && major <= 143)
+    {
+        xsnprintf(tty, sizeof(tty), "pts/%u", minor + (major - 136) * 256);
+    }
+    else if (major == 4 && minor < 64)
+    {
+        xsnprintf(tty, sizeof(tty), "tty%u", minor);
+    }
+    else if (major == 4)
+    {
+        xsnprintf(tty, sizeof(tty), "ttyS%u", minor - 64);
+    }
+    else
+    {
+        xsnprintf(tty, sizeof(tty), "%u:%u", major, minor);
+    }
+    return InternName(table->names, key, tty);
+}
+
+/* Like ps STIME: time of day if recent, else the date, else the year. */
+static void FormatStartTime(time_t start, time_t now, char *buf, size_t size)
+{
+    struct tm tm_start, tm_now;
+    localtime_r(&start, &tm_start);
+    localtime_r(&now, &tm_now);
+
+    const char *format = "%Y";
+    if (now - start < SECONDS_PER_DAY)
+    {
+        format = "%H:%M";
+    }
+    else if (tm_start.tm_year == tm_now.tm_year)
+    {
+        format = "%b%d";
+    }
+    strftime(buf, size, format, &tm_start);
+}
+
+/* [dd-]hh:mm:ss, or [[dd-]hh:]mm:ss if !with_hours like ps ELAPSED. */
+static void FormatDuration(long secs, bool with_hours, char *buf, size_t size)
+{
+    long days = secs / SECONDS_PER_DAY;
+    long hours = (secs / SECONDS_PER_HOUR) % 24;
+    long minutes = (secs / SECONDS_PER_MINUTE) % 60;
+    secs %= 60;
+
+    if (days > 0)
+    {
+        xsnprintf(buf, size, "%ld-%02ld:%02ld:%02ld", days, hours, minutes, secs);
+    }
+    else if (hours > 0 || with_hours)
+    {
+        xsnprintf(buf, size, "%02ld:%02ld:%02ld", hours, minutes, secs);
+    }
+    else
+    {
+        xsnprintf(buf, size, "%02ld:%02ld", minutes, secs);
+    }
+}
+
+static void ProcessTableGrow(ProcessTable *table)
+{
+    size_t n = (table->capacity == 0) ? 1024 : table->capacity * 2;
+
+    table->pid = xrealloc(table->pid, n * sizeof(*table->pid));
+    table->ppid = xrealloc(table->ppid, n * sizeof(*table->ppid));
+    table->pgid = xrealloc(table->pgid, n * sizeof(*table->pgid));
+    table->uid = xrealloc(table->uid, n * sizeof(*table->uid));
+    table->user = xrealloc(table->user, n * sizeof(*table->user));
+    table->state = xrealloc(table->state, n * sizeof(*table->state));
+    table->nice = xrealloc(table->nice, n * sizeof(*table->nice));
+    table->threads = xrealloc(table->threads, n * sizeof(*table->threads));
+    table->vsize = xrealloc(table->vsize, n * sizeof(*table->vsize));
+    table->rsize = xrealloc(table->rsize, n * sizeof(*table->rsize));
+    table->start = xrealloc(table->start, n * sizeof(*table->start));
+    table->cputime = xrealloc(table->cputime, n * sizeof(*table->cputime));
+    table->tty = xrealloc(table->tty, n * sizeof(*table->tty));
+    table->command = xrealloc(table->command, n * sizeof(*table->command));
+    table->line = xrealloc(table->line, n * sizeof(*table->line));
+
+    table->capacity = n;
+}
+
+static void ProcessTableAppend(ProcessTable *table, const ProcSystem *sys,
+                               const ProcEntry *entry, char *command)
+{
+    if (table->count == table->capacity)
+    {
+        ProcessTableGrow(table);
+    }
+
+    size_t i = table->count++;
+    table->pid[i] = entry->pid;
+    table->ppid[i] = entry->ppid;
+    table->pgid[i] = entry->pgid;
+    table->uid[i] = entry->uid;
+    table->user[i] = UserName(table, entry->uid);
+    table->state[i] = entry->state;
+    table->nice[i] = entry->nice;
+    table->threads[i] = entry->threads;
+    table->vsize[i] = entry->vsize / 1024;
+    table->rsize[i] = entry->rss * sys->page_kb;
+    table->start[i] = sys->boot_time + entry->starttime / sys->clock_ticks;
+    table->cputime[i] = (entry->utime + entry->stime) / sys->clock_ticks;
+    table->tty[i] = TtyName(table, entry->tty_nr);
+    table->command[i] = command;
+
+    time_t elapsed = MAX(table->loaded - table->start[i], 0);
+    double pcpu = (elapsed > 0) ? 100.0 * table->cputime[i] / elapsed : 0.0;
+    double pmem = (sys->mem_total_kb > 0) ?
+        100.0 * table->rsize[i] / sys->mem_total_kb : 0.0;
+
+    char stime[16], etime[32], cputime[32];
+    FormatStartTime(table->start[i], table->loaded, stime, sizeof(stime));
+    FormatDuration(elapsed, false, etime, sizeof(etime));
+    FormatDuration(table->cputime[i], true, cputime, sizeof(cputime));
+
+    xasprintf(&table->line[i],
+              "%-8s %8jd %8jd %8jd %4.1f %4.1f %9ld %3d %9ld %4d %-5s %11s %8s %s",
+              table->user[i], (intmax_t) table->pid[i],
+              (intmax_t) table->ppid[i], (intmax_t) table->pgid[i],
+              pcpu, pmem, table->vsize[i], table->nice[i], table->rsize[i],
+              table->threads[i], stime, etime, cputime, command);
+}
+
+/**
+ * Read the process table from #proc_root, normally "/proc". Processes that
+ * exit while being read are skipped.
+ *
+ * @return NULL if procfs is not usable, so that the caller can use ps.
+ */
+ProcessTable *ProcessTableLoad(const char *proc_root)
+{
+    ProcSystem sys;
+    if (!ReadProcSystem(proc_root, &sys))
+    {
+        Log(LOG_LEVEL_VERBOSE,
+            "Could not read system information from '%s'", proc_root);
+        return NULL;
+    }
+
+    DIR *dir = opendir(proc_root);
+    if (dir == NULL)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Could not open '%s'. (opendir: %s)",
+            proc_root, GetErrorStr());
+        return NULL;
+    }
+
+    ProcessTable *table = xcalloc(1, sizeof(ProcessTable));
+    table->names = StringMapNew();
+    table->legend = xstrdup(PROCESS_TABLE_LEGEND);
+    table->loaded = time(NULL);
+
+    char *buf = xmalloc(PROCESS_CMDLINE_MAX);
+    char path[PATH_MAX];
+
+    const struct dirent *dirp;
+    while ((dirp = readdir(dir)) != NULL)
+    {
+        char *end;
+        long pid = strtol(dirp->d_name, &end, 10);
+        if (*end != '\0' || pid <= 0)
+        {
+            continue;
+        }
+
+        ProcEntry entry = { .pid = pid };
+
+        xsnprintf(path, sizeof(path), "%s/%ld/stat", proc_root, pid);
+        ssize_t len = ReadProcFile(path, buf, CF_BUFSIZE);
+        if (len <= 0 || !ParseProcStat(buf, len, &entry))
+        {
+            continue;
+        }
+
+        xsnprintf(path, sizeof(path), "%s/%ld/status", proc_root, pid);
+        if (ReadProcFile(path, buf, CF_BUFSIZE) <= 0 ||
+            !ParseProcStatus(buf, &entry))
+        {
+            continue;
+        }
+
+        xsnprintf(path, sizeof(path), "%s/%ld/cmdline", proc_root, pid);
+        char *command = ReadProcCmdline(path, &entry, buf, PROCESS_CMDLINE_MAX);
+
+        ProcessTableAppend(table, &sys, &entry, command);
+    }
+
+    closedir(dir);
+    free(buf);
+
+    Log(LOG_LEVEL_VERBOSE, "Read %zu processes from '%s'",
+        table->count, proc_root);
+    return table;
+}
+
+void ProcessTableDestroy(ProcessTable *table)
+{
+    if (table == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < table->count; i++)
+    {
+        free(table->command[i]);
+        free(table->line[i]);
+    }
+
+    free(table->pid);
+    free(table->ppid);
+    free(table->pgid);
+    free(table->uid);
+    free(table->user);
+    free(table->state);
+    free(table->nice);
+    free(table->threads);
+    free(table->vsize);
+    free(table->rsize);
+    free(table->start);
+    free(table->cputime);
+    free(table->tty);
+    free(table->command);
+    free(table->line);
+    free(table->legend);
+    StringMapDestroy(table->names);
+    free(table);
+}
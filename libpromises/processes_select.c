@@ -42,6 +42,10 @@
 #include <printsize.h>
 #include <known_dirs.h>
 
+#ifdef __linux__
+#include <process_table.h>
+#endif
+
 # ifdef HAVE_GETZONEID
 #include <sequence.h>
 #define MAX_ZONENAME_SIZE 64
@@ -54,6 +58,11 @@
 #endif
 TABLE_STORAGE Item *PROCESSTABLE = NULL;
 
+#ifdef __linux__
+/* Read from /proc; when set, PROCESSTABLE is not used. */
+static ProcessTable *PROC_TABLE = NULL;
+#endif
+
 typedef enum
 {
     /*
@@ -133,6 +142,36 @@ static void ApplyPlatformExtraTable(char **names, char **columns);
 
 /***************************************************************************/
 
+/* Combine the attributes that matched, as process_result says. */
+static bool EvalProcessSelectAttributes(ProcessSelect a,
+                                        StringSet *process_select_attributes)
+{
+    if (a.process_result)
+    {
+        return EvalProcessResult(a.process_result, process_select_attributes);
+    }
+
+    if (StringSetSize(process_select_attributes) == 0)
+    {
+        return EvalProcessResult("", process_select_attributes);
+    }
+
+    Writer *w = StringWriter();
+    StringSetIterator iter = StringSetIteratorInit(process_select_attributes);
+    char *attr = StringSetIteratorNext(&iter);
+    WriterWrite(w, attr);
+
+    while ((attr = StringSetIteratorNext(&iter)))
+    {
+        WriterWriteChar(w, '.');
+        WriterWrite(w, attr);
+    }
+
+    bool result = EvalProcessResult(StringWriterData(w), process_select_attributes);
+    WriterClose(w);
+    return result;
+}
+
 static bool SelectProcess(const char *procentry,
                           time_t pstime,
                           char **names,
@@ -249,47 +288,151 @@ static bool SelectProcess(const char *procentry,
         StringSetAdd(process_select_attributes, xstrdup("tty"));
     }
 
-    if (!a.process_result)
+    result = EvalProcessSelectAttributes(a, process_select_attributes);
+
+cleanup:
+    StringSetDestroy(process_select_attributes);
+
+    for (int i = 0; column[i] != NULL; i++)
+    {
+        free(column[i]);
+    }
+
+    return result;
+}
+
+#ifdef __linux__
+
+static bool InRange(long value, long min, long max)
+{
+    return (min != CF_NOINT && max != CF_NOINT &&
+            min <= value && value <= max);
+}
+
+/* SelectProcess() for row #i of the /proc table, on typed values. */
+static bool SelectProcessFromTable(const ProcessTable *table, size_t i,
+                                   const char *process_regex,
+                                   ProcessSelect a, bool attrselect)
+{
+    assert(process_regex);
+
+    int s, e;
+    if (!StringMatch(process_regex, table->command[i], &s, &e))
+    {
+        return false;
+    }
+
+    if (!attrselect)
+    {
+        return true;
+    }
+
+    StringSet *process_select_attributes = StringSetNew();
+
+    for (const Rlist *rp = a.owner; rp != NULL; rp = rp->next)
     {
-        if (StringSetSize(process_select_attributes) == 0)
+        if (StringMatchFull(RlistScalarValue(rp), table->user[i]))
         {
-            result = EvalProcessResult("", process_select_attributes);
+            StringSetAdd(process_select_attributes, xstrdup("process_owner"));
+            break;
         }
-        else
-        {
-            Writer *w = StringWriter();
-            StringSetIterator iter = StringSetIteratorInit(process_select_attributes);
-            char *attr = StringSetIteratorNext(&iter);
-            WriterWrite(w, attr);
+    }
 
-            while ((attr = StringSetIteratorNext(&iter)))
-            {
-                WriterWriteChar(w, '.');
-                WriterWrite(w, attr);
-            }
+    if (InRange(table->pid[i], a.min_pid, a.max_pid))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("pid"));
+    }
 
-            result = EvalProcessResult(StringWriterData(w), process_select_attributes);
-            WriterClose(w);
-        }
+    if (InRange(table->ppid[i], a.min_ppid, a.max_ppid))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("ppid"));
     }
-    else
+
+    if (InRange(table->pgid[i], a.min_pgid, a.max_pgid))
     {
-        result = EvalProcessResult(a.process_result, process_select_attributes);
+        StringSetAdd(process_select_attributes, xstrdup("pgid"));
     }
 
-cleanup:
+    if (InRange(table->vsize[i], a.min_vsize, a.max_vsize))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("vsize"));
+    }
+
+    if (InRange(table->rsize[i], a.min_rsize, a.max_rsize))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("rsize"));
+    }
+
+    if (InRange(table->cputime[i], a.min_ttime, a.max_ttime))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("ttime"));
+    }
+
+    if (InRange(table->start[i], a.min_stime, a.max_stime))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("stime"));
+    }
+
+    if (InRange(table->nice[i], a.min_pri, a.max_pri))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("priority"));
+    }
+
+    if (InRange(table->threads[i], a.min_thread, a.max_thread))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("threads"));
+    }
+
+    const char state[2] = { table->state[i], '\0' };
+    if (a.status != NULL && StringMatchFull(a.status, state))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("status"));
+    }
+
+    if (a.command != NULL && StringMatchFull(a.command, table->command[i]))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("command"));
+    }
+
+    if (a.tty != NULL && StringMatchFull(a.tty, table->tty[i]))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("tty"));
+    }
+
+    bool result = EvalProcessSelectAttributes(a, process_select_attributes);
     StringSetDestroy(process_select_attributes);
+    return result;
+}
 
-    for (int i = 0; column[i] != NULL; i++)
+static Item *SelectProcessesFromTable(const ProcessTable *table,
+                                      const char *process_name,
+                                      ProcessSelect a, bool attrselect)
+{
+    Item *result = NULL;
+
+    for (size_t i = 0; i < table->count; i++)
     {
-        free(column[i]);
+        if (SelectProcessFromTable(table, i, process_name, a, attrselect))
+        {
+            PrependItem(&result, table->line[i], "");
+            result->counter = (int) table->pid[i];
+        }
     }
 
     return result;
 }
 
+#endif /* __linux__ */
+
 Item *SelectProcesses(const char *process_name, ProcessSelect a, bool attrselect)
 {
+#ifdef __linux__
+    if (PROC_TABLE != NULL)
+    {
+        return SelectProcessesFromTable(PROC_TABLE, process_name, a, attrselect);
+    }
+#endif
+
     const Item *processes = PROCESSTABLE;
     Item *result = NULL;
 
@@ -928,6 +1071,20 @@ bool IsProcessNameRunning(char *procNameRegex)
 
     memset(colHeaders, 0, sizeof(colHeaders));
 
+#ifdef __linux__
+    if (PROC_TABLE != NULL)
+    {
+        for (size_t j = 0; j < PROC_TABLE->count; j++)
+        {
+            if (StringMatchFull(procNameRegex, PROC_TABLE->command[j]))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+#endif
+
     if (PROCESSTABLE == NULL)
     {
         Log(LOG_LEVEL_ERR, "IsProcessNameRunning: PROCESSTABLE is empty");
@@ -1294,6 +1451,13 @@ static void CheckPsLineLimitations(void)
 
 const char *GetProcessTableLegend(void)
 {
+#ifdef __linux__
+    if (PROC_TABLE)
+    {
+        return PROC_TABLE->legend;
+    }
+#endif
+
     if (PROCESSTABLE)
     {
         // First entry in the table is legend.
@@ -1508,19 +1672,58 @@ static inline void ApplyPlatformExtraTable(ARG_UNUSED char **names, ARG_UNUSED c
 #endif
 
 #ifndef _WIN32
-int LoadProcessTable()
+#ifdef __linux__
+/**
+ * Read the process table from /proc, and save it in the state directory like
+ * LoadProcessTableFromPs() does, with the processes of root determined by
+ * uid rather than by the word "root" anywhere on the line.
+ */
+static bool LoadProcessTableFromProc(void)
 {
-    FILE *prp;
-    char pscomm[CF_MAXLINKSIZE];
+    PROC_TABLE = ProcessTableLoad("/proc");
+    if (PROC_TABLE == NULL)
+    {
+        return false;
+    }
+
+    Item *procs = NULL;
     Item *rootprocs = NULL;
     Item *otherprocs = NULL;
-
-
-    if (PROCESSTABLE)
+    for (size_t i = PROC_TABLE->count; i > 0; i--)
     {
-        Log(LOG_LEVEL_VERBOSE, "Reusing cached process table");
-        return true;
+        PrependItem(&procs, PROC_TABLE->line[i - 1], NULL);
+        PrependItem((PROC_TABLE->uid[i - 1] == 0) ? &rootprocs : &otherprocs,
+                    PROC_TABLE->line[i - 1], NULL);
     }
+    PrependItem(&procs, PROC_TABLE->legend, NULL);
+    PrependItem(&rootprocs, PROC_TABLE->legend, NULL);
+    PrependItem(&otherprocs, PROC_TABLE->legend, NULL);
+
+    const char *const statedir = GetStateDir();
+    char filename[CF_BUFSIZE];
+
+    xsnprintf(filename, sizeof(filename), "%s%ccf_procs", statedir, FILE_SEPARATOR);
+    RawSaveItemList(procs, filename, NewLineMode_Unix);
+    DeleteItemList(procs);
+
+    xsnprintf(filename, sizeof(filename), "%s%ccf_rootprocs", statedir, FILE_SEPARATOR);
+    RawSaveItemList(rootprocs, filename, NewLineMode_Unix);
+    DeleteItemList(rootprocs);
+
+    xsnprintf(filename, sizeof(filename), "%s%ccf_otherprocs", statedir, FILE_SEPARATOR);
+    RawSaveItemList(otherprocs, filename, NewLineMode_Unix);
+    DeleteItemList(otherprocs);
+
+    return true;
+}
+#endif
+
+static int LoadProcessTableFromPs(void)
+{
+    FILE *prp;
+    char pscomm[CF_MAXLINKSIZE];
+    Item *rootprocs = NULL;
+    Item *otherprocs = NULL;
 
     LoadPlatformExtraTable();
 
@@ -1665,6 +1868,29 @@ int LoadProcessTable()
     free(vbuff);
     return true;
 }
+
+int LoadProcessTable()
+{
+    if (PROCESSTABLE
+# ifdef __linux__
+        || PROC_TABLE
+# endif
+        )
+    {
+        Log(LOG_LEVEL_VERBOSE, "Reusing cached process table");
+        return true;
+    }
+
+# ifdef __linux__
+    if (LoadProcessTableFromProc())
+    {
+        return true;
+    }
+    Log(LOG_LEVEL_VERBOSE, "Could not read /proc, falling back to ps");
+# endif
+
+    return LoadProcessTableFromPs();
+}
 # endif
 
 void ClearProcessTable(void)
@@ -1673,4 +1899,9 @@ void ClearProcessTable(void)
 
     DeleteItemList(PROCESSTABLE);
     PROCESSTABLE = NULL;
+
+#ifdef __linux__
+    ProcessTableDestroy(PROC_TABLE);
+    PROC_TABLE = NULL;
+#endif
 }
@@ -1309,6 +1309,31 @@ char *RlistToString(const Rlist *rlist)
     return StringWriterClose(w);
 }
 
+/* Unlike writing it out, this does not sort the keys of objects. */
+static unsigned JsonElementHash(const JsonElement *element, unsigned seed, unsigned max)
+{
+    if (JsonGetElementType(element) == JSON_ELEMENT_TYPE_PRIMITIVE)
+    {
+        return StringHash(JsonPrimitiveGetAsString(element), seed, max);
+    }
+
+    unsigned hash = seed;
+    const bool object = (JsonGetContainerType(element) == JSON_CONTAINER_TYPE_OBJECT);
+
+    JsonIterator iter = JsonIteratorInit(element);
+    const JsonElement *child;
+    while ((child = JsonIteratorNextValue(&iter)) != NULL)
+    {
+        if (object)
+        {
+            hash = StringHash(JsonIteratorCurrentKey(&iter), hash, max);
+        }
+        hash = JsonElementHash(child, hash, max);
+    }
+
+    return hash;
+}
+
 unsigned RvalHash(Rval rval, unsigned seed, unsigned max)
 {
     switch (rval.type)
@@ -1319,6 +1344,8 @@ unsigned RvalHash(Rval rval, unsigned seed, unsigned max)
         return FnCallHash(RvalFnCallValue(rval), seed, max);
     case RVAL_TYPE_LIST:
         return RlistHash(RvalRlistValue(rval), seed, max);
+    case RVAL_TYPE_CONTAINER:
+        return JsonElementHash(RvalContainerValue(rval), seed, max);
     case RVAL_TYPE_NOPROMISEE:
         /* TODO modulus operation is biasing results. */
         return (seed + 1) % max;
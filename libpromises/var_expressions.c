@@ -102,7 +102,7 @@ unsigned int VarRefHash_untyped(const void *ref,
 {
     assert(ISPOW2(max));
 
-    return VarRefHash(ref) & (max - 1);
+    return ((const VarRef *) ref)->hash & (max - 1);
 }
 
 VarRef VarRefConst(const char *ns, const char *scope, const char *lval)
@@ -114,10 +114,36 @@ VarRef VarRefConst(const char *ns, const char *scope, const char *lval)
     ref.lval = (char *)lval;
     ref.num_indices = 0;
     ref.indices = NULL;
+    ref.hash = VarRefHash(&ref);
 
     return ref;
 }
 
+/**
+ * @return a shallow copy of #ref (parsed without a namespace and scope),
+ *         with the ones it did not name filled in from #ns and #scope, like
+ *         VarRefParseFromNamespaceAndScope() would have done. It points into
+ *         #ref and must not be passed to VarRefDestroy().
+ */
+VarRef VarRefConstInScope(const VarRef *ref, const char *ns, const char *scope)
+{
+    VarRef copy = *ref;
+
+    if (ref->scope == NULL)
+    {
+        copy.scope = (char *) scope;
+    }
+    if (ref->ns == NULL &&
+        (ref->scope == NULL ||
+         SpecialScopeFromString(ref->scope) == SPECIAL_SCOPE_NONE))
+    {
+        copy.ns = (char *) ns;
+    }
+
+    copy.hash = VarRefHash(&copy);
+    return copy;
+}
+
 VarRef *VarRefCopy(const VarRef *ref)
 {
     VarRef *copy = xmalloc(sizeof(VarRef));
@@ -139,6 +165,7 @@ VarRef *VarRefCopy(const VarRef *ref)
     {
         copy->indices = NULL;
     }
+    copy->hash = ref->hash;
 
     return copy;
 }
@@ -164,6 +191,7 @@ VarRef *VarRefCopyLocalized(const VarRef *ref)
     {
         copy->indices = NULL;
     }
+    copy->hash = VarRefHash(copy);
 
     return copy;
 }
@@ -177,6 +205,7 @@ VarRef *VarRefCopyIndexless(const VarRef *ref)
     copy->lval = ref->lval ? xstrdup(ref->lval) : NULL;
     copy->num_indices = 0;
     copy->indices = NULL;
+    copy->hash = VarRefHash(copy);
 
     return copy;
 }
@@ -329,10 +358,116 @@ VarRef *VarRefParseFromNamespaceAndScope(const char *qualified_name,
     ref->lval = lval;
     ref->indices = indices;
     ref->num_indices = num_indices;
+    ref->hash = VarRefHash(ref);
 
     return ref;
 }
 
+/**
+ * Parse #qualified_name like VarRefParseFromNamespaceAndScope() does with
+ * CF_NS and '.', but without allocating: the separators in #qualified_name
+ * are overwritten with '\0', and #ref points into it and into #indices,
+ * which must have room for #max_indices pointers. Such a VarRef must not be
+ * passed to VarRefDestroy().
+ *
+ * @return false, leaving #qualified_name untouched, if there are more than
+ *         #max_indices indices or they are not of the plain "[a][b]" form.
+ */
+bool VarRefParseInPlace(char *qualified_name, const char *_ns, const char *_scope,
+                        char **indices, size_t max_indices, VarRef *ref)
+{
+    assert(qualified_name);
+
+    char *indices_start = strchr(qualified_name, '[');
+    size_t num_indices = 0;
+
+    if (indices_start)
+    {
+        size_t open_count = 0;
+        for (const char *c = indices_start; *c != '\0'; c++)
+        {
+            if (*c == '[')
+            {
+                if (open_count++ == 0)
+                {
+                    num_indices++;
+                }
+            }
+            else if (*c == ']')
+            {
+                if (open_count-- == 0)
+                {
+                    return false;
+                }
+            }
+            else if (open_count == 0)
+            {
+                return false;
+            }
+        }
+
+        if (open_count != 0 || num_indices > max_indices)
+        {
+            return false;
+        }
+    }
+
+    char *ns = NULL;
+    char *scope_start = strchr(qualified_name, CF_NS);
+    if (scope_start && (!indices_start || scope_start < indices_start))
+    {
+        ns = qualified_name;
+        *scope_start = '\0';
+        scope_start++;
+    }
+    else
+    {
+        scope_start = qualified_name;
+    }
+
+    char *scope = NULL;
+    char *lval = scope_start;
+    char *lval_start = strchr(scope_start, '.');
+    if (lval_start && (!indices_start || lval_start < indices_start))
+    {
+        scope = scope_start;
+        *lval_start = '\0';
+        lval = lval_start + 1;
+    }
+
+    if (indices_start)
+    {
+        size_t cur_index = 0;
+        size_t open_count = 0;
+        for (char *c = indices_start; *c != '\0'; c++)
+        {
+            if (*c == '[' && open_count++ == 0)
+            {
+                indices[cur_index++] = c + 1;
+            }
+            else if (*c == ']' && --open_count == 0)
+            {
+                *c = '\0';
+            }
+        }
+        *indices_start = '\0';
+    }
+
+    if (scope && SpecialScopeFromString(scope) != SPECIAL_SCOPE_NONE)
+    {
+        _ns = NULL;
+    }
+
+    ref->ns = ns ? ns : (char *) _ns;
+    ref->scope = scope ? scope : (char *) _scope;
+    ref->lval = lval;
+    ref->indices = (num_indices > 0) ? indices : NULL;
+    ref->num_indices = num_indices;
+    ref->hash = VarRefHash(ref);
+
+    return true;
+}
+
 VarRef *VarRefParse(const char *var_ref_string)
 {
     return VarRefParseFromNamespaceAndScope(var_ref_string, NULL, NULL, CF_NS, '.');
@@ -476,16 +611,16 @@ void VarRefSetMeta(VarRef *ref, bool enabled)
             char *tmp = StringConcatenate(2, ref->scope, "_meta");
             free(ref->scope);
             ref->scope = tmp;
+            ref->hash = VarRefHash(ref);
         }
     }
     else
     {
         if (VarRefIsMeta(ref))
         {
-            char *tmp = ref->scope;
             size_t len = strlen(ref->scope);
-            memcpy(ref->scope, StringSubstring(ref->scope, len, 0, len - strlen("_meta")), len - strlen("_meta"));
-            free(tmp);
+            ref->scope[len - strlen("_meta")] = '\0';
+            ref->hash = VarRefHash(ref);
         }
     }
 }
@@ -507,6 +642,7 @@ void VarRefQualify(VarRef *ref, const char *ns, const char *scope)
 
     ref->ns = ns ? xstrdup(ns) : NULL;
     ref->scope = xstrdup(scope);
+    ref->hash = VarRefHash(ref);
 }
 
 void VarRefAddIndex(VarRef *ref, const char *index)
@@ -524,6 +660,7 @@ void VarRefAddIndex(VarRef *ref, const char *index)
 
     ref->indices[ref->num_indices] = xstrdup(index);
     ref->num_indices++;
+    ref->hash = VarRefHash(ref);
 }
 
 int VarRefCompare(const VarRef *a, const VarRef *b)
@@ -569,5 +706,8 @@ int VarRefCompare(const VarRef *a, const VarRef *b)
 
 bool VarRefEqual_untyped(const void *a, const void *b)
 {
-    return (VarRefCompare(a, b) == 0);
+    const VarRef *ref_a = a;
+    const VarRef *ref_b = b;
+    return (ref_a->hash == ref_b->hash &&
+            VarRefCompare(ref_a, ref_b) == 0);
 }
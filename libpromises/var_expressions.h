@@ -45,6 +45,10 @@ typedef struct
     char **indices;
     size_t num_indices;
 
+    /* VarRefHash() of the above, kept up to date by all the VarRef*()
+     * functions so that table lookups don't walk the strings again. */
+    unsigned int hash;
+
     /* TODO performance: when using VarRefCopy() we just need to allocate one
      *      big chunk with malloc() and all pointers can point in there.  This
      *      whole struct can be a single malloc'ed chunk with array[] space in
@@ -65,6 +69,9 @@ VarRef *VarRefParseFromNamespaceAndScope(const char *qualified_name,
                                          const char *_ns, const char *_scope,
                                          char ns_separator, char scope_separator);
 VarRef VarRefConst(const char *ns, const char *scope, const char *lval);
+VarRef VarRefConstInScope(const VarRef *ref, const char *ns, const char *scope);
+bool VarRefParseInPlace(char *qualified_name, const char *_ns, const char *_scope,
+                        char **indices, size_t max_indices, VarRef *ref);
 
 void VarRefDestroy        (VarRef *ref);
 void VarRefDestroy_untyped(void   *ref);
@@ -26,8 +26,30 @@
 #include <hash_map_priv.h>
 #include <alloc.h>
 
-/* FIXME: make configurable and move to map.c */
-#define HASHMAP_BUCKETS 8192
+/* Map is converted from ArrayMap at 14 elements, so this leaves room. */
+#define HASHMAP_MIN_CAPACITY_BITS 5
+
+/* Hash functions are asked for values in [0, HASHMAP_HASH_MAX). */
+#define HASHMAP_HASH_BITS 31
+#define HASHMAP_HASH_MAX (1U << HASHMAP_HASH_BITS)
+
+/* Bits of the hash that selected one of the 8192 buckets of the old
+ * chained table, and still decide the iteration order. */
+#define HASHMAP_BUCKET_BITS 13
+
+/* Grow when more than 3/4 of the home slots are taken. */
+#define HASHMAP_MAX_LOAD(capacity) ((capacity) / 4 * 3)
+
+/* Entries that probed past the last home slot go here. */
+#define HASHMAP_OVERFLOW(capacity) ((capacity) / 8 + 8)
+
+static void HashMapAllocate(HashMap *map, unsigned int capacity_bits)
+{
+    map->capacity_bits = capacity_bits;
+    map->capacity = (size_t) 1 << capacity_bits;
+    map->length = map->capacity + HASHMAP_OVERFLOW(map->capacity);
+    map->slots = xcalloc(map->length, sizeof(HashMapSlot));
+}
 
 HashMap *HashMapNew(MapHashFn hash_fn, MapKeyEqualFn equal_fn,
                     MapDestroyDataFn destroy_key_fn,
@@ -38,140 +60,227 @@ HashMap *HashMapNew(MapHashFn hash_fn, MapKeyEqualFn equal_fn,
     map->equal_fn = equal_fn;
     map->destroy_key_fn = destroy_key_fn;
     map->destroy_value_fn = destroy_value_fn;
-    map->buckets = xcalloc(HASHMAP_BUCKETS, sizeof(BucketListItem *));
+    HashMapAllocate(map, HASHMAP_MIN_CAPACITY_BITS);
     return map;
 }
 
-static unsigned int HashMapGetBucket(const HashMap *map, const void *key)
+static unsigned int HashMapHash(const HashMap *map, const void *key)
 {
-    return map->hash_fn(key, 0, HASHMAP_BUCKETS);
+    return map->hash_fn(key, 0, HASHMAP_HASH_MAX) & (HASHMAP_HASH_MAX - 1);
 }
 
 /**
- * @retval true if value was preexisting in the map and got replaced.
+ * Entries are sorted by this, and the most recently inserted first among
+ * equals: the old bucket first, then as many further hash bits as needed to
+ * tell the home slots apart.
  */
-bool HashMapInsert(HashMap *map, void *key, void *value)
+static unsigned int HashMapOrder(const HashMap *map, unsigned int hash)
 {
-    unsigned bucket = HashMapGetBucket(map, key);
+    const unsigned int bucket_mask = (1U << HASHMAP_BUCKET_BITS) - 1;
+    unsigned int rotated = ((hash & bucket_mask) << (HASHMAP_HASH_BITS - HASHMAP_BUCKET_BITS)) |
+        (hash >> HASHMAP_BUCKET_BITS);
+    return rotated >> (HASHMAP_HASH_BITS -
+                       MAX(map->capacity_bits, HASHMAP_BUCKET_BITS));
+}
 
-    for (BucketListItem *i = map->buckets[bucket]; i != NULL; i = i->next)
+static size_t HashMapHome(const HashMap *map, unsigned int order)
+{
+    return order >> (MAX(map->capacity_bits, HASHMAP_BUCKET_BITS) -
+                     map->capacity_bits);
+}
+
+/**
+ * Put an entry known not to be in the map in its place.
+ * @return false if it would not fit before the end of the slots.
+ */
+static bool HashMapPlace(HashMap *map, const HashMapSlot *entry)
+{
+    const unsigned int order = HashMapOrder(map, entry->hash);
+    size_t i = HashMapHome(map, order);
+
+    while (i < map->length && map->slots[i].used &&
+           HashMapOrder(map, map->slots[i].hash) < order)
     {
-        if (map->equal_fn(i->value.key, key))
-        {
-            /* Replace the key with the new one despite those two being the
-             * same, since the new key might be referenced somewhere inside
-             * the new value. */
-            map->destroy_key_fn(i->value.key);
-            map->destroy_value_fn(i->value.value);
-            i->value.key   = key;
-            i->value.value = value;
-            return true;
-        }
+        i++;
     }
 
-    BucketListItem *i = xcalloc(1, sizeof(BucketListItem));
-    i->value.key = key;
-    i->value.value = value;
-    i->next = map->buckets[bucket];
-    map->buckets[bucket] = i;
+    size_t end = i;
+    while (end < map->length && map->slots[end].used)
+    {
+        end++;
+    }
+    if (end == map->length)
+    {
+        return false;
+    }
 
-    return false;
+    memmove(&map->slots[i + 1], &map->slots[i], (end - i) * sizeof(HashMapSlot));
+    map->slots[i] = *entry;
+    map->slots[i].used = true;
+    return true;
 }
 
-bool HashMapRemove(HashMap *map, const void *key)
+static void HashMapResize(HashMap *map, unsigned int capacity_bits)
 {
-    unsigned bucket = HashMapGetBucket(map, key);
-
-    /*
-     * prev points to a previous "next" pointer to rewrite it in case value need
-     * to be deleted
-     */
+    HashMapSlot *old_slots = map->slots;
+    size_t old_length = map->length;
 
-    for (BucketListItem **prev = &map->buckets[bucket];
-         *prev != NULL;
-         prev = &((*prev)->next))
+    for (;;)
     {
-        BucketListItem *cur = *prev;
-        if (map->equal_fn(cur->value.key, key))
+        HashMapAllocate(map, capacity_bits);
+
+        /* Backwards, so that equals end up in the same order again. */
+        bool fits = true;
+        for (size_t i = old_length; fits && i-- > 0; )
         {
-            map->destroy_key_fn(cur->value.key);
-            map->destroy_value_fn(cur->value.value);
-            *prev = cur->next;
-            free(cur);
-            return true;
+            if (old_slots[i].used)
+            {
+                fits = HashMapPlace(map, &old_slots[i]);
+            }
         }
+
+        if (fits)
+        {
+            break;
+        }
+
+        free(map->slots);
+        capacity_bits++;
     }
 
-    return false;
+    free(old_slots);
 }
 
-MapKeyValue *HashMapGet(const HashMap *map, const void *key)
+/**
+ * @return the slot of #key, or -1 if not in the map.
+ */
+static ssize_t HashMapFind(const HashMap *map, const void *key, unsigned int hash)
 {
-    unsigned bucket = HashMapGetBucket(map, key);
+    const unsigned int order = HashMapOrder(map, hash);
 
-    for (BucketListItem *cur = map->buckets[bucket];
-         cur != NULL;
-         cur = cur->next)
+    for (size_t i = HashMapHome(map, order);
+         i < map->length && map->slots[i].used; i++)
     {
-        if (map->equal_fn(cur->value.key, key))
+        const HashMapSlot *slot = &map->slots[i];
+        if (slot->hash == hash && map->equal_fn(slot->value.key, key))
+        {
+            return i;
+        }
+
+        /* Everything from here on belongs further on. */
+        if (HashMapOrder(map, slot->hash) > order)
         {
-            return &cur->value;
+            break;
         }
     }
 
-    return NULL;
+    return -1;
 }
 
-static void FreeBucketListItem(HashMap *map, BucketListItem *item)
+/**
+ * @retval true if value was preexisting in the map and got replaced.
+ */
+bool HashMapInsert(HashMap *map, void *key, void *value)
 {
-    if (item->next)
+    unsigned int hash = HashMapHash(map, key);
+
+    ssize_t i = HashMapFind(map, key, hash);
+    if (i != -1)
+    {
+        /* Replace the key with the new one despite those two being the
+         * same, since the new key might be referenced somewhere inside
+         * the new value. */
+        map->destroy_key_fn(map->slots[i].value.key);
+        map->destroy_value_fn(map->slots[i].value.value);
+        map->slots[i].value.key   = key;
+        map->slots[i].value.value = value;
+        return true;
+    }
+
+    if (map->size + 1 > HASHMAP_MAX_LOAD(map->capacity))
+    {
+        HashMapResize(map, map->capacity_bits + 1);
+    }
+
+    HashMapSlot entry = { { key, value }, hash, true };
+    while (!HashMapPlace(map, &entry))
     {
-        FreeBucketListItem(map, item->next);
+        HashMapResize(map, map->capacity_bits + 1);
     }
+    map->size++;
 
-    map->destroy_key_fn(item->value.key);
-    map->destroy_value_fn(item->value.value);
-    free(item);
+    return false;
 }
 
-/* Do not destroy value item */
-static void FreeBucketListItemSoft(HashMap *map, BucketListItem *item)
+bool HashMapRemove(HashMap *map, const void *key)
 {
-    if (item->next)
+    ssize_t found = HashMapFind(map, key, HashMapHash(map, key));
+    if (found == -1)
     {
-        FreeBucketListItemSoft(map, item->next);
+        return false;
     }
 
-    map->destroy_key_fn(item->value.key);
-    free(item);
+    map->destroy_key_fn(map->slots[found].value.key);
+    map->destroy_value_fn(map->slots[found].value.value);
+
+    /* Move the following entries that are not at home back by one. */
+    size_t i = found;
+    while (i + 1 < map->length && map->slots[i + 1].used &&
+           HashMapHome(map, HashMapOrder(map, map->slots[i + 1].hash)) <= i)
+    {
+        map->slots[i] = map->slots[i + 1];
+        i++;
+    }
+
+    memset(&map->slots[i], 0, sizeof(HashMapSlot));
+    map->size--;
+
+    return true;
 }
 
-void HashMapClear(HashMap *map)
+MapKeyValue *HashMapGet(const HashMap *map, const void *key)
+{
+    ssize_t i = HashMapFind(map, key, HashMapHash(map, key));
+    return (i != -1) ? &map->slots[i].value : NULL;
+}
+
+size_t HashMapSize(const HashMap *map)
+{
+    return map->size;
+}
+
+static void HashMapFreeEntries(HashMap *map, bool destroy_values)
 {
-    for (int i = 0; i < HASHMAP_BUCKETS; ++i)
+    for (size_t i = 0; i < map->length; i++)
     {
-        if (map->buckets[i])
+        if (map->slots[i].used)
         {
-            FreeBucketListItem(map, map->buckets[i]);
+            map->destroy_key_fn(map->slots[i].value.key);
+            if (destroy_values)
+            {
+                map->destroy_value_fn(map->slots[i].value.value);
+            }
         }
-        map->buckets[i] = NULL;
     }
 }
 
+void HashMapClear(HashMap *map)
+{
+    HashMapFreeEntries(map, true);
+
+    /* Give the memory of a map that was large back. */
+    free(map->slots);
+    HashMapAllocate(map, HASHMAP_MIN_CAPACITY_BITS);
+    map->size = 0;
+}
+
+/* Do not destroy value item */
 void HashMapSoftDestroy(HashMap *map)
 {
     if (map)
     {
-        for (int i = 0; i < HASHMAP_BUCKETS; ++i)
-        {
-            if (map->buckets[i])
-            {
-                FreeBucketListItemSoft(map, map->buckets[i]);
-            }
-            map->buckets[i] = NULL;
-        }
-
-        free(map->buckets);
+        HashMapFreeEntries(map, false);
+        free(map->slots);
         free(map);
     }
 }
@@ -180,77 +289,61 @@ void HashMapDestroy(HashMap *map)
 {
     if (map)
     {
-        HashMapClear(map);
-        free(map->buckets);
+        HashMapFreeEntries(map, true);
+        free(map->slots);
         free(map);
     }
 }
 
 void HashMapPrintStats(const HashMap *hmap, FILE *f)
 {
-    size_t bucket_lengths[HASHMAP_BUCKETS] = { 0 };
-    size_t num_el = 0;
-    size_t num_buckets = 0;
+    size_t probe_counts[10] = { 0 };
+    size_t max_probe = 0;
+    size_t total_probe = 0;
 
-    for (int i = 0; i < HASHMAP_BUCKETS; i++)
+    for (size_t i = 0; i < hmap->length; i++)
     {
-        BucketListItem *b = hmap->buckets[i];
-        if (b != NULL)
-        {
-            num_buckets++;
-        }
-        while (b != NULL)
+        if (hmap->slots[i].used)
         {
-            num_el++;
-            bucket_lengths[i]++;
-            b = b->next;
+            size_t probe = i - HashMapHome(hmap, HashMapOrder(hmap, hmap->slots[i].hash)) + 1;
+            total_probe += probe;
+            max_probe = MAX(max_probe, probe);
+            probe_counts[MIN(probe, 10) - 1]++;
         }
-
     }
 
-    fprintf(f, "\tTotal number of buckets:     %5d\n", HASHMAP_BUCKETS);
-    fprintf(f, "\tNumber of non-empty buckets: %5zu\n", num_buckets);
-    fprintf(f, "\tTotal number of elements:    %5zu\n", num_el);
-    fprintf(f, "\tAverage elements per non-empty bucket (load factor): %5.2f\n",
-            (float) num_el / num_buckets);
+    fprintf(f, "\tTotal number of slots:       %5zu\n", hmap->length);
+    fprintf(f, "\tTotal number of elements:    %5zu\n", hmap->size);
+    fprintf(f, "\tLoad factor:                 %5.2f\n",
+            (float) hmap->size / hmap->capacity);
+    fprintf(f, "\tAverage probe length:        %5.2f\n",
+            hmap->size ? (float) total_probe / hmap->size : 0.0);
+    fprintf(f, "\tLongest probe length:        %5zu\n", max_probe);
 
-    fprintf(f, "\tThe 10 longest buckets are: \n");
+    fprintf(f, "\tElements by probe length: \n");
     for (int j = 0; j < 10; j++)
     {
-        /* Find the maximum 10 times, zeroing it after printing it. */
-        int longest_bucket_id = 0;
-        for (int i = 0; i < HASHMAP_BUCKETS; i++)
-        {
-            if (bucket_lengths[i] > bucket_lengths[longest_bucket_id])
-            {
-                longest_bucket_id = i;
-            }
-        }
-        fprintf(f, "\t\tbucket %5d with %zu elements\n",
-                longest_bucket_id, bucket_lengths[longest_bucket_id]);
-        bucket_lengths[longest_bucket_id] = 0;
+        fprintf(f, "\t\t%s%2d: %zu elements\n",
+                (j == 9) ? ">=" : "  ", j + 1, probe_counts[j]);
     }
 }
 /******************************************************************************/
 
 HashMapIterator HashMapIteratorInit(HashMap *map)
 {
-    return (HashMapIterator) { map, map->buckets[0], 0 };
+    return (HashMapIterator) { map, 0 };
 }
 
 MapKeyValue *HashMapIteratorNext(HashMapIterator *i)
 {
-    while (i->cur == NULL)
+    while (i->slot < i->map->length)
     {
-        if (++i->bucket >= HASHMAP_BUCKETS)
+        HashMapSlot *slot = &i->map->slots[i->slot++];
+        if (slot->used)
         {
-            return NULL;
+            return &slot->value;
         }
-
-        i->cur = i->map->buckets[i->bucket];
     }
 
-    MapKeyValue *ret = &i->cur->value;
-    i->cur = i->cur->next;
-    return ret;
+    return NULL;
 }
@@ -27,11 +27,31 @@
 
 #include <map_common.h>
 
-typedef struct BucketListItem_
+/*
+ * Open addressing with linear probing, entries stored inline in one array
+ * that grows as needed, so there is no allocation per entry.
+ *
+ * The entries are kept sorted by their home slot (an "ordered" hash table):
+ * an entry is inserted before the ones that belong further on, shifting
+ * them up to the next free slot, and removal shifts the following displaced
+ * entries back, so there are no tombstones. Probing stops at the first
+ * entry that belongs further on, which makes misses as cheap as hits.
+ *
+ * The array does not wrap around; an insertion that would run past its end
+ * grows it instead. Up to 8192 home slots, the order is that of the old
+ * 8192-bucket chained table (most recently inserted first within a bucket),
+ * so iteration order of maps of up to a few thousand entries is unchanged.
+ *
+ * Pointers to entries (MapKeyValue *) are invalidated by insertion and
+ * removal.
+ */
+
+typedef struct
 {
     MapKeyValue value;
-    struct BucketListItem_ *next;
-} BucketListItem;
+    unsigned int hash;          /* hash_fn(key, 0, HASHMAP_HASH_MAX) */
+    bool used;
+} HashMapSlot;
 
 typedef struct
 {
@@ -39,14 +59,17 @@ typedef struct
     MapKeyEqualFn equal_fn;
     MapDestroyDataFn destroy_key_fn;
     MapDestroyDataFn destroy_value_fn;
-    BucketListItem **buckets;
+    HashMapSlot *slots;
+    size_t capacity;            /* home slots, a power of 2 */
+    unsigned int capacity_bits;
+    size_t length;              /* home slots plus overflow slots */
+    size_t size;
 } HashMap;
 
 typedef struct
 {
     HashMap *map;
-    BucketListItem *cur;
-    int bucket;
+    size_t slot;
 } HashMapIterator;
 
 HashMap *HashMapNew(MapHashFn hash_fn, MapKeyEqualFn equal_fn,
@@ -59,6 +82,7 @@ MapKeyValue *HashMapGet(const HashMap *map, const void *key);
 void HashMapClear(HashMap *map);
 void HashMapSoftDestroy(HashMap *map);
 void HashMapDestroy(HashMap *map);
+size_t HashMapSize(const HashMap *map);
 void HashMapPrintStats(const HashMap *hmap, FILE *f);
 
 /******************************************************************************/
@@ -36,6 +36,10 @@
 #include <regex.h>
 #include <buffer.h>
 
+/* Objects with at least this many keys get a hash index of their keys,
+ * built on the first lookup and kept up to date from then on. */
+#define JSON_OBJECT_INDEX_THRESHOLD 32
+
 static const int SPACES_PER_INDENT = 2;
 const int DEFAULT_CONTAINER_CAPACITY = 64;
 
@@ -43,6 +47,25 @@ static const char *const JSON_TRUE = "true";
 static const char *const JSON_FALSE = "false";
 static const char *const JSON_NULL = "null";
 
+/**
+ * Open addressing (linear probing) index of an object's children by key. The
+ * keys are the children's own propertyName strings.
+ */
+typedef struct
+{
+    unsigned int hash;
+    JsonElement *element;                               /* NULL: empty slot */
+} JsonObjectIndexSlot;
+
+typedef struct
+{
+    JsonObjectIndexSlot *slots;
+    size_t capacity;                                         /* power of 2 */
+    size_t count;
+} JsonObjectIndex;
+
+static void JsonObjectIndexDestroy(JsonObjectIndex *index);
+
 struct JsonElement_
 {
     JsonElementType type;
@@ -53,6 +76,7 @@ struct JsonElement_
         {
             JsonContainerType type;
             Seq *children;
+            JsonObjectIndex *index;                 /* objects only, or NULL */
         } container;
         struct JsonPrimitive
         {
@@ -351,6 +375,8 @@ void JsonDestroy(JsonElement *element)
             assert(element->container.children);
             SeqDestroy(element->container.children);
             element->container.children = NULL;
+            JsonObjectIndexDestroy(element->container.index);
+            element->container.index = NULL;
             break;
 
         case JSON_ELEMENT_TYPE_PRIMITIVE:
@@ -781,6 +807,164 @@ JsonElement *JsonSelect(JsonElement *element, size_t num_indices, char **indices
 // JsonObject Functions
 // *******************************************************************************************
 
+static int JsonElementHasProperty(const void *propertyName, const void *jsonElement, void *user_data);
+
+/* FNV-1a */
+static unsigned int JsonKeyHash(const char *key)
+{
+    unsigned int h = 2166136261U;
+    for (const unsigned char *c = (const unsigned char *) key; *c != '\0'; c++)
+    {
+        h ^= *c;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static void JsonObjectIndexPut(JsonObjectIndex *index, unsigned int hash,
+                               JsonElement *element)
+{
+    size_t mask = index->capacity - 1;
+    size_t i = hash & mask;
+    while (index->slots[i].element != NULL)
+    {
+        i = (i + 1) & mask;
+    }
+    index->slots[i].hash = hash;
+    index->slots[i].element = element;
+    index->count++;
+}
+
+static void JsonObjectIndexResize(JsonObjectIndex *index, size_t capacity)
+{
+    size_t old_capacity = index->capacity;
+    JsonObjectIndexSlot *old_slots = index->slots;
+
+    index->slots = xcalloc(capacity, sizeof(*index->slots));
+    index->capacity = capacity;
+    index->count = 0;
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_slots[i].element != NULL)
+        {
+            JsonObjectIndexPut(index, old_slots[i].hash, old_slots[i].element);
+        }
+    }
+    free(old_slots);
+}
+
+static void JsonObjectIndexInsert(JsonObjectIndex *index, JsonElement *element)
+{
+    /* Keep the load factor under 1/2. */
+    if (2 * (index->count + 1) > index->capacity)
+    {
+        JsonObjectIndexResize(index, 2 * index->capacity);
+    }
+    JsonObjectIndexPut(index, JsonKeyHash(element->propertyName), element);
+}
+
+/* @return the slot of #key, or -1 */
+static ssize_t JsonObjectIndexFind(const JsonObjectIndex *index, const char *key)
+{
+    unsigned int hash = JsonKeyHash(key);
+    size_t mask = index->capacity - 1;
+
+    for (size_t i = hash & mask;
+         index->slots[i].element != NULL;
+         i = (i + 1) & mask)
+    {
+        if (index->slots[i].hash == hash &&
+            strcmp(index->slots[i].element->propertyName, key) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void JsonObjectIndexRemove(JsonObjectIndex *index, const char *key)
+{
+    ssize_t found = JsonObjectIndexFind(index, key);
+    if (found == -1)
+    {
+        return;
+    }
+
+    /* Shift the following entries of the probe sequence back, so that
+     * lookups need no tombstones. */
+    size_t mask = index->capacity - 1;
+    size_t hole = found;
+    for (size_t i = (hole + 1) & mask;
+         index->slots[i].element != NULL;
+         i = (i + 1) & mask)
+    {
+        size_t home = index->slots[i].hash & mask;
+        bool movable = (hole <= i) ? (home <= hole || home > i)
+                                   : (home <= hole && home > i);
+        if (movable)
+        {
+            index->slots[hole] = index->slots[i];
+            hole = i;
+        }
+    }
+
+    index->slots[hole].element = NULL;
+    index->count--;
+}
+
+static void JsonObjectIndexDestroy(JsonObjectIndex *index)
+{
+    if (index != NULL)
+    {
+        free(index->slots);
+        free(index);
+    }
+}
+
+/**
+ * @return the index of #object, built now if it just got big enough, or
+ *         NULL for small objects.
+ */
+static JsonObjectIndex *JsonObjectGetIndex(const JsonElement *object)
+{
+    if (object->container.index == NULL &&
+        object->container.children->length >= JSON_OBJECT_INDEX_THRESHOLD)
+    {
+        JsonObjectIndex *index = xcalloc(1, sizeof(JsonObjectIndex));
+        size_t capacity = 2 * JSON_OBJECT_INDEX_THRESHOLD;
+        while (capacity < 2 * object->container.children->length)
+        {
+            capacity *= 2;
+        }
+        index->slots = xcalloc(capacity, sizeof(*index->slots));
+        index->capacity = capacity;
+
+        for (size_t i = 0; i < object->container.children->length; i++)
+        {
+            JsonObjectIndexInsert(index, object->container.children->data[i]);
+        }
+
+        /* The index is a cache, building it does not change the object. */
+        ((JsonElement *) object)->container.index = index;
+    }
+
+    return object->container.index;
+}
+
+static JsonElement *JsonObjectLookup(const JsonElement *object, const char *key)
+{
+    const JsonObjectIndex *index = JsonObjectGetIndex(object);
+    if (index != NULL)
+    {
+        ssize_t slot = JsonObjectIndexFind(index, key);
+        return (slot == -1) ? NULL : index->slots[slot].element;
+    }
+
+    return SeqLookup(object->container.children, key, JsonElementHasProperty);
+}
+
+
 JsonElement *JsonObjectCreate(size_t initialCapacity)
 {
     return JsonElementCreateContainer(JSON_CONTAINER_TYPE_OBJECT, NULL, initialCapacity);
@@ -941,6 +1125,11 @@ void JsonObjectAppendElement(JsonElement *object, const char *key, JsonElement *
 
     JsonElementSetPropertyName(element, key);
     SeqAppend(object->container.children, element);
+
+    if (object->container.index != NULL)
+    {
+        JsonObjectIndexInsert(object->container.index, element);
+    }
 }
 
 static int JsonElementHasProperty(const void *propertyName, const void *jsonElement, ARG_UNUSED void *user_data)
@@ -970,6 +1159,29 @@ static ssize_t JsonElementIndexInParentObject(JsonElement *parent, const char* k
     assert(parent->container.type == JSON_CONTAINER_TYPE_OBJECT);
     assert(key);
 
+    const JsonObjectIndex *index = JsonObjectGetIndex(parent);
+    if (index != NULL)
+    {
+        ssize_t slot = JsonObjectIndexFind(index, key);
+        if (slot == -1)
+        {
+            return -1;
+        }
+
+        /* Only pointers to compare, and recently appended keys are the
+         * likeliest to be replaced. */
+        const JsonElement *element = index->slots[slot].element;
+        for (size_t i = parent->container.children->length; i > 0; i--)
+        {
+            if (parent->container.children->data[i - 1] == element)
+            {
+                return i - 1;
+            }
+        }
+        UnexpectedError("JSON object index out of sync for key '%s'", key);
+        return -1;
+    }
+
     return SeqIndexOf(parent->container.children, key, CompareKeyToPropertyName);
 }
 
@@ -983,6 +1195,10 @@ bool JsonObjectRemoveKey(JsonElement *object, const char *key)
     ssize_t index = JsonElementIndexInParentObject(object, key);
     if (index != -1)
     {
+        if (object->container.index != NULL)
+        {
+            JsonObjectIndexRemove(object->container.index, key);
+        }
         SeqRemove(object->container.children, index);
         return true;
     }
@@ -1001,7 +1217,11 @@ JsonElement *JsonObjectDetachKey(JsonElement *object, const char *key)
     ssize_t index = JsonElementIndexInParentObject(object, key);
     if (index != -1)
     {
-        detached = SeqLookup(object->container.children, key, JsonElementHasProperty);
+        if (object->container.index != NULL)
+        {
+            JsonObjectIndexRemove(object->container.index, key);
+        }
+        detached = object->container.children->data[index];
         SeqSoftRemove(object->container.children, index);
     }
 
@@ -1015,7 +1235,7 @@ const char *JsonObjectGetAsString(const JsonElement *object, const char *key)
     assert(object->container.type == JSON_CONTAINER_TYPE_OBJECT);
     assert(key);
 
-    JsonElement *childPrimitive = SeqLookup(object->container.children, key, JsonElementHasProperty);
+    JsonElement *childPrimitive = JsonObjectLookup(object, key);
 
     if (childPrimitive)
     {
@@ -1033,7 +1253,7 @@ JsonElement *JsonObjectGetAsObject(JsonElement *object, const char *key)
     assert(object->container.type == JSON_CONTAINER_TYPE_OBJECT);
     assert(key);
 
-    JsonElement *childPrimitive = SeqLookup(object->container.children, key, JsonElementHasProperty);
+    JsonElement *childPrimitive = JsonObjectLookup(object, key);
 
     if (childPrimitive)
     {
@@ -1052,7 +1272,7 @@ JsonElement *JsonObjectGetAsArray(JsonElement *object, const char *key)
     assert(object->container.type == JSON_CONTAINER_TYPE_OBJECT);
     assert(key);
 
-    JsonElement *childPrimitive = SeqLookup(object->container.children, key, JsonElementHasProperty);
+    JsonElement *childPrimitive = JsonObjectLookup(object, key);
 
     if (childPrimitive)
     {
@@ -1071,7 +1291,7 @@ JsonElement *JsonObjectGet(const JsonElement *object, const char *key)
     assert(object->container.type == JSON_CONTAINER_TYPE_OBJECT);
     assert(key);
 
-    return SeqLookup(object->container.children, key, JsonElementHasProperty);
+    return JsonObjectLookup(object, key);
 }
 
 // *******************************************************************************************
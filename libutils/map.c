@@ -33,7 +33,7 @@
 /*
  * This associative array implementation uses array with linear search up to
  * TINY_LIMIT elements, and then converts into full-fledged hash table with open
- * addressing.
+ * addressing, see hash_map_priv.h.
  *
  * There is a lot of small hash tables, both iterating and deleting them as a
  * hashtable takes a lot of time, especially given associative hash tables are
@@ -117,15 +117,7 @@ size_t MapSize(const Map *map)
     }
     else
     {
-        MapIterator i = MapIteratorInit((Map*)map);
-        size_t size = 0;
-
-        while (MapIteratorNext(&i))
-        {
-            size++;
-        }
-
-        return size;
+        return HashMapSize(map->hashmap);
     }
 }
 
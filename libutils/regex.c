@@ -31,9 +31,36 @@
 #include <string_lib.h>
 
 #include <buffer.h>
+#include <map.h>
 
 #define STRING_MATCH_OVECCOUNT 30
 
+/* Upper bound on the number of distinct patterns kept compiled at once. */
+#define REGEX_CACHE_MAX_ENTRIES 1024
+
+/*
+ * Process-wide LRU cache of compiled and studied patterns, keyed by the
+ * pattern text. Entries are reference counted: the cache holds one reference
+ * and every RegexCacheGet() caller holds another, so a pattern evicted while
+ * some other thread is still matching against it is freed only once that
+ * thread releases it.
+ */
+struct CachedRegex_
+{
+    char *regex;
+    pcre *pattern;
+    pcre_extra *extra;
+    int refcount;
+    CachedRegex *prev;                                  /* more recently used */
+    CachedRegex *next;                                  /* less recently used */
+};
+
+static pthread_mutex_t regex_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Map *regex_cache = NULL;
+static CachedRegex *regex_cache_mru = NULL;
+static CachedRegex *regex_cache_lru = NULL;
+static RegexCacheStats regex_cache_stats = { 0 };
+
 
 pcre *CompileRegex(const char *regex)
 {
@@ -53,13 +80,202 @@ pcre *CompileRegex(const char *regex)
     return rx;
 }
 
-bool StringMatchWithPrecompiledRegex(pcre *regex, const char *str, int *start, int *end)
+static void CachedRegexDestroy(CachedRegex *cached)
+{
+    free(cached->regex);
+    pcre_free(cached->pattern);
+    if (cached->extra != NULL)
+    {
+        pcre_free(cached->extra);
+    }
+    free(cached);
+}
+
+/* Must be called with regex_cache_mutex held. */
+static void RegexCacheUnlink(CachedRegex *cached)
+{
+    if (cached->prev != NULL)
+    {
+        cached->prev->next = cached->next;
+    }
+    else
+    {
+        regex_cache_mru = cached->next;
+    }
+
+    if (cached->next != NULL)
+    {
+        cached->next->prev = cached->prev;
+    }
+    else
+    {
+        regex_cache_lru = cached->prev;
+    }
+
+    cached->prev = NULL;
+    cached->next = NULL;
+}
+
+/* Must be called with regex_cache_mutex held. */
+static void RegexCachePushFront(CachedRegex *cached)
+{
+    cached->prev = NULL;
+    cached->next = regex_cache_mru;
+    if (regex_cache_mru != NULL)
+    {
+        regex_cache_mru->prev = cached;
+    }
+    regex_cache_mru = cached;
+    if (regex_cache_lru == NULL)
+    {
+        regex_cache_lru = cached;
+    }
+}
+
+/* Must be called with regex_cache_mutex held. */
+static void RegexCacheDrop(CachedRegex *cached)
+{
+    RegexCacheUnlink(cached);
+    MapRemove(regex_cache, cached->regex);
+
+    if (--cached->refcount == 0)
+    {
+        CachedRegexDestroy(cached);
+    }
+}
+
+CachedRegex *RegexCacheGet(const char *regex)
+{
+    assert(regex);
+
+    pthread_mutex_lock(&regex_cache_mutex);
+
+    if (regex_cache == NULL)
+    {
+        regex_cache = MapNew(StringHash_untyped, StringSafeEqual_untyped,
+                             NULL, NULL);
+    }
+
+    CachedRegex *cached = MapGet(regex_cache, regex);
+    if (cached != NULL)
+    {
+        regex_cache_stats.hits++;
+        cached->refcount++;
+        RegexCacheUnlink(cached);
+        RegexCachePushFront(cached);
+        pthread_mutex_unlock(&regex_cache_mutex);
+        return cached;
+    }
+
+    regex_cache_stats.misses++;
+    pthread_mutex_unlock(&regex_cache_mutex);
+
+    /* Compile outside the lock, pcre_compile() is the expensive part. */
+    pcre *pattern = CompileRegex(regex);
+    if (pattern == NULL)
+    {
+        return NULL;
+    }
+
+    const char *errorstr = NULL;
+    pcre_extra *extra = pcre_study(pattern, 0, &errorstr);
+    if (errorstr != NULL)
+    {
+        Log(LOG_LEVEL_DEBUG,
+            "Regular expression warning: pcre_study() '%s' in expression '%s'",
+            errorstr, regex);
+    }
+
+    cached = xcalloc(1, sizeof(CachedRegex));
+    cached->regex = xstrdup(regex);
+    cached->pattern = pattern;
+    cached->extra = extra;
+    cached->refcount = 1;
+
+    pthread_mutex_lock(&regex_cache_mutex);
+
+    /* Another thread may have compiled the same pattern meanwhile. */
+    CachedRegex *other = MapGet(regex_cache, regex);
+    if (other != NULL)
+    {
+        other->refcount++;
+        pthread_mutex_unlock(&regex_cache_mutex);
+        CachedRegexDestroy(cached);
+        return other;
+    }
+
+    while (MapSize(regex_cache) >= REGEX_CACHE_MAX_ENTRIES)
+    {
+        regex_cache_stats.evictions++;
+        RegexCacheDrop(regex_cache_lru);
+    }
+
+    cached->refcount++;
+    MapInsert(regex_cache, cached->regex, cached);
+    RegexCachePushFront(cached);
+
+    pthread_mutex_unlock(&regex_cache_mutex);
+    return cached;
+}
+
+void RegexCacheRelease(CachedRegex *cached)
+{
+    if (cached == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&regex_cache_mutex);
+    bool last = (--cached->refcount == 0);
+    pthread_mutex_unlock(&regex_cache_mutex);
+
+    if (last)
+    {
+        CachedRegexDestroy(cached);
+    }
+}
+
+pcre *CachedRegexPattern(const CachedRegex *cached)
+{
+    assert(cached);
+    return cached->pattern;
+}
+
+pcre_extra *CachedRegexExtra(const CachedRegex *cached)
+{
+    assert(cached);
+    return cached->extra;
+}
+
+void RegexCacheGetStats(RegexCacheStats *stats)
+{
+    assert(stats);
+
+    pthread_mutex_lock(&regex_cache_mutex);
+    *stats = regex_cache_stats;
+    stats->entries = (regex_cache != NULL) ? MapSize(regex_cache) : 0;
+    pthread_mutex_unlock(&regex_cache_mutex);
+}
+
+void RegexCacheClear(void)
+{
+    pthread_mutex_lock(&regex_cache_mutex);
+    while (regex_cache_lru != NULL)
+    {
+        RegexCacheDrop(regex_cache_lru);
+    }
+    memset(&regex_cache_stats, 0, sizeof(regex_cache_stats));
+    pthread_mutex_unlock(&regex_cache_mutex);
+}
+
+static bool StringMatchWithStudiedRegex(pcre *regex, pcre_extra *extra,
+                                        const char *str, int *start, int *end)
 {
     assert(regex);
     assert(str);
 
     int ovector[STRING_MATCH_OVECCOUNT] = { 0 };
-    int result = pcre_exec(regex, NULL, str, strlen(str),
+    int result = pcre_exec(regex, extra, str, strlen(str),
                            0, 0, ovector, STRING_MATCH_OVECCOUNT);
 
     if (result)
@@ -88,49 +304,62 @@ bool StringMatchWithPrecompiledRegex(pcre *regex, const char *str, int *start, i
     return result >= 0;
 }
 
+bool StringMatchWithPrecompiledRegex(pcre *regex, const char *str, int *start, int *end)
+{
+    return StringMatchWithStudiedRegex(regex, NULL, str, start, end);
+}
+
 bool StringMatch(const char *regex, const char *str, int *start, int *end)
 {
-    pcre *pattern = CompileRegex(regex);
+    CachedRegex *cached = RegexCacheGet(regex);
 
-    if (pattern == NULL)
+    if (cached == NULL)
     {
         return false;
     }
 
-    bool ret = StringMatchWithPrecompiledRegex(pattern, str, start, end);
+    bool ret = StringMatchWithStudiedRegex(cached->pattern, cached->extra,
+                                           str, start, end);
 
-    pcre_free(pattern);
+    RegexCacheRelease(cached);
     return ret;
 
 }
 
+static bool StringMatchFullWithStudiedRegex(pcre *pattern, pcre_extra *extra,
+                                            const char *str)
+{
+    int start = 0, end = 0;
+
+    if (StringMatchWithStudiedRegex(pattern, extra, str, &start, &end))
+    {
+        return (start == 0) && (end == strlen(str));
+    }
+    else
+    {
+        return false;
+    }
+}
+
 bool StringMatchFull(const char *regex, const char *str)
 {
-    pcre *pattern = CompileRegex(regex);
+    CachedRegex *cached = RegexCacheGet(regex);
 
-    if (pattern == NULL)
+    if (cached == NULL)
     {
         return false;
     }
 
-    bool ret = StringMatchFullWithPrecompiledRegex(pattern, str);
+    bool ret = StringMatchFullWithStudiedRegex(cached->pattern, cached->extra,
+                                               str);
 
-    pcre_free(pattern);
+    RegexCacheRelease(cached);
     return ret;
 }
 
 bool StringMatchFullWithPrecompiledRegex(pcre *pattern, const char *str)
 {
-    int start = 0, end = 0;
-
-    if (StringMatchWithPrecompiledRegex(pattern, str, &start, &end))
-    {
-        return (start == 0) && (end == strlen(str));
-    }
-    else
-    {
-        return false;
-    }
+    return StringMatchFullWithStudiedRegex(pattern, NULL, str);
 }
 
 // Returns a Sequence with Buffer elements.
@@ -235,21 +464,15 @@ Seq *StringMatchCaptures(const char *regex, const char *str, const bool return_n
     assert(regex);
     assert(str);
 
-    pcre *pattern = NULL;
-    {
-        const char *errorstr;
-        int erroffset;
-        pattern = pcre_compile(regex, PCRE_MULTILINE | PCRE_DOTALL,
-                               &errorstr, &erroffset, NULL);
-    }
+    CachedRegex *cached = RegexCacheGet(regex);
 
-    if (pattern == NULL)
+    if (cached == NULL)
     {
         return NULL;
     }
 
-    Seq *ret = StringMatchCapturesWithPrecompiledRegex(pattern, str, return_names);
-    pcre_free(pattern);
+    Seq *ret = StringMatchCapturesWithPrecompiledRegex(cached->pattern, str, return_names);
+    RegexCacheRelease(cached);
     return ret;
 }
 
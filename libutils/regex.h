@@ -49,4 +49,29 @@ bool CompareStringOrRegex(const char *value, const char *compareTo, bool regex);
 /* Does not free rx! */
 bool RegexPartialMatch(const pcre *rx, const char *teststring);
 
+/*
+ * Process-wide, thread-safe LRU cache of compiled and pcre_study()'d patterns
+ * keyed by pattern text. StringMatch(), StringMatchFull(),
+ * StringMatchCaptures() and CompareStringOrRegex() go through it.
+ *
+ * RegexCacheGet() returns NULL if the pattern does not compile, otherwise a
+ * handle that stays valid (even if evicted) until RegexCacheRelease().
+ */
+typedef struct CachedRegex_ CachedRegex;
+
+typedef struct
+{
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+} RegexCacheStats;
+
+CachedRegex *RegexCacheGet(const char *regex);
+void RegexCacheRelease(CachedRegex *cached);
+pcre *CachedRegexPattern(const CachedRegex *cached);
+pcre_extra *CachedRegexExtra(const CachedRegex *cached);
+void RegexCacheGetStats(RegexCacheStats *stats);
+void RegexCacheClear(void);
+
 #endif  /* CFENGINE_REGEX_H */
@@ -0,0 +1,162 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <threaded_queue.h>
+#include <alloc.h>
+
+
+struct ThreadedQueue_
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond_nonempty;
+    QueueItemDestroy *destroy;
+    void **items;                                  /* ring of #capacity */
+    size_t capacity;
+    size_t head;                                /* next item to pop */
+    size_t count;
+    size_t max_count;                           /* high watermark */
+    bool closed;
+};
+
+
+ThreadedQueue *ThreadedQueueNew(size_t capacity,
+                                QueueItemDestroy *item_destroy)
+{
+    assert(capacity > 0);
+
+    ThreadedQueue *q = xcalloc(1, sizeof(ThreadedQueue));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond_nonempty, NULL);
+    q->destroy = item_destroy;
+    q->items = xcalloc(capacity, sizeof(void *));
+    q->capacity = capacity;
+
+    return q;
+}
+
+/**
+ * @warning No thread may be using #q any more, call ThreadedQueueClose() and
+ *          join the consumers first.
+ */
+void ThreadedQueueDestroy(ThreadedQueue *q)
+{
+    if (q != NULL)
+    {
+        if (q->destroy != NULL)
+        {
+            for (size_t i = 0; i < q->count; i++)
+            {
+                q->destroy(q->items[(q->head + i) % q->capacity]);
+            }
+        }
+
+        pthread_cond_destroy(&q->cond_nonempty);
+        pthread_mutex_destroy(&q->lock);
+        free(q->items);
+        free(q);
+    }
+}
+
+/**
+ * @return false if the queue is full or closed, in which case #item is still
+ *         owned by the caller.
+ */
+bool ThreadedQueueTryPush(ThreadedQueue *q, void *item)
+{
+    bool pushed = false;
+
+    pthread_mutex_lock(&q->lock);
+    if (!q->closed && q->count < q->capacity)
+    {
+        q->items[(q->head + q->count) % q->capacity] = item;
+        q->count++;
+        q->max_count = MAX(q->max_count, q->count);
+        pushed = true;
+        pthread_cond_signal(&q->cond_nonempty);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return pushed;
+}
+
+/**
+ * Wait until an item is available and remove it from the queue.
+ *
+ * @return false if the queue was closed and there are no items left.
+ */
+bool ThreadedQueuePop(ThreadedQueue *q, void **item)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed)
+    {
+        pthread_cond_wait(&q->cond_nonempty, &q->lock);
+    }
+
+    bool popped = false;
+    if (q->count > 0)
+    {
+        *item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        popped = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return popped;
+}
+
+/**
+ * Refuse any further pushes and wake up all waiting consumers. Items already
+ * in the queue can still be popped.
+ */
+void ThreadedQueueClose(ThreadedQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->cond_nonempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+size_t ThreadedQueueCount(ThreadedQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    size_t count = q->count;
+    pthread_mutex_unlock(&q->lock);
+
+    return count;
+}
+
+size_t ThreadedQueueMaxCount(ThreadedQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    size_t max_count = q->max_count;
+    pthread_mutex_unlock(&q->lock);
+
+    return max_count;
+}
+
+size_t ThreadedQueueCapacity(const ThreadedQueue *q)
+{
+    return q->capacity;
+}
@@ -0,0 +1,52 @@
+/*
+   Copyright 2017 Northern.tech AS
+
+   This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; version 3.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_THREADED_QUEUE_H
+#define CFENGINE_THREADED_QUEUE_H
+
+#include <platform.h>
+#include <queue.h>                                     /* QueueItemDestroy */
+
+
+/**
+ * Bounded, thread-safe FIFO queue, for any number of producers and
+ * consumers. Producers never block: ThreadedQueueTryPush() fails when the
+ * queue is full, leaving it to the caller to reject the work. Consumers
+ * block in ThreadedQueuePop() until an item arrives or the queue is closed.
+ */
+typedef struct ThreadedQueue_ ThreadedQueue;
+
+ThreadedQueue *ThreadedQueueNew(size_t capacity,
+                                QueueItemDestroy *item_destroy);
+void ThreadedQueueDestroy(ThreadedQueue *q);
+
+bool ThreadedQueueTryPush(ThreadedQueue *q, void *item);
+bool ThreadedQueuePop(ThreadedQueue *q, void **item);
+void ThreadedQueueClose(ThreadedQueue *q);
+
+size_t ThreadedQueueCount(ThreadedQueue *q);
+size_t ThreadedQueueMaxCount(ThreadedQueue *q);
+size_t ThreadedQueueCapacity(const ThreadedQueue *q);
+
+#endif
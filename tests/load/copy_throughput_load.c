@@ -0,0 +1,336 @@
+#include <cf3.defs.h>
+#include <server.h>
+#include <server_common.h>                                      /* CfGetFile */
+#include <server_tls.h>                         /* ServerTLSSessionEstablish */
+#include <client_code.h>                               /* CopyRegularFileNet */
+#include <communication.h>                                   /* NewAgentConn */
+#include <tls_client.h>                                            /* TLSTry */
+#include <net.h>                      /* SendTransaction,ReceiveTransaction */
+#include <crypto.h>                                      /* CryptoInitialize */
+#include <misc_lib.h>                                  /* xclock_gettime */
+#include <known_dirs.h>                                     /* GetWorkDir */
+#include <unix.h>                                    /* GetCurrentUserName */
+#include <openssl/rsa.h>
+#include <openssl/bn.h>
+
+#include <libgen.h>                                             /* basename */
+
+
+/**
+ * Streams a file from the server's CfGetFile() into the agent's
+ * CopyRegularFileNet() over a local socketpair, and reports the throughput.
+ * The server side runs in a thread of this process, so that both ends of the
+ * transfer are the code that ships.
+ */
+
+
+char CFWORKDIR[CF_BUFSIZE];
+char SRCFILE[CF_BUFSIZE];
+char DSTFILE[CF_BUFSIZE];
+
+ProtocolVersion PROTOCOL = CF_PROTOCOL_TLS;
+int BLOCKSIZE = 0;                 /* 0: use whatever the server advertises */
+int FILE_MB = 64;
+int ITERATIONS = 5;
+
+
+void print_usage(const char *progname)
+{
+    printf("Usage: %s [-c] [-b blocksize] [megabytes [iterations]]\n"
+           "\n"
+           "\t-c  use the classic protocol instead of TLS\n"
+           "\t-b  force this GET block size on the client (TLS only)\n"
+           "\n"
+           "\tDefaults: TLS, %d MB file copied %d times\n",
+           progname, FILE_MB, ITERATIONS);
+}
+
+void parse_args(int argc, char *argv[])
+{
+    int i = 1;
+    while (i < argc && argv[i][0] == '-')
+    {
+        switch (argv[i][1])
+        {
+        case 'c':
+            PROTOCOL = CF_PROTOCOL_CLASSIC;
+            break;
+        case 'b':
+        {
+            i++;
+            int N = 0;
+            int ret = sscanf((argv[i] != NULL) ? argv[i] : "",
+                             "%d", &N);
+            if (ret != 1 || N <= 0 || N > CF_FILE_BLOCKSIZE_MAX)
+            {
+                print_usage(basename(argv[0]));
+                exit(EXIT_FAILURE);
+            }
+
+            BLOCKSIZE = N;
+            break;
+        }
+        default:
+            print_usage(basename(argv[0]));
+            exit(EXIT_FAILURE);
+        }
+
+        i++;
+    }
+
+    if (i < argc && (sscanf(argv[i++], "%d", &FILE_MB) != 1 || FILE_MB <= 0))
+    {
+        print_usage(basename(argv[0]));
+        exit(EXIT_FAILURE);
+    }
+    if (i < argc && (sscanf(argv[i++], "%d", &ITERATIONS) != 1 || ITERATIONS <= 0))
+    {
+        print_usage(basename(argv[0]));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static double timespec_diff(const struct timespec *start,
+                            const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) +
+        (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void create_source_file(void)
+{
+    xsnprintf(SRCFILE, sizeof(SRCFILE), "%s/source", CFWORKDIR);
+    xsnprintf(DSTFILE, sizeof(DSTFILE), "%s/destination", CFWORKDIR);
+
+    FILE *f = fopen(SRCFILE, "w");
+    if (f == NULL)
+    {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Pseudo-random content so that nothing gets sparse on the client. */
+    char buf[4096];
+    unsigned int seed = 1;
+    for (int mb = 0; mb < FILE_MB; mb++)
+    {
+        for (int k = 0; k < 1024 * 1024 / sizeof(buf); k++)
+        {
+            for (size_t j = 0; j < sizeof(buf); j++)
+            {
+                buf[j] = rand_r(&seed);
+            }
+            if (fwrite(buf, sizeof(buf), 1, f) != 1)
+            {
+                perror("fwrite");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    fclose(f);
+}
+
+static void generate_keys(void)
+{
+    RSA *rsa = RSA_new();
+    BIGNUM *e = BN_new();
+    BN_set_word(e, RSA_F4);
+    if (RSA_generate_key_ex(rsa, 2048, e, NULL) != 1)
+    {
+        fprintf(stderr, "RSA_generate_key_ex failed\n");
+        exit(EXIT_FAILURE);
+    }
+    BN_free(e);
+
+    PRIVKEY = rsa;
+    PUBKEY = RSAPublicKey_dup(rsa);
+}
+
+void tests_setup(void)
+{
+    xsnprintf(CFWORKDIR, sizeof(CFWORKDIR),
+             "/tmp/copy_throughput_load.XXXXXX");
+    char *retp = mkdtemp(CFWORKDIR);
+    if (retp == NULL)
+    {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    printf("Created directory: %s\n", CFWORKDIR);
+
+    char *envvar;
+    xasprintf(&envvar, "%s=%s",
+              "CFENGINE_TEST_OVERRIDE_WORKDIR", CFWORKDIR);
+    putenv(envvar);
+
+    char path[CF_BUFSIZE];
+    xsnprintf(path, sizeof(path), "%s/ppkeys", GetWorkDir());
+    mkdir(path, S_IRWXU);
+    mkdir(GetStateDir(), S_IRWXU);
+
+    create_source_file();
+
+    /* Like the daemons, survive the peer going away mid-write. */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (PROTOCOL == CF_PROTOCOL_TLS)
+    {
+        CryptoInitialize();
+        generate_keys();
+
+        PrependItem(&SV.trustkeylist, "127.0.0.1", NULL);
+        if (!ServerTLSInitialize() || !TLSClientInitialize(NULL, NULL))
+        {
+            fprintf(stderr, "TLS initialisation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void tests_teardown(void)
+{
+    unlink(SRCFILE);
+    unlink(DSTFILE);
+
+    char cmd[CF_BUFSIZE];
+    xsnprintf(cmd, sizeof(cmd), "rm -rf '%s'", CFWORKDIR);
+    system(cmd);
+}
+
+
+/* Serve GET requests on one end of the socketpair until it is closed. */
+static void *server_thread(void *arg)
+{
+    ServerConnectionState *conn = arg;
+
+    if (PROTOCOL == CF_PROTOCOL_TLS &&
+        ServerTLSSessionEstablish(conn) != 1)
+    {
+        fprintf(stderr, "Server failed to establish TLS session\n");
+        return NULL;
+    }
+
+    char recvbuffer[CF_BUFSIZE + CF_BUFEXT] = "";
+    char sendbuffer[CF_BUFSIZE] = "";
+    char filename[CF_BUFSIZE] = "";
+
+    while (ReceiveTransaction(conn->conn_info, recvbuffer, NULL) > 0)
+    {
+        ServerFileGetState get_args = { 0 };
+        if (sscanf(recvbuffer, "GET %d %[^\n]",
+                   &get_args.buf_size, filename) != 2)
+        {
+            break;
+        }
+
+        get_args.conn = conn;
+        get_args.replybuff = sendbuffer;
+        get_args.replyfile = filename;
+
+        CfGetFile(&get_args);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+    tests_setup();
+
+    char username[CF_SMALLBUF] = "";
+    GetCurrentUserName(username, sizeof(username));
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+    {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+
+    ServerConnectionState *server_conn = xcalloc(1, sizeof(*server_conn));
+    server_conn->conn_info = ConnectionInfoNew();
+    server_conn->conn_info->sd = sv[0];
+    server_conn->conn_info->protocol = PROTOCOL;
+    server_conn->uid = getuid();
+    strlcpy(server_conn->ipaddr, "127.0.0.1", sizeof(server_conn->ipaddr));
+    strlcpy(server_conn->username, username, sizeof(server_conn->username));
+
+    ConnectionFlags flags = { .protocol_version = PROTOCOL };
+    AgentConnection *agent_conn = NewAgentConn("127.0.0.1", NULL, flags);
+    agent_conn->conn_info->sd = sv[1];
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, server_thread, server_conn) != 0)
+    {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    if (PROTOCOL == CF_PROTOCOL_TLS)
+    {
+        if (TLSTry(agent_conn->conn_info) == -1 ||
+            TLSClientIdentificationDialog(agent_conn->conn_info,
+                                          username) != 1)
+        {
+            fprintf(stderr, "Client failed to establish TLS session\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    agent_conn->conn_info->protocol = PROTOCOL;
+    agent_conn->conn_info->status = CONNECTIONINFO_STATUS_ESTABLISHED;
+
+    if (BLOCKSIZE != 0)
+    {
+        agent_conn->conn_info->max_blocksize = BLOCKSIZE;
+    }
+
+    printf("Protocol: %s, GET blocksize limit: %d\n",
+           PROTOCOL_VERSION_STRING[PROTOCOL],
+           agent_conn->conn_info->max_blocksize);
+
+    const off_t size = (off_t) FILE_MB * 1024 * 1024;
+    double total_secs = 0;
+    bool failed = false;
+
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        struct timespec start, end;
+        xclock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (!CopyRegularFileNet(SRCFILE, DSTFILE, size, false, agent_conn))
+        {
+            fprintf(stderr, "Copy %d failed\n", i);
+            failed = true;
+            break;
+        }
+
+        xclock_gettime(CLOCK_MONOTONIC, &end);
+        double secs = timespec_diff(&start, &end);
+        total_secs += secs;
+
+        printf("Copy %2d: %6.3f s, %8.1f MB/s\n",
+               i, secs, FILE_MB / secs);
+    }
+
+    if (!failed)
+    {
+        struct stat sb;
+        if (stat(DSTFILE, &sb) != 0 || sb.st_size != size)
+        {
+            fprintf(stderr, "Destination has wrong size\n");
+            failed = true;
+        }
+        else
+        {
+            printf("Average: %8.1f MB/s\n",
+                   FILE_MB * ITERATIONS / total_secs);
+        }
+    }
+
+    DisconnectServer(agent_conn);
+    pthread_join(tid, NULL);
+
+    tests_teardown();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
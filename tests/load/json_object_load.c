@@ -0,0 +1,175 @@
+#include <platform.h>
+#include <json.h>
+#include <writer.h>
+#include <misc_lib.h>                                  /* xclock_gettime */
+
+#include <libgen.h>                                             /* basename */
+
+
+/**
+ * Times the operations on JSON objects that look keys up: building an object
+ * key by key, getting and replacing keys, copying, merging and parsing, for
+ * objects of growing size. With keys indexed the time per key should stay
+ * about flat as the objects grow.
+ */
+
+
+int MAX_KEYS = 50000;
+int ITERATIONS = 3;
+
+
+void print_usage(const char *progname)
+{
+    printf("Usage: %s [max_keys [iterations]]\n"
+           "\n"
+           "\tDefaults: objects of up to %d keys, %d iterations\n",
+           progname, MAX_KEYS, ITERATIONS);
+}
+
+void parse_args(int argc, char *argv[])
+{
+    int *const values[] = { &MAX_KEYS, &ITERATIONS };
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i > 2 || sscanf(argv[i], "%d", values[i - 1]) != 1 ||
+            *values[i - 1] <= 0)
+        {
+            print_usage(basename(argv[0]));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static double timespec_diff(const struct timespec *start,
+                            const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) +
+        (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static char *key_name(int i)
+{
+    static char key[32];
+    xsnprintf(key, sizeof(key), "key_%08d", i);
+    return key;
+}
+
+/* The keys must still be there, in insertion order. */
+static bool check_object(const JsonElement *object, int keys)
+{
+    if (JsonLength(object) != (size_t) keys)
+    {
+        return false;
+    }
+
+    JsonIterator iter = JsonIteratorInit(object);
+    for (int i = 0; i < keys; i++)
+    {
+        const char *key = JsonIteratorNextKey(&iter);
+        if (key == NULL || strcmp(key, key_name(i)) != 0 ||
+            JsonObjectGet(object, key) != JsonIteratorCurrentValue(&iter))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @return false if the object came out wrong
+ */
+static bool run(int keys, double secs[5])
+{
+    struct timespec start, built, looked_up, merged_at, parsed_at, removed;
+    xclock_gettime(CLOCK_MONOTONIC, &start);
+
+    JsonElement *object = JsonObjectCreate(keys);
+    for (int i = 0; i < keys; i++)
+    {
+        JsonObjectAppendString(object, key_name(i), "value");
+    }
+
+    xclock_gettime(CLOCK_MONOTONIC, &built);
+
+    size_t found = 0;
+    for (int i = 0; i < keys; i++)
+    {
+        found += (JsonObjectGet(object, key_name((i * 7919) % keys)) != NULL);
+        JsonObjectAppendString(object, key_name(i), "replaced");
+    }
+
+    xclock_gettime(CLOCK_MONOTONIC, &looked_up);
+
+    JsonElement *copy = JsonCopy(object);
+    JsonElement *merged = JsonMerge(object, copy);
+
+    xclock_gettime(CLOCK_MONOTONIC, &merged_at);
+
+    Writer *writer = StringWriter();
+    JsonWriteCompact(writer, object);
+    const char *data = StringWriterData(writer);
+    JsonElement *parsed = NULL;
+    JsonParseError err = JsonParse(&data, &parsed);
+
+    xclock_gettime(CLOCK_MONOTONIC, &parsed_at);
+
+    bool ok = (found == (size_t) keys && err == JSON_PARSE_OK &&
+               check_object(object, keys) && check_object(merged, keys) &&
+               JsonCompare(object, parsed) == 0);
+
+    while (JsonLength(copy) > 0)
+    {
+        JsonObjectRemoveKey(copy, key_name(JsonLength(copy) - 1));
+    }
+
+    xclock_gettime(CLOCK_MONOTONIC, &removed);
+
+    secs[0] += timespec_diff(&start, &built);
+    secs[1] += timespec_diff(&built, &looked_up);
+    secs[2] += timespec_diff(&looked_up, &merged_at);
+    secs[3] += timespec_diff(&merged_at, &parsed_at);
+    secs[4] += timespec_diff(&parsed_at, &removed);
+
+    WriterClose(writer);
+    JsonDestroy(parsed);
+    JsonDestroy(merged);
+    JsonDestroy(copy);
+    JsonDestroy(object);
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+
+    printf("%8s %12s %12s %12s %12s %12s   (microseconds per key)\n",
+           "keys", "build", "get+replace", "copy+merge", "write+parse",
+           "remove");
+
+    bool failed = false;
+    for (int keys = 10; keys <= MAX_KEYS; keys *= 10)
+    {
+        double secs[5] = { 0 };
+        for (int i = 0; i < ITERATIONS; i++)
+        {
+            if (!run(keys, secs))
+            {
+                fprintf(stderr, "Wrong results with %d keys\n", keys);
+                failed = true;
+            }
+        }
+
+        double scale = 1e6 / ((double) keys * ITERATIONS);
+        printf("%8d %12.3f %12.3f %12.3f %12.3f %12.3f\n", keys,
+               secs[0] * scale, secs[1] * scale, secs[2] * scale,
+               secs[3] * scale, secs[4] * scale);
+
+        if (keys < MAX_KEYS && keys * 10 > MAX_KEYS)
+        {
+            keys = MAX_KEYS / 10;
+        }
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -10,6 +10,7 @@
 
 
 unsigned int ROUND_DURATION = 10;          /* how long to run each loop */
+time_t FLUSH_INTERVAL = 0;                 /* write-behind if non-zero */
 #define NHOSTS 5000                        /* how many hosts to store in db */
 #define MAX_NUM_THREADS 10000
 #define MAX_NUM_FORKS   10000
@@ -391,6 +392,9 @@ Options:\n\
 	-c N:	After finishing all rounds with threads, N spawned child\n\
 		processes shall apply a mixed workload to the database each one\n\
 		for another round (default is 0, i.e. don't fork children)\n\
+	-w N:	Buffer lastseen updates in memory like cf-serverd does, and\n\
+		write them to the database every N seconds (default is 0,\n\
+		i.e. write every update at once)\n\
 \n",
                argv0);
 }
@@ -439,6 +443,21 @@ void parse_args(int argc, char *argv[],
             *num_forked_children = N;
             break;
         }
+        case 'w':
+        {
+            i++;
+            int N = -1;
+            int ret = sscanf((argv[i] != NULL) ? argv[i] : "",
+                             "%d", &N);
+            if (ret != 1 || N < 0)
+            {
+                print_usage(basename(argv[0]));
+                exit(EXIT_FAILURE);
+            }
+
+            FLUSH_INTERVAL = N;
+            break;
+        }
         default:
             print_usage(basename(argv[0]));
             exit(EXIT_FAILURE);
@@ -567,6 +586,13 @@ int main(int argc, char *argv[])
     }
 
 
+    if (FLUSH_INTERVAL > 0)
+    {
+        printf("Writing lastseen updates every %jd seconds\n",
+               (intmax_t) FLUSH_INTERVAL);
+        LastSeenWriteBehindStart(FLUSH_INTERVAL);
+    }
+
     printf("Showing number of operations per second:\n\n");
 
     /* === CREATE lastsaw() WORKER THREADS === */
@@ -677,6 +703,11 @@ int main(int argc, char *argv[])
     }
     ThreadUnlock(&end_mtx);
 
+    if (FLUSH_INTERVAL > 0)
+    {
+        LastSeenWriteBehindStop();
+    }
+
     /* === CLEAN UP TODO register these with atexit() === */
 
     int retval = EXIT_SUCCESS;
@@ -0,0 +1,202 @@
+#include <platform.h>
+#include <map.h>
+#include <alloc.h>
+#include <misc_lib.h>                                  /* xclock_gettime */
+
+#include <libgen.h>                                             /* basename */
+
+
+/**
+ * Times the operations on string maps: inserting keys, looking up present
+ * and missing keys, iterating, removing half of the keys and destroying the
+ * map, for maps of growing size. Then times many small maps, just past the
+ * array stage, as used e.g. for the classes of a bundle. With the hash table
+ * growing as needed the time per key should stay about flat.
+ */
+
+
+int MAX_KEYS = 500000;
+int ITERATIONS = 3;
+
+#define SMALL_MAPS 20000
+#define SMALL_MAP_KEYS 20
+
+
+void print_usage(const char *progname)
+{
+    printf("Usage: %s [max_keys [iterations]]\n"
+           "\n"
+           "\tDefaults: maps of up to %d keys, %d iterations\n",
+           progname, MAX_KEYS, ITERATIONS);
+}
+
+void parse_args(int argc, char *argv[])
+{
+    int *const values[] = { &MAX_KEYS, &ITERATIONS };
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i > 2 || sscanf(argv[i], "%d", values[i - 1]) != 1 ||
+            *values[i - 1] <= 0)
+        {
+            print_usage(basename(argv[0]));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static double timespec_diff(const struct timespec *start,
+                            const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) +
+        (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static char *key_name(const char *prefix, int i)
+{
+    static char key[64];
+    xsnprintf(key, sizeof(key), "default:bundle.%s_%d", prefix, i);
+    return key;
+}
+
+static size_t count_keys(StringMap *map)
+{
+    MapIterator iter = MapIteratorInit(map->impl);
+    size_t count = 0;
+    while (MapIteratorNext(&iter))
+    {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @return false if the map came out wrong
+ */
+static bool run(int keys, double secs[5])
+{
+    struct timespec start, inserted, looked_up, iterated, removed, destroyed;
+    xclock_gettime(CLOCK_MONOTONIC, &start);
+
+    StringMap *map = StringMapNew();
+    size_t duplicates = 0;
+    for (int i = 0; i < keys; i++)
+    {
+        char *key = key_name("variable", i);
+        duplicates += StringMapInsert(map, xstrdup(key), xstrdup(key));
+    }
+
+    xclock_gettime(CLOCK_MONOTONIC, &inserted);
+
+    size_t found = 0, missing = 0;
+    for (int i = 0; i < keys; i++)
+    {
+        found += StringMapHasKey(map, key_name("variable", i));
+        missing += !StringMapHasKey(map, key_name("missing", i));
+    }
+
+    xclock_gettime(CLOCK_MONOTONIC, &looked_up);
+
+    size_t counted = count_keys(map);
+
+    xclock_gettime(CLOCK_MONOTONIC, &iterated);
+
+    size_t removed_keys = 0;
+    for (int i = 0; i < keys; i += 2)
+    {
+        removed_keys += StringMapRemove(map, key_name("variable", i));
+    }
+
+    xclock_gettime(CLOCK_MONOTONIC, &removed);
+
+    bool ok = (duplicates == 0 && found == (size_t) keys &&
+               missing == (size_t) keys && counted == (size_t) keys &&
+               removed_keys == (size_t) (keys + 1) / 2 &&
+               StringMapSize(map) == (size_t) keys / 2);
+
+    StringMapDestroy(map);
+
+    xclock_gettime(CLOCK_MONOTONIC, &destroyed);
+
+    secs[0] += timespec_diff(&start, &inserted);
+    secs[1] += timespec_diff(&inserted, &looked_up);
+    secs[2] += timespec_diff(&looked_up, &iterated);
+    secs[3] += timespec_diff(&iterated, &removed);
+    secs[4] += timespec_diff(&removed, &destroyed);
+
+    return ok;
+}
+
+/**
+ * @return false if a map came out wrong
+ */
+static bool run_small(double *secs)
+{
+    struct timespec start, end;
+    xclock_gettime(CLOCK_MONOTONIC, &start);
+
+    bool ok = true;
+    for (int m = 0; m < SMALL_MAPS; m++)
+    {
+        StringMap *map = StringMapNew();
+        for (int i = 0; i < SMALL_MAP_KEYS; i++)
+        {
+            char *key = key_name("class", i);
+            StringMapInsert(map, xstrdup(key), xstrdup(key));
+        }
+        ok = ok && (count_keys(map) == SMALL_MAP_KEYS);
+        StringMapDestroy(map);
+    }
+
+    xclock_gettime(CLOCK_MONOTONIC, &end);
+    *secs += timespec_diff(&start, &end);
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+
+    printf("%8s %12s %12s %12s %12s %12s   (microseconds per key)\n",
+           "keys", "insert", "hit+miss", "iterate", "remove half",
+           "destroy");
+
+    bool failed = false;
+    for (int keys = 10; keys <= MAX_KEYS; keys *= 10)
+    {
+        double secs[5] = { 0 };
+        for (int i = 0; i < ITERATIONS; i++)
+        {
+            if (!run(keys, secs))
+            {
+                fprintf(stderr, "Wrong results with %d keys\n", keys);
+                failed = true;
+            }
+        }
+
+        double scale = 1e6 / ((double) keys * ITERATIONS);
+        printf("%8d %12.3f %12.3f %12.3f %12.3f %12.3f\n", keys,
+               secs[0] * scale, secs[1] * scale, secs[2] * scale,
+               secs[3] * scale, secs[4] * scale);
+
+        if (keys < MAX_KEYS && keys * 10 > MAX_KEYS)
+        {
+            keys = MAX_KEYS / 10;
+        }
+    }
+
+    double small_secs = 0;
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        if (!run_small(&small_secs))
+        {
+            fprintf(stderr, "Wrong results with small maps\n");
+            failed = true;
+        }
+    }
+    printf("%d maps of %d keys: %.3f microseconds per map\n",
+           SMALL_MAPS, SMALL_MAP_KEYS,
+           small_secs * 1e6 / ((double) SMALL_MAPS * ITERATIONS));
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,219 @@
+#include <cf3.defs.h>
+#include <known_dirs.h>                                     /* GetStateDir */
+#include <misc_lib.h>                                   /* xclock_gettime */
+
+/* The ps and /proc loaders are static, so compile them in. */
+#include <processes_select.c>
+
+#include <libgen.h>                                             /* basename */
+
+
+/**
+ * Loads the process table with ps and with /proc, and runs a number of
+ * process promises' worth of selections against each. Extra idle processes
+ * can be forked to see how both scale with the size of the table.
+ */
+
+
+char CFWORKDIR[CF_BUFSIZE];
+
+int CHILDREN = 1000;
+int SELECTIONS = 50;
+int ITERATIONS = 5;
+
+
+void print_usage(const char *progname)
+{
+    printf("Usage: %s [children [selections [iterations]]]\n"
+           "\n"
+           "\tDefaults: %d extra processes, %d selections per load,"
+           " %d iterations\n",
+           progname, CHILDREN, SELECTIONS, ITERATIONS);
+}
+
+void parse_args(int argc, char *argv[])
+{
+    int *const values[] = { &CHILDREN, &SELECTIONS, &ITERATIONS };
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i > 3 || sscanf(argv[i], "%d", values[i - 1]) != 1 ||
+            *values[i - 1] < 0)
+        {
+            print_usage(basename(argv[0]));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static double timespec_diff(const struct timespec *start,
+                            const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) +
+        (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void tests_setup(void)
+{
+    xsnprintf(CFWORKDIR, sizeof(CFWORKDIR),
+             "/tmp/process_table_load.XXXXXX");
+    char *retp = mkdtemp(CFWORKDIR);
+    if (retp == NULL)
+    {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    printf("Created directory: %s\n", CFWORKDIR);
+
+    char *envvar;
+    xasprintf(&envvar, "%s=%s",
+              "CFENGINE_TEST_OVERRIDE_WORKDIR", CFWORKDIR);
+    putenv(envvar);
+    mkdir(GetStateDir(), S_IRWXU);
+
+    VPSHARDCLASS = PLATFORM_CONTEXT_LINUX;
+}
+
+void tests_teardown(void)
+{
+    char cmd[CF_BUFSIZE];
+    xsnprintf(cmd, sizeof(cmd), "rm -rf '%s'", CFWORKDIR);
+    system(cmd);
+}
+
+static pid_t *spawn_children(int n)
+{
+    pid_t *pids = xcalloc(n, sizeof(pid_t));
+    for (int i = 0; i < n; i++)
+    {
+        pids[i] = fork();
+        if (pids[i] == -1)
+        {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pids[i] == 0)
+        {
+            pause();
+            _exit(EXIT_SUCCESS);
+        }
+    }
+    return pids;
+}
+
+static void reap_children(pid_t *pids, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        kill(pids[i], SIGTERM);
+        waitpid(pids[i], NULL, 0);
+    }
+    free(pids);
+}
+
+/**
+ * Load the table with #load and select SELECTIONS times: every other one by
+ * attributes, like a processes promise with process_select.
+ *
+ * @return number of processes found by the last selection
+ */
+static int run(const char *name, bool (*load)(void),
+               double *load_secs, double *select_secs)
+{
+    ProcessSelect a = {
+        .min_pid = 1, .max_pid = INT_MAX,
+        .min_ppid = getpid(), .max_ppid = getpid(),
+        .min_pgid = CF_NOINT, .max_pgid = CF_NOINT,
+        .min_rsize = CF_NOINT, .max_rsize = CF_NOINT,
+        .min_vsize = CF_NOINT, .max_vsize = CF_NOINT,
+        .min_ttime = CF_NOINT, .max_ttime = CF_NOINT,
+        .min_stime = CF_NOINT, .max_stime = CF_NOINT,
+        .min_pri = CF_NOINT, .max_pri = CF_NOINT,
+        .min_thread = CF_NOINT, .max_thread = CF_NOINT,
+        .process_result = "ppid",
+    };
+
+    struct timespec start, loaded, end;
+    xclock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (!load())
+    {
+        fprintf(stderr, "Loading the process table with %s failed\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    xclock_gettime(CLOCK_MONOTONIC, &loaded);
+
+    int found = 0;
+    for (int i = 0; i < SELECTIONS; i++)
+    {
+        Item *matched = SelectProcesses("process_table_load", a, (i % 2) == 1);
+        found = ListLen(matched);
+        DeleteItemList(matched);
+    }
+
+    xclock_gettime(CLOCK_MONOTONIC, &end);
+    ClearProcessTable();
+
+    *load_secs += timespec_diff(&start, &loaded);
+    *select_secs += timespec_diff(&loaded, &end);
+    return found;
+}
+
+static bool load_ps(void)
+{
+    return LoadProcessTableFromPs();
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+    tests_setup();
+
+    pid_t *children = spawn_children(CHILDREN);
+
+    struct
+    {
+        const char *name;
+        bool (*load)(void);
+        double load_secs;
+        double select_secs;
+        int found;
+    } backends[] = {
+        { "ps", load_ps, 0, 0, 0 },
+        { "/proc", LoadProcessTableFromProc, 0, 0, 0 },
+    };
+
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+        {
+            backends[b].found = run(backends[b].name, backends[b].load,
+                                    &backends[b].load_secs,
+                                    &backends[b].select_secs);
+        }
+    }
+
+    reap_children(children, CHILDREN);
+
+    bool failed = false;
+    printf("%d extra processes, %d selections per load, %d iterations\n",
+           CHILDREN, SELECTIONS, ITERATIONS);
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+    {
+        printf("%-6s load: %8.2f ms, select: %8.2f ms, found %d\n",
+               backends[b].name,
+               1000 * backends[b].load_secs / ITERATIONS,
+               1000 * backends[b].select_secs / ITERATIONS,
+               backends[b].found);
+
+        /* The children, and this process unless selecting by ppid. */
+        if (backends[b].found < CHILDREN)
+        {
+            failed = true;
+        }
+    }
+
+    tests_teardown();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
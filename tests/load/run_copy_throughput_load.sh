@@ -0,0 +1,3 @@
+#!/bin/sh
+
+./copy_throughput_load -c 16 2 && ./copy_throughput_load 16 2
@@ -0,0 +1,3 @@
+#!/bin/sh
+
+./json_object_load 50000 3
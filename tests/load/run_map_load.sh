@@ -0,0 +1,3 @@
+#!/bin/sh
+
+./map_load 500000 3
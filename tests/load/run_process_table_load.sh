@@ -0,0 +1,3 @@
+#!/bin/sh
+
+./process_table_load 1000 50 3
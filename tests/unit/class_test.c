@@ -1,6 +1,7 @@
 #include <test.h>
 
 #include <class.h>
+#include <misc_lib.h>                                          /* xsnprintf */
 
 static void test_class_ref(void)
 {
@@ -106,6 +107,60 @@ static void test_put_replace(void)
     ClassTableDestroy(t);
 }
 
+static void test_class_ids(void)
+{
+    ClassId id = ClassIdIntern("ns", "interned");
+    assert_true(id != CLASS_ID_NONE);
+    assert_int_equal(ClassIdIntern("ns", "interned"), id);
+    assert_int_equal(ClassIdFind("ns", "interned"), id);
+    assert_true(ClassIdFind("ns2", "interned") == CLASS_ID_NONE);
+    assert_true(ClassIdFind("ns", "never_interned") == CLASS_ID_NONE);
+
+    /* NULL is the default namespace. */
+    ClassId default_id = ClassIdIntern(NULL, "interned");
+    assert_int_equal(ClassIdFind("default", "interned"), default_id);
+    assert_true(default_id != id);
+
+    /* Enough names to grow the interning table a few times. */
+    ClassTable *t = ClassTableNew();
+    for (int i = 0; i < 5000; i++)
+    {
+        char name[32];
+        xsnprintf(name, sizeof(name), "class_%d", i);
+        assert_false(ClassTablePut(t, (i % 2) ? "ns" : NULL, name,
+                                   true, CONTEXT_SCOPE_NAMESPACE, NULL));
+    }
+    for (int i = 0; i < 5000; i++)
+    {
+        char name[32];
+        xsnprintf(name, sizeof(name), "class_%d", i);
+        const char *ns = (i % 2) ? "ns" : NULL;
+        Class *cls = ClassTableGet(t, ns, name);
+        assert_true(cls != NULL);
+        assert_string_equal(name, cls->name);
+        assert_true(ClassTableGetById(t, ClassIdFind(ns, name)) == cls);
+        assert_true(ClassTableGet(t, (i % 2) ? NULL : "ns", name) == NULL);
+    }
+
+    assert_true(ClassTableRemove(t, "ns", "class_1"));
+    assert_false(ClassTableRemove(t, "ns", "class_1"));
+    assert_true(ClassTableGet(t, "ns", "class_1") == NULL);
+
+    int count = 0;
+    ClassTableIterator *iter = ClassTableIteratorNew(t, "ns", true, true);
+    while (ClassTableIteratorNext(iter) != NULL)
+    {
+        count++;
+    }
+    ClassTableIteratorDestroy(iter);
+    assert_int_equal(count, 2499);
+
+    assert_true(ClassTableClear(t));
+    assert_false(ClassTableClear(t));
+    assert_true(ClassTableGet(t, NULL, "class_0") == NULL);
+    ClassTableDestroy(t);
+}
+
 int main()
 {
     PRINT_TEST_BANNER();
@@ -115,6 +170,7 @@ int main()
         unit_test(test_ns),
         unit_test(test_class_ref),
         unit_test(test_put_replace),
+        unit_test(test_class_ids),
     };
 
     return run_tests(tests);
@@ -0,0 +1,126 @@
+#include <test.h>
+
+#include <conn_cache.h>
+#include <communication.h>                                  /* NewAgentConn */
+#include <connection_info.h>                         /* ConnectionInfoSetSocket */
+#include <misc_lib.h>                                          /* xsnprintf */
+
+
+static const ConnectionFlags FLAGS = {
+    .protocol_version = CF_PROTOCOL_CLASSIC,
+    .cache_connection = true,
+};
+
+/* A connection with a real socket, so that the cache considers it open. */
+static AgentConnection *NewTestConnection(const char *server, const char *port)
+{
+    AgentConnection *conn = NewAgentConn(server, port, FLAGS);
+
+    int sv[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    close(sv[1]);
+    ConnectionInfoSetSocket(conn->conn_info, sv[0]);
+
+    return conn;
+}
+
+static void test_reuse_idle_connection(void)
+{
+    ConnCache_Init();
+
+    AgentConnection *conn = NewTestConnection("server1", "5308");
+    ConnCache_Add(conn, CONNCACHE_STATUS_BUSY);
+
+    /* Busy connections are not handed out again. */
+    assert_true(ConnCache_FindIdleMarkBusy("server1", "5308", FLAGS) == NULL);
+
+    ConnCache_MarkNotBusy(conn);
+    assert_true(ConnCache_FindIdleMarkBusy("server1", "5308", FLAGS) == conn);
+    assert_true(ConnCache_FindIdleMarkBusy("server1", "5308", FLAGS) == NULL);
+
+    /* Other port, other server or other flags are other connections. */
+    ConnCache_MarkNotBusy(conn);
+    assert_true(ConnCache_FindIdleMarkBusy("server1", "5309", FLAGS) == NULL);
+    assert_true(ConnCache_FindIdleMarkBusy("server2", "5308", FLAGS) == NULL);
+    ConnectionFlags tls = FLAGS;
+    tls.protocol_version = CF_PROTOCOL_TLS;
+    assert_true(ConnCache_FindIdleMarkBusy("server1", "5308", tls) == NULL);
+
+    ConnCache_Destroy();
+}
+
+static void test_many_servers(void)
+{
+    ConnCache_Init();
+
+    AgentConnection *conns[100];
+    for (int i = 0; i < 100; i++)
+    {
+        char server[32];
+        xsnprintf(server, sizeof(server), "server%d", i);
+        conns[i] = NewTestConnection(server, NULL);
+        ConnCache_Add(conns[i], CONNCACHE_STATUS_IDLE);
+    }
+
+    for (int i = 99; i >= 0; i--)
+    {
+        char server[32];
+        xsnprintf(server, sizeof(server), "server%d", i);
+        assert_true(ConnCache_FindIdleMarkBusy(server, NULL, FLAGS) == conns[i]);
+        assert_true(ConnCache_FindIdleMarkBusy(server, "5308", FLAGS) == NULL);
+    }
+
+    ConnCache_Destroy();
+}
+
+static void test_expired_connection_is_closed(void)
+{
+    ConnCache_Init();
+
+    ConnCacheStats before;
+    ConnCache_GetStats(&before);
+
+    AgentConnection *conn = NewTestConnection("server1", "5308");
+    ConnCache_Add(conn, CONNCACHE_STATUS_IDLE);
+
+    ConnCache_SetLimits(0, 0);
+    assert_true(ConnCache_FindIdleMarkBusy("server1", "5308", FLAGS) == NULL);
+    ConnCache_SetLimits(3600, 300);
+
+    ConnCacheStats after;
+    ConnCache_GetStats(&after);
+    assert_int_equal(after.expired - before.expired, 1);
+
+    ConnCache_Destroy();
+}
+
+static void test_offline_backoff(void)
+{
+    ConnCache_Init();
+
+    assert_false(ConnCache_IsOffline("server1", "5308", FLAGS));
+
+    ConnCache_Add(NewAgentConn("server1", "5308", FLAGS), CONNCACHE_STATUS_OFFLINE);
+    assert_true(ConnCache_IsOffline("server1", "5308", FLAGS));
+    assert_false(ConnCache_IsOffline("server1", "5309", FLAGS));
+
+    /* A successful connection makes the server healthy again. */
+    ConnCache_Add(NewTestConnection("server1", "5308"), CONNCACHE_STATUS_BUSY);
+    assert_false(ConnCache_IsOffline("server1", "5308", FLAGS));
+
+    ConnCache_Destroy();
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_reuse_idle_connection),
+        unit_test(test_many_servers),
+        unit_test(test_expired_connection_is_closed),
+        unit_test(test_offline_backoff),
+    };
+
+    return run_tests(tests);
+}
@@ -225,6 +225,135 @@ void test_old_workdir_db_location(void)
     free(new_db);
 }
 
+void test_sub_db(void)
+{
+    // Test that sub-databases are kept apart from each other.
+    CF_DB *db;
+    char value[CF_BUFSIZE];
+
+    assert_true(OpenSubDB(&db, dbid_packages_installed, "one"));
+    assert_true(WriteDB(db, "key", "one", strlen("one") + 1));
+    CloseDB(db);
+
+    assert_true(OpenSubDB(&db, dbid_packages_installed, "two"));
+    assert_false(ReadDB(db, "key", value, sizeof(value)));
+    CloseDB(db);
+
+    assert_true(OpenSubDB(&db, dbid_packages_installed, "one"));
+    assert_true(ReadDB(db, "key", value, sizeof(value)));
+    assert_string_equal(value, "one");
+    CloseDB(db);
+}
+
+void test_replaced_file(void)
+{
+    // Test that a database file removed between two uses is not read from a
+    // handle that was kept open.
+    CF_DB *db;
+    char value[CF_BUFSIZE];
+
+    assert_true(OpenDB(&db, dbid_state));
+    assert_true(WriteDB(db, "key", "value", strlen("value") + 1));
+    CloseDB(db);
+
+    char *path = DBIdToPath(dbid_state);
+    assert_int_equal(unlink(path), 0);
+    free(path);
+
+    assert_true(OpenDB(&db, dbid_state));
+    assert_false(ReadDB(db, "key", value, sizeof(value)));
+    CloseDB(db);
+}
+
+static void *WriteSessionKey(void *arg ARG_UNUSED)
+{
+    CF_DB *db;
+    assert_true(OpenDB(&db, dbid_cache));
+    assert_true(WriteDB(db, "session", "written", strlen("written") + 1));
+    CloseDB(db);
+    return NULL;
+}
+
+void test_read_session(void)
+{
+    // Test that reads in a session share one snapshot of the database.
+    CF_DB *db;
+    char value[CF_BUFSIZE];
+
+    assert_true(BeginDBReadSession(dbid_cache));
+
+    assert_true(OpenDB(&db, dbid_cache));
+    assert_false(ReadDB(db, "session", value, sizeof(value)));
+    CloseDB(db);
+
+    pthread_t tid;
+    assert_int_equal(pthread_create(&tid, NULL, WriteSessionKey, NULL), 0);
+    assert_int_equal(pthread_join(tid, NULL), 0);
+
+    // Still the same transaction, so not visible yet.
+    assert_true(OpenDB(&db, dbid_cache));
+    assert_false(ReadDB(db, "session", value, sizeof(value)));
+    CloseDB(db);
+
+    EndDBReadSession(dbid_cache);
+
+    assert_true(OpenDB(&db, dbid_cache));
+    assert_true(ReadDB(db, "session", value, sizeof(value)));
+    assert_string_equal(value, "written");
+    CloseDB(db);
+}
+
+static volatile bool THEIRS_WRITTEN = false;
+
+static void *WriteTheirsKey(void *arg ARG_UNUSED)
+{
+    CF_DB *db;
+    assert_true(OpenDB(&db, dbid_cache));
+    assert_true(WriteDB(db, "theirs", "written", strlen("written") + 1));
+    CloseDB(db);
+    THEIRS_WRITTEN = true;
+    return NULL;
+}
+
+void test_write_in_read_session(void)
+{
+    // Test that a write inside a session is committed right away, so that
+    // it does not keep other writers waiting until the session ends.
+    CF_DB *db;
+    char value[CF_BUFSIZE];
+
+    assert_true(BeginDBReadSession(dbid_cache));
+
+    assert_true(OpenDB(&db, dbid_cache));
+    assert_false(ReadDB(db, "mine", value, sizeof(value)));
+    assert_true(WriteDB(db, "mine", "written", strlen("written") + 1));
+    CloseDB(db);
+
+    pthread_t tid;
+    assert_int_equal(pthread_create(&tid, NULL, WriteTheirsKey, NULL), 0);
+
+    struct timespec sleeptime = {
+        .tv_sec = 0,
+        .tv_nsec = 10000000 /* 10 ms */
+    };
+    for (int i = 0; i < 500 && !THEIRS_WRITTEN; i++)
+    {
+        nanosleep(&sleeptime, NULL);
+    }
+    assert_true(THEIRS_WRITTEN);
+    assert_int_equal(pthread_join(tid, NULL), 0);
+
+    // Our write ended the transaction, so the other write is visible.
+    assert_true(OpenDB(&db, dbid_cache));
+    assert_true(ReadDB(db, "mine", value, sizeof(value)));
+    assert_string_equal(value, "written");
+    assert_true(ReadDB(db, "theirs", value, sizeof(value)));
+    assert_string_equal(value, "written");
+    CloseDB(db);
+
+    EndDBReadSession(dbid_cache);
+}
+
 int main()
 {
     PRINT_TEST_BANNER();
@@ -238,6 +367,10 @@ int main()
             unit_test(test_iter_delete_entry),
             unit_test(test_recreate),
             unit_test(test_old_workdir_db_location),
+            unit_test(test_sub_db),
+            unit_test(test_replaced_file),
+            unit_test(test_read_session),
+            unit_test(test_write_in_read_session),
         };
 
     PRINT_TEST_BANNER();
@@ -100,6 +100,98 @@ static void test_class_persistence(void)
     EvalContextDestroy(ctx);
 }
 
+static void test_class_expression_cache(void)
+{
+    EvalContext *ctx = EvalContextNew();
+    EvalContextClassPutHard(ctx, "alpha", "");
+    EvalContextClassPutHard(ctx, "beta", "");
+
+    ClassExpressionCacheStats before, after;
+    ClassExpressionCacheGetStats(&before);
+
+    /* Bare names never reach the cache. */
+    assert_true(IsDefinedClass(ctx, "alpha"));
+    assert_true(IsDefinedClass(ctx, "default:beta"));
+    assert_false(IsDefinedClass(ctx, "gamma"));
+    assert_true(IsDefinedClass(ctx, "true"));
+    assert_false(IsDefinedClass(ctx, "false"));
+    assert_true(IsDefinedClass(ctx, "any"));
+
+    for (int i = 0; i < 3; i++)
+    {
+        assert_true(IsDefinedClass(ctx, "alpha.beta"));
+        assert_true(IsDefinedClass(ctx, "gamma|(beta.!gamma)"));
+        assert_true(IsDefinedClass(ctx, " alpha & beta "));
+        assert_false(IsDefinedClass(ctx, "alpha beta"));
+        assert_false(IsDefinedClass(ctx, "alpha.(beta"));
+    }
+
+    ClassExpressionCacheGetStats(&after);
+    assert_int_equal(after.misses - before.misses, 5);
+    assert_int_equal(after.hits - before.hits, 10);
+    assert_int_equal(after.entries - before.entries, 5);
+
+    /* The cached trees are evaluated against the current classes. */
+    EvalContextClassPutHard(ctx, "gamma", "");
+    assert_false(IsDefinedClass(ctx, "alpha.!gamma"));
+    assert_false(IsDefinedClass(ctx, "!gamma.alpha"));
+    assert_true(IsDefinedClass(ctx, "gamma.alpha.beta"));
+
+    EvalContextDestroy(ctx);
+}
+
+static void test_promise_inputs(void)
+{
+    EvalContext *ctx = EvalContextNew();
+    EvalContextClassPutHard(ctx, "alpha", "");
+
+    Policy *p = PolicyNew();
+    Bundle *bp = PolicyAppendBundle(p, "default", "main", "agent", NULL, NULL);
+    EvalContextStackPushBundleFrame(ctx, bp, NULL, false);
+
+    VarRef *x = VarRefParseFromBundle("x", bp);
+    VarRef *y = VarRefParseFromBundle("y", bp);
+    EvalContextVariablePut(ctx, x, "1", CF_DATA_TYPE_STRING, "");
+
+    EvalContextInputsRecordBegin(ctx);
+    assert_true(IsDefinedClass(ctx, "alpha|beta"));
+    assert_true(EvalContextVariableGet(ctx, x, NULL) != NULL);
+    EvalInputs *inputs = EvalContextInputsRecordEnd(ctx);
+    assert_true(inputs != NULL);
+
+    /* Changes to what was not read do not matter... */
+    assert_false(EvalContextInputsChanged(ctx, inputs));
+    EvalContextClassPutHard(ctx, "gamma", "");
+    EvalContextVariablePut(ctx, y, "2", CF_DATA_TYPE_STRING, "");
+    assert_false(EvalContextInputsChanged(ctx, inputs));
+
+    /* ...changes to what was, including reads that found nothing, do. */
+    EvalContextClassPutSoft(ctx, "beta", CONTEXT_SCOPE_NAMESPACE, "");
+    assert_true(EvalContextInputsChanged(ctx, inputs));
+    EvalInputsDestroy(inputs);
+
+    EvalContextInputsRecordBegin(ctx);
+    EvalContextVariableGet(ctx, x, NULL);
+    inputs = EvalContextInputsRecordEnd(ctx);
+    EvalContextVariablePut(ctx, x, "3", CF_DATA_TYPE_STRING, "");
+    assert_true(EvalContextInputsChanged(ctx, inputs));
+    EvalInputsDestroy(inputs);
+
+    /* A recording that nests another one is volatile. */
+    EvalContextInputsRecordBegin(ctx);
+    EvalContextInputsRecordBegin(ctx);
+    inputs = EvalContextInputsRecordEnd(ctx);
+    assert_true(inputs != NULL);
+    EvalInputsDestroy(inputs);
+    assert_true(EvalContextInputsRecordEnd(ctx) == NULL);
+
+    VarRefDestroy(x);
+    VarRefDestroy(y);
+    EvalContextStackPopFrame(ctx);
+    PolicyDestroy(p);
+    EvalContextDestroy(ctx);
+}
+
 int main()
 {
     PRINT_TEST_BANNER();
@@ -108,6 +200,8 @@ int main()
     const UnitTest tests[] =
     {
         unit_test(test_class_persistence),
+        unit_test(test_class_expression_cache),
+        unit_test(test_promise_inputs),
     };
 
     int ret = run_tests(tests);
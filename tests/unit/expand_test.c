@@ -357,6 +357,60 @@ static void test_expand_scalar_nested_inner_undefined(void **state)
     BufferDestroy(res);
 }
 
+static void test_expand_scalar_template_reuse(void **state)
+{
+    EvalContext *ctx = *state;
+    {
+        VarRef *lval = VarRefParse("default:bundle.one");
+        EvalContextVariablePut(ctx, lval, "first", CF_DATA_TYPE_STRING, NULL);
+        VarRefDestroy(lval);
+    }
+    {
+        VarRef *lval = VarRefParse("default:other.one");
+        EvalContextVariablePut(ctx, lval, "other first", CF_DATA_TYPE_STRING, NULL);
+        VarRefDestroy(lval);
+    }
+    {
+        VarRef *lval = VarRefParse("ns:bundle.one");
+        EvalContextVariablePut(ctx, lval, "ns first", CF_DATA_TYPE_STRING, NULL);
+        VarRefDestroy(lval);
+    }
+
+    ScalarTemplateCacheStats before, after;
+    ScalarTemplateCacheGetStats(&before);
+
+    /* The same template, expanded in different scopes. */
+    const char *tmpl = "$(one) / $(bundle.one) / ${default:other.one} $";
+    struct
+    {
+        const char *ns;
+        const char *scope;
+        const char *expected;
+    } cases[] = {
+        { "default", "bundle", "first / first / other first $" },
+        { "default", "other", "other first / first / other first $" },
+        { "ns", "bundle", "ns first / ns first / other first $" },
+        { "ns", "other", "$(one) / ns first / other first $" },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        Buffer *res = BufferNew();
+        ExpandScalar(ctx, cases[i].ns, cases[i].scope, tmpl, res);
+        assert_string_equal(cases[i].expected, BufferData(res));
+        BufferDestroy(res);
+    }
+
+    /* Strings without references are not cached. */
+    char *plain = ExpandScalar(ctx, "default", "bundle", "no $references$", NULL);
+    assert_string_equal("no $references$", plain);
+    free(plain);
+
+    ScalarTemplateCacheGetStats(&after);
+    assert_int_equal(after.misses - before.misses, 1);
+    assert_int_equal(after.hits - before.hits, 3);
+}
+
 static void test_expand_list_nested(void **state)
 {
     EvalContext *ctx = *state;
@@ -576,6 +630,7 @@ int main()
         unit_test_setup_teardown(test_expand_scalar_array_with_scalar_arg, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_scalar_undefined, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_scalar_nested_inner_undefined, test_setup, test_teardown),
+        unit_test_setup_teardown(test_expand_scalar_template_reuse, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_list_nested, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_promise_array_with_scalar_arg, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_promise_slist, test_setup, test_teardown),
@@ -0,0 +1,181 @@
+#include <test.h>
+
+#include <cf3.defs.h>
+#include <fncall_cache.h>
+#include <rlist.h>
+#include <json.h>
+#include <misc_lib.h>                                          /* xsnprintf */
+#include <known_dirs.h>
+
+
+char CFWORKDIR[CF_BUFSIZE];
+char INPUT[CF_BUFSIZE];
+
+#define TTL 600
+
+
+static void tests_setup(void)
+{
+    static char env[] = /* Needs to be static for putenv() */
+        "CFENGINE_TEST_OVERRIDE_WORKDIR=/tmp/fncall_cache_test.XXXXXX";
+
+    char *workdir = strchr(env, '=') + 1; /* start of the path */
+    assert(workdir - 1 && workdir[0] == '/');
+
+    mkdtemp(workdir);
+    strlcpy(CFWORKDIR, workdir, CF_BUFSIZE);
+    putenv(env);
+    mkdir(GetStateDir(), (S_IRWXU | S_IRWXG | S_IRWXO));
+
+    xsnprintf(INPUT, sizeof(INPUT), "%s/input", CFWORKDIR);
+}
+
+static void tests_teardown(void)
+{
+    char cmd[CF_BUFSIZE];
+    xsnprintf(cmd, CF_BUFSIZE, "rm -rf '%s'", GetStateDir());
+    system(cmd);
+    xsnprintf(cmd, CF_BUFSIZE, "rm -rf '%s'", GetWorkDir());
+    system(cmd);
+}
+
+static void write_input(const char *contents)
+{
+    FILE *f = fopen(INPUT, "w");
+    assert_true(f != NULL);
+    fputs(contents, f);
+    fclose(f);
+}
+
+
+static void test_scalar(void)
+{
+    Rlist *args = NULL;
+    RlistAppendScalar(&args, "/bin/echo hello");
+    RlistAppendScalar(&args, "noshell");
+
+    Rval rval;
+    assert_false(FnCallCacheLoad("execresult", args, TTL, &rval));
+
+    FnCallCacheStore("execresult", args,
+                     (Rval) { "hello", RVAL_TYPE_SCALAR });
+    assert_true(FnCallCacheLoad("execresult", args, TTL, &rval));
+    assert_int_equal(rval.type, RVAL_TYPE_SCALAR);
+    assert_string_equal(RvalScalarValue(rval), "hello");
+    RvalDestroy(rval);
+
+    /* Same arguments, other function. */
+    assert_false(FnCallCacheLoad("returnszero", args, TTL, &rval));
+
+    /* Disabled. */
+    assert_false(FnCallCacheLoad("execresult", args, 0, &rval));
+
+    RlistDestroy(args);
+}
+
+static void test_list(void)
+{
+    Rlist *args = NULL;
+    RlistAppendScalar(&args, "/tmp/*");
+
+    Rlist *list = NULL;
+    RlistAppendScalar(&list, "/tmp/a");
+    RlistAppendScalar(&list, "/tmp/b");
+    FnCallCacheStore("findfiles", args, (Rval) { list, RVAL_TYPE_LIST });
+
+    Rval rval;
+    assert_true(FnCallCacheLoad("findfiles", args, TTL, &rval));
+    assert_int_equal(rval.type, RVAL_TYPE_LIST);
+    assert_true(RlistEqual(RvalRlistValue(rval), list));
+    RvalDestroy(rval);
+
+    /* An empty list is a result as well. */
+    FnCallCacheStore("findfiles", args, (Rval) { NULL, RVAL_TYPE_LIST });
+    assert_true(FnCallCacheLoad("findfiles", args, TTL, &rval));
+    assert_int_equal(rval.type, RVAL_TYPE_LIST);
+    assert_true(rval.item == NULL);
+
+    RlistDestroy(list);
+    RlistDestroy(args);
+}
+
+static void test_file_input(void)
+{
+    write_input("{ \"a\": [1, 2] }");
+
+    Rlist *args = NULL;
+    RlistAppendScalar(&args, INPUT);
+    RlistAppendScalar(&args, "1000");
+
+    JsonElement *json = JsonObjectCreate(1);
+    JsonElement *array = JsonArrayCreate(2);
+    JsonArrayAppendInteger(array, 1);
+    JsonArrayAppendInteger(array, 2);
+    JsonObjectAppendArray(json, "a", array);
+    FnCallCacheStore("readjson", args, (Rval) { json, RVAL_TYPE_CONTAINER });
+
+    Rval rval;
+    assert_true(FnCallCacheLoad("readjson", args, TTL, &rval));
+    assert_int_equal(rval.type, RVAL_TYPE_CONTAINER);
+    assert_int_equal(JsonCompare(RvalContainerValue(rval), json), 0);
+    RvalDestroy(rval);
+
+    /* Changing the size of the input invalidates the entry. */
+    write_input("{ \"a\": [1, 2, 3] }");
+    assert_false(FnCallCacheLoad("readjson", args, TTL, &rval));
+
+    /* So does removing it, and a missing input is never cached. */
+    unlink(INPUT);
+    FnCallCacheStore("readjson", args, (Rval) { json, RVAL_TYPE_CONTAINER });
+    assert_false(FnCallCacheLoad("readjson", args, TTL, &rval));
+
+    JsonDestroy(json);
+    RlistDestroy(args);
+}
+
+static void test_not_persistable(void)
+{
+    Rlist *args = NULL;
+    RlistAppendScalar(&args, "x");
+
+    assert_false(FnCallCacheIsPersistable("canonify"));
+    FnCallCacheStore("canonify", args, (Rval) { "x", RVAL_TYPE_SCALAR });
+
+    Rval rval;
+    assert_false(FnCallCacheLoad("canonify", args, TTL, &rval));
+
+    RlistDestroy(args);
+}
+
+static void test_stats(void)
+{
+    FnCallCacheStats stats;
+    FnCallCacheGetStats(&stats);
+
+    /* Counted by the tests above. */
+    assert_true(stats.hits >= 4);
+    assert_true(stats.misses >= 1);
+    assert_true(stats.stale >= 1);
+    assert_true(stats.stored >= 4);
+}
+
+
+int main()
+{
+    tests_setup();
+
+    const UnitTest tests[] =
+        {
+            unit_test(test_scalar),
+            unit_test(test_list),
+            unit_test(test_file_input),
+            unit_test(test_not_persistable),
+            unit_test(test_stats),
+        };
+
+    PRINT_TEST_BANNER();
+    int ret = run_tests(tests);
+
+    tests_teardown();
+    return ret;
+}
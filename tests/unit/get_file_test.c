@@ -0,0 +1,204 @@
+#include <test.h>
+
+#include <cf3.defs.h>
+#include <server.h>
+#include <server_common.h>                                      /* CfGetFile */
+#include <server_tls.h>                         /* ServerTLSSessionEstablish */
+#include <client_code.h>                               /* CopyRegularFileNet */
+#include <communication.h>                                   /* NewAgentConn */
+#include <tls_client.h>                                            /* TLSTry */
+#include <net.h>                                       /* ReceiveTransaction */
+#include <crypto.h>                                      /* CryptoInitialize */
+#include <known_dirs.h>                                        /* GetWorkDir */
+#include <unix.h>                                      /* GetCurrentUserName */
+#include <openssl/rsa.h>
+#include <openssl/bn.h>
+
+
+/*
+ * CfGetFile() against CopyRegularFileNet() over a socketpair. When the
+ * server refuses a file, the connection must stay usable for the next
+ * request, whatever the block size.
+ */
+
+#define FILE_SIZE 1000                    /* less than any GET block size */
+
+static char CFWORKDIR[CF_BUFSIZE];
+static char REFUSED_FILE[CF_BUFSIZE];
+static char ALLOWED_FILE[CF_BUFSIZE];
+static char DESTINATION[CF_BUFSIZE];
+static char USERNAME[CF_SMALLBUF];
+
+static void WriteFile(const char *filename, mode_t mode, char c)
+{
+    char buf[FILE_SIZE];
+    memset(buf, c, sizeof(buf));
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    assert_true(fd != -1);
+    assert_int_equal(sizeof(buf), write(fd, buf, sizeof(buf)));
+    close(fd);
+    assert_int_equal(0, chmod(filename, mode));
+}
+
+static void tests_setup(void)
+{
+    xsnprintf(CFWORKDIR, sizeof(CFWORKDIR), "/tmp/get_file_test.XXXXXX");
+    assert_true(mkdtemp(CFWORKDIR) != NULL);
+
+    char *envvar;
+    xasprintf(&envvar, "%s=%s", "CFENGINE_TEST_OVERRIDE_WORKDIR", CFWORKDIR);
+    putenv(envvar);
+
+    char path[CF_BUFSIZE];
+    xsnprintf(path, sizeof(path), "%s/ppkeys", GetWorkDir());
+    mkdir(path, S_IRWXU);
+    mkdir(GetStateDir(), S_IRWXU);
+
+    /* The server sees the client as some other user, so it refuses files
+     * that are not world-readable. */
+    xsnprintf(REFUSED_FILE, sizeof(REFUSED_FILE), "%s/refused", CFWORKDIR);
+    xsnprintf(ALLOWED_FILE, sizeof(ALLOWED_FILE), "%s/allowed", CFWORKDIR);
+    xsnprintf(DESTINATION, sizeof(DESTINATION), "%s/destination", CFWORKDIR);
+    WriteFile(REFUSED_FILE, 0600, 'r');
+    WriteFile(ALLOWED_FILE, 0644, 'a');
+
+    GetCurrentUserName(USERNAME, sizeof(USERNAME));
+    signal(SIGPIPE, SIG_IGN);
+
+    CryptoInitialize();
+    RSA *rsa = RSA_new();
+    BIGNUM *e = BN_new();
+    BN_set_word(e, RSA_F4);
+    assert_int_equal(1, RSA_generate_key_ex(rsa, 2048, e, NULL));
+    BN_free(e);
+    PRIVKEY = rsa;
+    PUBKEY = RSAPublicKey_dup(rsa);
+
+    PrependItem(&SV.trustkeylist, "127.0.0.1", NULL);
+    assert_true(ServerTLSInitialize());
+    assert_true(TLSClientInitialize(NULL, NULL));
+}
+
+static void tests_teardown(void)
+{
+    char cmd[CF_BUFSIZE];
+    xsnprintf(cmd, sizeof(cmd), "rm -rf '%s'", CFWORKDIR);
+    system(cmd);
+}
+
+/* Serve GET requests on one end of the socketpair until it is closed. */
+static void *ServeGets(void *arg)
+{
+    ServerConnectionState *conn = arg;
+
+    if (conn->conn_info->protocol == CF_PROTOCOL_TLS &&
+        ServerTLSSessionEstablish(conn) != 1)
+    {
+        return NULL;
+    }
+    conn->uid = getuid() + 1;
+
+    char recvbuffer[CF_BUFSIZE + CF_BUFEXT] = "";
+    char sendbuffer[CF_BUFSIZE] = "";
+    char filename[CF_BUFSIZE] = "";
+
+    while (ReceiveTransaction(conn->conn_info, recvbuffer, NULL) > 0)
+    {
+        ServerFileGetState get_args = { 0 };
+        if (sscanf(recvbuffer, "GET %d %[^\n]",
+                   &get_args.buf_size, filename) != 2)
+        {
+            break;
+        }
+
+        get_args.conn = conn;
+        get_args.replybuff = sendbuffer;
+        get_args.replyfile = filename;
+
+        CfGetFile(&get_args);
+    }
+
+    return NULL;
+}
+
+static void RefusedThenAllowed(ProtocolVersion protocol)
+{
+    int sv[2];
+    assert_int_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+
+    ServerConnectionState *server_conn = xcalloc(1, sizeof(*server_conn));
+    server_conn->conn_info = ConnectionInfoNew();
+    server_conn->conn_info->sd = sv[0];
+    server_conn->conn_info->protocol = protocol;
+    strlcpy(server_conn->ipaddr, "127.0.0.1", sizeof(server_conn->ipaddr));
+    strlcpy(server_conn->username, USERNAME, sizeof(server_conn->username));
+
+    ConnectionFlags flags = { .protocol_version = protocol };
+    AgentConnection *agent_conn = NewAgentConn("127.0.0.1", NULL, flags);
+    agent_conn->conn_info->sd = sv[1];
+
+    pthread_t tid;
+    assert_int_equal(0, pthread_create(&tid, NULL, ServeGets, server_conn));
+
+    if (protocol == CF_PROTOCOL_TLS)
+    {
+        assert_int_not_equal(-1, TLSTry(agent_conn->conn_info));
+        assert_int_equal(1, TLSClientIdentificationDialog(agent_conn->conn_info,
+                                                          USERNAME));
+        /* Blocks larger than the file, so that it all fits in one. */
+        assert_true(agent_conn->conn_info->max_blocksize > FILE_SIZE);
+    }
+    agent_conn->conn_info->protocol = protocol;
+    agent_conn->conn_info->status = CONNECTIONINFO_STATUS_ESTABLISHED;
+
+    assert_false(CopyRegularFileNet(REFUSED_FILE, DESTINATION, FILE_SIZE,
+                                    false, agent_conn));
+
+    /* Nothing of the refusal must be left for the next request to read. */
+    assert_true(CopyRegularFileNet(ALLOWED_FILE, DESTINATION, FILE_SIZE,
+                                   false, agent_conn));
+    char buf[FILE_SIZE + 1];
+    int fd = open(DESTINATION, O_RDONLY);
+    assert_true(fd != -1);
+    assert_int_equal(FILE_SIZE, read(fd, buf, sizeof(buf)));
+    close(fd);
+    for (int i = 0; i < FILE_SIZE; i++)
+    {
+        assert_int_equal('a', buf[i]);
+    }
+
+    DisconnectServer(agent_conn);
+    pthread_join(tid, NULL);
+
+    ConnectionInfoDestroy(&server_conn->conn_info);
+    free(server_conn);
+    unlink(DESTINATION);
+}
+
+static void test_refused_then_allowed_classic(void)
+{
+    RefusedThenAllowed(CF_PROTOCOL_CLASSIC);
+}
+
+static void test_refused_then_allowed_tls(void)
+{
+    RefusedThenAllowed(CF_PROTOCOL_TLS);
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    tests_setup();
+
+    const UnitTest tests[] =
+    {
+        unit_test(test_refused_then_allowed_classic),
+        unit_test(test_refused_then_allowed_tls),
+    };
+
+    int ret = run_tests(tests);
+
+    tests_teardown();
+    return ret;
+}
@@ -0,0 +1,243 @@
+#include <test.h>
+
+#include <cmockery.h>
+#include <iptree.h>
+#include <addr_lib.h>                                     /* FuzzySetMatch */
+#include <regex.h>                                        /* StringMatchFull */
+#include <misc_lib.h>                                          /* xsnprintf */
+#include <alloc.h>
+
+
+static void test_exact_and_prefix(void)
+{
+    IPTree *t = IPTree_New();
+
+    assert_true(IPTree_Insert(t, "10.1.2.3"));
+    assert_true(IPTree_Insert(t, "192.168"));
+    assert_true(IPTree_Insert(t, "172"));
+    assert_int_equal(IPTree_Len(t), 3);
+
+    assert_string_equal(IPTree_Match(t, "10.1.2.3"), "10.1.2.3");
+    assert_true(IPTree_Match(t, "10.1.2.4") == NULL);
+    assert_true(IPTree_Match(t, "10.1.2.30") == NULL);
+
+    assert_string_equal(IPTree_Match(t, "192.168.0.1"), "192.168");
+    assert_string_equal(IPTree_Match(t, "192.168.255.255"), "192.168");
+    assert_true(IPTree_Match(t, "192.169.0.1") == NULL);
+    /* "192.16" must not match "192.168" the same way FuzzySetMatch() won't. */
+    assert_true(IPTree_Match(t, "192.16.0.1") == NULL);
+
+    assert_string_equal(IPTree_Match(t, "172.16.0.1"), "172");
+    assert_true(IPTree_Match(t, "17.16.0.1") == NULL);
+
+    /* Duplicates are accepted but counted once. */
+    assert_true(IPTree_Insert(t, "10.1.2.3"));
+    assert_int_equal(IPTree_Len(t), 3);
+
+    IPTree_Free(t);
+}
+
+static void test_cidr(void)
+{
+    IPTree *t = IPTree_New();
+
+    assert_true(IPTree_Insert(t, "10.0.0.0/8"));
+    assert_true(IPTree_Insert(t, "128.39.74.10/23"));      /* host bits set */
+    assert_true(IPTree_Insert(t, "2001:db8::/32"));
+    assert_true(IPTree_Insert(t, "fe80::/10"));        /* not a byte multiple */
+    assert_true(IPTree_Insert(t, "::1"));
+
+    assert_string_equal(IPTree_Match(t, "10.200.3.4"), "10.0.0.0/8");
+    assert_true(IPTree_Match(t, "11.0.0.1") == NULL);
+    assert_string_equal(IPTree_Match(t, "128.39.75.56"), "128.39.74.10/23");
+    assert_true(IPTree_Match(t, "128.39.76.1") == NULL);
+
+    assert_string_equal(IPTree_Match(t, "2001:db8:1::5"), "2001:db8::/32");
+    assert_true(IPTree_Match(t, "2001:db9::5") == NULL);
+    assert_string_equal(IPTree_Match(t, "febf::1"), "fe80::/10");
+    assert_true(IPTree_Match(t, "fec0::1") == NULL);
+    assert_string_equal(IPTree_Match(t, "0:0:0:0:0:0:0:1"), "::1");
+
+    /* IPv4 rules never match IPv6 addresses and vice versa. */
+    assert_true(IPTree_Match(t, "::ffff:10.0.0.1") == NULL);
+
+    assert_true(IPTree_Match(t, "garbage") == NULL);
+    assert_true(IPTree_Match(t, "") == NULL);
+
+    IPTree_Free(t);
+
+    t = IPTree_New();
+    assert_true(IPTree_Insert(t, "0.0.0.0/0"));
+    assert_string_equal(IPTree_Match(t, "1.2.3.4"), "0.0.0.0/0");
+    assert_true(IPTree_Match(t, "::1") == NULL);
+    IPTree_Free(t);
+}
+
+static void test_rejected(void)
+{
+    IPTree *t = IPTree_New();
+
+    assert_false(IPTree_Insert(t, "10.1.1-5.1"));                 /* range */
+    assert_false(IPTree_Insert(t, "10\\.1\\..*"));                /* regex */
+    assert_false(IPTree_Insert(t, "10.01.1.1"));          /* leading zero */
+    assert_false(IPTree_Insert(t, "10.1."));              /* trailing dot */
+    assert_false(IPTree_Insert(t, "1.2.3.4.5"));
+    assert_false(IPTree_Insert(t, "256.1.1.1"));
+    assert_false(IPTree_Insert(t, "10.0.0.0/33"));
+    assert_false(IPTree_Insert(t, "10.0.0.0/"));
+    assert_false(IPTree_Insert(t, "10.0.0.0/8x"));
+    assert_false(IPTree_Insert(t, "2001:db8::/129"));
+    assert_false(IPTree_Insert(t, "2001:db8"));
+    assert_false(IPTree_Insert(t, "host.example.com"));
+    assert_false(IPTree_Insert(t, ""));
+
+    assert_int_equal(IPTree_Len(t), 0);
+    assert_true(IPTree_Match(t, "10.1.1.1") == NULL);
+
+    IPTree_Free(t);
+}
+
+/* The way cf-serverd matched admit_ips before the tree. */
+static const char *LegacyMatch(char **rules, size_t len, const char *ipaddr)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (FuzzySetMatch(rules[i], ipaddr) == 0 ||
+            StringMatchFull(rules[i], ipaddr))
+        {
+            return rules[i];
+        }
+    }
+    return NULL;
+}
+
+static double Elapsed(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+        (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+#define BENCH_RULES    800
+#define BENCH_LOOKUPS  200
+
+/* Compare results and speed against the legacy linear search, with an ACL of
+ * the size of a large site's admit_ips. */
+static void test_benchmark_vs_linear(void)
+{
+    char *rules[BENCH_RULES];
+    IPTree *t = IPTree_New();
+
+    for (int i = 0; i < BENCH_RULES; i++)
+    {
+        char rule[64];
+        switch (i % 4)
+        {
+        case 0:
+            xsnprintf(rule, sizeof(rule), "10.%d.%d.0/24",
+                      (i / 256) % 256, i % 256);
+            break;
+        case 1:
+            xsnprintf(rule, sizeof(rule), "172.%d.%d",
+                      16 + (i / 256) % 16, i % 256);
+            break;
+        case 2:
+            xsnprintf(rule, sizeof(rule), "192.168.%d.%d",
+                      (i / 256) % 256, i % 256);
+            break;
+        default:
+            xsnprintf(rule, sizeof(rule), "2001:db8:%x::/48", i);
+            break;
+        }
+        rules[i] = xstrdup(rule);
+        assert_true(IPTree_Insert(t, rules[i]));
+    }
+
+    /* Every other lookup is for an address inside one of the rules, the rest
+     * are mostly misses. */
+    char *addrs[BENCH_LOOKUPS];
+    for (int i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        char addr[64];
+        int r = (i * 7919) % BENCH_RULES;
+        int kind = (i % 2 == 0) ? r % 4 : 4;
+        switch (kind)
+        {
+        case 0:
+            xsnprintf(addr, sizeof(addr), "10.%d.%d.%d",
+                      (r / 256) % 256, r % 256, i % 256);
+            break;
+        case 1:
+            xsnprintf(addr, sizeof(addr), "172.%d.%d.1",
+                      16 + (r / 256) % 16, r % 256);
+            break;
+        case 2:
+            xsnprintf(addr, sizeof(addr), "192.168.%d.%d",
+                      (r / 256) % 256, r % 256);
+            break;
+        case 3:
+            xsnprintf(addr, sizeof(addr), "2001:db8:%x::%x", r, i);
+            break;
+        default:
+            xsnprintf(addr, sizeof(addr), "203.0.%d.%d", r % 256, i % 256);
+            break;
+        }
+        addrs[i] = xstrdup(addr);
+    }
+
+    /* Decisions must be the same; the rule reported may differ when more than
+     * one covers the address. */
+    const char *legacy_results[BENCH_LOOKUPS];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        legacy_results[i] = LegacyMatch(rules, BENCH_RULES, addrs[i]);
+    }
+    double legacy_time = Elapsed(&start);
+
+    const char *tree_results[BENCH_LOOKUPS];
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        tree_results[i] = IPTree_Match(t, addrs[i]);
+    }
+    double tree_time = Elapsed(&start);
+
+    int matched = 0;
+    for (int i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        assert_int_equal(legacy_results[i] != NULL, tree_results[i] != NULL);
+        matched += (tree_results[i] != NULL);
+    }
+
+    printf("%d rules, %d lookups (%d matching): "
+           "linear %.3fs, tree %.6fs\n",
+           BENCH_RULES, BENCH_LOOKUPS, matched, legacy_time, tree_time);
+
+    for (int i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        free(addrs[i]);
+    }
+    for (int i = 0; i < BENCH_RULES; i++)
+    {
+        free(rules[i]);
+    }
+    IPTree_Free(t);
+}
+
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_exact_and_prefix),
+        unit_test(test_cidr),
+        unit_test(test_rejected),
+        unit_test(test_benchmark_vs_linear),
+    };
+
+    return run_tests(tests);
+}
@@ -1236,6 +1236,82 @@ static void test_detach_key_from_object(void)
     JsonDestroy(detached);
 }
 
+static void test_large_object(void)
+{
+    /* Big enough for the keys to get indexed. */
+    const int keys = 100;
+    char key[16];
+
+    JsonElement *object = JsonObjectCreate(keys);
+    for (int i = 0; i < keys; i++)
+    {
+        xsnprintf(key, sizeof(key), "k%d", i);
+        JsonObjectAppendInteger(object, key, i);
+    }
+    assert_int_equal(keys, JsonLength(object));
+
+    for (int i = 0; i < keys; i++)
+    {
+        xsnprintf(key, sizeof(key), "k%d", i);
+        assert_int_equal(i, JsonPrimitiveGetAsInteger(JsonObjectGet(object, key)));
+    }
+    assert_true(JsonObjectGet(object, "k100") == NULL);
+
+    /* Replacing a key moves it to the end, like for small objects. */
+    JsonObjectAppendString(object, "k10", "ten");
+    assert_int_equal(keys, JsonLength(object));
+    assert_string_equal("ten", JsonObjectGetAsString(object, "k10"));
+
+    assert_true(JsonObjectRemoveKey(object, "k20"));
+    assert_false(JsonObjectRemoveKey(object, "k20"));
+    assert_true(JsonObjectGet(object, "k20") == NULL);
+
+    JsonElement *detached = JsonObjectDetachKey(object, "k30");
+    assert_int_equal(30, JsonPrimitiveGetAsInteger(detached));
+    JsonDestroy(detached);
+    assert_true(JsonObjectGet(object, "k30") == NULL);
+    assert_int_equal(keys - 2, JsonLength(object));
+
+    /* Keys that were not touched still resolve after the removals. */
+    for (int i = 0; i < keys; i++)
+    {
+        if (i != 10 && i != 20 && i != 30)
+        {
+            xsnprintf(key, sizeof(key), "k%d", i);
+            assert_int_equal(i, JsonPrimitiveGetAsInteger(JsonObjectGet(object, key)));
+        }
+    }
+
+    JsonIterator iter = JsonIteratorInit(object);
+    assert_string_equal("k0", JsonIteratorNextKey(&iter));
+    assert_string_equal("k1", JsonIteratorNextKey(&iter));
+    const char *last = NULL;
+    while (JsonIteratorHasMore(&iter))
+    {
+        last = JsonIteratorNextKey(&iter);
+    }
+    assert_string_equal("k10", last);
+
+    /* Writing sorts the keys in place, lookups must still work after. */
+    Writer *writer = StringWriter();
+    JsonWriteCompact(writer, object);
+    const char *output = StringWriterData(writer);
+    assert_true(strncmp(output, "{\"k0\":0,\"k1\":1,\"k10\":\"ten\",", 25) == 0);
+    assert_true(strstr(output, "\"k20\"") == NULL);
+    assert_int_equal(99, JsonPrimitiveGetAsInteger(JsonObjectGet(object, "k99")));
+    assert_true(JsonObjectRemoveKey(object, "k99"));
+    assert_true(JsonObjectGet(object, "k99") == NULL);
+    JsonObjectAppendInteger(object, "k99", 99);
+
+    JsonElement *copy = JsonCopy(object);
+    assert_int_equal(0, JsonCompare(object, copy));
+    assert_string_equal("ten", JsonObjectGetAsString(copy, "k10"));
+    JsonDestroy(copy);
+
+    WriterClose(writer);
+    JsonDestroy(object);
+}
+
 static void test_parse_array_double_and_trailing_commas(void)
 {
     {
@@ -1436,6 +1512,7 @@ int main()
         unit_test(test_array_remove_range),
         unit_test(test_remove_key_from_object),
         unit_test(test_detach_key_from_object),
+        unit_test(test_large_object),
         unit_test(test_parse_array_double_and_trailing_commas),
         unit_test(test_parse_array_comma_after_brace),
         unit_test(test_parse_array_bad_nested_elems),
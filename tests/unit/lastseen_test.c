@@ -212,6 +212,95 @@ static void test_remove_ip(void)
     CloseDB(db);
 }
 
+static void test_write_behind(void)
+{
+    setup();
+
+    LastSeenWriteBehindStart(3600);
+    UpdateLastSawHost("SHA-12345", "127.0.0.64", true, 555);
+    UpdateLastSawHost("SHA-12345", "127.0.0.64", true, 1110);
+
+    DBHandle *db;
+    OpenDB(&db, dbid_lastseen);
+
+    /* Nothing is written before the flush. */
+    assert_int_equal(DBHasStr(db, "qiSHA-12345"), false);
+    assert_int_equal(DBHasStr(db, "a127.0.0.64"), false);
+    CloseDB(db);
+
+    /* Lookups write out the buffer first. */
+    char result[CF_BUFSIZE];
+    assert_int_equal(Address2Hostkey(result, sizeof(result), "127.0.0.64"), true);
+    assert_string_equal(result, "SHA-12345");
+
+    /* Same results as test_update(). */
+    OpenDB(&db, dbid_lastseen);
+    KeyHostSeen q;
+    assert_int_equal(ReadDB(db, "qiSHA-12345", &q, sizeof(q)), true);
+    assert_int_equal(q.lastseen, 1110);
+    assert_double_close(q.Q.q, 555.0);
+    assert_double_close(q.Q.dq, 555.0);
+    assert_double_close(q.Q.expect, 222.0);
+    assert_double_close(q.Q.var, 123210.0);
+    CloseDB(db);
+
+    LastSeenWriteBehindStop();
+}
+
+static void test_write_behind_merge(void)
+{
+    /* Repeated sightings, some within the same second, of a host that moves
+     * from one address to another. */
+    const time_t times[] = { 100, 100, 160, 161, 161, 161, 300 };
+    const char *const addresses[] = { IP1, IP1, IP1, IP2, IP2, IP2, IP2 };
+    const size_t num_sightings = sizeof(times) / sizeof(times[0]);
+
+    setup();
+    UpdateLastSawHost("SHA-12345", IP3, true, 50);
+    for (size_t i = 0; i < num_sightings; i++)
+    {
+        UpdateLastSawHost("SHA-12345", addresses[i], true, times[i]);
+        UpdateLastSawHost("SHA-67890", IP3, false, times[i]);
+    }
+
+    DBHandle *db;
+    KeyHostSeen expected[2];
+    OpenDB(&db, dbid_lastseen);
+    assert_int_equal(ReadDB(db, "qiSHA-12345", &expected[0], sizeof(expected[0])), true);
+    assert_int_equal(ReadDB(db, "qoSHA-67890", &expected[1], sizeof(expected[1])), true);
+    CloseDB(db);
+
+    setup();
+    UpdateLastSawHost("SHA-12345", IP3, true, 50);
+    LastSeenWriteBehindStart(3600);
+    for (size_t i = 0; i < num_sightings; i++)
+    {
+        UpdateLastSawHost("SHA-12345", addresses[i], true, times[i]);
+        UpdateLastSawHost("SHA-67890", IP3, false, times[i]);
+    }
+    LastSeenWriteBehindStop();
+
+    KeyHostSeen q[2];
+    OpenDB(&db, dbid_lastseen);
+    assert_int_equal(ReadDB(db, "qiSHA-12345", &q[0], sizeof(q[0])), true);
+    assert_int_equal(ReadDB(db, "qoSHA-67890", &q[1], sizeof(q[1])), true);
+    for (int i = 0; i < 2; i++)
+    {
+        assert_int_equal(q[i].lastseen, expected[i].lastseen);
+        assert_double_close(q[i].Q.q, expected[i].Q.q);
+        assert_double_close(q[i].Q.dq, expected[i].Q.dq);
+        assert_double_close(q[i].Q.expect, expected[i].Q.expect);
+        assert_double_close(q[i].Q.var, expected[i].Q.var);
+    }
+
+    /* So do the address mappings. */
+    assert_string_equal(DBGetStr(db, "kSHA-12345"), IP2);
+    assert_string_equal(DBGetStr(db, "a"IP1), "SHA-12345");
+    assert_string_equal(DBGetStr(db, "a"IP2), "SHA-12345");
+    assert_string_equal(DBGetStr(db, "a"IP3), "SHA-67890");
+    CloseDB(db);
+}
+
 
 /* These tests can't be multi-threaded anyway. */
 static DBHandle *DBH;
@@ -589,6 +678,8 @@ int main()
             unit_test(test_reverse_missing_forward),
             unit_test(test_remove),
             unit_test(test_remove_ip),
+            unit_test(test_write_behind),
+            unit_test(test_write_behind_merge),
 
             unit_test_setup_teardown(test_consistent_1a, begin, end),
             unit_test_setup_teardown(test_consistent_1b, begin, end),
@@ -6,6 +6,7 @@
 #include <string_lib.h>
 
 #include <alloc.h>
+#include <misc_lib.h>                                          /* xsnprintf */
 
 static unsigned int ConstHash(ARG_UNUSED const void *key,
                               ARG_UNUSED unsigned int seed,
@@ -299,6 +300,90 @@ static void test_hash_map_key_referenced_in_value(void)
     HashMapDestroy(m);
 }
 
+static void test_hashmap_degenerate_hash_fn_remove(void)
+{
+    HashMap *hashmap = HashMapNew(ConstHash, StringSafeEqual_untyped, free, free);
+
+    for (int i = 0; i < 100; i++)
+    {
+        assert_false(HashMapInsert(hashmap, CharTimes('a', i), CharTimes('b', i)));
+    }
+
+    /* Removing from the middle of one long probe sequence must keep the
+     * rest of it reachable. */
+    for (int i = 0; i < 100; i += 3)
+    {
+        char *key = CharTimes('a', i);
+        assert_true(HashMapRemove(hashmap, key));
+        assert_false(HashMapRemove(hashmap, key));
+        free(key);
+    }
+
+    for (int i = 0; i < 100; i++)
+    {
+        char *key = CharTimes('a', i);
+        MapKeyValue *item = HashMapGet(hashmap, key);
+        if (i % 3 == 0)
+        {
+            assert_int_equal(item, NULL);
+        }
+        else
+        {
+            assert_int_equal(strlen(item->value), i);
+        }
+        free(key);
+    }
+    assert_int_equal(HashMapSize(hashmap), 66);
+
+    HashMapDestroy(hashmap);
+}
+
+static void test_grow_and_remove(void)
+{
+    /* Enough keys for the table to grow several times; timings of much
+     * larger maps are in tests/load/map_load.c. */
+    char key[32];
+    StringMap *map = StringMapNew();
+
+    for (int i = 0; i < 2000; i++)
+    {
+        xsnprintf(key, sizeof(key), "default:bundle.variable_%d", i);
+        assert_false(StringMapInsert(map, xstrdup(key), xstrdup(key)));
+    }
+    assert_int_equal(StringMapSize(map), 2000);
+
+    for (int i = 0; i < 2000; i++)
+    {
+        xsnprintf(key, sizeof(key), "default:bundle.variable_%d", i);
+        assert_true(StringMapHasKey(map, key));
+        xsnprintf(key, sizeof(key), "default:bundle.missing_%d", i);
+        assert_false(StringMapHasKey(map, key));
+    }
+
+    for (int i = 0; i < 2000; i += 2)
+    {
+        xsnprintf(key, sizeof(key), "default:bundle.variable_%d", i);
+        assert_true(StringMapRemove(map, key));
+    }
+
+    for (int i = 0; i < 2000; i++)
+    {
+        xsnprintf(key, sizeof(key), "default:bundle.variable_%d", i);
+        assert_int_equal(StringMapHasKey(map, key), i % 2 == 1);
+    }
+    assert_int_equal(StringMapSize(map), 1000);
+
+    MapIterator it = MapIteratorInit(map->impl);
+    size_t count = 0;
+    while (MapIteratorNext(&it))
+    {
+        count++;
+    }
+    assert_int_equal(count, 1000);
+
+    StringMapDestroy(map);
+}
+
 
 int main()
 {
@@ -315,9 +400,11 @@ int main()
         unit_test(test_soft_destroy),
         unit_test(test_hashmap_new_destroy),
         unit_test(test_hashmap_degenerate_hash_fn),
+        unit_test(test_hashmap_degenerate_hash_fn_remove),
         unit_test(test_array_map_key_referenced_in_value),
         unit_test(test_hash_map_key_referenced_in_value),
         unit_test(test_iterate_jumbo),
+        unit_test(test_grow_and_remove),
     };
 
     return run_tests(tests);
@@ -2,18 +2,28 @@
 
 #include <cf3.defs.h>
 #include <locks.h>
+#include <policy.h>
+#include <eval_context.h>
 #include <misc_lib.h>                                          /* xsnprintf */
 #include <known_dirs.h>
 
+#include <sys/wait.h>
+
 
 char CFWORKDIR[CF_BUFSIZE];
 
 static void tests_setup(void)
 {
+    static char env[] = /* Needs to be static for putenv() */
+        "CFENGINE_TEST_OVERRIDE_WORKDIR=/tmp/persistent_lock_test.XXXXXX";
+    char *workdir = strchr(env, '=');
+    assert(workdir && workdir[1] == '/');
+    workdir++;
+
     OpenSSL_add_all_digests();
-    /* FIXME: get rid of hardcoded filenames */
-    xsnprintf(CFWORKDIR, CF_BUFSIZE, "/tmp/persistent_lock_test.XXXXXX");
-    mkdtemp(CFWORKDIR);
+    mkdtemp(workdir);
+    strlcpy(CFWORKDIR, workdir, CF_BUFSIZE);
+    putenv(env);
 
     char buf[CF_BUFSIZE];
     xsnprintf(buf, CF_BUFSIZE, "%s", GetStateDir());
@@ -27,6 +37,237 @@ static void tests_teardown(void)
     system(cmd);
 }
 
+static const TransactionContext TC = {
+    .ifelapsed = 60,
+    .expireafter = 120,
+};
+
+/* A fresh EvalContext for every run, as its promise lock cache would
+ * otherwise short-circuit AcquireLock(). */
+static CfLock AcquirePromiseLock(const Promise *pp)
+{
+    EvalContext *ctx = EvalContextNew();
+    CfLock lock = AcquireLock(ctx, pp->promiser, "localhost", time(NULL),
+                              TC, pp, false);
+    EvalContextDestroy(ctx);
+    return lock;
+}
+
+/* Runs #check in a new process, as another agent would, and returns
+ * whether it succeeded. */
+static bool RunAsOtherAgent(bool (*check)(void))
+{
+    pid_t pid = fork();
+    assert_true(pid >= 0);
+    if (pid == 0)
+    {
+        _exit(check() ? 0 : 1);
+    }
+
+    int status;
+    return (waitpid(pid, &status, 0) == pid &&
+            WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static Policy *CRASH_POLICY = NULL;
+static Promise *CRASH_DONE_PP = NULL;
+static Promise *CRASH_HELD_PP = NULL;
+
+static bool CheckCrashLocks(void)
+{
+    /* The "last." time of the completed promise was lost, so it runs
+     * again, but the promise still being run is seen as running. */
+    CfLock done = AcquirePromiseLock(CRASH_DONE_PP);
+    CfLock held = AcquirePromiseLock(CRASH_HELD_PP);
+    return (done.lock != NULL && held.lock == NULL);
+}
+
+static void test_lock_session_crash(void)
+{
+    CRASH_POLICY = PolicyNew();
+    Bundle *bp = PolicyAppendBundle(CRASH_POLICY, "default", "main", "agent",
+                                    NULL, NULL);
+    PromiseType *tp = BundleAppendPromiseType(bp, "files");
+    CRASH_DONE_PP = PromiseTypeAppendPromise(tp, "/tmp/crash",
+                                             (Rval) { NULL, RVAL_TYPE_NOPROMISEE },
+                                             "any", NULL);
+    CRASH_HELD_PP = PromiseTypeAppendPromise(tp, "/tmp/crash_held",
+                                             (Rval) { NULL, RVAL_TYPE_NOPROMISEE },
+                                             "any", NULL);
+
+    pid_t pid = fork();
+    assert_true(pid >= 0);
+    if (pid == 0)
+    {
+        /* Die holding one lock and having completed another promise, without
+         * running any atexit() handlers. */
+        BeginLockSession();
+        CfLock lock = AcquirePromiseLock(CRASH_DONE_PP);
+        YieldCurrentLock(lock);
+        lock = AcquirePromiseLock(CRASH_HELD_PP);
+        _exit(lock.lock != NULL ? 0 : 1);
+    }
+
+    int status;
+    assert_int_equal(pid, waitpid(pid, &status, 0));
+    assert_true(WIFEXITED(status));
+    assert_int_equal(0, WEXITSTATUS(status));
+
+    assert_true(RunAsOtherAgent(CheckCrashLocks));
+
+    PolicyDestroy(CRASH_POLICY);
+}
+
+static Policy *SYNC_POLICY = NULL;
+static Promise *SYNC_DONE_PP = NULL;
+static Promise *SYNC_HELD_PP = NULL;
+static Promise *SYNC_WORKER_PP = NULL;
+
+static bool CheckSyncLocks(void)
+{
+    /* The worker wrote its own "last." time, but not the one its parent
+     * had pending. */
+    CfLock worker = AcquirePromiseLock(SYNC_WORKER_PP);
+    CfLock done = AcquirePromiseLock(SYNC_DONE_PP);
+    return (worker.lock == NULL && done.lock != NULL);
+}
+
+static void test_lock_session_sync_then_crash(void)
+{
+    SYNC_POLICY = PolicyNew();
+    Bundle *bp = PolicyAppendBundle(SYNC_POLICY, "default", "main", "agent",
+                                    NULL, NULL);
+    PromiseType *tp = BundleAppendPromiseType(bp, "files");
+    SYNC_DONE_PP = PromiseTypeAppendPromise(tp, "/tmp/sync_done",
+                                            (Rval) { NULL, RVAL_TYPE_NOPROMISEE },
+                                            "any", NULL);
+    SYNC_HELD_PP = PromiseTypeAppendPromise(tp, "/tmp/sync_held",
+                                            (Rval) { NULL, RVAL_TYPE_NOPROMISEE },
+                                            "any", NULL);
+    SYNC_WORKER_PP = PromiseTypeAppendPromise(tp, "/tmp/sync_worker",
+                                              (Rval) { NULL, RVAL_TYPE_NOPROMISEE },
+                                              "any", NULL);
+
+    pid_t pid = fork();
+    assert_true(pid >= 0);
+    if (pid == 0)
+    {
+        /* Complete one promise and hold the lock of another, let a forked
+         * worker run a promise and sync, then die still holding our lock. */
+        BeginLockSession();
+        CfLock done = AcquirePromiseLock(SYNC_DONE_PP);
+        bool done_locked = (done.lock != NULL);
+        YieldCurrentLock(done);
+        CfLock held = AcquirePromiseLock(SYNC_HELD_PP);
+
+        pid_t worker = fork();
+        if (worker == 0)
+        {
+            ForkLockSession();
+
+            /* The worker sees the promise we are running. */
+            CfLock busy = AcquirePromiseLock(SYNC_HELD_PP);
+
+            CfLock lock = AcquirePromiseLock(SYNC_WORKER_PP);
+            bool locked = (lock.lock != NULL);
+            YieldCurrentLock(lock);
+            SyncLockSession();
+            _exit((locked && busy.lock == NULL) ? 0 : 1);
+        }
+
+        int status;
+        bool ok = (worker > 0 && waitpid(worker, &status, 0) == worker &&
+                   WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+        _exit((ok && done_locked && held.lock != NULL) ? 0 : 1);
+    }
+
+    int status;
+    assert_int_equal(pid, waitpid(pid, &status, 0));
+    assert_true(WIFEXITED(status));
+    assert_int_equal(0, WEXITSTATUS(status));
+
+    assert_true(RunAsOtherAgent(CheckSyncLocks));
+
+    PolicyDestroy(SYNC_POLICY);
+}
+
+static void test_lock_session_commit(void)
+{
+    Policy *policy = PolicyNew();
+    Bundle *bp = PolicyAppendBundle(policy, "default", "main", "agent",
+                                    NULL, NULL);
+    PromiseType *tp = BundleAppendPromiseType(bp, "files");
+    Promise *pp = PromiseTypeAppendPromise(tp, "/tmp/commit",
+                                           (Rval) { NULL, RVAL_TYPE_NOPROMISEE },
+                                           "any", NULL);
+
+    BeginLockSession();
+
+    CfLock lock = AcquirePromiseLock(pp);
+    assert_true(lock.lock != NULL);
+    char *lock_name = xstrdup(lock.lock);
+    char *last_name = xstrdup(lock.last);
+
+    /* The "lock." entry is in the database while the promise runs... */
+    assert_true(FindLockTime(lock_name) > 0);
+    YieldCurrentLock(lock);
+    assert_true(FindLockTime(lock_name) == -1);
+
+    /* ...but the "last." time only reaches it when the session is
+     * committed, the session itself sees it before. */
+    assert_true(FindLockTime(last_name) == -1);
+    CfLock again = AcquirePromiseLock(pp);
+    assert_true(again.lock == NULL);
+
+    CommitLockSession();
+
+    assert_true(FindLockTime(last_name) > 0);
+    assert_true(FindLockTime(lock_name) == -1);
+
+    /* ifelapsed is honoured across sessions and outside of them. */
+    BeginLockSession();
+    again = AcquirePromiseLock(pp);
+    assert_true(again.lock == NULL);
+    CommitLockSession();
+
+    again = AcquirePromiseLock(pp);
+    assert_true(again.lock == NULL);
+
+    free(lock_name);
+    free(last_name);
+    PolicyDestroy(policy);
+}
+
+static void test_lock_session_keeps_other_locks(void)
+{
+    Policy *policy = PolicyNew();
+    Bundle *bp = PolicyAppendBundle(policy, "default", "main", "agent",
+                                    NULL, NULL);
+    PromiseType *tp = BundleAppendPromiseType(bp, "files");
+    Promise *pp = PromiseTypeAppendPromise(tp, "/tmp/other",
+                                           (Rval) { NULL, RVAL_TYPE_NOPROMISEE },
+                                           "any", NULL);
+
+    BeginLockSession();
+
+    CfLock lock = AcquirePromiseLock(pp);
+    assert_true(lock.lock != NULL);
+    char *lock_name = xstrdup(lock.lock);
+    YieldCurrentLock(lock);
+
+    /* Another agent takes the lock after we released it. */
+    assert_int_equal(WriteLock(lock_name), 0);
+
+    CommitLockSession();
+
+    /* The commit left that agent's lock alone. */
+    assert_true(FindLockTime(lock_name) > 0);
+
+    free(lock_name);
+    PolicyDestroy(policy);
+}
+
 int main()
 {
     PRINT_TEST_BANNER();
@@ -34,9 +275,12 @@ int main()
 
     const UnitTest tests[] =
       {
-
+          unit_test(test_lock_session_crash),
+          unit_test(test_lock_session_sync_then_crash),
+          unit_test(test_lock_session_commit),
+          unit_test(test_lock_session_keeps_other_locks),
       };
-    
+
     int ret = run_tests(tests);
 
     tests_teardown();
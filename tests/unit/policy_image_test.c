@@ -0,0 +1,146 @@
+#include <test.h>
+
+#include <policy_image.h>
+#include <parser.h>
+#include <file_lib.h>
+#include <misc_lib.h>                                          /* xsnprintf */
+
+#define TEST_CHECKSUM "MD5=0123456789abcdef0123456789abcdef"
+
+static char POLICY_PATH[PATH_MAX];
+static char IMAGE_FILE[] = "/tmp/policy_image_test.XXXXXX";
+
+static void WriteTestImage(void)
+{
+    Policy *policy = ParserParseFile(AGENT_TYPE_COMMON, POLICY_PATH, 0, 0);
+    assert_true(policy != NULL);
+    assert_true(PolicyImageWrite(policy, IMAGE_FILE, POLICY_PATH, TEST_CHECKSUM));
+    PolicyDestroy(policy);
+}
+
+/* The image must give exactly what the parser gives the agent. */
+static void AssertImageMatchesParse(AgentType agent_type)
+{
+    Policy *parsed = ParserParseFile(agent_type, POLICY_PATH, 0, 0);
+    Policy *image = PolicyImageRead(IMAGE_FILE, POLICY_PATH, TEST_CHECKSUM, agent_type);
+    assert_true(parsed != NULL);
+    assert_true(image != NULL);
+
+    assert_int_equal(SeqLength(parsed->bundles), SeqLength(image->bundles));
+    assert_int_equal(SeqLength(parsed->bodies), SeqLength(image->bodies));
+    assert_int_equal(PolicyHash(parsed), PolicyHash(image));
+
+    JsonElement *parsed_json = PolicyToJson(parsed);
+    JsonElement *image_json = PolicyToJson(image);
+    assert_int_equal(JsonCompare(parsed_json, image_json), 0);
+    JsonDestroy(parsed_json);
+    JsonDestroy(image_json);
+
+    /* Not part of the JSON. */
+    for (size_t i = 0; i < SeqLength(parsed->bundles); i++)
+    {
+        const Bundle *a = SeqAt(parsed->bundles, i);
+        const Bundle *b = SeqAt(image->bundles, i);
+        assert_string_equal(a->source_path, b->source_path);
+        assert_int_equal(a->offset.start, b->offset.start);
+        assert_int_equal(a->offset.end, b->offset.end);
+        assert_int_equal(a->offset.line, b->offset.line);
+        assert_true(b->parent_policy == image);
+    }
+
+    Seq *errors = SeqNew(10, PolicyErrorDestroy);
+    assert_true(PolicyCheckPartial(image, errors));
+    SeqDestroy(errors);
+
+    PolicyDestroy(parsed);
+    PolicyDestroy(image);
+}
+
+static void test_round_trip(void)
+{
+    WriteTestImage();
+
+    AssertImageMatchesParse(AGENT_TYPE_COMMON);
+}
+
+static void test_agent_types(void)
+{
+    WriteTestImage();
+
+    AssertImageMatchesParse(AGENT_TYPE_AGENT);
+    AssertImageMatchesParse(AGENT_TYPE_SERVER);
+    AssertImageMatchesParse(AGENT_TYPE_MONITOR);
+    AssertImageMatchesParse(AGENT_TYPE_EXECUTOR);
+}
+
+static void test_stale(void)
+{
+    WriteTestImage();
+
+    assert_true(PolicyImageRead(IMAGE_FILE, POLICY_PATH,
+                                "MD5=00000000000000000000000000000000",
+                                AGENT_TYPE_AGENT) == NULL);
+    assert_true(PolicyImageRead(IMAGE_FILE, "/elsewhere/policy_image.cf",
+                                TEST_CHECKSUM, AGENT_TYPE_AGENT) == NULL);
+    assert_true(PolicyImageRead("/nonexistent/policy_image.img", POLICY_PATH,
+                                TEST_CHECKSUM, AGENT_TYPE_AGENT) == NULL);
+}
+
+static void test_damaged(void)
+{
+    WriteTestImage();
+
+    struct stat sb;
+    assert_int_equal(stat(IMAGE_FILE, &sb), 0);
+    char *data = xmalloc(sb.st_size);
+    int fd = open(IMAGE_FILE, O_RDWR);
+    assert_int_equal(FullRead(fd, data, sb.st_size), sb.st_size);
+
+    /* Changed contents. */
+    char *promiser = memmem(data, sb.st_size, "/tmp/stuff", strlen("/tmp/stuff"));
+    assert_true(promiser != NULL);
+    *promiser = 'X';
+    assert_int_equal(pwrite(fd, data, sb.st_size, 0), sb.st_size);
+    assert_true(PolicyImageRead(IMAGE_FILE, POLICY_PATH, TEST_CHECKSUM, AGENT_TYPE_AGENT) == NULL);
+    *promiser = '/';
+
+    /* Truncated. */
+    assert_int_equal(pwrite(fd, data, sb.st_size, 0), sb.st_size);
+    assert_int_equal(ftruncate(fd, sb.st_size - 10), 0);
+    assert_true(PolicyImageRead(IMAGE_FILE, POLICY_PATH, TEST_CHECKSUM, AGENT_TYPE_AGENT) == NULL);
+
+    /* Huge count of bodies, which follows the checksum. */
+    assert_int_equal(pwrite(fd, data, sb.st_size, 0), sb.st_size);
+    const char *checksum = memmem(data, sb.st_size, TEST_CHECKSUM, strlen(TEST_CHECKSUM));
+    assert_true(checksum != NULL);
+    const uint32_t huge = UINT32_MAX - 1;
+    off_t bodies = checksum + strlen(TEST_CHECKSUM) - data;
+    assert_int_equal(pwrite(fd, &huge, sizeof(huge), bodies), sizeof(huge));
+    assert_true(PolicyImageRead(IMAGE_FILE, POLICY_PATH, TEST_CHECKSUM, AGENT_TYPE_AGENT) == NULL);
+
+    close(fd);
+    free(data);
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+
+    xsnprintf(POLICY_PATH, sizeof(POLICY_PATH), "%s/policy_image.cf", TESTDATADIR);
+    int fd = mkstemp(IMAGE_FILE);
+    assert_true(fd != -1);
+    close(fd);
+
+    const UnitTest tests[] =
+    {
+        unit_test(test_round_trip),
+        unit_test(test_agent_types),
+        unit_test(test_stale),
+        unit_test(test_damaged),
+    };
+
+    int ret = run_tests(tests);
+
+    unlink(IMAGE_FILE);
+    return ret;
+}
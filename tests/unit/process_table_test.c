@@ -0,0 +1,168 @@
+#include <test.h>
+
+#include <cf3.defs.h>
+#include <process_table.h>
+#include <misc_lib.h>                                          /* xsnprintf */
+
+
+/* A fake /proc with a few processes, filled in by tests_setup(). */
+static char PROC_ROOT[] = "/tmp/process_table_test.XXXXXX";
+
+static void write_file(const char *dir, const char *name,
+                       const char *contents, size_t len)
+{
+    char path[PATH_MAX];
+    xsnprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *f = fopen(path, "w");
+    assert_true(f != NULL);
+    assert_int_equal(fwrite(contents, 1, len, f), len);
+    fclose(f);
+}
+
+static void write_process(int pid, const char *stat, unsigned int uid,
+                          const char *cmdline, size_t cmdline_len)
+{
+    char dir[PATH_MAX];
+    xsnprintf(dir, sizeof(dir), "%s/%d", PROC_ROOT, pid);
+    mkdir(dir, 0700);
+
+    char status[256];
+    xsnprintf(status, sizeof(status),
+              "Name:\tx\nState:\tS (sleeping)\nUid:\t%u\t%u\t%u\t%u\n",
+              uid + 1, uid, uid, uid);
+
+    write_file(dir, "stat", stat, strlen(stat));
+    write_file(dir, "status", status, strlen(status));
+    write_file(dir, "cmdline", cmdline, cmdline_len);
+}
+
+static void tests_setup(void)
+{
+    mkdtemp(PROC_ROOT);
+
+    const char stat[] = "cpu  1 2 3 4\nbtime 1500000000\nprocesses 1\n";
+    const char meminfo[] = "MemTotal:        1000000 kB\nMemFree: 1 kB\n";
+    write_file(PROC_ROOT, "stat", stat, strlen(stat));
+    write_file(PROC_ROOT, "meminfo", meminfo, strlen(meminfo));
+
+    /* A command name with spaces and parentheses, on a pseudo terminal. */
+    const char cmdline[] = "/usr/bin/daemon\0--foreground\0";
+    write_process(1234,
+                  "1234 (da) (mon) S 1 1230 1230 34817 1230 4202752 1 0 0 0 "
+                  "300 200 0 0 20 5 3 0 1000 10485760 256 18446744073709551615",
+                  0, cmdline, sizeof(cmdline) - 1);
+
+    /* A kernel thread has no command line. */
+    write_process(2, "2 (kthreadd) S 0 0 0 0 -1 2129984 0 0 0 0 0 0 0 0 20 0 "
+                  "1 0 1 0 0 18446744073709551615",
+                  0, "", 0);
+
+    /* A zombie owned by somebody else. */
+    write_process(4321, "4321 (gone) Z 1234 1230 1230 0 -1 4194372 0 0 0 0 "
+                  "0 0 0 0 20 0 1 0 2000 0 0 18446744073709551615",
+                  65534, "", 0);
+
+    /* Not a process. */
+    char dir[PATH_MAX];
+    xsnprintf(dir, sizeof(dir), "%s/self", PROC_ROOT);
+    mkdir(dir, 0700);
+}
+
+static void tests_teardown(void)
+{
+    char cmd[CF_BUFSIZE];
+    xsnprintf(cmd, CF_BUFSIZE, "rm -rf '%s'", PROC_ROOT);
+    system(cmd);
+}
+
+static ssize_t find_pid(const ProcessTable *table, pid_t pid)
+{
+    for (size_t i = 0; i < table->count; i++)
+    {
+        if (table->pid[i] == pid)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+static void test_fake_proc(void)
+{
+    ProcessTable *table = ProcessTableLoad(PROC_ROOT);
+    assert_true(table != NULL);
+    assert_int_equal(table->count, 3);
+
+    long ticks = sysconf(_SC_CLK_TCK);
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+
+    ssize_t i = find_pid(table, 1234);
+    assert_true(i != -1);
+    assert_int_equal(table->ppid[i], 1);
+    assert_int_equal(table->pgid[i], 1230);
+    assert_int_equal(table->uid[i], 0);             /* effective, not real */
+    assert_int_equal(table->state[i], 'S');
+    assert_int_equal(table->nice[i], 5);
+    assert_int_equal(table->threads[i], 3);
+    assert_int_equal(table->vsize[i], 10240);
+    assert_int_equal(table->rsize[i], 256 * page_kb);
+    assert_int_equal(table->start[i], 1500000000 + 1000 / ticks);
+    assert_int_equal(table->cputime[i], 500 / ticks);
+    assert_string_equal(table->tty[i], "pts/1");
+    assert_string_equal(table->command[i], "/usr/bin/daemon --foreground");
+    assert_true(strstr(table->line[i], " /usr/bin/daemon --foreground") != NULL);
+
+    i = find_pid(table, 2);
+    assert_true(i != -1);
+    assert_string_equal(table->command[i], "[kthreadd]");
+    assert_string_equal(table->tty[i], "?");
+
+    i = find_pid(table, 4321);
+    assert_true(i != -1);
+    assert_int_equal(table->state[i], 'Z');
+    assert_int_equal(table->uid[i], 65534);
+    assert_string_equal(table->command[i], "[gone] <defunct>");
+
+    ProcessTableDestroy(table);
+}
+
+static void test_own_process(void)
+{
+    ProcessTable *table = ProcessTableLoad("/proc");
+    assert_true(table != NULL);
+
+    ssize_t i = find_pid(table, getpid());
+    assert_true(i != -1);
+    assert_int_equal(table->ppid[i], getppid());
+    assert_int_equal(table->uid[i], geteuid());
+    assert_int_equal(table->state[i], 'R');
+    assert_int_equal(table->threads[i], 1);
+    assert_true(strstr(table->command[i], "process_table_test") != NULL);
+
+    ProcessTableDestroy(table);
+}
+
+static void test_no_proc(void)
+{
+    assert_true(ProcessTableLoad("/nonexistent") == NULL);
+}
+
+
+int main()
+{
+    tests_setup();
+
+    const UnitTest tests[] =
+        {
+            unit_test(test_fake_proc),
+            unit_test(test_own_process),
+            unit_test(test_no_proc),
+        };
+
+    PRINT_TEST_BANNER();
+    int ret = run_tests(tests);
+
+    tests_teardown();
+    return ret;
+}
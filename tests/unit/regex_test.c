@@ -4,6 +4,7 @@
 #include <matching.h>
 #include <match_scope.h>
 #include <eval_context.h>
+#include <regex.h>
 
 static void test_full_text_match(void)
 {
@@ -43,6 +44,64 @@ static void test_block_text_match2(void)
     EvalContextDestroy(ctx);
 }
 
+static void test_regex_cache_hits(void)
+{
+    RegexCacheClear();
+
+    assert_true(StringMatchFull("a.c", "abc"));
+    assert_true(StringMatchFull("a.c", "axc"));
+    assert_false(StringMatchFull("a.c", "abcd"));
+    assert_true(CompareStringOrRegex("abc", "a.c", true));
+
+    RegexCacheStats stats;
+    RegexCacheGetStats(&stats);
+    assert_int_equal(stats.misses, 1);
+    assert_int_equal(stats.hits, 3);
+    assert_int_equal(stats.entries, 1);
+}
+
+static void test_regex_cache_invalid(void)
+{
+    RegexCacheClear();
+
+    assert_false(StringMatchFull("(unbalanced", "unbalanced"));
+    assert_true(RegexCacheGet("(unbalanced") == NULL);
+
+    RegexCacheStats stats;
+    RegexCacheGetStats(&stats);
+    assert_int_equal(stats.entries, 0);
+}
+
+static void test_regex_cache_eviction(void)
+{
+    RegexCacheClear();
+
+    CachedRegex *first = RegexCacheGet("first[0-9]+");
+    assert_true(first != NULL);
+
+    /* Push "first[0-9]+" out of the cache while we still hold it. */
+    char regex[64];
+    for (int i = 0; i < 2000; i++)
+    {
+        xsnprintf(regex, sizeof(regex), "pattern%d", i);
+        assert_true(StringMatchFull(regex, regex));
+    }
+
+    RegexCacheStats stats;
+    RegexCacheGetStats(&stats);
+    assert_true(stats.evictions > 0);
+    assert_true(stats.entries < 2000);
+
+    assert_true(StringMatchFullWithPrecompiledRegex(CachedRegexPattern(first),
+                                                    "first123"));
+    RegexCacheRelease(first);
+
+    int start, end;
+    assert_true(StringMatch("[0-9]+", "abc123def", &start, &end));
+    assert_int_equal(start, 3);
+    assert_int_equal(end, 6);
+}
+
 int main()
 {
     PRINT_TEST_BANNER();
@@ -52,6 +111,9 @@ int main()
         unit_test(test_full_text_match2),
         unit_test(test_block_text_match),
         unit_test(test_block_text_match2),
+        unit_test(test_regex_cache_hits),
+        unit_test(test_regex_cache_invalid),
+        unit_test(test_regex_cache_eviction),
     };
 
     return run_tests(tests);
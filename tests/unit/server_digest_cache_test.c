@@ -0,0 +1,265 @@
+#include <test.h>
+
+#include <server_digest_cache.h>
+#include <files_hashes.h>                                      /* HashFile */
+
+
+static char TEST_DIR[] = "/tmp/server_digest_cache_test.XXXXXX";
+static char OLD_FILE[PATH_MAX];                 /* ctime a few seconds ago */
+static char CHANGED_FILE[PATH_MAX];       /* old too, until test_changed_file */
+static char TREE_DIR[PATH_MAX];
+static char TREE_SUBDIR[PATH_MAX];
+
+static void WriteFile(const char *filename, const char *contents)
+{
+    FILE *fh = fopen(filename, "w");
+    assert_true(fh != NULL);
+    fputs(contents, fh);
+    fclose(fh);
+}
+
+static void TreeFileName(char *dst, const char *dir, int i)
+{
+    xsnprintf(dst, PATH_MAX, "%s/file%d", dir, i);
+}
+
+static void tests_setup(void)
+{
+    assert_true(mkdtemp(TEST_DIR) != NULL);
+
+    xsnprintf(OLD_FILE, sizeof(OLD_FILE), "%s/old", TEST_DIR);
+    WriteFile(OLD_FILE, "Lorem ipsum dolor sit amet\n");
+    xsnprintf(CHANGED_FILE, sizeof(CHANGED_FILE), "%s/changed", TEST_DIR);
+    WriteFile(CHANGED_FILE, "first version\n");
+
+    /* tree/file0, tree/file1, tree/sub/file2, tree/link -> ../old */
+    xsnprintf(TREE_DIR, sizeof(TREE_DIR), "%s/tree", TEST_DIR);
+    xsnprintf(TREE_SUBDIR, sizeof(TREE_SUBDIR), "%s/tree/sub", TEST_DIR);
+    assert_int_equal(0, mkdir(TREE_DIR, 0700));
+    assert_int_equal(0, mkdir(TREE_SUBDIR, 0700));
+    char filename[PATH_MAX];
+    for (int i = 0; i < 3; i++)
+    {
+        TreeFileName(filename, (i < 2) ? TREE_DIR : TREE_SUBDIR, i);
+        WriteFile(filename, (i == 0) ? "zero\n" : (i == 1) ? "one\n" : "two\n");
+    }
+    xsnprintf(filename, sizeof(filename), "%s/link", TREE_DIR);
+    assert_int_equal(0, symlink(OLD_FILE, filename));
+
+    /* Files changed within the last couple of seconds are not cached. */
+    sleep(2);
+}
+
+static void tests_teardown(void)
+{
+    char cmd[PATH_MAX + 16];
+    xsnprintf(cmd, sizeof(cmd), "rm -rf '%s'", TEST_DIR);
+    system(cmd);
+}
+
+static void setup(void)
+{
+    ServerDigestCacheClear();
+}
+
+static void AssertDigestOf(const char *filename)
+{
+    unsigned char expected[EVP_MAX_MD_SIZE + 1] = { 0 };
+    unsigned char digest[EVP_MAX_MD_SIZE + 1] = { 0 };
+    HashFile(filename, expected, CF_DEFAULT_DIGEST);
+
+    assert_true(ServerDigestCacheHashFile(filename, digest));
+    assert_memory_equal(expected, digest, sizeof(digest));
+}
+
+static void test_hit_after_miss(void)
+{
+    setup();
+    ServerDigestCacheStats before, after;
+    ServerDigestCacheGetStats(&before);
+
+    AssertDigestOf(OLD_FILE);
+    AssertDigestOf(OLD_FILE);
+    AssertDigestOf(OLD_FILE);
+
+    ServerDigestCacheGetStats(&after);
+    assert_int_equal(1, after.misses - before.misses);
+    assert_int_equal(2, after.hits - before.hits);
+    assert_int_equal(0, after.uncached - before.uncached);
+    assert_int_equal(1, after.entries);
+}
+
+static void test_missing_file(void)
+{
+    setup();
+    char filename[PATH_MAX];
+    xsnprintf(filename, sizeof(filename), "%s/missing", TEST_DIR);
+
+    unsigned char digest[EVP_MAX_MD_SIZE + 1] = { 0 };
+    assert_false(ServerDigestCacheHashFile(filename, digest));
+
+    ServerDigestCacheStats stats;
+    ServerDigestCacheGetStats(&stats);
+    assert_int_equal(0, stats.entries);
+}
+
+static void test_changed_file(void)
+{
+    setup();
+    ServerDigestCacheStats before, after;
+    ServerDigestCacheGetStats(&before);
+
+    AssertDigestOf(CHANGED_FILE);
+
+    /* The same size and inode, but new mtime and ctime. */
+    WriteFile(CHANGED_FILE, "other version\n");
+    AssertDigestOf(CHANGED_FILE);
+    /* Just written, so hashed every time and not cached. */
+    AssertDigestOf(CHANGED_FILE);
+
+    ServerDigestCacheGetStats(&after);
+    assert_int_equal(3, after.misses - before.misses);
+    assert_int_equal(0, after.hits - before.hits);
+    assert_int_equal(2, after.uncached - before.uncached);
+    assert_int_equal(0, after.entries);
+}
+
+static void test_precompute(void)
+{
+    setup();
+    ServerDigestCacheStats before, after;
+    ServerDigestCacheGetStats(&before);
+
+    /* The symlink is not followed. */
+    assert_int_equal(3, ServerDigestCachePrecompute(TREE_DIR));
+    /* Already cached. */
+    assert_int_equal(0, ServerDigestCachePrecompute(TREE_DIR));
+
+    char filename[PATH_MAX];
+    for (int i = 0; i < 3; i++)
+    {
+        TreeFileName(filename, (i < 2) ? TREE_DIR : TREE_SUBDIR, i);
+        AssertDigestOf(filename);
+    }
+
+    ServerDigestCacheGetStats(&after);
+    assert_int_equal(3, after.precomputed - before.precomputed);
+    assert_int_equal(3, after.hits - before.hits);
+    assert_int_equal(0, after.misses - before.misses);
+    assert_int_equal(3, after.entries);
+}
+
+static void test_precompute_thread(void)
+{
+    setup();
+    Seq *paths = SeqNew(2, free);
+    SeqAppend(paths, xstrdup(TREE_SUBDIR));
+    SeqAppend(paths, xstrdup(OLD_FILE));
+
+    assert_true(ServerDigestCachePrecomputeStart(paths));
+
+    ServerDigestCacheStats stats;
+    for (int i = 0; i < 500; i++)
+    {
+        ServerDigestCacheGetStats(&stats);
+        if (stats.entries == 2)
+        {
+            break;
+        }
+        usleep(10000);
+    }
+    ServerDigestCachePrecomputeStop();
+    assert_int_equal(2, stats.entries);
+}
+
+static void test_eviction(void)
+{
+    setup();
+    ServerDigestCacheSetCapacity(2);
+    ServerDigestCacheStats before, after;
+    ServerDigestCacheGetStats(&before);
+
+    char file0[PATH_MAX], file1[PATH_MAX], file2[PATH_MAX];
+    TreeFileName(file0, TREE_DIR, 0);
+    TreeFileName(file1, TREE_DIR, 1);
+    TreeFileName(file2, TREE_SUBDIR, 2);
+
+    AssertDigestOf(file0);
+    AssertDigestOf(file1);
+    AssertDigestOf(file0);                      /* file1 is least recent */
+    AssertDigestOf(file2);                             /* evicts file1 */
+    AssertDigestOf(file0);
+    AssertDigestOf(file2);
+
+    ServerDigestCacheGetStats(&after);
+    assert_int_equal(1, after.evicted - before.evicted);
+    assert_int_equal(3, after.misses - before.misses);
+    assert_int_equal(3, after.hits - before.hits);
+    assert_int_equal(2, after.entries);
+
+    /* Precomputing stops when full, instead of evicting. */
+    setup();
+    assert_int_equal(2, ServerDigestCachePrecompute(TREE_DIR));
+
+    ServerDigestCacheSetCapacity(50000);
+}
+
+#define CONCURRENT_THREADS 8
+
+static void *HashOldFile(void *arg)
+{
+    unsigned char *digest = arg;
+    assert_true(ServerDigestCacheHashFile(OLD_FILE, digest));
+    return NULL;
+}
+
+static void test_concurrent(void)
+{
+    setup();
+    ServerDigestCacheStats before, after;
+    ServerDigestCacheGetStats(&before);
+
+    pthread_t threads[CONCURRENT_THREADS];
+    unsigned char digests[CONCURRENT_THREADS][EVP_MAX_MD_SIZE + 1] = { { 0 } };
+    for (int i = 0; i < CONCURRENT_THREADS; i++)
+    {
+        assert_int_equal(0, pthread_create(&threads[i], NULL,
+                                           HashOldFile, digests[i]));
+    }
+    for (int i = 0; i < CONCURRENT_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 1; i < CONCURRENT_THREADS; i++)
+    {
+        assert_memory_equal(digests[0], digests[i], sizeof(digests[0]));
+    }
+
+    /* Only one of the threads has hashed the file. */
+    ServerDigestCacheGetStats(&after);
+    assert_int_equal(1, after.misses - before.misses);
+    assert_int_equal(CONCURRENT_THREADS - 1, after.hits - before.hits);
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    tests_setup();
+
+    const UnitTest tests[] =
+    {
+        unit_test(test_hit_after_miss),
+        unit_test(test_missing_file),
+        unit_test(test_changed_file),
+        unit_test(test_precompute),
+        unit_test(test_precompute_thread),
+        unit_test(test_eviction),
+        unit_test(test_concurrent),
+    };
+
+    int ret = run_tests(tests);
+
+    tests_teardown();
+    return ret;
+}
@@ -0,0 +1,170 @@
+#include <test.h>
+
+#include <server_reactor.h>
+
+
+#ifdef HAVE_SYS_EPOLL_H
+
+static int READY_CALLS;
+static int DROP_CALLS;
+static void *LAST_DATA;
+static bool ACCEPT_READY;
+
+static bool OnReady(void *data)
+{
+    READY_CALLS++;
+    LAST_DATA = data;
+    return ACCEPT_READY;
+}
+
+static void OnDrop(void *data)
+{
+    DROP_CALLS++;
+    LAST_DATA = data;
+}
+
+static int LISTEN_PAIR[2];
+static int SIGNAL_PAIR[2];
+static int CONN_PAIR[2];
+
+static void setup(void)
+{
+    assert_int_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, LISTEN_PAIR));
+    assert_int_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, SIGNAL_PAIR));
+    assert_int_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, CONN_PAIR));
+    /* Like the real signal pipe, draining it must not block. */
+    assert_int_equal(0, fcntl(SIGNAL_PAIR[0], F_SETFL, O_NONBLOCK));
+
+    READY_CALLS = DROP_CALLS = 0;
+    LAST_DATA = NULL;
+    ACCEPT_READY = true;
+
+    assert_true(ServerReactorStart(LISTEN_PAIR[0], SIGNAL_PAIR[0],
+                                   OnReady, OnDrop));
+    assert_true(ServerReactorIsRunning());
+}
+
+static void teardown(void)
+{
+    ServerReactorStop();
+    assert_false(ServerReactorIsRunning());
+
+    for (int i = 0; i < 2; i++)
+    {
+        close(LISTEN_PAIR[i]);
+        close(SIGNAL_PAIR[i]);
+        close(CONN_PAIR[i]);
+    }
+}
+
+static void test_incoming_and_signal(void)
+{
+    setup();
+
+    assert_int_equal(1, write(LISTEN_PAIR[1], "x", 1));
+    assert_int_equal(1, ServerReactorWait(5));
+
+    char c;
+    assert_int_equal(1, read(LISTEN_PAIR[0], &c, 1));
+    assert_int_equal(1, write(SIGNAL_PAIR[1], "s", 1));
+    assert_int_equal(0, ServerReactorWait(5));
+
+    assert_int_equal(0, READY_CALLS);
+    teardown();
+}
+
+static void test_park_and_resume(void)
+{
+    setup();
+    int data;
+
+    assert_true(ServerReactorPark(CONN_PAIR[0], &data, 600));
+    assert_int_equal(1, ServerReactorParkedCount());
+
+    /* Nothing to read, nothing happens. */
+    assert_int_equal(0, ServerReactorWait(1));
+    assert_int_equal(0, READY_CALLS);
+
+    /* A request arrives. */
+    assert_int_equal(1, write(CONN_PAIR[1], "r", 1));
+    assert_int_equal(1, write(SIGNAL_PAIR[1], "s", 1));
+    assert_int_equal(0, ServerReactorWait(5));
+    assert_int_equal(1, READY_CALLS);
+    assert_true(LAST_DATA == &data);
+    assert_int_equal(0, ServerReactorParkedCount());
+
+    /* Handed over, so no further notifications. */
+    assert_int_equal(0, ServerReactorWait(1));
+    assert_int_equal(1, READY_CALLS);
+
+    assert_int_equal(0, DROP_CALLS);
+    teardown();
+}
+
+static void test_backlog(void)
+{
+    setup();
+    int data;
+
+    ACCEPT_READY = false;                            /* all workers busy */
+    assert_true(ServerReactorPark(CONN_PAIR[0], &data, 600));
+    assert_int_equal(1, write(CONN_PAIR[1], "r", 1));
+    assert_int_equal(0, ServerReactorWait(1));
+    assert_true(READY_CALLS > 1);                           /* retried */
+    assert_int_equal(1, ServerReactorParkedCount());
+
+    ACCEPT_READY = true;
+    READY_CALLS = 0;
+    assert_int_equal(0, ServerReactorWait(1));
+    assert_int_equal(1, READY_CALLS);
+    assert_int_equal(0, ServerReactorParkedCount());
+
+    teardown();
+    assert_int_equal(0, DROP_CALLS);
+}
+
+static void test_idle_timeout(void)
+{
+    setup();
+    int data;
+
+    assert_true(ServerReactorPark(CONN_PAIR[0], &data, 0));
+    assert_int_equal(0, ServerReactorWait(2));
+    assert_int_equal(1, DROP_CALLS);
+    assert_true(LAST_DATA == &data);
+    assert_int_equal(0, ServerReactorParkedCount());
+
+    teardown();
+}
+
+static void test_stop_drops_parked(void)
+{
+    setup();
+    int data;
+
+    assert_true(ServerReactorPark(CONN_PAIR[0], &data, 600));
+    teardown();
+    assert_int_equal(1, DROP_CALLS);
+
+    /* Not running, can't park. */
+    assert_false(ServerReactorPark(CONN_PAIR[0], &data, 600));
+}
+
+#endif  /* HAVE_SYS_EPOLL_H */
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+#ifdef HAVE_SYS_EPOLL_H
+        unit_test(test_incoming_and_signal),
+        unit_test(test_park_and_resume),
+        unit_test(test_backlog),
+        unit_test(test_idle_timeout),
+        unit_test(test_stop_drops_parked),
+#endif
+    };
+
+    return run_tests(tests);
+}
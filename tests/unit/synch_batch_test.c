@@ -0,0 +1,343 @@
+#include <test.h>
+
+#include <cf3.defs.h>
+#include <server.h>
+#include <server_tls.h>           /* ServerTLSSessionEstablish, BusyWithNewProtocol */
+#include <server_access.h>                                       /* paths_acl */
+#include <client_code.h>                                    /* CompareHashNet */
+#include <client_protocol.h>                                 /* BadProtoReply */
+#include <communication.h>                                   /* NewAgentConn */
+#include <stat_cache.h>                                   /* StatCachePrefetch */
+#include <tls_client.h>                                            /* TLSTry */
+#include <net.h>                                       /* ReceiveTransaction */
+#include <crypto.h>                                      /* CryptoInitialize */
+#include <generic_agent.h>                     /* GenericAgentSetDefaultDigest */
+#include <files_hashes.h>                                         /* HashFile */
+#include <known_dirs.h>                                        /* GetWorkDir */
+#include <unix.h>                                      /* GetCurrentUserName */
+#include <openssl/rsa.h>
+#include <openssl/bn.h>
+
+
+/*
+ * SYNCHBATCH requests of the stat cache, served by BusyWithNewProtocol()
+ * over a socketpair. Whatever the replies, the connection must stay in step
+ * with the requests.
+ */
+
+static char CFWORKDIR[CF_BUFSIZE];
+static char SRCDIR[CF_BUFSIZE];                   /* admitted to 127.0.0.1 */
+static char DESTDIR[CF_BUFSIZE];
+static char USERNAME[CF_SMALLBUF];
+
+static void WriteFile(const char *dir, const char *name, const char *content)
+{
+    char filename[CF_BUFSIZE];
+    xsnprintf(filename, sizeof(filename), "%s/%s", dir, name);
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert_true(fd != -1);
+    assert_int_equal(strlen(content), write(fd, content, strlen(content)));
+    close(fd);
+}
+
+static char *SrcPath(const char *name)
+{
+    char *path;
+    xasprintf(&path, "%s/%s", SRCDIR, name);
+    return path;
+}
+
+static void tests_setup(void)
+{
+    xsnprintf(CFWORKDIR, sizeof(CFWORKDIR), "/tmp/synch_batch_test.XXXXXX");
+    assert_true(mkdtemp(CFWORKDIR) != NULL);
+
+    char *envvar;
+    xasprintf(&envvar, "%s=%s", "CFENGINE_TEST_OVERRIDE_WORKDIR", CFWORKDIR);
+    putenv(envvar);
+
+    char path[CF_BUFSIZE];
+    xsnprintf(path, sizeof(path), "%s/ppkeys", GetWorkDir());
+    mkdir(path, S_IRWXU);
+    mkdir(GetStateDir(), S_IRWXU);
+
+    xsnprintf(SRCDIR, sizeof(SRCDIR), "%s/src", CFWORKDIR);
+    xsnprintf(DESTDIR, sizeof(DESTDIR), "%s/dest", CFWORKDIR);
+    mkdir(SRCDIR, S_IRWXU);
+    mkdir(DESTDIR, S_IRWXU);
+
+    WriteFile(SRCDIR, "same", "same content");
+    WriteFile(DESTDIR, "same", "same content");
+    WriteFile(SRCDIR, "differs", "source content");
+    WriteFile(DESTDIR, "differs", "a copy's text");     /* same size */
+    WriteFile(SRCDIR, "other", "other");
+    WriteFile(CFWORKDIR, "secret", "not admitted");
+
+    xsnprintf(path, sizeof(path), "%s/", SRCDIR);
+    paths_acl = xcalloc(1, sizeof(*paths_acl));
+    size_t pos = acl_SortedInsert(&paths_acl, path);
+    assert_true(pos != (size_t) -1);
+    assert_true(StrList_Append(&paths_acl->acls[pos].admit.ips,
+                               "127.0.0.1") != (size_t) -1);
+
+    GetCurrentUserName(USERNAME, sizeof(USERNAME));
+    signal(SIGPIPE, SIG_IGN);
+
+    CryptoInitialize();
+    GenericAgentSetDefaultDigest(&CF_DEFAULT_DIGEST, &CF_DEFAULT_DIGEST_LEN);
+    RSA *rsa = RSA_new();
+    BIGNUM *e = BN_new();
+    BN_set_word(e, RSA_F4);
+    assert_int_equal(1, RSA_generate_key_ex(rsa, 2048, e, NULL));
+    BN_free(e);
+    PRIVKEY = rsa;
+    PUBKEY = RSAPublicKey_dup(rsa);
+
+    PrependItem(&SV.trustkeylist, "127.0.0.1", NULL);
+    assert_true(ServerTLSInitialize());
+    assert_true(TLSClientInitialize(NULL, NULL));
+}
+
+static void tests_teardown(void)
+{
+    acl_Free(paths_acl);
+    paths_acl = NULL;
+
+    char cmd[CF_BUFSIZE];
+    xsnprintf(cmd, sizeof(cmd), "rm -rf '%s'", CFWORKDIR);
+    system(cmd);
+}
+
+/* Serve requests on one end of the socketpair until it is closed. */
+static void *Serve(void *arg)
+{
+    ServerConnectionState *conn = arg;
+
+    if (ServerTLSSessionEstablish(conn) == 1)
+    {
+        while (BusyWithNewProtocol(NULL, conn))
+        {
+        }
+    }
+
+    return NULL;
+}
+
+typedef struct
+{
+    ServerConnectionState *server_conn;
+    AgentConnection *agent_conn;
+    pthread_t tid;
+} TestConnection;
+
+static void Connect(TestConnection *tc)
+{
+    int sv[2];
+    assert_int_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+
+    tc->server_conn = xcalloc(1, sizeof(*tc->server_conn));
+    tc->server_conn->conn_info = ConnectionInfoNew();
+    tc->server_conn->conn_info->sd = sv[0];
+    tc->server_conn->conn_info->protocol = CF_PROTOCOL_TLS;
+    strlcpy(tc->server_conn->ipaddr, "127.0.0.1",
+            sizeof(tc->server_conn->ipaddr));
+    strlcpy(tc->server_conn->username, USERNAME,
+            sizeof(tc->server_conn->username));
+
+    ConnectionFlags flags = { .protocol_version = CF_PROTOCOL_TLS };
+    tc->agent_conn = NewAgentConn("127.0.0.1", NULL, flags);
+    tc->agent_conn->conn_info->sd = sv[1];
+
+    assert_int_equal(0, pthread_create(&tc->tid, NULL, Serve, tc->server_conn));
+
+    assert_int_not_equal(-1, TLSTry(tc->agent_conn->conn_info));
+    assert_int_equal(1, TLSClientIdentificationDialog(tc->agent_conn->conn_info,
+                                                      USERNAME));
+    tc->agent_conn->conn_info->protocol = CF_PROTOCOL_TLS;
+    tc->agent_conn->conn_info->status = CONNECTIONINFO_STATUS_ESTABLISHED;
+
+    /* The server advertised SYNCHBATCH. */
+    assert_true(tc->agent_conn->conn_info->max_synch_batch > 0);
+}
+
+static void Disconnect(TestConnection *tc)
+{
+    DisconnectServer(tc->agent_conn);
+    pthread_join(tc->tid, NULL);
+
+    ConnectionInfoDestroy(&tc->server_conn->conn_info);
+    free(tc->server_conn);
+}
+
+/* A plain SYNCH request gets its answer, not a leftover of the batch. */
+static void AssertInStep(AgentConnection *conn)
+{
+    char *file = SrcPath("other");
+    struct stat sb;
+    assert_int_equal(0, cf_remote_stat(conn, false, file, &sb, "file"));
+    assert_int_equal(strlen("other"), sb.st_size);
+    assert_true(S_ISREG(sb.st_mode));
+    free(file);
+}
+
+static void test_stat_batch(void)
+{
+    TestConnection tc;
+    Connect(&tc);
+
+    Seq *files = SeqNew(2, free);
+    SeqAppend(files, SrcPath("same"));
+    SeqAppend(files, SrcPath("differs"));
+
+    assert_int_equal(2, StatCachePrefetch(tc.agent_conn, files));
+
+    const Stat *sp = StatCacheLookup(tc.agent_conn, SeqAt(files, 1),
+                                     tc.agent_conn->this_server);
+    assert_true(sp != NULL);
+    assert_int_equal(strlen("source content"), sp->cf_size);
+    assert_true(S_ISREG(sp->cf_mode));
+
+    AssertInStep(tc.agent_conn);
+    assert_false(tc.agent_conn->error);
+
+    SeqDestroy(files);
+    Disconnect(&tc);
+}
+
+static void test_refused_entry_fails_batch(void)
+{
+    TestConnection tc;
+    Connect(&tc);
+
+    Seq *files = SeqNew(3, free);
+    char *secret;
+    xasprintf(&secret, "%s/secret", CFWORKDIR);
+    SeqAppend(files, secret);
+    SeqAppend(files, SrcPath("same"));
+
+    assert_int_equal(-1, StatCachePrefetch(tc.agent_conn, files));
+
+    /* The refusal fails the batch, yet the other entries were read and the
+     * connection is still usable. */
+    assert_false(tc.agent_conn->error);
+    assert_true(StatCacheLookup(tc.agent_conn, secret,
+                                tc.agent_conn->this_server) == NULL);
+    assert_true(StatCacheLookup(tc.agent_conn, SeqAt(files, 1),
+                                tc.agent_conn->this_server) != NULL);
+    AssertInStep(tc.agent_conn);
+
+    SeqDestroy(files);
+    Disconnect(&tc);
+}
+
+static void test_bad_clock_answers_every_entry(void)
+{
+    TestConnection tc;
+    Connect(&tc);
+
+    /* A batch dated 1970 is refused as a whole... */
+    char *same = SrcPath("same");
+    char *differs = SrcPath("differs");
+    char buf[CF_BUFSIZE];
+    assert_int_not_equal(-1, SendTransaction(tc.agent_conn->conn_info,
+                                             "SYNCHBATCH 1 2", 0, CF_DONE));
+    xsnprintf(buf, sizeof(buf), "STAT %s", same);
+    assert_int_not_equal(-1, SendTransaction(tc.agent_conn->conn_info,
+                                             buf, 0, CF_DONE));
+    xsnprintf(buf, sizeof(buf), "STAT %s", differs);
+    assert_int_not_equal(-1, SendTransaction(tc.agent_conn->conn_info,
+                                             buf, 0, CF_DONE));
+
+    /* ...with one reply per entry. */
+    for (int i = 0; i < 2; i++)
+    {
+        memset(buf, 0, sizeof(buf));
+        assert_int_not_equal(-1, ReceiveTransaction(tc.agent_conn->conn_info,
+                                                    buf, NULL));
+        assert_true(BadProtoReply(buf));
+        assert_true(strstr(buf, "unsynchronized") != NULL);
+    }
+
+    AssertInStep(tc.agent_conn);
+
+    free(same);
+    free(differs);
+    Disconnect(&tc);
+}
+
+static void test_digest_batch(void)
+{
+    TestConnection tc;
+    Connect(&tc);
+
+    const char *names[] = { "same", "differs" };
+    Seq *files = SeqNew(2, free);
+    Seq *digests = SeqNew(2, free);
+    Seq *local_stats = SeqNew(2, free);
+    struct stat dsb[2];
+
+    for (int i = 0; i < 2; i++)
+    {
+        char dest[CF_BUFSIZE];
+        xsnprintf(dest, sizeof(dest), "%s/%s", DESTDIR, names[i]);
+        assert_int_equal(0, stat(dest, &dsb[i]));
+
+        unsigned char *digest = xcalloc(1, EVP_MAX_MD_SIZE + 1);
+        HashFile(dest, digest, CF_DEFAULT_DIGEST);
+
+        SeqAppend(files, SrcPath(names[i]));
+        SeqAppend(digests, digest);
+        SeqAppend(local_stats, xmemdup(&dsb[i], sizeof(dsb[i])));
+    }
+
+    /* Only files already in the stat cache get a verdict. */
+    assert_int_equal(2, StatCachePrefetch(tc.agent_conn, files));
+    assert_int_equal(2, StatCachePrefetchDigests(tc.agent_conn, files,
+                                                 digests, local_stats));
+
+    const Stat *sp = StatCacheLookup(tc.agent_conn, SeqAt(files, 0),
+                                     tc.agent_conn->this_server);
+    assert_true(sp != NULL && sp->cf_digest != NULL);
+    assert_false(sp->cf_digest_differs);
+    sp = StatCacheLookup(tc.agent_conn, SeqAt(files, 1),
+                         tc.agent_conn->this_server);
+    assert_true(sp != NULL && sp->cf_digest != NULL);
+    assert_true(sp->cf_digest_differs);
+
+    /* Answered from the cache. */
+    for (int i = 0; i < 2; i++)
+    {
+        char dest[CF_BUFSIZE];
+        xsnprintf(dest, sizeof(dest), "%s/%s", DESTDIR, names[i]);
+        assert_int_equal(i == 1, CompareHashNet(SeqAt(files, i), dest, &dsb[i],
+                                                false, tc.agent_conn));
+    }
+
+    AssertInStep(tc.agent_conn);
+    assert_false(tc.agent_conn->error);
+
+    SeqDestroy(files);
+    SeqDestroy(digests);
+    SeqDestroy(local_stats);
+    Disconnect(&tc);
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    tests_setup();
+
+    const UnitTest tests[] =
+    {
+        unit_test(test_stat_batch),
+        unit_test(test_refused_entry_fails_batch),
+        unit_test(test_bad_clock_answers_every_entry),
+        unit_test(test_digest_batch),
+    };
+
+    int ret = run_tests(tests);
+
+    tests_teardown();
+    return ret;
+}
@@ -0,0 +1,127 @@
+#include <test.h>
+
+#include <threaded_queue.h>
+#include <alloc.h>
+
+
+static void test_push_pop(void)
+{
+    ThreadedQueue *q = ThreadedQueueNew(2, free);
+    assert_int_equal(2, ThreadedQueueCapacity(q));
+    assert_int_equal(0, ThreadedQueueCount(q));
+
+    assert_true(ThreadedQueueTryPush(q, xstrdup("hello")));
+    assert_true(ThreadedQueueTryPush(q, xstrdup("world")));
+    assert_int_equal(2, ThreadedQueueCount(q));
+
+    /* Full, the item stays ours. */
+    char *extra = xstrdup("extra");
+    assert_false(ThreadedQueueTryPush(q, extra));
+    free(extra);
+
+    void *item;
+    assert_true(ThreadedQueuePop(q, &item));
+    assert_string_equal("hello", item);
+    free(item);
+
+    /* Wrap around the ring. */
+    assert_true(ThreadedQueueTryPush(q, xstrdup("again")));
+    assert_true(ThreadedQueuePop(q, &item));
+    assert_string_equal("world", item);
+    free(item);
+    assert_true(ThreadedQueuePop(q, &item));
+    assert_string_equal("again", item);
+    free(item);
+
+    assert_int_equal(0, ThreadedQueueCount(q));
+    assert_int_equal(2, ThreadedQueueMaxCount(q));
+
+    ThreadedQueueDestroy(q);
+}
+
+static void test_close(void)
+{
+    ThreadedQueue *q = ThreadedQueueNew(4, free);
+
+    assert_true(ThreadedQueueTryPush(q, xstrdup("1")));
+    assert_true(ThreadedQueueTryPush(q, xstrdup("2")));
+    ThreadedQueueClose(q);
+
+    /* No more pushes, but what's queued can still be popped. */
+    char *extra = xstrdup("3");
+    assert_false(ThreadedQueueTryPush(q, extra));
+    free(extra);
+
+    void *item;
+    assert_true(ThreadedQueuePop(q, &item));
+    assert_string_equal("1", item);
+    free(item);
+
+    /* Remaining item is freed by ThreadedQueueDestroy(). */
+    ThreadedQueueDestroy(q);
+}
+
+#define NUM_CONSUMERS  4
+#define NUM_ITEMS      10000
+
+static ThreadedQueue *SHARED_QUEUE;
+
+static void *Consumer(void *arg)
+{
+    long *sum = arg;
+    void *item;
+    while (ThreadedQueuePop(SHARED_QUEUE, &item))
+    {
+        *sum += (long) (intptr_t) item;
+    }
+    return NULL;
+}
+
+static void test_threads(void)
+{
+    SHARED_QUEUE = ThreadedQueueNew(16, NULL);
+
+    pthread_t consumers[NUM_CONSUMERS];
+    long sums[NUM_CONSUMERS] = { 0 };
+    for (int i = 0; i < NUM_CONSUMERS; i++)
+    {
+        assert_int_equal(0, pthread_create(&consumers[i], NULL,
+                                           Consumer, &sums[i]));
+    }
+
+    for (intptr_t i = 1; i <= NUM_ITEMS; i++)
+    {
+        while (!ThreadedQueueTryPush(SHARED_QUEUE, (void *) i))
+        {
+            sched_yield();                                /* queue full */
+        }
+    }
+    ThreadedQueueClose(SHARED_QUEUE);
+
+    long total = 0;
+    for (int i = 0; i < NUM_CONSUMERS; i++)
+    {
+        assert_int_equal(0, pthread_join(consumers[i], NULL));
+        total += sums[i];
+    }
+
+    /* Every item was popped exactly once. */
+    assert_int_equal((long) NUM_ITEMS * (NUM_ITEMS + 1) / 2, total);
+    assert_int_equal(0, ThreadedQueueCount(SHARED_QUEUE));
+    assert_true(ThreadedQueueMaxCount(SHARED_QUEUE) <= 16);
+
+    ThreadedQueueDestroy(SHARED_QUEUE);
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_push_pop),
+        unit_test(test_close),
+        unit_test(test_threads),
+    };
+
+    return run_tests(tests);
+}
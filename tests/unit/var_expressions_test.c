@@ -181,6 +181,75 @@ static void test_to_string_unqualified(void)
     }
 }
 
+static void CheckParseInPlace(const char *str, const char *ns, const char *scope)
+{
+    VarRef *expected = VarRefParseFromNamespaceAndScope(str, ns, scope, CF_NS, '.');
+
+    char buf[CF_MAXVARSIZE];
+    strlcpy(buf, str, sizeof(buf));
+    char *indices[4];
+    VarRef ref;
+    assert_true(VarRefParseInPlace(buf, ns, scope, indices, 4, &ref));
+
+    assert_int_equal(0, VarRefCompare(expected, &ref));
+    assert_int_equal(expected->hash, ref.hash);
+    assert_true(VarRefEqual_untyped(expected, &ref));
+    VarRefDestroy(expected);
+}
+
+static void test_parse_in_place(void)
+{
+    CheckParseInPlace("lval", NULL, NULL);
+    CheckParseInPlace("lval", "ns", "scope");
+    CheckParseInPlace("scope.lval", "ns", "other");
+    CheckParseInPlace("ns:scope.lval", NULL, "other");
+    CheckParseInPlace("sys.lval", "ns", "scope");
+    CheckParseInPlace("ns:scope.lval[x][y]", NULL, NULL);
+    CheckParseInPlace("lval[x-x.x:x]", "ns", "scope");
+    CheckParseInPlace("lval[a[b]][]", "ns", "scope");
+
+    /* What it can't do, it leaves alone. */
+    char *indices[1];
+    VarRef ref;
+    char too_many[] = "lval[x][y]";
+    assert_false(VarRefParseInPlace(too_many, NULL, NULL, indices, 1, &ref));
+    assert_string_equal("lval[x][y]", too_many);
+    char unbalanced[] = "lval[x";
+    assert_false(VarRefParseInPlace(unbalanced, NULL, NULL, indices, 1, &ref));
+    char trailing[] = "lval[x]y";
+    assert_false(VarRefParseInPlace(trailing, NULL, NULL, indices, 1, &ref));
+    assert_string_equal("lval[x]y", trailing);
+}
+
+static void test_hash_follows_changes(void)
+{
+    VarRef *ref = VarRefParse("lval");
+    VarRef *other = VarRefParse("ns:scope.lval[x]");
+    assert_false(VarRefEqual_untyped(ref, other));
+
+    VarRefQualify(ref, "ns", "scope");
+    VarRefAddIndex(ref, "x");
+    assert_int_equal(other->hash, ref->hash);
+    assert_true(VarRefEqual_untyped(ref, other));
+
+    VarRefSetMeta(ref, true);
+    assert_false(VarRefEqual_untyped(ref, other));
+    VarRefSetMeta(ref, false);
+    assert_string_equal("scope", ref->scope);
+    assert_true(VarRefEqual_untyped(ref, other));
+
+    /* NULL namespace is the default one. */
+    VarRef *def = VarRefParse("default:scope.lval");
+    VarRef *nons = VarRefParse("scope.lval");
+    assert_int_equal(def->hash, nons->hash);
+    assert_true(VarRefEqual_untyped(def, nons));
+
+    VarRefDestroy(nons);
+    VarRefDestroy(def);
+    VarRefDestroy(other);
+    VarRefDestroy(ref);
+}
+
 int main()
 {
     PRINT_TEST_BANNER();
@@ -198,6 +267,8 @@ int main()
         unit_test(test_special_scope),
         unit_test(test_to_string_qualified),
         unit_test(test_to_string_unqualified),
+        unit_test(test_parse_in_place),
+        unit_test(test_hash_follows_changes),
     };
 
     return run_tests(tests);